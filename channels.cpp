@@ -0,0 +1,548 @@
+#include "channels.hpp"
+
+#include <string.h>
+#include <cassert>
+
+using std::vector;
+using ChannelId = ChannelMultiplexer::ChannelId;
+
+
+static const size_t channel_header_size = 5;
+static const size_t credit_size = 4;
+
+namespace {
+enum class MessageKind : char {
+  data = 0,
+  credit = 1
+};
+}
+
+
+static void encodeUint32(char *p,uint32_t value)
+{
+  p[0] = char(value >> 24);
+  p[1] = char(value >> 16);
+  p[2] = char(value >> 8);
+  p[3] = char(value);
+}
+
+
+static uint32_t decodeUint32(const char *message)
+{
+  const unsigned char *p = reinterpret_cast<const unsigned char *>(message);
+  return (uint32_t(p[0]) << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+
+static void
+  buildMessage(
+    vector<char> &message,
+    ChannelId channel_id,
+    MessageKind kind,
+    const char *payload,
+    size_t payload_size
+  )
+{
+  message.resize(channel_header_size + payload_size);
+  encodeUint32(message.data(),channel_id);
+  message[4] = char(kind);
+  memcpy(message.data() + channel_header_size, payload, payload_size);
+}
+
+
+struct ChannelMultiplexer::Impl {
+  static Channel &channel(ChannelMultiplexer &self,ChannelId channel_id)
+  {
+    auto iter = self.channels.find(channel_id);
+
+    if (iter == self.channels.end()) {
+      Channel &channel = self.channels[channel_id];
+      channel.send_credit = self.options.window_size;
+      return channel;
+    }
+
+    return iter->second;
+  }
+
+  static void
+    sendDataMessage(
+      Channel &channel,
+      const vector<char> &message,
+      OutputInterface &output
+    )
+  {
+    assert(channel.send_credit > 0);
+    channel.send_credit -= message.size() - channel_header_size;
+    output.queueMessage(message.data(),message.size());
+  }
+
+  static void
+    sendWaitingMessages(
+      ChannelMultiplexer &self,
+      Channel &channel,
+      OutputInterface &output
+    )
+  {
+    while (!channel.waiting_messages.empty() && channel.send_credit > 0) {
+      sendDataMessage(channel,channel.waiting_messages.front(),output);
+      channel.waiting_messages.pop_front();
+      --self.n_waiting_messages;
+    }
+  }
+
+  static void
+    gotCredit(
+      ChannelMultiplexer &self,
+      ChannelId channel_id,
+      const char *payload,
+      size_t payload_size,
+      OutputInterface &output
+    )
+  {
+    if (payload_size != credit_size) {
+      return;
+    }
+
+    auto iter = self.channels.find(channel_id);
+
+    if (iter == self.channels.end()) {
+      // Nothing was sent on the channel, so the credit isn't for anything.
+      return;
+    }
+
+    Channel &channel = iter->second;
+    channel.send_credit += decodeUint32(payload);
+    sendWaitingMessages(self,channel,output);
+  }
+
+  static void
+    gotData(
+      ChannelMultiplexer &self,
+      ChannelId channel_id,
+      const char *payload,
+      size_t payload_size,
+      EventInterface &event_handler,
+      OutputInterface &output
+    )
+  {
+    bool is_new_channel = self.channels.count(channel_id) == 0;
+
+    if (is_new_channel && self.channels.size() >= self.options.max_channels) {
+      return;
+    }
+
+    // The channel is created first, so that if it is missing afterwards,
+    // the event handler closed the connection.
+    Impl::channel(self,channel_id);
+    event_handler.gotMessage(channel_id,payload,payload_size);
+    auto iter = self.channels.find(channel_id);
+
+    if (iter == self.channels.end()) {
+      return;
+    }
+
+    // Credit is only given back once the message has been handled.
+
+    Channel &channel = iter->second;
+    channel.n_bytes_to_credit += payload_size;
+
+    if (channel.n_bytes_to_credit*2 < self.options.window_size) {
+      return;
+    }
+
+    char credit[credit_size];
+    encodeUint32(credit,channel.n_bytes_to_credit);
+    channel.n_bytes_to_credit = 0;
+
+    buildMessage(
+      self.message_buffer,channel_id,MessageKind::credit,credit,credit_size
+    );
+
+    output.queueMessage(self.message_buffer.data(),self.message_buffer.size());
+  }
+};
+
+
+ChannelMultiplexer::ChannelMultiplexer()
+: ChannelMultiplexer(Options())
+{
+}
+
+
+ChannelMultiplexer::ChannelMultiplexer(const Options &options_arg)
+: options(options_arg)
+{
+  assert(options.window_size > 0);
+  assert(options.max_channels > 0);
+}
+
+
+void
+  ChannelMultiplexer::queueMessage(
+    ChannelId channel_id,
+    const char *message,
+    size_t message_size,
+    OutputInterface &output
+  )
+{
+  Channel &channel = Impl::channel(*this,channel_id);
+
+  if (channel.waiting_messages.empty() && channel.send_credit > 0) {
+    buildMessage(
+      message_buffer,channel_id,MessageKind::data,message,message_size
+    );
+
+    Impl::sendDataMessage(channel,message_buffer,output);
+    return;
+  }
+
+  channel.waiting_messages.emplace_back();
+
+  buildMessage(
+    channel.waiting_messages.back(),
+    channel_id,
+    MessageKind::data,
+    message,
+    message_size
+  );
+
+  ++n_waiting_messages;
+}
+
+
+void
+  ChannelMultiplexer::handleMessage(
+    const char *message,
+    size_t message_size,
+    EventInterface &event_handler,
+    OutputInterface &output
+  )
+{
+  if (message_size < channel_header_size) {
+    return;
+  }
+
+  ChannelId channel_id = decodeUint32(message);
+  MessageKind kind = MessageKind(message[4]);
+  const char *payload = message + channel_header_size;
+  size_t payload_size = message_size - channel_header_size;
+
+  switch (kind) {
+    case MessageKind::data:
+      Impl::gotData(
+        *this,channel_id,payload,payload_size,event_handler,output
+      );
+      break;
+    case MessageKind::credit:
+      Impl::gotCredit(*this,channel_id,payload,payload_size,output);
+      break;
+  }
+}
+
+
+void ChannelMultiplexer::clear()
+{
+  channels.clear();
+  n_waiting_messages = 0;
+}
+
+
+struct ChannelServer::Impl {
+  struct Output : ChannelMultiplexer::OutputInterface {
+    MessageServer &message_server;
+    const ClientId client_id;
+
+    Output(MessageServer &message_server_arg,ClientId client_id_arg)
+    : message_server(message_server_arg),
+      client_id(client_id_arg)
+    {
+    }
+
+    void queueMessage(const char *message,size_t message_size) override
+    {
+      message_server.queueMessageToClient(client_id,message,message_size);
+    }
+  };
+
+  struct ChannelHandler : ChannelMultiplexer::EventInterface {
+    ChannelServer::EventInterface &event_handler;
+    const ClientId client_id;
+
+    ChannelHandler(
+      ChannelServer::EventInterface &event_handler_arg,
+      ClientId client_id_arg
+    )
+    : event_handler(event_handler_arg),
+      client_id(client_id_arg)
+    {
+    }
+
+    void
+      gotMessage(
+        ChannelId channel_id,
+        const char *message,
+        size_t message_size
+      ) override
+    {
+      event_handler.gotMessage(client_id,channel_id,message,message_size);
+    }
+  };
+
+  struct MessageHandler : MessageServer::EventInterface {
+    ChannelServer &server;
+    ChannelServer::EventInterface &event_handler;
+
+    MessageHandler(
+      ChannelServer &server_arg,
+      ChannelServer::EventInterface &event_handler_arg
+    )
+    : server(server_arg),
+      event_handler(event_handler_arg)
+    {
+    }
+
+    void
+      gotMessage(
+        ClientId client_id,
+        const char *message,
+        size_t message_size
+      ) override
+    {
+      Output output(server.message_server,client_id);
+      ChannelHandler channel_handler(event_handler,client_id);
+
+      multiplexer(server,client_id).handleMessage(
+        message,message_size,channel_handler,output
+      );
+    }
+
+    void clientConnected(ClientId client_id) override
+    {
+      multiplexer(server,client_id).clear();
+      event_handler.clientConnected(client_id);
+    }
+
+    void clientDisconnected(ClientId client_id) override
+    {
+      multiplexer(server,client_id).clear();
+      event_handler.clientDisconnected(client_id);
+    }
+  };
+
+  static ChannelMultiplexer &
+    multiplexer(ChannelServer &self,ClientId client_id)
+  {
+    assert(client_id >= 0);
+    std::deque<ChannelMultiplexer> &multiplexers = self.client_multiplexers;
+
+    if (size_t(client_id) >= multiplexers.size()) {
+      multiplexers.resize(client_id + 1,ChannelMultiplexer(self.options));
+    }
+
+    return multiplexers[client_id];
+  }
+};
+
+
+ChannelServer::ChannelServer(SocketsInterface &sockets_arg)
+: ChannelServer(sockets_arg,Options())
+{
+}
+
+
+ChannelServer::ChannelServer(
+  SocketsInterface &sockets_arg,
+  const Options &options_arg
+)
+: message_server(sockets_arg),
+  options(options_arg)
+{
+}
+
+
+void ChannelServer::setupSelect(PreSelectParamsInterface &pre_select_params)
+{
+  message_server.setupSelect(pre_select_params);
+}
+
+
+void
+  ChannelServer::handleSelect(
+    const PostSelectParamsInterface &post_select_params,
+    EventInterface &event_handler
+  )
+{
+  Impl::MessageHandler message_handler(*this,event_handler);
+  message_server.handleSelect(post_select_params,message_handler);
+}
+
+
+bool ChannelServer::isSendingAMessageTo(ClientId client_id) const
+{
+  if (message_server.isSendingAMessageTo(client_id)) {
+    return true;
+  }
+
+  if (size_t(client_id) >= client_multiplexers.size()) {
+    return false;
+  }
+
+  return client_multiplexers[client_id].nWaitingMessages() != 0;
+}
+
+
+void
+  ChannelServer::queueMessageToClient(
+    ClientId client_id,
+    ChannelId channel_id,
+    const char *message,
+    size_t message_size
+  )
+{
+  Impl::Output output(message_server,client_id);
+
+  Impl::multiplexer(*this,client_id).queueMessage(
+    channel_id,message,message_size,output
+  );
+}
+
+
+struct ChannelClient::Impl {
+  struct Output : ChannelMultiplexer::OutputInterface {
+    MessageClient &message_client;
+
+    Output(MessageClient &message_client_arg)
+    : message_client(message_client_arg)
+    {
+    }
+
+    void queueMessage(const char *message,size_t message_size) override
+    {
+      message_client.queueMessage(message,message_size);
+    }
+  };
+
+  struct ChannelHandler : ChannelMultiplexer::EventInterface {
+    ChannelClient::EventInterface &event_handler;
+
+    ChannelHandler(ChannelClient::EventInterface &event_handler_arg)
+    : event_handler(event_handler_arg)
+    {
+    }
+
+    void
+      gotMessage(
+        ChannelId channel_id,
+        const char *message,
+        size_t message_size
+      ) override
+    {
+      event_handler.gotMessage(channel_id,message,message_size);
+    }
+  };
+
+  struct MessageHandler : MessageClient::EventInterface {
+    ChannelClient &client;
+    ChannelClient::EventInterface &event_handler;
+
+    MessageHandler(
+      ChannelClient &client_arg,
+      ChannelClient::EventInterface &event_handler_arg
+    )
+    : client(client_arg),
+      event_handler(event_handler_arg)
+    {
+    }
+
+    void connectionRefused() override
+    {
+      event_handler.connectionRefused();
+    }
+
+    void connected() override
+    {
+      event_handler.connected();
+    }
+
+    void gotMessage(const char *message,size_t message_size) override
+    {
+      Output output(client.message_client);
+      ChannelHandler channel_handler(event_handler);
+
+      client.multiplexer.handleMessage(
+        message,message_size,channel_handler,output
+      );
+    }
+  };
+};
+
+
+ChannelClient::ChannelClient(SocketsInterface &sockets_arg)
+: ChannelClient(sockets_arg,Options())
+{
+}
+
+
+ChannelClient::ChannelClient(
+  SocketsInterface &sockets_arg,
+  const Options &options_arg
+)
+: message_client(sockets_arg),
+  multiplexer(options_arg)
+{
+}
+
+
+void ChannelClient::startConnecting(int port)
+{
+  multiplexer.clear();
+  message_client.startConnecting(port);
+}
+
+
+void ChannelClient::startConnecting(const InternetAddress &address)
+{
+  multiplexer.clear();
+  message_client.startConnecting(address);
+}
+
+
+void ChannelClient::disconnect()
+{
+  message_client.disconnect();
+  multiplexer.clear();
+}
+
+
+void ChannelClient::setupSelect(PreSelectParamsInterface &pre_select_params)
+{
+  message_client.setupSelect(pre_select_params);
+}
+
+
+void
+  ChannelClient::handleSelect(
+    const PostSelectParamsInterface &post_select_params,
+    EventInterface &event_handler
+  )
+{
+  Impl::MessageHandler message_handler(*this,event_handler);
+  message_client.handleSelect(post_select_params,message_handler);
+
+  if (!message_client.isActive()) {
+    // Messages waiting for credit would have been lost with the others.
+    multiplexer.clear();
+  }
+}
+
+
+void
+  ChannelClient::queueMessage(
+    ChannelId channel_id,
+    const char *message,
+    size_t message_size
+  )
+{
+  Impl::Output output(message_client);
+  multiplexer.queueMessage(channel_id,message,message_size,output);
+}
@@ -0,0 +1,202 @@
+#ifndef CHANNELS_HPP_
+#define CHANNELS_HPP_
+
+#include <cstdint>
+#include <deque>
+#include <unordered_map>
+#include <vector>
+#include "messageservice.hpp"
+
+
+// Channels are independent streams of messages which share one
+// connection.  Each message starts with a four byte channel id and a one
+// byte kind.  Data messages carry a payload for the channel, and credit
+// messages let the other end send more payload bytes on it.
+//
+// Each end of a channel starts with a window of credit, and the receiver
+// gives the credit back as it delivers messages, so a channel never has
+// much more than a window of data in flight.  Messages beyond that wait
+// on their own channel instead of filling the connection ahead of the
+// other channels.  A message is sent whenever its channel has any credit
+// left, so messages larger than the window still get through.  Both ends
+// need to use the same window size.
+
+
+// The channels of one connection.  Messages for the connection are passed
+// to an OutputInterface, which queues them on the connection.
+class ChannelMultiplexer {
+  public:
+    using ChannelId = uint32_t;
+
+    struct Options {
+      size_t window_size = 64*1024;
+
+      // Data for a new channel is dropped once there are this many, so
+      // the other end can't use up memory by opening channels.
+      size_t max_channels = 1024;
+    };
+
+    struct OutputInterface {
+      virtual void queueMessage(const char *message,size_t message_size) = 0;
+    };
+
+    struct EventInterface {
+      virtual void
+        gotMessage(ChannelId,const char *message,size_t message_size) = 0;
+    };
+
+    ChannelMultiplexer();
+    explicit ChannelMultiplexer(const Options &options_arg);
+
+    void
+      queueMessage(
+        ChannelId,
+        const char *message,
+        size_t message_size,
+        OutputInterface &
+      );
+
+    // Handles a message from the connection.  Messages which aren't
+    // understood are ignored, as is credit for channels which were never
+    // used here.
+    void
+      handleMessage(
+        const char *message,
+        size_t message_size,
+        EventInterface &,
+        OutputInterface &
+      );
+
+    // The number of messages waiting for credit.
+    size_t nWaitingMessages() const { return n_waiting_messages; }
+
+    size_t nChannels() const { return channels.size(); }
+
+    // Forget all the channels, as when the connection is closed.
+    void clear();
+
+  private:
+    struct Impl;
+
+    struct Channel {
+      // Can go below zero, since a message is sent as long as there is
+      // any credit.
+      int64_t send_credit = 0;
+
+      // Payload bytes which were delivered but not yet given back as
+      // credit.  Credit is given back in batches of half a window.
+      size_t n_bytes_to_credit = 0;
+
+      std::deque<std::vector<char>> waiting_messages;
+    };
+
+    Options options;
+    std::unordered_map<ChannelId,Channel> channels;
+    size_t n_waiting_messages = 0;
+    std::vector<char> message_buffer;
+};
+
+
+class ChannelServer {
+  public:
+    using ClientId = MessageServer::ClientId;
+    using ChannelId = ChannelMultiplexer::ChannelId;
+    using Options = ChannelMultiplexer::Options;
+
+    struct EventInterface {
+      using ClientId = ChannelServer::ClientId;
+      using ChannelId = ChannelServer::ChannelId;
+
+      virtual void
+        gotMessage(
+          ClientId,ChannelId,const char *message,size_t message_size
+        ) = 0;
+
+      virtual void clientConnected(ClientId) = 0;
+      virtual void clientDisconnected(ClientId) = 0;
+    };
+
+    ChannelServer(SocketsInterface &sockets_arg);
+    ChannelServer(SocketsInterface &sockets_arg,const Options &options_arg);
+
+    void startListening(int port) { message_server.startListening(port); }
+    void stopListening() { message_server.stopListening(); }
+    bool isActive() const { return message_server.isActive(); }
+    int nClients() const { return message_server.nClients(); }
+    void setupSelect(PreSelectParamsInterface &);
+    void handleSelect(const PostSelectParamsInterface &,EventInterface &);
+    bool isSendingAMessageTo(ClientId) const;
+
+    void
+      queueMessageToClient(
+        ClientId,
+        ChannelId,
+        const char *message,
+        size_t message_size
+      );
+
+  private:
+    struct Impl;
+
+    MessageServer message_server;
+    const Options options;
+
+    // Indexed by client id.  The multiplexers are never moved, since
+    // messages can be queued to other clients while one is being used.
+    std::deque<ChannelMultiplexer> client_multiplexers;
+};
+
+
+class ChannelClient {
+  public:
+    using ChannelId = ChannelMultiplexer::ChannelId;
+    using Options = ChannelMultiplexer::Options;
+
+    struct EventInterface {
+      using ChannelId = ChannelClient::ChannelId;
+
+      virtual void connectionRefused() = 0;
+      virtual void connected() = 0;
+
+      virtual void
+        gotMessage(ChannelId,const char *message,size_t message_size) = 0;
+    };
+
+    ChannelClient(SocketsInterface &sockets_arg);
+    ChannelClient(SocketsInterface &sockets_arg,const Options &options_arg);
+
+    ChannelClient(const ChannelClient &) = delete;
+
+    // The channels start over on each connection.
+    void startConnecting(int port);
+    void startConnecting(const InternetAddress &);
+
+    bool isActive() const { return message_client.isActive(); }
+    bool isConnected() const { return message_client.isConnected(); }
+
+    bool isSendingAMessage() const
+    {
+      return
+        message_client.isSendingAMessage() ||
+        multiplexer.nWaitingMessages() != 0;
+    }
+
+    // Messages which are waiting for their channel to get credit.
+    size_t nWaitingMessages() const { return multiplexer.nWaitingMessages(); }
+
+    void disconnect();
+    void setupSelect(PreSelectParamsInterface &);
+    void handleSelect(const PostSelectParamsInterface &,EventInterface &);
+
+    void
+      queueMessage(ChannelId,const char *message,size_t message_size);
+
+  private:
+    struct Impl;
+
+    MessageClient message_client;
+    ChannelMultiplexer multiplexer;
+};
+
+
+#endif /* CHANNELS_HPP_ */
@@ -0,0 +1,254 @@
+#include "channels.hpp"
+
+#include <string>
+#include <utility>
+#include <vector>
+#include "fakesockets.hpp"
+#include "fakeselector.hpp"
+
+using std::string;
+using std::vector;
+using ClientId = ChannelServer::ClientId;
+using ChannelId = ChannelServer::ChannelId;
+using ChannelMessage = std::pair<ChannelId,string>;
+
+static const int server_port = 4151;
+
+
+namespace {
+struct ServerHandler : ChannelServer::EventInterface {
+  ChannelServer &server;
+  vector<ChannelMessage> messages;
+  bool echo_messages = false;
+
+  ServerHandler(ChannelServer &server_arg)
+  : server(server_arg)
+  {
+  }
+
+  void
+    gotMessage(
+      ClientId client_id,
+      ChannelId channel_id,
+      const char *message,
+      size_t message_size
+    ) override
+  {
+    messages.emplace_back(channel_id,string(message,message_size));
+
+    if (echo_messages) {
+      server.queueMessageToClient(client_id,channel_id,message,message_size);
+    }
+  }
+
+  void clientConnected(ClientId) override {}
+  void clientDisconnected(ClientId) override {}
+};
+}
+
+
+namespace {
+struct ClientHandler : ChannelClient::EventInterface {
+  vector<ChannelMessage> messages;
+
+  void connectionRefused() override { assert(false); }
+  void connected() override {}
+
+  void
+    gotMessage(
+      ChannelId channel_id,
+      const char *message,
+      size_t message_size
+    ) override
+  {
+    messages.emplace_back(channel_id,string(message,message_size));
+  }
+};
+}
+
+
+namespace {
+struct Tester {
+  FakeFileDescriptorAllocator file_descriptor_allocator;
+  FakeSockets sockets{file_descriptor_allocator};
+  FakeSelector selector{{&sockets}};
+  ChannelServer server;
+  ChannelClient client;
+  ServerHandler server_handler{server};
+  ClientHandler client_handler;
+
+  Tester(const ChannelMultiplexer::Options &options)
+  : server(sockets,options),
+    client(sockets,options)
+  {
+    server.startListening(server_port);
+    client.startConnecting(server_port);
+
+    while (server.nClients() != 1 || !client.isConnected()) {
+      processEvents();
+    }
+  }
+
+  void processEvents()
+  {
+    selector.beginSelect();
+    server.setupSelect(selector.preSelectParams());
+    client.setupSelect(selector.preSelectParams());
+    selector.callSelect();
+    server.handleSelect(selector.postSelectParams(),server_handler);
+    client.handleSelect(selector.postSelectParams(),client_handler);
+    selector.endSelect();
+  }
+};
+}
+
+
+namespace {
+struct OutputCollector : ChannelMultiplexer::OutputInterface {
+  vector<string> messages;
+
+  void queueMessage(const char *message,size_t message_size) override
+  {
+    messages.push_back(string(message,message_size));
+  }
+};
+}
+
+
+namespace {
+struct ChannelMessageCollector : ChannelMultiplexer::EventInterface {
+  vector<ChannelMessage> messages;
+
+  void
+    gotMessage(
+      ChannelId channel_id,
+      const char *message,
+      size_t message_size
+    ) override
+  {
+    messages.emplace_back(channel_id,string(message,message_size));
+  }
+};
+}
+
+
+static void
+  handleMessages(
+    ChannelMultiplexer &multiplexer,
+    const vector<string> &messages,
+    ChannelMultiplexer::EventInterface &event_handler,
+    ChannelMultiplexer::OutputInterface &output
+  )
+{
+  for (const string &message : messages) {
+    multiplexer.handleMessage(
+      message.data(),message.size(),event_handler,output
+    );
+  }
+}
+
+
+static void
+  queueMessageOn(ChannelClient &client,ChannelId channel_id,const string &s)
+{
+  client.queueMessage(channel_id,s.data(),s.size());
+}
+
+
+static void testBusyChannelDoesNotBlockOthers()
+{
+  ChannelMultiplexer::Options options;
+  options.window_size = 16;
+  Tester tester(options);
+  vector<string> bulk_messages;
+
+  for (int i=0; i!=10; ++i) {
+    bulk_messages.push_back("bulk " + std::to_string(i) + "....");
+  }
+
+  for (const string &message : bulk_messages) {
+    queueMessageOn(tester.client,/*channel_id*/1,message);
+  }
+
+  // Two messages use up the window, so the rest wait for credit.
+  assert(tester.client.nWaitingMessages() == 8);
+  queueMessageOn(tester.client,/*channel_id*/2,"urgent");
+  assert(tester.client.nWaitingMessages() == 8);
+
+  while (tester.server_handler.messages.size() != 11) {
+    tester.processEvents();
+  }
+
+  const vector<ChannelMessage> &messages = tester.server_handler.messages;
+  assert(messages[2] == ChannelMessage(2,"urgent"));
+  vector<string> received_bulk_messages;
+
+  for (const ChannelMessage &message : messages) {
+    if (message.first == 1) {
+      received_bulk_messages.push_back(message.second);
+    }
+  }
+
+  assert(received_bulk_messages == bulk_messages);
+  assert(!tester.client.isSendingAMessage());
+}
+
+
+static void testReplyingOnChannels()
+{
+  Tester tester{ChannelMultiplexer::Options()};
+  tester.server_handler.echo_messages = true;
+  queueMessageOn(tester.client,/*channel_id*/7,"a");
+  queueMessageOn(tester.client,/*channel_id*/3,"b");
+  queueMessageOn(tester.client,/*channel_id*/7,"c");
+
+  while (tester.client_handler.messages.size() != 3) {
+    tester.processEvents();
+  }
+
+  assert(
+    tester.client_handler.messages ==
+    (vector<ChannelMessage>{{7,"a"},{3,"b"},{7,"c"}})
+  );
+}
+
+
+static void testLimitingChannels()
+{
+  ChannelMultiplexer::Options options;
+  options.window_size = 2;
+  options.max_channels = 2;
+  ChannelMultiplexer sender(options);
+  ChannelMultiplexer receiver(options);
+  OutputCollector sender_output;
+  sender.queueMessage(/*channel_id*/1,"ab",2,sender_output);
+  sender.queueMessage(/*channel_id*/2,"c",1,sender_output);
+  sender.queueMessage(/*channel_id*/3,"d",1,sender_output);
+  OutputCollector receiver_output;
+  ChannelMessageCollector received;
+  handleMessages(receiver,sender_output.messages,received,receiver_output);
+  assert(received.messages == (vector<ChannelMessage>{{1,"ab"},{2,"c"}}));
+  assert(receiver.nChannels() == 2);
+
+  // The credit means nothing to a multiplexer which never sent on the
+  // channels.
+  assert(receiver_output.messages.size() == 2);
+  ChannelMultiplexer stranger(options);
+  OutputCollector stranger_output;
+  ChannelMessageCollector stranger_received;
+
+  handleMessages(
+    stranger,receiver_output.messages,stranger_received,stranger_output
+  );
+
+  assert(stranger.nChannels() == 0);
+  assert(stranger_output.messages.empty());
+}
+
+
+int main()
+{
+  testBusyChannelDoesNotBlockOthers();
+  testReplyingOnChannels();
+  testLimitingChannels();
+}
@@ -0,0 +1,20 @@
+#ifndef CLOCK_HPP_
+#define CLOCK_HPP_
+
+#include <chrono>
+
+
+struct ClockInterface {
+  using TimePoint = std::chrono::steady_clock::time_point;
+  using Duration = std::chrono::steady_clock::duration;
+
+  virtual TimePoint now() const = 0;
+};
+
+
+struct SystemClock : ClockInterface {
+  TimePoint now() const override { return std::chrono::steady_clock::now(); }
+};
+
+
+#endif /* CLOCK_HPP_ */
@@ -0,0 +1,286 @@
+#include "compression.hpp"
+
+#include <string.h>
+#include <algorithm>
+#include <cassert>
+
+using std::vector;
+
+
+static const size_t min_match_length = 4;
+static const size_t max_offset = 65535;
+static const int hash_bits = 12;
+
+// As in LZ4, the last bytes are always literals and no match starts near
+// the end, which lets decoders copy in larger pieces.
+static const size_t n_last_literals = 5;
+static const size_t match_start_margin = 12;
+
+
+static uint32_t read32(const char *p)
+{
+  uint32_t value;
+  memcpy(&value,p,sizeof value);
+  return value;
+}
+
+
+static uint64_t read64(const char *p)
+{
+  uint64_t value;
+  memcpy(&value,p,sizeof value);
+  return value;
+}
+
+
+static size_t hashOf(uint32_t sequence)
+{
+  return (sequence * 2654435761u) >> (32 - hash_bits);
+}
+
+
+static char *writeExtraLength(char *p,size_t length)
+{
+  while (length >= 255) {
+    *p++ = char(255);
+    length -= 255;
+  }
+
+  *p++ = char(length);
+  return p;
+}
+
+
+// Writes the token and the literals.  match_code is the match length
+// beyond the minimum, which goes in the token.
+static char *
+  writeLiterals(
+    char *p,
+    const char *literals,
+    size_t n_literals,
+    size_t match_code
+  )
+{
+  size_t literal_code = std::min<size_t>(n_literals,15);
+  *p++ = char((literal_code << 4) | std::min<size_t>(match_code,15));
+
+  if (n_literals >= 15) {
+    p = writeExtraLength(p,n_literals - 15);
+  }
+
+  memcpy(p,literals,n_literals);
+  return p + n_literals;
+}
+
+
+static char *writeMatch(char *p,size_t offset,size_t match_code)
+{
+  p[0] = char(offset);
+  p[1] = char(offset >> 8);
+  p += 2;
+
+  if (match_code >= 15) {
+    p = writeExtraLength(p,match_code - 15);
+  }
+
+  return p;
+}
+
+
+static bool
+  readExtraLength(
+    const unsigned char *&p,
+    const unsigned char *end,
+    size_t &length
+  )
+{
+  for (;;) {
+    if (p == end) {
+      return false;
+    }
+
+    unsigned char byte = *p++;
+    length += byte;
+
+    if (byte != 255) {
+      return true;
+    }
+  }
+}
+
+
+size_t LzCompressor::maxCompressedSize(size_t input_size)
+{
+  return input_size + input_size/255 + 16;
+}
+
+
+void
+  LzCompressor::compress(
+    const char *input,
+    size_t input_size,
+    vector<char> &output
+  )
+{
+  assert(input_size <= UINT32_MAX);
+  size_t output_start = output.size();
+  output.resize(output_start + maxCompressedSize(input_size));
+  char *p = output.data() + output_start;
+  size_t anchor = 0;
+
+  if (input_size > match_start_margin) {
+    hash_table.assign(size_t(1) << hash_bits, 0);
+    size_t match_start_limit = input_size - match_start_margin;
+    size_t match_end_limit = input_size - n_last_literals;
+    size_t position = 0;
+
+    while (position < match_start_limit) {
+      uint32_t sequence = read32(input + position);
+      uint32_t &entry = hash_table[hashOf(sequence)];
+      size_t candidate = entry;
+      entry = position;
+
+      bool is_match =
+        candidate < position &&
+        position - candidate <= max_offset &&
+        read32(input + candidate) == sequence;
+
+      if (!is_match) {
+        // Step further the longer nothing has matched, so that data which
+        // doesn't compress is passed over quickly.
+        position += 1 + ((position - anchor) >> 6);
+        continue;
+      }
+
+      size_t match_end = position + min_match_length;
+      size_t candidate_end = candidate + min_match_length;
+
+      while (
+        match_end + 8 <= match_end_limit &&
+        read64(input + match_end) == read64(input + candidate_end)
+      ) {
+        match_end += 8;
+        candidate_end += 8;
+      }
+
+      while (
+        match_end < match_end_limit && input[match_end] == input[candidate_end]
+      ) {
+        ++match_end;
+        ++candidate_end;
+      }
+
+      // The match may also start before the sequence which was found.
+      while (
+        position > anchor &&
+        candidate > 0 &&
+        input[position - 1] == input[candidate - 1]
+      ) {
+        --position;
+        --candidate;
+      }
+
+      size_t match_code = match_end - position - min_match_length;
+      p = writeLiterals(p,input + anchor,position - anchor,match_code);
+      p = writeMatch(p,position - candidate,match_code);
+      anchor = match_end;
+      position = match_end;
+
+      if (position < match_start_limit) {
+        // Catch matches which start inside this one.
+        hash_table[hashOf(read32(input + position - 2))] = position - 2;
+      }
+    }
+  }
+
+  p = writeLiterals(p,input + anchor,input_size - anchor,0);
+  output.resize(p - output.data());
+}
+
+
+size_t lzMaxDecompressedSize(size_t input_size)
+{
+  return input_size*255;
+}
+
+
+bool
+  lzDecompress(
+    const char *input,
+    size_t input_size,
+    char *output,
+    size_t output_size
+  )
+{
+  const unsigned char *p = reinterpret_cast<const unsigned char *>(input);
+  const unsigned char *input_end = p + input_size;
+  char *q = output;
+  char *output_end = output + output_size;
+
+  for (;;) {
+    if (p == input_end) {
+      return false;
+    }
+
+    unsigned token = *p++;
+    size_t n_literals = token >> 4;
+
+    if (n_literals == 15 && !readExtraLength(p,input_end,n_literals)) {
+      return false;
+    }
+
+    if (
+      n_literals > size_t(input_end - p) ||
+      n_literals > size_t(output_end - q)
+    ) {
+      return false;
+    }
+
+    memcpy(q,p,n_literals);
+    p += n_literals;
+    q += n_literals;
+
+    if (p == input_end) {
+      // Only the last sequence has no match.
+      return q == output_end;
+    }
+
+    if (input_end - p < 2) {
+      return false;
+    }
+
+    size_t offset = p[0] | (p[1] << 8);
+    p += 2;
+
+    if (offset == 0 || offset > size_t(q - output)) {
+      return false;
+    }
+
+    size_t match_length = token & 15;
+
+    if (match_length == 15 && !readExtraLength(p,input_end,match_length)) {
+      return false;
+    }
+
+    match_length += min_match_length;
+
+    if (match_length > size_t(output_end - q)) {
+      return false;
+    }
+
+    const char *match = q - offset;
+
+    if (offset >= match_length) {
+      memcpy(q,match,match_length);
+    }
+    else {
+      // The match overlaps the bytes it produces, which is how runs are
+      // encoded, so it has to be copied in order.
+      for (size_t i=0; i!=match_length; ++i) {
+        q[i] = match[i];
+      }
+    }
+
+    q += match_length;
+  }
+}
@@ -0,0 +1,46 @@
+#ifndef COMPRESSION_HPP_
+#define COMPRESSION_HPP_
+
+#include <stddef.h>
+#include <cstdint>
+#include <vector>
+
+
+// A fast LZ77 codec using the LZ4 block format.  Each sequence is a token
+// byte holding the literal and match lengths, any extra length bytes, the
+// literals, and a two byte little-endian offset back to the match.  The
+// last sequence only has literals.  It works well on text and other
+// repetitive data, and costs little on data which doesn't compress.
+class LzCompressor {
+  public:
+    // The most that compress() can produce for an input of this size.
+    static size_t maxCompressedSize(size_t input_size);
+
+    // Appends the compressed input to the output.
+    void
+      compress(const char *input,size_t input_size,std::vector<char> &output);
+
+  private:
+    // The last position where each hashed four byte sequence was seen.
+    // It is kept so that compressing doesn't allocate.
+    std::vector<uint32_t> hash_table;
+};
+
+
+// The most that an input of this size can decompress to.  Each byte
+// stands for at most 255 bytes of output.
+extern size_t lzMaxDecompressedSize(size_t input_size);
+
+
+// Returns false unless the input is valid and decompresses to exactly
+// output_size bytes.  Nothing is written outside of the output.
+extern bool
+  lzDecompress(
+    const char *input,
+    size_t input_size,
+    char *output,
+    size_t output_size
+  );
+
+
+#endif /* COMPRESSION_HPP_ */
@@ -0,0 +1,140 @@
+#include "compression.hpp"
+
+#include <cassert>
+#include <random>
+#include <string>
+#include <vector>
+
+using std::string;
+using std::vector;
+
+
+static vector<char> compressed(LzCompressor &compressor,const string &input)
+{
+  vector<char> output;
+  compressor.compress(input.data(),input.size(),output);
+  assert(output.size() <= LzCompressor::maxCompressedSize(input.size()));
+  return output;
+}
+
+
+static bool canDecompress(const vector<char> &input,size_t output_size)
+{
+  string output(output_size,'\0');
+  return lzDecompress(input.data(),input.size(),output.data(),output_size);
+}
+
+
+static void testRoundTrip(LzCompressor &compressor,const string &input)
+{
+  vector<char> output = compressed(compressor,input);
+  string decompressed(input.size(),'\0');
+
+  bool worked =
+    lzDecompress(
+      output.data(),output.size(),decompressed.data(),decompressed.size()
+    );
+
+  assert(worked);
+  assert(decompressed == input);
+  assert(input.size() <= lzMaxDecompressedSize(output.size()));
+}
+
+
+static string textSample(int n_lines)
+{
+  string text;
+
+  for (int i=0; i!=n_lines; ++i) {
+    text +=
+      "2026-10-18 12:00:" + std::to_string(i % 60) +
+      " INFO request " + std::to_string(i) + " handled for user " +
+      std::to_string(i % 7) + " in " + std::to_string(i % 13) + "ms\n";
+  }
+
+  return text;
+}
+
+
+static string randomSample(size_t size)
+{
+  std::mt19937 engine(1);
+  string data(size,'\0');
+
+  for (char &c : data) {
+    c = char(engine());
+  }
+
+  return data;
+}
+
+
+static void testRoundTrips()
+{
+  LzCompressor compressor;
+  testRoundTrip(compressor,"");
+  testRoundTrip(compressor,"a");
+  testRoundTrip(compressor,"abcdefghijklm");
+  testRoundTrip(compressor,string(100000,'x'));
+  testRoundTrip(compressor,textSample(2000));
+  testRoundTrip(compressor,randomSample(100000));
+
+  // Matches further back than an offset can reach.
+  string text = textSample(10);
+  testRoundTrip(compressor,text + randomSample(70000) + text);
+}
+
+
+static void testCompressing()
+{
+  LzCompressor compressor;
+  string text = textSample(2000);
+  assert(compressed(compressor,text).size()*3 < text.size());
+
+  // A run is a match which overlaps itself.
+  assert(compressed(compressor,string(100000,'x')).size() < 500);
+
+  // Random data only grows by the overhead.
+  string random_data = randomSample(100000);
+  assert(compressed(compressor,random_data).size() < 100000*1.01);
+}
+
+
+static void testRejectingBadInput()
+{
+  LzCompressor compressor;
+  string text = textSample(100);
+  vector<char> output = compressed(compressor,text);
+  assert(canDecompress(output,text.size()));
+  assert(!canDecompress(output,text.size() - 1));
+  assert(!canDecompress(output,text.size() + 1));
+
+  vector<char> truncated_output(output.begin(),output.end() - 1);
+  assert(!canDecompress(truncated_output,text.size()));
+
+  // A match can't reach back before the start.
+  vector<char> bad_offset = {char(0x10),'a',char(2),char(0)};
+  assert(!canDecompress(bad_offset,5));
+  assert(!canDecompress({},0));
+
+  // Arbitrary bytes never write outside of the output.
+  std::mt19937 engine(2);
+
+  for (int i=0; i!=10000; ++i) {
+    vector<char> garbage(engine() % 32);
+
+    for (char &c : garbage) {
+      c = char(engine());
+    }
+
+    canDecompress(garbage,engine() % 64);
+  }
+}
+
+
+int main()
+{
+  testRoundTrips();
+  testCompressing();
+  testRejectingBadInput();
+}
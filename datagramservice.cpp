@@ -0,0 +1,451 @@
+#include "datagramservice.hpp"
+
+#include <cerrno>
+#include <algorithm>
+#include <cassert>
+
+using SocketId = SocketsInterface::SocketId;
+using ReceivedDatagram = SocketsInterface::ReceivedDatagram;
+using DatagramToSend = SocketsInterface::DatagramToSend;
+
+
+DatagramTransceiver::DatagramTransceiver()
+: receive_buffer(batch_size*max_message_size),
+  received_datagrams(batch_size)
+{
+  for (int i=0; i!=batch_size; ++i) {
+    ReceivedDatagram &datagram = received_datagrams[i];
+    datagram.buffer = receive_buffer.data() + i*max_message_size;
+    datagram.buffer_size = max_message_size;
+    datagram.size = 0;
+    datagram.is_truncated = false;
+  }
+
+  datagrams_to_send.reserve(batch_size);
+}
+
+
+void
+  DatagramTransceiver::queueMessage(
+    const InternetAddress &address,
+    const char *message,
+    size_t message_size
+  )
+{
+  assert(message_size <= max_message_size);
+  send_queue.push_back(Message{address,{message,message + message_size}});
+}
+
+
+void
+  DatagramTransceiver::sendQueuedMessages(
+    SocketsInterface &sockets,
+    SocketId socket_id
+  )
+{
+  while (!send_queue.empty()) {
+    int n_to_send = std::min<size_t>(send_queue.size(),batch_size);
+    datagrams_to_send.clear();
+
+    for (int i=0; i!=n_to_send; ++i) {
+      const Message &message = send_queue[i];
+
+      datagrams_to_send.push_back(
+        DatagramToSend{
+          message.bytes.data(),message.bytes.size(),message.address
+        }
+      );
+    }
+
+    int n_sent =
+      sockets.sendDatagrams(socket_id,datagrams_to_send.data(),n_to_send);
+
+    if (n_sent < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      // The first message couldn't be sent, and it isn't going to work if
+      // we try again, so drop it and carry on with the rest.
+      send_queue.pop_front();
+      continue;
+    }
+
+    send_queue.erase(send_queue.begin(),send_queue.begin() + n_sent);
+
+    if (n_sent == 0) {
+      // The socket buffer is full, so wait until it is writable again.
+      // A batch which was only partly sent is retried instead, since it
+      // may have stopped at a message which can't be sent.
+      return;
+    }
+  }
+}
+
+
+void
+  DatagramTransceiver::receiveMessages(
+    SocketsInterface &sockets,
+    SocketId socket_id,
+    EventInterface &event_handler
+  )
+{
+  for (int i_batch=0; i_batch!=max_batches_per_receive; ++i_batch) {
+    int n_received =
+      sockets.recvDatagrams(socket_id,received_datagrams.data(),batch_size);
+
+    if (n_received < 0) {
+      // Errors like an earlier datagram being refused are reported here,
+      // but the socket is still usable, so try again on the next select.
+      return;
+    }
+
+    for (int i=0; i!=n_received; ++i) {
+      const ReceivedDatagram &datagram = received_datagrams[i];
+
+      if (datagram.is_truncated) {
+        // It is too large to be one of our messages.
+        continue;
+      }
+
+      const char *message = static_cast<const char *>(datagram.buffer);
+      event_handler.gotMessage(datagram.address,message,datagram.size);
+    }
+
+    if (n_received != batch_size) {
+      // There are no more waiting.
+      return;
+    }
+  }
+}
+
+
+struct DatagramServer::Impl {
+  struct MessageHandler : DatagramTransceiver::EventInterface {
+    DatagramServer &server;
+    DatagramServer::EventInterface &event_handler;
+
+    MessageHandler(
+      DatagramServer &server_arg,
+      DatagramServer::EventInterface &event_handler_arg
+    )
+    : server(server_arg),
+      event_handler(event_handler_arg)
+    {
+    }
+
+    void
+      gotMessage(
+        const InternetAddress &address,
+        const char *message,
+        size_t message_size
+      ) override
+    {
+      ClientId client_id =
+        clientIdForAddress(server,address,event_handler);
+
+      event_handler.gotMessage(client_id,message,message_size);
+    }
+  };
+
+  static void appendClient(DatagramServer &self,ClientId client_id)
+  {
+    Client &client = self.clients[client_id];
+    client.maybe_previous_client_id = self.maybe_last_client_id;
+    client.maybe_next_client_id.reset();
+
+    if (self.maybe_last_client_id) {
+      self.clients[*self.maybe_last_client_id].maybe_next_client_id =
+        client_id;
+    }
+    else {
+      self.maybe_first_client_id = client_id;
+    }
+
+    self.maybe_last_client_id = client_id;
+  }
+
+  static void removeClient(DatagramServer &self,ClientId client_id)
+  {
+    Client &client = self.clients[client_id];
+    std::optional<ClientId> maybe_previous_id =
+      client.maybe_previous_client_id;
+    std::optional<ClientId> maybe_next_id = client.maybe_next_client_id;
+
+    if (maybe_previous_id) {
+      self.clients[*maybe_previous_id].maybe_next_client_id = maybe_next_id;
+    }
+    else {
+      self.maybe_first_client_id = maybe_next_id;
+    }
+
+    if (maybe_next_id) {
+      self.clients[*maybe_next_id].maybe_previous_client_id =
+        maybe_previous_id;
+    }
+    else {
+      self.maybe_last_client_id = maybe_previous_id;
+    }
+
+    client.maybe_previous_client_id.reset();
+    client.maybe_next_client_id.reset();
+  }
+
+  static ClientId
+    newClientId(
+      DatagramServer &self,
+      DatagramServer::EventInterface &event_handler
+    )
+  {
+    if (int(self.clients.size()) < self.max_clients) {
+      self.clients.emplace_back();
+      return self.clients.size() - 1;
+    }
+
+    assert(self.maybe_first_client_id);
+    ClientId client_id = *self.maybe_first_client_id;
+    removeClient(self,client_id);
+    self.client_ids.erase(self.clients[client_id].address);
+    event_handler.clientForgotten(client_id);
+    return client_id;
+  }
+
+  static ClientId
+    clientIdForAddress(
+      DatagramServer &self,
+      const InternetAddress &address,
+      DatagramServer::EventInterface &event_handler
+    )
+  {
+    auto iter = self.client_ids.find(address);
+
+    if (iter != self.client_ids.end()) {
+      ClientId client_id = iter->second;
+
+      if (self.maybe_last_client_id != client_id) {
+        removeClient(self,client_id);
+        appendClient(self,client_id);
+      }
+
+      return client_id;
+    }
+
+    ClientId client_id = newClientId(self,event_handler);
+    self.clients[client_id].address = address;
+    self.client_ids[address] = client_id;
+    appendClient(self,client_id);
+    return client_id;
+  }
+};
+
+
+DatagramServer::DatagramServer(SocketsInterface &sockets_arg)
+: sockets(sockets_arg)
+{
+}
+
+
+DatagramServer::~DatagramServer()
+{
+  if (maybe_socket_id) {
+    stopListening();
+  }
+}
+
+
+void DatagramServer::startListening(int port)
+{
+  assert(!maybe_socket_id);
+  InternetAddress server_address;
+  server_address.setPort(port);
+
+  SocketId socket_id = sockets.createDatagram();
+  sockets.setNonBlocking(socket_id,true);
+  sockets.bind(socket_id,server_address);
+  maybe_socket_id = socket_id;
+}
+
+
+void DatagramServer::stopListening()
+{
+  assert(maybe_socket_id);
+  sockets.close(*maybe_socket_id);
+  maybe_socket_id.reset();
+  transceiver.clear();
+}
+
+
+void DatagramServer::setMaxClients(int max_clients_arg)
+{
+  assert(max_clients_arg > 0);
+  assert(nClients() <= max_clients_arg);
+  max_clients = max_clients_arg;
+}
+
+
+void DatagramServer::setupSelect(PreSelectParamsInterface &pre_select_params)
+{
+  if (!maybe_socket_id) {
+    return;
+  }
+
+  pre_select_params.setRead(*maybe_socket_id);
+
+  if (transceiver.hasMessageToSend()) {
+    pre_select_params.setWrite(*maybe_socket_id);
+  }
+}
+
+
+void
+  DatagramServer::handleSelect(
+    const PostSelectParamsInterface &post_select_params,
+    EventInterface &event_handler
+  )
+{
+  if (!maybe_socket_id) {
+    return;
+  }
+
+  SocketId socket_id = *maybe_socket_id;
+
+  if (post_select_params.readIsSet(socket_id)) {
+    Impl::MessageHandler message_handler(*this,event_handler);
+    transceiver.receiveMessages(sockets,socket_id,message_handler);
+  }
+
+  if (post_select_params.writeIsSet(socket_id)) {
+    transceiver.sendQueuedMessages(sockets,socket_id);
+  }
+}
+
+
+const InternetAddress &DatagramServer::clientAddress(ClientId client_id) const
+{
+  assert(client_id >= 0 && client_id < nClients());
+  return clients[client_id].address;
+}
+
+
+bool DatagramServer::isSendingAMessage() const
+{
+  return transceiver.hasMessageToSend();
+}
+
+
+void
+  DatagramServer::queueMessageToClient(
+    ClientId client_id,
+    const char *message,
+    int message_size
+  )
+{
+  transceiver.queueMessage(clientAddress(client_id),message,message_size);
+}
+
+
+struct DatagramClient::Impl {
+  struct MessageHandler : DatagramTransceiver::EventInterface {
+    DatagramClient::EventInterface &event_handler;
+
+    MessageHandler(DatagramClient::EventInterface &event_handler_arg)
+    : event_handler(event_handler_arg)
+    {
+    }
+
+    void
+      gotMessage(
+        const InternetAddress &,
+        const char *message,
+        size_t message_size
+      ) override
+    {
+      event_handler.gotMessage(message,message_size);
+    }
+  };
+};
+
+
+DatagramClient::DatagramClient(SocketsInterface &sockets_arg)
+: sockets(sockets_arg)
+{
+}
+
+
+DatagramClient::~DatagramClient()
+{
+  if (maybe_socket_id) {
+    stop();
+  }
+}
+
+
+void DatagramClient::startSending(int port)
+{
+  assert(!maybe_socket_id);
+  server_address.setLoopback();
+  server_address.setPort(port);
+
+  SocketId socket_id = sockets.createDatagram();
+  sockets.setNonBlocking(socket_id,true);
+  maybe_socket_id = socket_id;
+}
+
+
+void DatagramClient::stop()
+{
+  assert(maybe_socket_id);
+  sockets.close(*maybe_socket_id);
+  maybe_socket_id.reset();
+  transceiver.clear();
+}
+
+
+void DatagramClient::setupSelect(PreSelectParamsInterface &pre_select_params)
+{
+  if (!maybe_socket_id) {
+    return;
+  }
+
+  pre_select_params.setRead(*maybe_socket_id);
+
+  if (transceiver.hasMessageToSend()) {
+    pre_select_params.setWrite(*maybe_socket_id);
+  }
+}
+
+
+void
+  DatagramClient::handleSelect(
+    const PostSelectParamsInterface &post_select_params,
+    EventInterface &event_handler
+  )
+{
+  if (!maybe_socket_id) {
+    return;
+  }
+
+  SocketId socket_id = *maybe_socket_id;
+
+  if (post_select_params.readIsSet(socket_id)) {
+    Impl::MessageHandler message_handler(event_handler);
+    transceiver.receiveMessages(sockets,socket_id,message_handler);
+  }
+
+  if (post_select_params.writeIsSet(socket_id)) {
+    transceiver.sendQueuedMessages(sockets,socket_id);
+  }
+}
+
+
+bool DatagramClient::isSendingAMessage() const
+{
+  return transceiver.hasMessageToSend();
+}
+
+
+void DatagramClient::queueMessage(const char *message,int message_size)
+{
+  assert(maybe_socket_id);
+  transceiver.queueMessage(server_address,message,message_size);
+}
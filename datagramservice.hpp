@@ -0,0 +1,156 @@
+#ifndef DATAGRAMSERVICE_HPP_
+#define DATAGRAMSERVICE_HPP_
+
+#include <vector>
+#include <deque>
+#include <map>
+#include <optional>
+#include "socketsinterface.hpp"
+#include "selectparams.hpp"
+
+
+// Sends and receives messages on a datagram socket, one message per
+// datagram.  Datagrams are received and sent in batches, so that many
+// small messages only take a few system calls.  Delivery isn't
+// guaranteed, and messages may arrive out of order.
+class DatagramTransceiver {
+  public:
+    using SocketId = SocketsInterface::SocketId;
+
+    static const size_t max_message_size = 8192;
+    static const int batch_size = 32;
+
+    // Only this many batches are received at a time, so that a flood of
+    // datagrams can't keep the caller from its other sockets.  The rest
+    // are received after the next select.
+    static const int max_batches_per_receive = 8;
+
+    struct EventInterface {
+      virtual void
+        gotMessage(
+          const InternetAddress &,const char *,size_t message_size
+        ) = 0;
+    };
+
+    DatagramTransceiver();
+
+    void
+      queueMessage(
+        const InternetAddress &,const char *message,size_t message_size
+      );
+
+    bool hasMessageToSend() const { return !send_queue.empty(); }
+    void sendQueuedMessages(SocketsInterface &,SocketId);
+    void receiveMessages(SocketsInterface &,SocketId,EventInterface &);
+    void clear() { send_queue.clear(); }
+
+  private:
+    struct Message {
+      InternetAddress address;
+      std::vector<char> bytes;
+    };
+
+    std::deque<Message> send_queue;
+    std::vector<char> receive_buffer;
+    std::vector<SocketsInterface::ReceivedDatagram> received_datagrams;
+    std::vector<SocketsInterface::DatagramToSend> datagrams_to_send;
+};
+
+
+// Clients are identified by the address their messages come from, and
+// get an id when their first message arrives.  Since anyone can send from
+// any number of addresses, only a limited number of clients are
+// remembered.  Once there are that many, a message from a new address
+// makes the server forget the client it heard from least recently, and
+// give that client's id to the new one.
+class DatagramServer {
+  public:
+    using ClientId = int;
+    using SocketId = SocketsInterface::SocketId;
+
+    static const int default_max_clients = 4096;
+
+    struct EventInterface {
+      using ClientId = DatagramServer::ClientId;
+      virtual void gotMessage(ClientId,const char *,size_t message_size) = 0;
+
+      // Called just before the id is reused for a new client.
+      virtual void clientForgotten(ClientId) = 0;
+    };
+
+    DatagramServer(SocketsInterface &sockets_arg);
+    DatagramServer(const DatagramServer &) = delete;
+    DatagramServer(DatagramServer &&) = delete;
+    ~DatagramServer();
+
+    void startListening(int port);
+    void stopListening();
+    bool isActive() const { return maybe_socket_id.has_value(); }
+    void setMaxClients(int);
+    void setupSelect(PreSelectParamsInterface &);
+    void handleSelect(const PostSelectParamsInterface &,EventInterface &);
+    int nClients() const { return clients.size(); }
+    const InternetAddress &clientAddress(ClientId) const;
+    bool isSendingAMessage() const;
+
+    void
+      queueMessageToClient(
+        ClientId,
+        const char *message_arg,
+        int message_size_arg
+      );
+
+  private:
+    struct Impl;
+
+    struct Client {
+      InternetAddress address;
+      std::optional<ClientId> maybe_previous_client_id;
+      std::optional<ClientId> maybe_next_client_id;
+    };
+
+    SocketsInterface &sockets;
+    std::optional<SocketId> maybe_socket_id;
+    int max_clients = default_max_clients;
+    std::vector<Client> clients;
+    std::map<InternetAddress,ClientId> client_ids;
+
+    // The clients are linked in the order that we last heard from them,
+    // so the one to forget is always at the front.
+    std::optional<ClientId> maybe_first_client_id;
+    std::optional<ClientId> maybe_last_client_id;
+
+    DatagramTransceiver transceiver;
+};
+
+
+struct DatagramClient {
+  public:
+    struct EventInterface {
+      virtual void gotMessage(const char *,size_t message_size) = 0;
+    };
+
+    DatagramClient(SocketsInterface &sockets_arg);
+    DatagramClient(const DatagramClient &) = delete;
+    DatagramClient(DatagramClient &&) = delete;
+    ~DatagramClient();
+
+    void startSending(int port);
+    bool isActive() const { return maybe_socket_id.has_value(); }
+    void setupSelect(PreSelectParamsInterface &);
+    void handleSelect(const PostSelectParamsInterface &,EventInterface &);
+    bool isSendingAMessage() const;
+    void queueMessage(const char *message_arg,int message_size_arg);
+    void stop();
+
+  private:
+    struct Impl;
+
+    SocketsInterface &sockets;
+    std::optional<SocketsInterface::SocketId> maybe_socket_id;
+    InternetAddress server_address;
+    DatagramTransceiver transceiver;
+};
+
+
+#endif /* DATAGRAMSERVICE_HPP_ */
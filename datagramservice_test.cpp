@@ -0,0 +1,267 @@
+#include "datagramservice.hpp"
+
+#include <string>
+#include <vector>
+#include "fakesockets.hpp"
+#include "fakeselector.hpp"
+
+using std::string;
+using std::vector;
+
+static const int server_port = 4147;
+
+
+namespace {
+struct ServerHandler : DatagramServer::EventInterface {
+  vector<string> messages;
+  vector<DatagramServer::ClientId> client_ids;
+
+  void
+    gotMessage(
+      ClientId client_id,const char *message,size_t message_size
+    ) override
+  {
+    messages.push_back(string(message,message_size));
+    client_ids.push_back(client_id);
+  }
+
+  void clientForgotten(ClientId client_id) override
+  {
+    forgotten_client_ids.push_back(client_id);
+  }
+
+  vector<DatagramServer::ClientId> forgotten_client_ids;
+};
+}
+
+
+namespace {
+struct ClientHandler : DatagramClient::EventInterface {
+  vector<string> messages;
+
+  void gotMessage(const char *message,size_t message_size) override
+  {
+    messages.push_back(string(message,message_size));
+  }
+};
+}
+
+
+namespace {
+struct Tester {
+  FakeFileDescriptorAllocator file_descriptor_allocator;
+  FakeSockets sockets{file_descriptor_allocator};
+  FakeSelector selector{{&sockets}};
+  DatagramServer server{sockets};
+  DatagramClient client1{sockets};
+  DatagramClient client2{sockets};
+  ServerHandler server_handler;
+  ClientHandler client1_handler;
+  ClientHandler client2_handler;
+
+  Tester()
+  {
+    server.startListening(server_port);
+    client1.startSending(server_port);
+    client2.startSending(server_port);
+  }
+
+  void processEvents()
+  {
+    selector.beginSelect();
+    server.setupSelect(selector.preSelectParams());
+    client1.setupSelect(selector.preSelectParams());
+    client2.setupSelect(selector.preSelectParams());
+    selector.callSelect();
+    server.handleSelect(selector.postSelectParams(),server_handler);
+    client1.handleSelect(selector.postSelectParams(),client1_handler);
+    client2.handleSelect(selector.postSelectParams(),client2_handler);
+    selector.endSelect();
+  }
+};
+}
+
+
+static void queueMessageOn(DatagramClient &client,const string &message)
+{
+  client.queueMessage(message.data(),message.size());
+}
+
+
+static void testSendingAndReplying()
+{
+  Tester tester;
+  queueMessageOn(tester.client1,"first");
+  queueMessageOn(tester.client1,string("with\0null",9));
+
+  while (tester.server_handler.messages.size() != 2) {
+    tester.processEvents();
+  }
+
+  vector<string> expected_messages = {"first",string("with\0null",9)};
+  assert(tester.server_handler.messages == expected_messages);
+  assert(tester.server.nClients() == 1);
+  DatagramServer::ClientId client_id = tester.server_handler.client_ids[0];
+  tester.server.queueMessageToClient(client_id,"reply",5);
+
+  while (tester.client1_handler.messages.empty()) {
+    tester.processEvents();
+  }
+
+  assert(tester.client1_handler.messages == vector<string>{"reply"});
+  assert(tester.client2_handler.messages.empty());
+}
+
+
+static void testMultipleClients()
+{
+  Tester tester;
+  queueMessageOn(tester.client1,"one");
+  queueMessageOn(tester.client2,"two");
+  queueMessageOn(tester.client1,"three");
+
+  while (tester.server_handler.messages.size() != 3) {
+    tester.processEvents();
+  }
+
+  // Each client's messages are sent as one batch.
+  assert(
+    tester.server_handler.messages ==
+    (vector<string>{"one","three","two"})
+  );
+
+  assert(
+    tester.server_handler.client_ids ==
+    (vector<DatagramServer::ClientId>{0,0,1})
+  );
+
+  assert(tester.server.nClients() == 2);
+}
+
+
+static void testDroppingMessages()
+{
+  Tester tester;
+  const int n_messages = 10;
+
+  for (int i=0; i!=n_messages; ++i) {
+    queueMessageOn(tester.client1,std::to_string(i));
+  }
+
+  // The client sends everything in one batch, but the server's socket
+  // can only hold a few of them.
+  while (tester.client1.isSendingAMessage()) {
+    tester.processEvents();
+  }
+
+  for (int i=0; i!=2; ++i) {
+    tester.processEvents();
+  }
+
+  assert(
+    tester.server_handler.messages ==
+    (vector<string>{"0","1","2","3"})
+  );
+}
+
+
+static void testSkippingUnsendableMessages()
+{
+  Tester tester;
+  SocketsInterface &sockets = tester.sockets;
+  DatagramTransceiver transceiver;
+  SocketsInterface::SocketId socket_id = sockets.createDatagram();
+  InternetAddress server_address;
+  server_address.setLoopback();
+  server_address.setPort(server_port);
+  InternetAddress bad_address;
+  bad_address.setLoopback();
+  bad_address.setPort(0);
+  transceiver.queueMessage(bad_address,"lost",4);
+  transceiver.queueMessage(server_address,"sent",4);
+  transceiver.queueMessage(bad_address,"lost",4);
+  transceiver.queueMessage(server_address,"also sent",9);
+  transceiver.sendQueuedMessages(sockets,socket_id);
+  assert(!transceiver.hasMessageToSend());
+  tester.processEvents();
+
+  assert(
+    tester.server_handler.messages ==
+    (vector<string>{"sent","also sent"})
+  );
+
+  sockets.close(socket_id);
+}
+
+
+static void testForgettingClients()
+{
+  Tester tester;
+  tester.server.setMaxClients(1);
+  queueMessageOn(tester.client1,"one");
+
+  while (tester.server_handler.messages.size() != 1) {
+    tester.processEvents();
+  }
+
+  queueMessageOn(tester.client2,"two");
+
+  while (tester.server_handler.messages.size() != 2) {
+    tester.processEvents();
+  }
+
+  assert(tester.server.nClients() == 1);
+
+  assert(
+    tester.server_handler.forgotten_client_ids ==
+    vector<DatagramServer::ClientId>{0}
+  );
+
+  assert(
+    tester.server_handler.client_ids ==
+    (vector<DatagramServer::ClientId>{0,0})
+  );
+
+  // The id now belongs to the second client.
+  tester.server.queueMessageToClient(0,"reply",5);
+
+  while (tester.client2_handler.messages.empty()) {
+    tester.processEvents();
+  }
+
+  assert(tester.client2_handler.messages == vector<string>{"reply"});
+  assert(tester.client1_handler.messages.empty());
+}
+
+
+static void testDroppingTruncatedDatagrams()
+{
+  Tester tester;
+  SocketsInterface &sockets = tester.sockets;
+  SocketsInterface::SocketId socket_id = sockets.createDatagram();
+  InternetAddress server_address;
+  server_address.setLoopback();
+  server_address.setPort(server_port);
+  string too_large(DatagramTransceiver::max_message_size + 1,'x');
+
+  SocketsInterface::DatagramToSend datagrams[] = {
+    {too_large.data(),too_large.size(),server_address},
+    {"ok",2,server_address},
+  };
+
+  assert(sockets.sendDatagrams(socket_id,datagrams,/*n*/2) == 2);
+  tester.processEvents();
+  assert(tester.server_handler.messages == vector<string>{"ok"});
+  sockets.close(socket_id);
+}
+
+
+int main()
+{
+  testSendingAndReplying();
+  testMultipleClients();
+  testDroppingMessages();
+  testSkippingUnsendableMessages();
+  testForgettingClients();
+  testDroppingTruncatedDatagrams();
+}
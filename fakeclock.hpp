@@ -0,0 +1,18 @@
+#ifndef FAKECLOCK_HPP_
+#define FAKECLOCK_HPP_
+
+#include "clock.hpp"
+
+
+// A clock which only moves when told to.
+class FakeClock : public ClockInterface {
+  public:
+    TimePoint now() const override { return current_time; }
+    void advance(Duration duration) { current_time += duration; }
+
+  private:
+    TimePoint current_time;
+};
+
+
+#endif /* FAKECLOCK_HPP_ */
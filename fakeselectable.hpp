@@ -1,7 +1,9 @@
 #ifndef FAKESELECTABLE_HPP_
 #define FAKESELECTABLE_HPP_
 
-#include <float.h>
+#include <algorithm>
+#include <chrono>
+#include <optional>
 #include <vector>
 
 
@@ -9,19 +11,51 @@ struct FakeSelectParams {
   std::vector<bool> read_set;
   std::vector<bool> write_set;
   std::vector<bool> except_set;
-  float timeout = 0;
+  std::optional<std::chrono::microseconds> maybe_timeout;
+  std::vector<int> ready_fds;
 
   void setupSelect(int n_fds)
   {
     read_set.assign(n_fds,false);
     write_set.assign(n_fds,false);
     except_set.assign(n_fds,false);
-    timeout = FLT_MAX;
+    maybe_timeout.reset();
+    ready_fds.clear();
+  }
+
+  // Called once the selectables have cleared what isn't ready.
+  void updateReadyFds()
+  {
+    ready_fds.clear();
+    int n_fds = read_set.size();
+
+    for (int fd=0; fd!=n_fds; ++fd) {
+      if (read_set[fd] || write_set[fd]) {
+        ready_fds.push_back(fd);
+      }
+    }
+  }
+
+  bool anyAreSet() const
+  {
+    auto is_set = [](bool value){ return value; };
+
+    return
+      std::any_of(read_set.begin(),read_set.end(),is_set) ||
+      std::any_of(write_set.begin(),write_set.end(),is_set);
+  }
+
+  void setTimeout(std::chrono::microseconds duration)
+  {
+    if (!maybe_timeout || duration < *maybe_timeout) {
+      maybe_timeout = duration;
+    }
   }
 
   void setRead(int fd) { read_set[fd] = true; }
   void setWrite(int fd) { write_set[fd] = true; }
   void clearRead(int fd) { read_set[fd] = false; }
+  void clearWrite(int fd) { write_set[fd] = false; }
   bool readIsSet(int fd) const { return read_set[fd]; }
   bool writeIsSet(int fd) const { return write_set[fd]; }
 };
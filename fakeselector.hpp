@@ -1,4 +1,5 @@
 #include "selector.hpp"
+#include "fakeclock.hpp"
 
 
 class FakeSelector : public AbstractSelector {
@@ -14,10 +15,15 @@ class FakeSelector : public AbstractSelector {
       fake_selectables.push_back(&arg);
     }
 
+    // When nothing is ready, the clock is advanced by the timeout, as if
+    // we had waited that long.
+    void setClock(FakeClock &clock) { clock_ptr = &clock; }
+
   private:
     FakeSelectParams select_params;
     BasicSelectParamsWrapper<FakeSelectParams> select_params_wrapper;
     std::vector<FakeSelectable *> fake_selectables;
+    FakeClock *clock_ptr = nullptr;
 
     SelectParamsInterface &_selectParams() override
     {
@@ -50,5 +56,14 @@ class FakeSelector : public AbstractSelector {
         assert(selectable_ptr);
         selectable_ptr->select(select_params);
       }
+
+      select_params.updateReadyFds();
+
+      if (clock_ptr && select_params.maybe_timeout) {
+        if (!select_params.anyAreSet()) {
+          std::chrono::microseconds zero(0);
+          clock_ptr->advance(std::max(*select_params.maybe_timeout,zero));
+        }
+      }
     }
 };
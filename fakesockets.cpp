@@ -1,9 +1,17 @@
 #include "fakesockets.hpp"
 
+#include <algorithm>
+
 using SocketId = FakeSockets::SocketId;
 using std::optional;
 
 
+static bool isTransientError(int error_number)
+{
+  return error_number == EINTR || error_number == EAGAIN;
+}
+
+
 FakeSockets::FakeSockets(
   FakeFileDescriptorAllocator &file_descriptor_allocator_arg
 )
@@ -71,6 +79,18 @@ bool FakeSockets::anySocketsIsBoundToPort(int port) const
 }
 
 
+int FakeSockets::unusedPort() const
+{
+  int port = 49152;
+
+  while (anySocketsIsBoundToPort(port)) {
+    ++port;
+  }
+
+  return port;
+}
+
+
 void FakeSockets::bind(SocketId sockfd,const InternetAddress &address)
 {
   if (anySocketsIsBoundToPort(address.port())) {
@@ -123,6 +143,11 @@ bool FakeSockets::checkWrite(SocketId socket_id)
 {
   Socket &socket = this->socket(socket_id);
 
+  if (socket.is_datagram) {
+    // Datagrams that don't fit are dropped instead of blocking.
+    return true;
+  }
+
   if (socket.isConnecting()) {
     // See if there is another socket that is listening on the
     // same port we are connecting to.
@@ -214,7 +239,10 @@ bool FakeSockets::checkRead(SocketId socket_id)
 {
   Socket &socket = this->socket(socket_id);
 
-  if (socket.isConnecting()) {
+  if (socket.is_datagram) {
+    return !socket.received_datagrams.empty();
+  }
+  else if (socket.isConnecting()) {
     assert(false);
   }
   else if (socket.is_listening) {
@@ -239,6 +267,12 @@ bool FakeSockets::checkRead(SocketId socket_id)
       return true;
     }
 
+    if (hasZeroCopyCompletion(socket_id)) {
+      // Like a real socket, a pending notification on the error queue
+      // makes the socket readable.
+      return true;
+    }
+
     if (!remote_socket.output_buffer.isEmpty()) {
       return true;
     }
@@ -304,31 +338,45 @@ int FakeSockets::send(SocketId sockfd, const void * buf, size_t len)
     SocketId remote_socket_id = *socket.maybe_remote_socket_id;
 
     if (this->socket(remote_socket_id).is_closed) {
-      return 0; // report EOF
+      errno = EPIPE;
+      return -1;
     }
   }
 
+  if (socket.output_buffer.isFull()) {
+    errno = EAGAIN;
+    return -1;
+  }
+
   if (socket.maybe_n_bytes_before_send_error) {
-    size_t n_bytes_before_send_error = *socket.maybe_n_bytes_before_send_error;
+    size_t &n_bytes_before_send_error = *socket.maybe_n_bytes_before_send_error;
 
     if (n_bytes_before_send_error == 0) {
+      errno = socket.send_error_number;
+
+      if (isTransientError(errno)) {
+        socket.maybe_n_bytes_before_send_error.reset();
+      }
+
       return -1;
     }
 
-    if (n_bytes_before_send_error < len) {
-      size_t n_bytes_to_send = n_bytes_before_send_error;
-      *socket.maybe_n_bytes_before_send_error -= n_bytes_to_send;
-      assert(*socket.maybe_n_bytes_before_send_error == 0);
-      return socket.output_buffer.put(buf,n_bytes_to_send);
-    }
-    else {
-      assert(false);
-    }
+    int n_bytes_put =
+      putOutput(socket,buf,std::min(len,n_bytes_before_send_error));
 
-    *socket.maybe_n_bytes_before_send_error -= len;
+    n_bytes_before_send_error -= n_bytes_put;
+    return n_bytes_put;
   }
 
-  return socket.output_buffer.put(buf,len);
+  return putOutput(socket,buf,len);
+}
+
+
+int FakeSockets::putOutput(Socket &socket,const void *buf,size_t len)
+{
+  int n_bytes_put = socket.output_buffer.put(buf,len);
+  socket.n_output_bytes_put += n_bytes_put;
+  return n_bytes_put;
 }
 
 
@@ -340,20 +388,36 @@ int FakeSockets::recv(SocketId sockfd, void *buf, size_t len)
     size_t &n_bytes_before_recv_error = *socket.maybe_n_bytes_before_recv_error;
 
     if (n_bytes_before_recv_error == 0) {
+      errno = socket.recv_error_number;
+
+      if (isTransientError(errno)) {
+        socket.maybe_n_bytes_before_recv_error.reset();
+      }
+
       return -1;
     }
 
     if (n_bytes_before_recv_error < len) {
       len = n_bytes_before_recv_error;
     }
-
-    n_bytes_before_recv_error -= len;
   }
 
   assert(socket.maybe_remote_socket_id);
   SocketId remote_socket_id = *socket.maybe_remote_socket_id;
   Socket &remote_socket = this->socket(remote_socket_id);
-  return remote_socket.output_buffer.get(buf,len);
+  int n_bytes_got = remote_socket.output_buffer.get(buf,len);
+  remote_socket.n_output_bytes_taken += n_bytes_got;
+
+  if (socket.maybe_n_bytes_before_recv_error) {
+    *socket.maybe_n_bytes_before_recv_error -= n_bytes_got;
+  }
+
+  if (n_bytes_got == 0 && len != 0 && !remote_socket.is_closed) {
+    errno = EAGAIN;
+    return -1;
+  }
+
+  return n_bytes_got;
 }
 
 
@@ -385,13 +449,310 @@ void FakeSockets::close(SocketId sockfd)
 }
 
 
-void FakeSockets::setNBytesBeforeRecvError(SocketId socket_id, size_t n_bytes)
+SocketId FakeSockets::createDatagram()
+{
+  SocketId socket_id = allocate();
+  socket(socket_id).is_datagram = true;
+  return socket_id;
+}
+
+
+auto FakeSockets::maybeDatagramSocketBoundToPort(int port) -> Socket *
+{
+  for (int i=0; i!=nSocketIds(); ++i) {
+    if (Socket *socket_ptr = maybeSocket(i)) {
+      if (socket_ptr->is_datagram && socket_ptr->maybe_bound_port == port) {
+        return socket_ptr;
+      }
+    }
+  }
+
+  return nullptr;
+}
+
+
+int
+  FakeSockets::recvDatagrams(
+    SocketId sockfd,
+    ReceivedDatagram *datagrams,
+    int n
+  )
+{
+  Socket &socket = this->socket(sockfd);
+  assert(socket.is_datagram);
+  std::deque<Datagram> &received_datagrams = socket.received_datagrams;
+  int n_received = 0;
+
+  while (n_received != n && !received_datagrams.empty()) {
+    const Datagram &datagram = received_datagrams.front();
+    ReceivedDatagram &result = datagrams[n_received];
+    result.size = std::min(datagram.data.size(),result.buffer_size);
+    result.is_truncated = datagram.data.size() > result.buffer_size;
+    char *buffer = static_cast<char *>(result.buffer);
+    std::copy_n(datagram.data.begin(),result.size,buffer);
+    result.address = InternetAddress();
+    result.address.setPort(datagram.source_port);
+    received_datagrams.pop_front();
+    ++n_received;
+  }
+
+  return n_received;
+}
+
+
+int
+  FakeSockets::sendDatagrams(
+    SocketId sockfd,
+    const DatagramToSend *datagrams,
+    int n
+  )
+{
+  Socket &socket = this->socket(sockfd);
+  assert(socket.is_datagram);
+
+  if (!socket.isBound()) {
+    // Like the kernel, bind to an unused port on the first send.
+    socket.bind(unusedPort());
+  }
+
+  int source_port = *socket.maybe_bound_port;
+
+  for (int i=0; i!=n; ++i) {
+    const DatagramToSend &datagram = datagrams[i];
+    int target_port = datagram.address.port();
+
+    if (target_port == 0) {
+      // Like the kernel, refuse to send to port zero.
+      if (i == 0) {
+        errno = EINVAL;
+        return -1;
+      }
+
+      return i;
+    }
+    Socket *target_ptr = maybeDatagramSocketBoundToPort(target_port);
+
+    if (!target_ptr) {
+      // Nobody is listening, so the datagram is lost.
+      continue;
+    }
+
+    if (target_ptr->received_datagrams.size() >= max_queued_datagrams) {
+      ++target_ptr->n_dropped_datagrams;
+      continue;
+    }
+
+    const char *data = static_cast<const char *>(datagram.data);
+
+    target_ptr->received_datagrams.push_back(
+      Datagram{source_port,std::vector<char>(data,data + datagram.size)}
+    );
+  }
+
+  return n;
+}
+
+
+int FakeSockets::nDroppedDatagrams(SocketId socket_id) const
+{
+  return socket(socket_id).n_dropped_datagrams;
+}
+
+
+void
+  FakeSockets::setNBytesBeforeRecvError(
+    SocketId socket_id,
+    size_t n_bytes,
+    int error_number
+  )
 {
   socket(socket_id).maybe_n_bytes_before_recv_error = n_bytes;
+  socket(socket_id).recv_error_number = error_number;
 }
 
 
-void FakeSockets::setNBytesBeforeSendError(SocketId socket_id, size_t n_bytes)
+void
+  FakeSockets::setNBytesBeforeSendError(
+    SocketId socket_id,
+    size_t n_bytes,
+    int error_number
+  )
 {
   socket(socket_id).maybe_n_bytes_before_send_error = n_bytes;
+  socket(socket_id).send_error_number = error_number;
+}
+
+
+uint32_t FakeSockets::nZeroCopySends(SocketId socket_id) const
+{
+  return socket(socket_id).n_zero_copy_sends;
+}
+
+
+int
+  FakeSockets::sendFile(
+    SocketId sockfd,
+    int file_descriptor,
+    off_t offset,
+    size_t len
+  )
+{
+  return sendFileBySending(*this,sockfd,file_descriptor,offset,len);
+}
+
+
+void FakeSockets::setNoDelay(SocketId socket_id,bool no_delay)
+{
+  socket(socket_id).no_delay_is_set = no_delay;
+}
+
+
+void FakeSockets::setCork(SocketId socket_id,bool cork)
+{
+  socket(socket_id).is_corked = cork;
+}
+
+
+void
+  FakeSockets::setKeepAlive(SocketId socket_id,std::chrono::seconds idle_time)
+{
+  socket(socket_id).maybe_keep_alive_time = idle_time;
+}
+
+
+void FakeSockets::setBufferCapacity(SocketId socket_id,size_t capacity)
+{
+  Socket &socket = this->socket(socket_id);
+  assert(socket.output_buffer.isEmpty());
+  socket.output_buffer = Buffer(capacity);
+}
+
+
+void FakeSockets::reverseZeroCopyCompletions(SocketId socket_id)
+{
+  socket(socket_id).zero_copy_completions_are_reversed = true;
+}
+
+
+bool FakeSockets::noDelayIsSet(SocketId socket_id) const
+{
+  return socket(socket_id).no_delay_is_set;
+}
+
+
+bool FakeSockets::isCorked(SocketId socket_id) const
+{
+  return socket(socket_id).is_corked;
+}
+
+
+std::optional<std::chrono::seconds>
+  FakeSockets::maybeKeepAliveTime(SocketId socket_id) const
+{
+  return socket(socket_id).maybe_keep_alive_time;
+}
+
+
+bool FakeSockets::enableZeroCopy(SocketId socket_id)
+{
+  socket(socket_id).zero_copy_is_enabled = true;
+  return true;
+}
+
+
+int
+  FakeSockets::sendZeroCopy(
+    SocketId sockfd,
+    const void *buf,
+    size_t len,
+    bool &is_zero_copy
+  )
+{
+  int send_result = send(sockfd,buf,len);
+  Socket &socket = this->socket(sockfd);
+  is_zero_copy = false;
+
+  if (send_result > 0 && socket.zero_copy_is_enabled) {
+    // The data is copied into the output buffer anyway, but we report the
+    // send as complete only once the peer has received it.
+    PendingZeroCopySend pending_send;
+    pending_send.send_id = socket.n_zero_copy_sends++;
+    pending_send.n_output_bytes = socket.n_output_bytes_put;
+    socket.pending_zero_copy_sends.push_back(pending_send);
+    is_zero_copy = true;
+  }
+
+  return send_result;
+}
+
+
+bool
+  FakeSockets::zeroCopySendIsComplete(
+    SocketId socket_id,
+    const PendingZeroCopySend &pending_send
+  )
+{
+  Socket &socket = this->socket(socket_id);
+
+  if (socket.maybe_remote_socket_id) {
+    if (this->socket(*socket.maybe_remote_socket_id).is_closed) {
+      return true;
+    }
+  }
+
+  return socket.n_output_bytes_taken >= pending_send.n_output_bytes;
+}
+
+
+bool FakeSockets::hasZeroCopyCompletion(SocketId socket_id)
+{
+  Socket &socket = this->socket(socket_id);
+
+  if (socket.pending_zero_copy_sends.empty()) {
+    return false;
+  }
+
+  if (socket.zero_copy_completions_are_reversed) {
+    // Sends complete in order, so the last one is complete only once
+    // they all are.
+    return
+      zeroCopySendIsComplete(socket_id,socket.pending_zero_copy_sends.back());
+  }
+
+  return
+    zeroCopySendIsComplete(socket_id,socket.pending_zero_copy_sends.front());
+}
+
+
+auto FakeSockets::readZeroCopyCompletion(SocketId socket_id)
+  -> optional<ZeroCopyCompletion>
+{
+  if (!hasZeroCopyCompletion(socket_id)) {
+    return std::nullopt;
+  }
+
+  Socket &socket = this->socket(socket_id);
+  std::deque<PendingZeroCopySend> &pending_sends =
+    socket.pending_zero_copy_sends;
+  ZeroCopyCompletion completion;
+
+  if (socket.zero_copy_completions_are_reversed) {
+    completion.first_send_id = pending_sends.back().send_id;
+    completion.last_send_id = completion.first_send_id;
+    pending_sends.pop_back();
+    return completion;
+  }
+
+  completion.first_send_id = pending_sends.front().send_id;
+
+  // Like the kernel, report consecutive completions together.
+  while (
+    !pending_sends.empty() &&
+    zeroCopySendIsComplete(socket_id,pending_sends.front())
+  ) {
+    completion.last_send_id = pending_sends.front().send_id;
+    pending_sends.pop_front();
+  }
+
+  return completion;
 }
@@ -2,6 +2,9 @@
 #define FAKESOCKETS_HPP_
 
 #include <optional>
+#include <stdexcept>
+#include <deque>
+#include <vector>
 #include "socketsinterface.hpp"
 #include "buffer.hpp"
 #include "fakefiledescriptorallocator.hpp"
@@ -12,8 +15,17 @@ class FakeSockets : public SocketsInterface, public FakeSelectable {
   public:
     FakeSockets(FakeFileDescriptorAllocator &file_descriptor_allocator_arg);
 
-    int create() override { return allocate(); }
+    int create(int /*address_family*/ = AF_INET) override
+    {
+      return allocate();
+    }
+
     void setNonBlocking(SocketId socket_id,bool non_blocking) override;
+    void setNoDelay(SocketId socket_id,bool no_delay) override;
+    void setCork(SocketId socket_id,bool cork) override;
+
+    void
+      setKeepAlive(SocketId socket_id,std::chrono::seconds idle_time) override;
     void connect(SocketId socket_id, const InternetAddress &address) override;
     void bind(SocketId sockfd,const InternetAddress &address) override;
     void listen(SocketId sockfd, int /*backlog*/) override;
@@ -22,25 +34,99 @@ class FakeSockets : public SocketsInterface, public FakeSelectable {
     int recv(SocketId sockfd, void *buf, size_t len) override;
     void close(SocketId sockfd) override;
 
+    SocketId createDatagram() override;
+    int recvDatagrams(SocketId, ReceivedDatagram *, int n) override;
+    int sendDatagrams(SocketId, const DatagramToSend *, int n) override;
+
+    int
+      sendFile(
+        SocketId, int file_descriptor, off_t offset, size_t len
+      ) override;
+
+    bool enableZeroCopy(SocketId sockfd) override;
+
+    int
+      sendZeroCopy(
+        SocketId sockfd, const void *buf, size_t len, bool &is_zero_copy
+      ) override;
+
+    std::optional<ZeroCopyCompletion>
+      readZeroCopyCompletion(SocketId sockfd) override;
+
     int nSocketIds() const { return sockets.size(); }
     int nFileDescriptors() const { return nSocketIds(); }
     int nAllocated() const;
     void select(FakeSelectParams &);
-    void setNBytesBeforeRecvError(SocketId, size_t n);
-    void setNBytesBeforeSendError(SocketId, size_t n);
+    // After n more bytes, recv() or send() fail with the error.  EINTR
+    // and EAGAIN only happen once, as they would on a real socket, and
+    // other errors keep happening.
+    void
+      setNBytesBeforeRecvError(
+        SocketId, size_t n, int error_number = ECONNRESET
+      );
+
+    void
+      setNBytesBeforeSendError(SocketId, size_t n, int error_number = EPIPE);
+
+    // How many bytes sent on the socket can wait for the peer to receive
+    // them.  This starts out tiny, so that partial sends and receives
+    // happen, and can only be changed while nothing is waiting.
+    void setBufferCapacity(SocketId,size_t capacity);
+
+    // The kernel doesn't promise to report zero-copy completions in order.
+    // After this, they are held back until every zero-copy send on the
+    // socket is complete, and then reported one send at a time, last
+    // first.
+    void reverseZeroCopyCompletions(SocketId);
+
+    uint32_t nZeroCopySends(SocketId) const;
+    bool noDelayIsSet(SocketId) const;
+    bool isCorked(SocketId) const;
+    std::optional<std::chrono::seconds> maybeKeepAliveTime(SocketId) const;
+    int nDroppedDatagrams(SocketId) const;
+
+    // Like a real socket buffer, only a limited number of datagrams can be
+    // waiting to be received, and further ones are dropped.
+    static const size_t max_queued_datagrams = 4;
 
   private:
+    struct PendingZeroCopySend {
+      uint32_t send_id;
+
+      // The send completes once the peer has received this many bytes.
+      size_t n_output_bytes;
+    };
+
+    struct Datagram {
+      int source_port;
+      std::vector<char> data;
+    };
+
     struct Socket {
+      bool is_datagram = false;
       bool connection_was_refused = false;
       bool is_listening = false;
       bool is_non_blocking = false;
       bool is_closed = false;
+      bool no_delay_is_set = false;
+      bool is_corked = false;
+      std::optional<std::chrono::seconds> maybe_keep_alive_time;
       std::optional<int> maybe_bound_port;
       std::optional<int> maybe_connect_port;
       std::optional<SocketId> maybe_remote_socket_id;
       std::optional<size_t> maybe_n_bytes_before_recv_error;
       std::optional<size_t> maybe_n_bytes_before_send_error;
+      int recv_error_number = 0;
+      int send_error_number = 0;
       Buffer output_buffer{/*capacity*/2};
+      size_t n_output_bytes_put = 0;
+      size_t n_output_bytes_taken = 0;
+      bool zero_copy_is_enabled = false;
+      bool zero_copy_completions_are_reversed = false;
+      uint32_t n_zero_copy_sends = 0;
+      std::deque<PendingZeroCopySend> pending_zero_copy_sends;
+      std::deque<Datagram> received_datagrams;
+      int n_dropped_datagrams = 0;
 
       bool isBound() const { return maybe_bound_port.has_value(); }
       void bind(int port) { maybe_bound_port = port; }
@@ -93,10 +179,21 @@ class FakeSockets : public SocketsInterface, public FakeSelectable {
       return *socket_ptr;
     }
 
+    const Socket &socket(int i) const
+    {
+      assert(sockets[i]);
+      return *sockets[i];
+    }
+
     bool anySocketsIsBoundToPort(int port) const;
+    int unusedPort() const;
+    Socket *maybeDatagramSocketBoundToPort(int port);
     bool connectionWasRefused(SocketId socket_id);
     std::optional<SocketId> findSocketConnectedToSocket(SocketId socket_id);
     std::optional<SocketId> findSocketIdListeningOnPort(int port);
+    int putOutput(Socket &,const void *buf,size_t len);
+    bool zeroCopySendIsComplete(SocketId,const PendingZeroCopySend &);
+    bool hasZeroCopyCompletion(SocketId);
     bool checkRead(SocketId socket_id);
     bool checkWrite(SocketId socket_id);
     bool checkExcept(SocketId socket_id);
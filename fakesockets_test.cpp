@@ -1,5 +1,7 @@
 #include "fakesockets.hpp"
 
+#include <unistd.h>
+#include <cstdlib>
 #include "fakeselector.hpp"
 
 
@@ -96,7 +98,108 @@ static void testSetNBytesBeforeRecvError()
 }
 
 
+static void testWouldBlock()
+{
+  FakeFileDescriptorAllocator file_descriptor_allocator;
+  FakeSockets sockets(file_descriptor_allocator);
+
+  Connection connection = createConnection(sockets);
+  SocketId server_socket_id = connection.server_socket_id;
+  SocketId client_socket_id = connection.client_socket_id;
+  char buffer[4] = {};
+
+  {
+    int recv_result = sockets.recv(client_socket_id, buffer, sizeof buffer);
+    assert(ioStatus(recv_result) == IoStatus::would_block);
+  }
+  {
+    int send_result = sockets.send(server_socket_id, "123", 3);
+    assert(send_result == 2);
+    send_result = sockets.send(server_socket_id, "3", 1);
+    assert(ioStatus(send_result) == IoStatus::would_block);
+  }
+
+  sockets.close(server_socket_id);
+
+  {
+    int recv_result = sockets.recv(client_socket_id, buffer, sizeof buffer);
+    assert(recv_result == 2);
+    recv_result = sockets.recv(client_socket_id, buffer, sizeof buffer);
+    assert(ioStatus(recv_result) == IoStatus::closed);
+  }
+
+  sockets.close(client_socket_id);
+}
+
+
+static void testZeroCopyCompletions()
+{
+  FakeFileDescriptorAllocator file_descriptor_allocator;
+  FakeSockets sockets(file_descriptor_allocator);
+
+  Connection connection = createConnection(sockets);
+  SocketId server_socket_id = connection.server_socket_id;
+  SocketId client_socket_id = connection.client_socket_id;
+  bool enable_result = sockets.enableZeroCopy(server_socket_id);
+  assert(enable_result);
+
+  for (char c : {'1','2'}) {
+    bool is_zero_copy = false;
+    int send_result =
+      sockets.sendZeroCopy(server_socket_id, &c, 1, is_zero_copy);
+    assert(send_result == 1);
+    assert(is_zero_copy);
+  }
+
+  // The sends aren't complete until the peer has received the data.
+  assert(!sockets.readZeroCopyCompletion(server_socket_id));
+
+  {
+    char buffer[2] = {};
+    int recv_result = sockets.recv(client_socket_id, buffer, sizeof buffer);
+    assert(recv_result == 2);
+  }
+
+  auto maybe_completion = sockets.readZeroCopyCompletion(server_socket_id);
+  assert(maybe_completion);
+  assert(maybe_completion->first_send_id == 0);
+  assert(maybe_completion->last_send_id == 1);
+  assert(!sockets.readZeroCopyCompletion(server_socket_id));
+}
+
+
+static void testSendFileErrors()
+{
+  FakeFileDescriptorAllocator file_descriptor_allocator;
+  FakeSockets sockets(file_descriptor_allocator);
+  Connection connection = createConnection(sockets);
+  SocketId server_socket_id = connection.server_socket_id;
+  char path[] = "/tmp/fakesockets_test.XXXXXX";
+  int file_descriptor = mkstemp(path);
+  assert(file_descriptor >= 0);
+  unlink(path);
+  ssize_t write_result = write(file_descriptor,"abc",3);
+  assert(write_result == 3);
+
+  errno = 0;
+  int send_result =
+    sockets.sendFile(server_socket_id,file_descriptor,/*offset*/3,/*len*/1);
+  assert(send_result == -1);
+  assert(errno == EIO);
+
+  close(file_descriptor);
+  errno = 0;
+  send_result =
+    sockets.sendFile(server_socket_id,file_descriptor,/*offset*/0,/*len*/1);
+  assert(send_result == -1);
+  assert(errno == EBADF);
+}
+
+
 int main()
 {
   testSetNBytesBeforeRecvError();
+  testWouldBlock();
+  testZeroCopyCompletions();
+  testSendFileErrors();
 }
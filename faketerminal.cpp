@@ -1,47 +1,22 @@
 #include "faketerminal.hpp"
 
-#include <optional>
+#include <algorithm>
+#include <cerrno>
 
 
-using std::optional;
 using std::string;
 
 
-static optional<size_t> maybeNewlinePosition(const Buffer &input_buffer)
-{
-  size_t n = input_buffer.size();
-
-  for (size_t i=0; i!=n; ++i) {
-    if (input_buffer.peek(i) == '\n') {
-      return i;
-    }
-  }
-
-  return std::nullopt;
-}
-
-
 int FakeTerminal::read(int file_descriptor,char *buffer,size_t size)
 {
   assert(file_descriptor == input_file_descriptor);
-  assert(!tty.input_buffer.isEmpty());
-  optional<size_t> maybe_newline_position =
-    maybeNewlinePosition(tty.input_buffer);
-
-  if (!maybe_newline_position) {
-    // No newline -- why are we reading?
-    assert(false);
-  }
-
-  size_t newline_position = *maybe_newline_position;
+  assert(canRead());
 
-  if (newline_position < size) {
-    tty.input_buffer.get(buffer,newline_position + 1);
-    return newline_position + 1;
+  if (maybe_max_read_size && size > *maybe_max_read_size) {
+    size = *maybe_max_read_size;
   }
 
-  // Read up to the first newline.
-  assert(false);
+  return tty.input_buffer.get(buffer,size);
 }
 
 
@@ -51,20 +26,24 @@ int
   )
 {
   assert(file_descriptor == error_file_descriptor);
-  output_member += string(buffer,size);
-  return size;
-}
 
+  if (output_is_blocked) {
+    errno = EAGAIN;
+    return -1;
+  }
+
+  if (maybe_max_write_size && size_t(size) > *maybe_max_write_size) {
+    size = *maybe_max_write_size;
+  }
 
-bool FakeTerminal::haveNewlineInBuffer() const
-{
-  return !!maybeNewlinePosition(tty.input_buffer);
+  output_member += string(buffer,size);
+  return size;
 }
 
 
 bool FakeTerminal::canRead() const
 {
-  return haveNewlineInBuffer();
+  return !tty.input_buffer.isEmpty() || input_was_closed;
 }
 
 
@@ -75,12 +54,18 @@ void FakeTerminal::select(FakeSelectParams &params)
       params.clearRead(input_file_descriptor);
     }
   }
+
+  if (params.writeIsSet(error_file_descriptor)) {
+    if (output_is_blocked) {
+      params.clearWrite(error_file_descriptor);
+    }
+  }
 }
 
 
 int FakeTerminal::nFileDescriptors() const
 {
-  return input_file_descriptor + 1;
+  return std::max(input_file_descriptor,error_file_descriptor) + 1;
 }
 
 
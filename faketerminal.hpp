@@ -1,3 +1,4 @@
+#include <optional>
 #include "terminal.hpp"
 #include "buffer.hpp"
 #include "fakefiledescriptorallocator.hpp"
@@ -17,6 +18,16 @@ struct FakeTerminal : Terminal, FakeSelectable {
   FakeTty tty;
   std::string output_member;
 
+  // Reads return everything which is buffered, like a pipe, unless they
+  // are limited.
+  std::optional<size_t> maybe_max_read_size;
+  bool input_was_closed = false;
+
+  // Like a slow tty, writes can be limited to a few bytes, or not be
+  // possible at all.
+  std::optional<size_t> maybe_max_write_size;
+  bool output_is_blocked = false;
+
   FakeTerminal(FakeFileDescriptorAllocator &file_descriptor_allocator)
   : input_file_descriptor(file_descriptor_allocator.allocate()),
     error_file_descriptor(file_descriptor_allocator.allocate())
@@ -34,6 +45,7 @@ struct FakeTerminal : Terminal, FakeSelectable {
   }
 
   void addInput(const std::string &);
+  void closeInput() { input_was_closed = true; }
   const std::string &output() const;
   void clearOutput();
 
@@ -43,6 +55,5 @@ struct FakeTerminal : Terminal, FakeSelectable {
   void select(FakeSelectParams &) override;
   int nFileDescriptors() const override;
   bool canRead() const;
-  bool haveNewlineInBuffer() const;
 };
 
@@ -3,16 +3,20 @@
 #ifdef _WIN32
 #else
 #include <netdb.h>
+#include <arpa/inet.h>
 #endif
 #include <sstream>
 #include <cstring>
+#include <cassert>
+#include <stdexcept>
+#include <tuple>
 
 
 InternetAddress::InternetAddress()
 {
-  memset(&address,0,sizeof address);
-  address.sin_family = AF_INET;
-  address.sin_addr.s_addr = INADDR_ANY;
+  memset(&storage,0,sizeof storage);
+  storage.ss_family = AF_INET;
+  v4().sin_addr.s_addr = INADDR_ANY;
 }
 
 
@@ -21,47 +25,178 @@ InternetAddress::~InternetAddress()
 }
 
 
+sockaddr_in &InternetAddress::v4()
+{
+  assert(family() == AF_INET);
+  return reinterpret_cast<sockaddr_in &>(storage);
+}
+
+
+const sockaddr_in &InternetAddress::v4() const
+{
+  assert(family() == AF_INET);
+  return reinterpret_cast<const sockaddr_in &>(storage);
+}
+
+
+sockaddr_in6 &InternetAddress::v6()
+{
+  assert(family() == AF_INET6);
+  return reinterpret_cast<sockaddr_in6 &>(storage);
+}
+
+
+const sockaddr_in6 &InternetAddress::v6() const
+{
+  assert(family() == AF_INET6);
+  return reinterpret_cast<const sockaddr_in6 &>(storage);
+}
+
+
 void InternetAddress::setPort(int port)
 {
   uint16_t port_in_network_byte_order = htons(port);
-  address.sin_port = port_in_network_byte_order;
+
+  if (family() == AF_INET6) {
+    v6().sin6_port = port_in_network_byte_order;
+  }
+  else {
+    v4().sin_port = port_in_network_byte_order;
+  }
 }
 
 
 int InternetAddress::port() const
 {
-  uint16_t port_in_network_byte_order = address.sin_port;
+  uint16_t port_in_network_byte_order =
+    (family() == AF_INET6) ? v6().sin6_port : v4().sin_port;
+
   return ntohs(port_in_network_byte_order);
 }
 
 
 void InternetAddress::setHostname(const std::string &hostname)
 {
-  hostent *server_ptr = gethostbyname(hostname.c_str());
+  addrinfo hints = {};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  addrinfo *result_ptr = nullptr;
 
-  if (!server_ptr) {
+  int getaddrinfo_result =
+    getaddrinfo(hostname.c_str(),/*service*/nullptr,&hints,&result_ptr);
+
+  if (getaddrinfo_result != 0) {
     std::ostringstream stream;
     stream << "Unable to resolve hostname " << hostname << ".";
     throw std::runtime_error(stream.str());
   }
 
-  memcpy(&address.sin_addr.s_addr,server_ptr->h_addr,server_ptr->h_length);
+  int old_port = port();
+  setSockaddr(result_ptr->ai_addr,result_ptr->ai_addrlen);
+  setPort(old_port);
+  freeaddrinfo(result_ptr);
+}
+
+
+void InternetAddress::setLoopback(int family)
+{
+  int old_port = port();
+  memset(&storage,0,sizeof storage);
+  storage.ss_family = family;
+
+  if (family == AF_INET6) {
+    v6().sin6_addr = in6addr_loopback;
+  }
+  else {
+    v4().sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  }
+
+  setPort(old_port);
+}
+
+
+void InternetAddress::setSockaddr(const sockaddr *addr,socklen_t addrlen)
+{
+  assert(addr->sa_family == AF_INET || addr->sa_family == AF_INET6);
+  assert(addrlen <= sizeof storage);
+  memset(&storage,0,sizeof storage);
+  memcpy(&storage,addr,addrlen);
 }
 
 
 socklen_t InternetAddress::sockaddrSize() const
 {
-  return sizeof address;
+  if (family() == AF_INET6) {
+    return sizeof(sockaddr_in6);
+  }
+
+  return sizeof(sockaddr_in);
 }
 
 
 sockaddr *InternetAddress::sockaddrPtr()
 {
-  return reinterpret_cast<sockaddr*>(&address);
+  return reinterpret_cast<sockaddr*>(&storage);
 }
 
 
 const sockaddr *InternetAddress::sockaddrPtr() const
 {
-  return reinterpret_cast<const sockaddr*>(&address);
+  return reinterpret_cast<const sockaddr*>(&storage);
+}
+
+
+std::string InternetAddress::hostString() const
+{
+  char buffer[INET6_ADDRSTRLEN] = "";
+
+  if (family() == AF_INET6) {
+    inet_ntop(AF_INET6,&v6().sin6_addr,buffer,sizeof buffer);
+  }
+  else {
+    inet_ntop(AF_INET,&v4().sin_addr,buffer,sizeof buffer);
+  }
+
+  return buffer;
+}
+
+
+bool InternetAddress::operator==(const InternetAddress &that) const
+{
+  if (family() != that.family()) {
+    return false;
+  }
+
+  if (family() == AF_INET6) {
+    return
+      memcmp(&v6().sin6_addr,&that.v6().sin6_addr,sizeof(in6_addr)) == 0 &&
+      v6().sin6_port == that.v6().sin6_port;
+  }
+
+  return
+    v4().sin_addr.s_addr == that.v4().sin_addr.s_addr &&
+    v4().sin_port == that.v4().sin_port;
+}
+
+
+bool InternetAddress::operator<(const InternetAddress &that) const
+{
+  if (family() != that.family()) {
+    return family() < that.family();
+  }
+
+  if (family() == AF_INET6) {
+    int compare_result =
+      memcmp(&v6().sin6_addr,&that.v6().sin6_addr,sizeof(in6_addr));
+
+    if (compare_result != 0) {
+      return compare_result < 0;
+    }
+
+    return v6().sin6_port < that.v6().sin6_port;
+  }
+
+  return
+    std::tie(v4().sin_addr.s_addr,v4().sin_port) <
+    std::tie(that.v4().sin_addr.s_addr,that.v4().sin_port);
 }
@@ -11,6 +11,8 @@
 #include <string>
 
 
+// An IPv4 or IPv6 address and port.  Addresses are IPv4 unless set
+// otherwise.
 class InternetAddress {
   public:
     InternetAddress();
@@ -18,13 +20,34 @@ class InternetAddress {
 
     void setPort(int port);
     int port() const;
+    int family() const { return storage.ss_family; }
+
+    // Uses getaddrinfo(), which blocks.  Resolver resolves hostnames
+    // without blocking.
     void setHostname(const std::string &hostname);
+
+    void setLoopback(int family = AF_INET);
+    void setSockaddr(const sockaddr *,socklen_t);
     socklen_t sockaddrSize() const;
     sockaddr *sockaddrPtr();
     const sockaddr *sockaddrPtr() const;
+    std::string hostString() const;
+
+    bool operator==(const InternetAddress &) const;
+    bool operator!=(const InternetAddress &that) const
+    {
+      return !operator==(that);
+    }
+
+    bool operator<(const InternetAddress &) const;
 
   private:
-    sockaddr_in address;
+    sockaddr_storage storage;
+
+    sockaddr_in &v4();
+    const sockaddr_in &v4() const;
+    sockaddr_in6 &v6();
+    const sockaddr_in6 &v6() const;
 };
 
 #endif /* INTERNETADDRESS_HPP_ */
@@ -0,0 +1,939 @@
+#include "journal.hpp"
+
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+#include <optional>
+#include <stdexcept>
+
+using std::string;
+using std::vector;
+using Sequence = MessageJournal::Sequence;
+
+
+// Each record is a four byte big-endian message size, a four byte
+// checksum of the size and the message, and then the message.
+static const size_t record_header_size = 8;
+static const size_t index_interval = 64;
+static const char segment_suffix[] = ".journal";
+static const size_t sequence_digits = 20;
+
+// Clients send a subscribe command with their subscriber id and the first
+// sequence number they want, and acknowledge commands with the sequence
+// number after the last message they are done with.  Messages to clients
+// are the sequence number followed by the message.
+static const char subscribe_command = 's';
+static const char acknowledge_command = 'a';
+static const size_t sequence_size = 8;
+
+
+static void encodeUint32(char *p,uint32_t value)
+{
+  p[0] = char(value >> 24);
+  p[1] = char(value >> 16);
+  p[2] = char(value >> 8);
+  p[3] = char(value);
+}
+
+
+static uint32_t decodeUint32(const char *message)
+{
+  const unsigned char *p = reinterpret_cast<const unsigned char *>(message);
+  return (uint32_t(p[0]) << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+
+static void encodeUint64(char *p,uint64_t value)
+{
+  encodeUint32(p,value >> 32);
+  encodeUint32(p + 4,uint32_t(value));
+}
+
+
+static uint64_t decodeUint64(const char *p)
+{
+  return (uint64_t(decodeUint32(p)) << 32) | decodeUint32(p + 4);
+}
+
+
+// FNV-1a, which is enough to notice a record which was only partly
+// written.
+static uint32_t
+  recordChecksum(const char *size_bytes,const char *message,size_t message_size)
+{
+  uint32_t hash = 2166136261u;
+
+  auto add = [&](const char *p,size_t n){
+    for (size_t i=0; i!=n; ++i) {
+      hash = (hash ^ static_cast<unsigned char>(p[i])) * 16777619u;
+    }
+  };
+
+  add(size_bytes,4);
+  add(message,message_size);
+  return hash;
+}
+
+
+static string segmentFileName(Sequence first_sequence)
+{
+  char name[sequence_digits + sizeof segment_suffix];
+
+  snprintf(
+    name,sizeof name,"%020llu%s",
+    static_cast<unsigned long long>(first_sequence),segment_suffix
+  );
+
+  return name;
+}
+
+
+static std::optional<Sequence> maybeSegmentFirstSequence(const char *name)
+{
+  if (strlen(name) != sequence_digits + strlen(segment_suffix)) {
+    return std::nullopt;
+  }
+
+  if (strcmp(name + sequence_digits,segment_suffix) != 0) {
+    return std::nullopt;
+  }
+
+  Sequence first_sequence = 0;
+
+  for (size_t i=0; i!=sequence_digits; ++i) {
+    if (name[i] < '0' || name[i] > '9') {
+      return std::nullopt;
+    }
+
+    first_sequence = first_sequence*10 + (name[i] - '0');
+  }
+
+  return first_sequence;
+}
+
+
+static void throwSystemError(const string &what)
+{
+  throw std::runtime_error(what + ": " + strerror(errno));
+}
+
+
+struct MessageJournal::Impl {
+  static string segmentPath(const MessageJournal &self,Sequence first_sequence)
+  {
+    return self.directory + "/" + segmentFileName(first_sequence);
+  }
+
+  static void mapSegment(Segment &segment)
+  {
+    if (segment.capacity == 0) {
+      return;
+    }
+
+    void *mapping =
+      mmap(
+        nullptr,segment.capacity,PROT_READ,MAP_SHARED,
+        segment.file_descriptor,0
+      );
+
+    if (mapping == MAP_FAILED) {
+      throwSystemError("Unable to map journal segment");
+    }
+
+    segment.mapping = static_cast<const char *>(mapping);
+  }
+
+  static void unmapSegment(Segment &segment)
+  {
+    if (segment.mapping) {
+      munmap(const_cast<char *>(segment.mapping),segment.capacity);
+      segment.mapping = nullptr;
+    }
+  }
+
+  static void closeSegment(Segment &segment)
+  {
+    unmapSegment(segment);
+    close(segment.file_descriptor);
+  }
+
+  // Returns the size of the record at the offset if it is complete.
+  static std::optional<size_t>
+    maybeRecordSize(const Segment &segment,size_t offset)
+  {
+    size_t n_bytes_left = segment.capacity - offset;
+
+    if (n_bytes_left < record_header_size) {
+      return std::nullopt;
+    }
+
+    const char *record = segment.mapping + offset;
+    size_t message_size = decodeUint32(record);
+
+    if (n_bytes_left - record_header_size < message_size) {
+      return std::nullopt;
+    }
+
+    uint32_t checksum =
+      recordChecksum(record,record + record_header_size,message_size);
+
+    if (decodeUint32(record + 4) != checksum) {
+      return std::nullopt;
+    }
+
+    return record_header_size + message_size;
+  }
+
+  static void recoverSegment(Segment &segment)
+  {
+    size_t offset = 0;
+
+    while (std::optional<size_t> maybe_size = maybeRecordSize(segment,offset)) {
+      if (segment.n_messages % index_interval == 0) {
+        segment.index.push_back(offset);
+      }
+
+      offset += *maybe_size;
+      ++segment.n_messages;
+    }
+
+    segment.size = offset;
+  }
+
+  // Zeroes everything after the last complete record, so that a partly
+  // written record can't be taken for part of a later one.
+  static void clearTail(Segment &segment)
+  {
+    if (segment.size == segment.capacity) {
+      return;
+    }
+
+    unmapSegment(segment);
+
+    bool cleared =
+      ftruncate(segment.file_descriptor,segment.size) == 0 &&
+      ftruncate(segment.file_descriptor,segment.capacity) == 0;
+
+    if (!cleared) {
+      throwSystemError("Unable to clear journal segment");
+    }
+
+    mapSegment(segment);
+  }
+
+  static vector<Sequence> segmentFirstSequences(const MessageJournal &self)
+  {
+    DIR *dir_ptr = opendir(self.directory.c_str());
+
+    if (!dir_ptr) {
+      throwSystemError("Unable to open journal directory " + self.directory);
+    }
+
+    vector<Sequence> first_sequences;
+
+    while (dirent *entry_ptr = readdir(dir_ptr)) {
+      std::optional<Sequence> maybe_first_sequence =
+        maybeSegmentFirstSequence(entry_ptr->d_name);
+
+      if (maybe_first_sequence) {
+        first_sequences.push_back(*maybe_first_sequence);
+      }
+    }
+
+    closedir(dir_ptr);
+    std::sort(first_sequences.begin(),first_sequences.end());
+    return first_sequences;
+  }
+
+  static void openSegments(MessageJournal &self)
+  {
+    for (Sequence first_sequence : segmentFirstSequences(self)) {
+      string path = segmentPath(self,first_sequence);
+      int file_descriptor = open(path.c_str(),O_RDWR);
+
+      if (file_descriptor < 0) {
+        throwSystemError("Unable to open journal segment " + path);
+      }
+
+      struct stat status;
+
+      if (fstat(file_descriptor,&status) != 0) {
+        close(file_descriptor);
+        throwSystemError("Unable to get size of journal segment " + path);
+      }
+
+      self.segments.emplace_back();
+      Segment &segment = self.segments.back();
+      segment.first_sequence = first_sequence;
+      segment.capacity = status.st_size;
+      segment.file_descriptor = file_descriptor;
+      mapSegment(segment);
+      recoverSegment(segment);
+      size_t n_segments = self.segments.size();
+
+      if (n_segments > 1) {
+        const Segment &previous = self.segments[n_segments - 2];
+
+        if (previous.first_sequence + previous.n_messages != first_sequence) {
+          throw std::runtime_error(
+            "Journal segment " + path + " doesn't follow the one before it."
+          );
+        }
+      }
+    }
+
+    if (!self.segments.empty()) {
+      clearTail(self.segments.back());
+    }
+  }
+
+  static void syncDirectory(const MessageJournal &self)
+  {
+    int file_descriptor = open(self.directory.c_str(),O_RDONLY);
+
+    if (file_descriptor < 0) {
+      throwSystemError("Unable to open journal directory " + self.directory);
+    }
+
+    int sync_result = fsync(file_descriptor);
+    close(file_descriptor);
+
+    if (sync_result != 0) {
+      throwSystemError("Unable to sync journal directory " + self.directory);
+    }
+  }
+
+  static void startSegment(MessageJournal &self,size_t capacity)
+  {
+    assert(self.n_pending_messages == 0);
+    Sequence first_sequence = self.nextSequence();
+
+    if (!self.segments.empty() && self.segments.back().n_messages == 0) {
+      // Its file is reused.
+      closeSegment(self.segments.back());
+      self.segments.pop_back();
+    }
+
+    string path = segmentPath(self,first_sequence);
+    int file_descriptor = open(path.c_str(),O_RDWR | O_CREAT | O_TRUNC,0644);
+
+    if (file_descriptor < 0) {
+      throwSystemError("Unable to create journal segment " + path);
+    }
+
+    if (ftruncate(file_descriptor,capacity) != 0) {
+      close(file_descriptor);
+      throwSystemError("Unable to size journal segment " + path);
+    }
+
+    self.segments.emplace_back();
+    Segment &segment = self.segments.back();
+    segment.first_sequence = first_sequence;
+    segment.capacity = capacity;
+    segment.file_descriptor = file_descriptor;
+    mapSegment(segment);
+
+    if (self.options.sync_on_commit) {
+      // Otherwise the file itself might not survive a crash.
+      syncDirectory(self);
+    }
+  }
+
+  static bool hasRoomFor(const MessageJournal &self,size_t record_size)
+  {
+    if (self.segments.empty()) {
+      return false;
+    }
+
+    const Segment &segment = self.segments.back();
+    size_t n_bytes_used = segment.size + self.pending_records.size();
+    return segment.capacity - n_bytes_used >= record_size;
+  }
+
+  static void
+    writeAll(int file_descriptor,const char *data,size_t size,off_t offset)
+  {
+    while (size != 0) {
+      ssize_t write_result = pwrite(file_descriptor,data,size,offset);
+
+      if (write_result < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+
+        throwSystemError("Unable to write journal segment");
+      }
+
+      data += write_result;
+      size -= write_result;
+      offset += write_result;
+    }
+  }
+
+  // The segment which has the sequence if it hasn't been discarded.
+  static size_t segmentIndex(const MessageJournal &self,Sequence sequence)
+  {
+    auto iter =
+      std::upper_bound(
+        self.segments.begin(),self.segments.end(),sequence,
+        [](Sequence sequence,const Segment &segment){
+          return sequence < segment.first_sequence;
+        }
+      );
+
+    if (iter == self.segments.begin()) {
+      return 0;
+    }
+
+    return (iter - self.segments.begin()) - 1;
+  }
+
+  static size_t messageOffset(const Segment &segment,size_t message_index)
+  {
+    assert(message_index < segment.n_messages);
+    size_t offset = segment.index[message_index / index_interval];
+
+    for (size_t i=0; i!=message_index % index_interval; ++i) {
+      offset += record_header_size + decodeUint32(segment.mapping + offset);
+    }
+
+    return offset;
+  }
+};
+
+
+MessageJournal::MessageJournal(const string &directory_arg)
+: MessageJournal(directory_arg,Options())
+{
+}
+
+
+MessageJournal::MessageJournal(
+  const string &directory_arg,
+  const Options &options_arg
+)
+: directory(directory_arg),
+  options(options_arg)
+{
+  assert(options.segment_size > 0);
+
+  try {
+    Impl::openSegments(*this);
+  }
+  catch (...) {
+    for (Segment &segment : segments) {
+      Impl::closeSegment(segment);
+    }
+
+    throw;
+  }
+}
+
+
+MessageJournal::~MessageJournal()
+{
+  for (Segment &segment : segments) {
+    Impl::closeSegment(segment);
+  }
+}
+
+
+Sequence MessageJournal::append(const char *message,size_t message_size)
+{
+  assert(message_size <= UINT32_MAX);
+  size_t record_size = record_header_size + message_size;
+
+  if (!Impl::hasRoomFor(*this,record_size)) {
+    commit();
+    Impl::startSegment(*this,std::max(options.segment_size,record_size));
+  }
+
+  const Segment &segment = segments.back();
+  size_t old_size = pending_records.size();
+
+  if ((segment.n_messages + n_pending_messages) % index_interval == 0) {
+    pending_index.push_back(segment.size + old_size);
+  }
+
+  pending_records.resize(old_size + record_size);
+  char *record = pending_records.data() + old_size;
+  encodeUint32(record,message_size);
+  memcpy(record + record_header_size, message, message_size);
+
+  encodeUint32(
+    record + 4,
+    recordChecksum(record,record + record_header_size,message_size)
+  );
+
+  Sequence sequence = nextSequence();
+  ++n_pending_messages;
+  return sequence;
+}
+
+
+void MessageJournal::commit()
+{
+  if (n_pending_messages == 0) {
+    return;
+  }
+
+  Segment &segment = segments.back();
+
+  Impl::writeAll(
+    segment.file_descriptor,
+    pending_records.data(),
+    pending_records.size(),
+    segment.size
+  );
+
+  if (options.sync_on_commit && fdatasync(segment.file_descriptor) != 0) {
+    throwSystemError("Unable to sync journal segment");
+  }
+
+  segment.size += pending_records.size();
+  segment.n_messages += n_pending_messages;
+  segment.index.insert(
+    segment.index.end(),pending_index.begin(),pending_index.end()
+  );
+  pending_records.clear();
+  pending_index.clear();
+  n_pending_messages = 0;
+}
+
+
+Sequence MessageJournal::firstSequence() const
+{
+  if (segments.empty()) {
+    return 0;
+  }
+
+  return segments.front().first_sequence;
+}
+
+
+Sequence MessageJournal::committedSequence() const
+{
+  if (segments.empty()) {
+    return 0;
+  }
+
+  const Segment &segment = segments.back();
+  return segment.first_sequence + segment.n_messages;
+}
+
+
+Sequence
+  MessageJournal::read(
+    Sequence first_sequence,
+    size_t max_bytes,
+    ReadHandlerInterface &handler
+  ) const
+{
+  Sequence sequence = std::max(first_sequence,firstSequence());
+  size_t n_bytes_read = 0;
+
+  for (
+    size_t segment_index = Impl::segmentIndex(*this,sequence);
+    segment_index < segments.size() && n_bytes_read < max_bytes;
+    ++segment_index
+  ) {
+    const Segment &segment = segments[segment_index];
+    Sequence end_sequence = segment.first_sequence + segment.n_messages;
+
+    if (sequence >= end_sequence) {
+      continue;
+    }
+
+    size_t offset =
+      Impl::messageOffset(segment,sequence - segment.first_sequence);
+
+    while (sequence != end_sequence && n_bytes_read < max_bytes) {
+      const char *record = segment.mapping + offset;
+      size_t message_size = decodeUint32(record);
+      handler.gotMessage(sequence,record + record_header_size,message_size);
+      offset += record_header_size + message_size;
+      n_bytes_read += record_header_size + message_size;
+      ++sequence;
+    }
+  }
+
+  return sequence;
+}
+
+
+void MessageJournal::discardBefore(Sequence sequence)
+{
+  while (segments.size() > 1 && segments[1].first_sequence <= sequence) {
+    Segment &segment = segments.front();
+    string path = Impl::segmentPath(*this,segment.first_sequence);
+    Impl::closeSegment(segment);
+
+    if (unlink(path.c_str()) != 0) {
+      throwSystemError("Unable to remove journal segment " + path);
+    }
+
+    segments.pop_front();
+  }
+}
+
+
+struct JournalServer::Impl {
+  struct MessageHandler : MessageServer::EventInterface {
+    JournalServer &server;
+
+    MessageHandler(JournalServer &server_arg)
+    : server(server_arg)
+    {
+    }
+
+    void
+      gotMessage(
+        ClientId client_id,
+        const char *message,
+        size_t message_size
+      ) override
+    {
+      if (message_size < 1) {
+        return;
+      }
+
+      char command = message[0];
+      const char *rest = message + 1;
+      size_t rest_size = message_size - 1;
+
+      if (command == subscribe_command && rest_size == 2*sequence_size) {
+        SubscriberId subscriber_id = decodeUint64(rest);
+        Sequence next_sequence = decodeUint64(rest + sequence_size);
+        subscribe(server,client_id,subscriber_id,next_sequence);
+      }
+      else if (command == acknowledge_command && rest_size == sequence_size) {
+        acknowledge(server,client_id,decodeUint64(rest));
+      }
+    }
+
+    void clientConnected(ClientId client_id) override
+    {
+      client(server,client_id) = Client();
+    }
+
+    void clientDisconnected(ClientId client_id) override
+    {
+      client(server,client_id) = Client();
+    }
+  };
+
+  struct Sender : MessageJournal::ReadHandlerInterface {
+    JournalServer &server;
+    const ClientId client_id;
+
+    Sender(JournalServer &server_arg,ClientId client_id_arg)
+    : server(server_arg),
+      client_id(client_id_arg)
+    {
+    }
+
+    void
+      gotMessage(
+        Sequence sequence,
+        const char *message,
+        size_t message_size
+      ) override
+    {
+      vector<char> &buffer = server.message_buffer;
+      buffer.resize(sequence_size + message_size);
+      encodeUint64(buffer.data(),sequence);
+      memcpy(buffer.data() + sequence_size, message, message_size);
+
+      server.message_server.queueMessageToClient(
+        client_id,buffer.data(),buffer.size()
+      );
+    }
+  };
+
+  static Client &client(JournalServer &self,ClientId client_id)
+  {
+    assert(client_id >= 0);
+
+    if (size_t(client_id) >= self.clients.size()) {
+      self.clients.resize(client_id + 1);
+    }
+
+    return self.clients[client_id];
+  }
+
+  static void
+    subscribe(
+      JournalServer &self,
+      ClientId client_id,
+      SubscriberId subscriber_id,
+      Sequence next_sequence
+    )
+  {
+    Client &client = Impl::client(self,client_id);
+    client.is_subscribed = true;
+    client.subscriber_id = subscriber_id;
+    client.next_sequence = next_sequence;
+
+    // A new subscriber doesn't need anything before where it started.
+    self.acknowledged_sequences.emplace(subscriber_id,next_sequence);
+  }
+
+  static void
+    acknowledge(JournalServer &self,ClientId client_id,Sequence sequence)
+  {
+    const Client &client = Impl::client(self,client_id);
+
+    if (!client.is_subscribed) {
+      return;
+    }
+
+    auto iter = self.acknowledged_sequences.find(client.subscriber_id);
+
+    if (iter == self.acknowledged_sequences.end()) {
+      // The subscriber was removed.
+      return;
+    }
+
+    sequence = std::min(sequence,self.journal.committedSequence());
+    iter->second = std::max(iter->second,sequence);
+    self.journal.discardBefore(self.acknowledgedSequence());
+  }
+
+  static void queueMessages(JournalServer &self)
+  {
+    Sequence committed_sequence = self.journal.committedSequence();
+
+    ClientId n_clients = self.clients.size();
+
+    for (ClientId client_id=0; client_id!=n_clients; ++client_id) {
+      Client &client = self.clients[client_id];
+
+      if (!client.is_subscribed) {
+        continue;
+      }
+
+      if (client.next_sequence >= committed_sequence) {
+        continue;
+      }
+
+      if (self.message_server.isSendingAMessageTo(client_id)) {
+        continue;
+      }
+
+      Sender sender(self,client_id);
+
+      client.next_sequence =
+        self.journal.read(
+          client.next_sequence,self.options.max_read_bytes,sender
+        );
+    }
+  }
+};
+
+
+JournalServer::JournalServer(
+  SocketsInterface &sockets_arg,
+  MessageJournal &journal_arg
+)
+: JournalServer(sockets_arg,journal_arg,Options())
+{
+}
+
+
+JournalServer::JournalServer(
+  SocketsInterface &sockets_arg,
+  MessageJournal &journal_arg,
+  const Options &options_arg
+)
+: message_server(sockets_arg),
+  journal(journal_arg),
+  options(options_arg)
+{
+  assert(options.max_read_bytes > 0);
+}
+
+
+void JournalServer::setupSelect(PreSelectParamsInterface &pre_select_params)
+{
+  journal.commit();
+  Impl::queueMessages(*this);
+  message_server.setupSelect(pre_select_params);
+}
+
+
+void
+  JournalServer::handleSelect(
+    const PostSelectParamsInterface &post_select_params
+  )
+{
+  Impl::MessageHandler message_handler(*this);
+  message_server.handleSelect(post_select_params,message_handler);
+}
+
+
+Sequence JournalServer::publish(const char *message,size_t message_size)
+{
+  return journal.append(message,message_size);
+}
+
+
+void
+  JournalServer::addSubscriber(
+    SubscriberId subscriber_id,
+    Sequence n_acknowledged_messages
+  )
+{
+  acknowledged_sequences.emplace(subscriber_id,n_acknowledged_messages);
+}
+
+
+void JournalServer::removeSubscriber(SubscriberId subscriber_id)
+{
+  acknowledged_sequences.erase(subscriber_id);
+  journal.discardBefore(acknowledgedSequence());
+}
+
+
+Sequence JournalServer::acknowledgedSequence() const
+{
+  if (acknowledged_sequences.empty()) {
+    // Without subscribers, nothing has been acknowledged.
+    return journal.firstSequence();
+  }
+
+  Sequence sequence = acknowledged_sequences.begin()->second;
+
+  for (auto &subscriber_and_sequence : acknowledged_sequences) {
+    sequence = std::min(sequence,subscriber_and_sequence.second);
+  }
+
+  return sequence;
+}
+
+
+struct JournalClient::Impl {
+  struct MessageHandler : MessageClient::EventInterface {
+    JournalClient &client;
+    JournalClient::EventInterface &event_handler;
+
+    MessageHandler(
+      JournalClient &client_arg,
+      JournalClient::EventInterface &event_handler_arg
+    )
+    : client(client_arg),
+      event_handler(event_handler_arg)
+    {
+    }
+
+    void connectionRefused() override
+    {
+      event_handler.connectionRefused();
+    }
+
+    void connected() override
+    {
+      event_handler.connected();
+    }
+
+    void gotMessage(const char *message,size_t message_size) override
+    {
+      if (message_size < sequence_size) {
+        return;
+      }
+
+      Sequence sequence = decodeUint64(message);
+
+      if (sequence < client.next_sequence) {
+        // We already have it.
+        return;
+      }
+
+      // There is a gap if the messages were discarded before we got them.
+      client.next_sequence = sequence + 1;
+
+      event_handler.gotMessage(
+        sequence,message + sequence_size,message_size - sequence_size
+      );
+    }
+  };
+
+  static void
+    queueCommand(
+      JournalClient &self,
+      char command,
+      const vector<uint64_t> &values
+    )
+  {
+    vector<char> &buffer = self.message_buffer;
+    buffer.resize(1 + values.size()*sequence_size);
+    buffer[0] = command;
+
+    for (size_t i=0; i!=values.size(); ++i) {
+      encodeUint64(buffer.data() + 1 + i*sequence_size,values[i]);
+    }
+
+    self.message_client.queueMessage(buffer.data(),buffer.size());
+  }
+
+  static void queueSubscribe(JournalClient &self)
+  {
+    queueCommand(
+      self,subscribe_command,{self.subscriber_id,self.next_sequence}
+    );
+  }
+};
+
+
+JournalClient::JournalClient(
+  SocketsInterface &sockets_arg,
+  SubscriberId subscriber_id_arg,
+  Sequence next_sequence_arg
+)
+: message_client(sockets_arg),
+  subscriber_id(subscriber_id_arg),
+  next_sequence(next_sequence_arg)
+{
+}
+
+
+void JournalClient::startConnecting(int port)
+{
+  message_client.startConnecting(port);
+  Impl::queueSubscribe(*this);
+}
+
+
+void JournalClient::startConnecting(const InternetAddress &address)
+{
+  message_client.startConnecting(address);
+  Impl::queueSubscribe(*this);
+}
+
+
+void JournalClient::setupSelect(PreSelectParamsInterface &pre_select_params)
+{
+  message_client.setupSelect(pre_select_params);
+}
+
+
+void
+  JournalClient::handleSelect(
+    const PostSelectParamsInterface &post_select_params,
+    EventInterface &event_handler
+  )
+{
+  Impl::MessageHandler message_handler(*this,event_handler);
+  message_client.handleSelect(post_select_params,message_handler);
+}
+
+
+void JournalClient::acknowledge(Sequence sequence)
+{
+  Impl::queueCommand(*this,acknowledge_command,{sequence});
+}
@@ -0,0 +1,249 @@
+#ifndef JOURNAL_HPP_
+#define JOURNAL_HPP_
+
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "messageservice.hpp"
+
+
+// An append-only log of messages on disk, numbered consecutively from
+// zero.  The messages are kept in segment files in a directory, each named
+// for the sequence number of its first message, so that old messages can
+// be discarded a whole file at a time.
+//
+// Appended messages are buffered until they are committed, which writes
+// them with one write() and waits for one sync, however many there are.
+// Committed messages are read back through a mapping of each segment.
+// Each record has a checksum, so that after a crash the journal ends at
+// the last message which was completely written.
+class MessageJournal {
+  public:
+    using Sequence = uint64_t;
+
+    struct Options {
+      // Segments are created this large, or larger for a message which
+      // wouldn't fit.  The files are sparse, so unused space isn't
+      // allocated.
+      size_t segment_size = 64*1024*1024;
+
+      // Wait for each commit to reach the disk.
+      bool sync_on_commit = true;
+    };
+
+    struct ReadHandlerInterface {
+      virtual void
+        gotMessage(Sequence,const char *message,size_t message_size) = 0;
+    };
+
+    // Opens the journal in the directory, which has to exist, keeping the
+    // messages which were committed before.
+    explicit MessageJournal(const std::string &directory_arg);
+
+    MessageJournal(
+      const std::string &directory_arg,
+      const Options &options_arg
+    );
+
+    MessageJournal(const MessageJournal &) = delete;
+
+    // Messages which weren't committed are lost.
+    ~MessageJournal();
+
+    // Returns the sequence number of the message.
+    Sequence append(const char *message,size_t message_size);
+
+    void commit();
+
+    // The oldest message which hasn't been discarded.
+    Sequence firstSequence() const;
+
+    // One past the last committed message.
+    Sequence committedSequence() const;
+
+    // The sequence number the next appended message will get.
+    Sequence nextSequence() const
+    {
+      return committedSequence() + n_pending_messages;
+    }
+
+    // Calls the handler for committed messages in order, starting at
+    // first_sequence or the first message which is left, until at least
+    // max_bytes of messages have been read.  Returns the sequence number
+    // after the last message read.  The handler must not change the
+    // journal.
+    Sequence
+      read(
+        Sequence first_sequence,
+        size_t max_bytes,
+        ReadHandlerInterface &
+      ) const;
+
+    // Delete the segments which only have messages before the sequence.
+    // The last segment is always kept.
+    void discardBefore(Sequence);
+
+    int nSegments() const { return segments.size(); }
+
+  private:
+    struct Impl;
+
+    struct Segment {
+      Sequence first_sequence = 0;
+
+      // Only committed messages are counted.
+      size_t n_messages = 0;
+      size_t size = 0;
+
+      size_t capacity = 0;
+      int file_descriptor = -1;
+      const char *mapping = nullptr;
+
+      // The offset of every index_interval'th message, so that reading
+      // can start near any message without scanning the segment.
+      std::vector<size_t> index;
+    };
+
+    const std::string directory;
+    const Options options;
+    std::deque<Segment> segments;
+
+    // Records which haven't been written yet.  They go at the end of the
+    // last segment.
+    std::vector<char> pending_records;
+    size_t n_pending_messages = 0;
+    std::vector<size_t> pending_index;
+};
+
+
+// Sends the messages in a MessageJournal to subscribers.  A client names
+// the subscriber it is and the first message it wants, and then gets
+// every message from there on in order, including ones which were added
+// while it was disconnected or before the server was restarted.  Messages
+// are only sent once they are committed, so a subscriber never sees a
+// message which would be missing after a restart.
+//
+// Subscribers acknowledge the messages they are done with, and segments
+// are discarded once every subscriber has acknowledged them.
+// Acknowledgements aren't saved, so after a restart nothing is discarded
+// until each subscriber has acknowledged again.
+class JournalServer {
+  public:
+    using ClientId = MessageServer::ClientId;
+    using Sequence = MessageJournal::Sequence;
+    using SubscriberId = uint64_t;
+
+    struct Options {
+      // Messages are read from the journal for a client once it has sent
+      // what it had, up to this many bytes at a time, so that replaying
+      // the journal to one client doesn't hold up the others.
+      size_t max_read_bytes = 256*1024;
+    };
+
+    JournalServer(SocketsInterface &sockets_arg,MessageJournal &journal_arg);
+
+    JournalServer(
+      SocketsInterface &sockets_arg,
+      MessageJournal &journal_arg,
+      const Options &options_arg
+    );
+
+    void startListening(int port) { message_server.startListening(port); }
+    void stopListening() { message_server.stopListening(); }
+    bool isActive() const { return message_server.isActive(); }
+    int nClients() const { return message_server.nClients(); }
+
+    // Commits what was published since the last select, so the messages
+    // share a sync, and queues messages for the clients.
+    void setupSelect(PreSelectParamsInterface &);
+
+    void handleSelect(const PostSelectParamsInterface &);
+
+    // The message is sent once it has been committed.
+    Sequence publish(const char *message,size_t message_size);
+
+    // Subscribers which are known before they connect keep the messages
+    // they haven't acknowledged from being discarded.  Subscribers are
+    // also added when they first connect.
+    void addSubscriber(SubscriberId,Sequence n_acknowledged_messages = 0);
+
+    void removeSubscriber(SubscriberId);
+
+    // Every subscriber has acknowledged the messages before this.
+    Sequence acknowledgedSequence() const;
+
+  private:
+    struct Impl;
+
+    struct Client {
+      bool is_subscribed = false;
+      SubscriberId subscriber_id = 0;
+      Sequence next_sequence = 0;
+    };
+
+    MessageServer message_server;
+    MessageJournal &journal;
+    const Options options;
+
+    // Indexed by client id.
+    std::vector<Client> clients;
+
+    // The number of messages each subscriber has acknowledged.
+    std::unordered_map<SubscriberId,Sequence> acknowledged_sequences;
+
+    std::vector<char> message_buffer;
+};
+
+
+class JournalClient {
+  public:
+    using Sequence = MessageJournal::Sequence;
+    using SubscriberId = JournalServer::SubscriberId;
+
+    struct EventInterface {
+      virtual void connectionRefused() = 0;
+      virtual void connected() = 0;
+
+      virtual void
+        gotMessage(Sequence,const char *message,size_t message_size) = 0;
+    };
+
+    // Messages are requested from next_sequence on.
+    JournalClient(
+      SocketsInterface &sockets_arg,
+      SubscriberId subscriber_id_arg,
+      Sequence next_sequence_arg = 0
+    );
+
+    JournalClient(const JournalClient &) = delete;
+
+    // Each connection resumes after the last message which was received.
+    void startConnecting(int port);
+    void startConnecting(const InternetAddress &);
+
+    bool isActive() const { return message_client.isActive(); }
+    bool isConnected() const { return message_client.isConnected(); }
+    void disconnect() { message_client.disconnect(); }
+    void setupSelect(PreSelectParamsInterface &);
+    void handleSelect(const PostSelectParamsInterface &,EventInterface &);
+
+    // The sequence number of the next message which is expected.
+    Sequence nextSequence() const { return next_sequence; }
+
+    // Tell the server that the messages before the sequence have been
+    // dealt with, so that it can discard them.
+    void acknowledge(Sequence);
+
+  private:
+    struct Impl;
+
+    MessageClient message_client;
+    const SubscriberId subscriber_id;
+    Sequence next_sequence;
+    std::vector<char> message_buffer;
+};
+
+
+#endif /* JOURNAL_HPP_ */
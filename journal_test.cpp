@@ -0,0 +1,358 @@
+#include "journal.hpp"
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <cassert>
+#include <string>
+#include <utility>
+#include <vector>
+#include "fakesockets.hpp"
+#include "fakeselector.hpp"
+
+using std::string;
+using std::vector;
+using Sequence = MessageJournal::Sequence;
+using SequencedMessage = std::pair<Sequence,string>;
+
+static const int server_port = 4152;
+
+
+namespace {
+struct TemporaryDirectory {
+  string path;
+
+  TemporaryDirectory()
+  {
+    char name[] = "/tmp/journal_test.XXXXXX";
+    char *result = mkdtemp(name);
+    assert(result);
+    path = result;
+  }
+
+  ~TemporaryDirectory()
+  {
+    DIR *dir_ptr = opendir(path.c_str());
+    assert(dir_ptr);
+
+    while (dirent *entry_ptr = readdir(dir_ptr)) {
+      string name = entry_ptr->d_name;
+
+      if (name != "." && name != "..") {
+        unlink((path + "/" + name).c_str());
+      }
+    }
+
+    closedir(dir_ptr);
+    rmdir(path.c_str());
+  }
+};
+}
+
+
+namespace {
+struct MessageCollector : MessageJournal::ReadHandlerInterface {
+  vector<SequencedMessage> messages;
+
+  void
+    gotMessage(
+      Sequence sequence,
+      const char *message,
+      size_t message_size
+    ) override
+  {
+    messages.emplace_back(sequence,string(message,message_size));
+  }
+};
+}
+
+
+static Sequence append(MessageJournal &journal,const string &message)
+{
+  return journal.append(message.data(),message.size());
+}
+
+
+static vector<SequencedMessage>
+  readAll(const MessageJournal &journal,Sequence first_sequence = 0)
+{
+  MessageCollector collector;
+  Sequence next_sequence =
+    journal.read(first_sequence,/*max_bytes*/SIZE_MAX,collector);
+  assert(next_sequence == journal.committedSequence());
+  return collector.messages;
+}
+
+
+static MessageJournal::Options smallSegmentOptions()
+{
+  MessageJournal::Options options;
+  options.segment_size = 64;
+  options.sync_on_commit = false;
+  return options;
+}
+
+
+static void testAppendingAndReopening()
+{
+  TemporaryDirectory directory;
+
+  {
+    MessageJournal journal(directory.path);
+    assert(append(journal,"first") == 0);
+    assert(append(journal,"second") == 1);
+    assert(journal.committedSequence() == 0);
+    assert(readAll(journal).empty());
+    journal.commit();
+    assert(journal.committedSequence() == 2);
+    assert(append(journal,"lost") == 2);
+  }
+
+  MessageJournal journal(directory.path);
+  assert(journal.firstSequence() == 0);
+  assert(journal.committedSequence() == 2);
+  assert(
+    readAll(journal) ==
+    (vector<SequencedMessage>{{0,"first"},{1,"second"}})
+  );
+  assert(append(journal,"third") == 2);
+  journal.commit();
+  assert(readAll(journal,2) == (vector<SequencedMessage>{{2,"third"}}));
+}
+
+
+static void testReadingInPieces()
+{
+  TemporaryDirectory directory;
+  MessageJournal journal(directory.path);
+
+  for (int i=0; i!=200; ++i) {
+    append(journal,std::to_string(i));
+  }
+
+  journal.commit();
+  MessageCollector collector;
+
+  // Each of these records takes eleven bytes, so this stops after two.
+  Sequence next_sequence = journal.read(150,/*max_bytes*/20,collector);
+  assert(next_sequence == 152);
+
+  assert(
+    collector.messages ==
+    (vector<SequencedMessage>{{150,"150"},{151,"151"}})
+  );
+}
+
+
+static void testDiscardingSegments()
+{
+  TemporaryDirectory directory;
+
+  {
+    MessageJournal journal(directory.path,smallSegmentOptions());
+
+    // Each record is 8 bytes of header and 24 of message, so two fit in a
+    // segment.
+    for (int i=0; i!=10; ++i) {
+      append(journal,"message " + string(15,'a') + std::to_string(i));
+      journal.commit();
+    }
+
+    assert(journal.nSegments() == 5);
+    journal.discardBefore(5);
+    assert(journal.nSegments() == 3);
+    assert(journal.firstSequence() == 4);
+    assert(readAll(journal).front().first == 4);
+    journal.discardBefore(100);
+    assert(journal.nSegments() == 1);
+    assert(journal.firstSequence() == 8);
+  }
+
+  MessageJournal journal(directory.path,smallSegmentOptions());
+  assert(journal.firstSequence() == 8);
+  assert(journal.committedSequence() == 10);
+  assert(readAll(journal).size() == 2);
+}
+
+
+static void testRecoveringFromATornWrite()
+{
+  TemporaryDirectory directory;
+
+  {
+    MessageJournal journal(directory.path);
+    append(journal,"complete");
+    journal.commit();
+  }
+
+  {
+    // Make it look like the next record was only partly written.
+    string path = directory.path + "/00000000000000000000.journal";
+    int file_descriptor = open(path.c_str(),O_WRONLY);
+    assert(file_descriptor >= 0);
+    const char partial_record[] = {0,0,0,20,1,2,3,4,'p','a','r'};
+
+    ssize_t n_written =
+      pwrite(file_descriptor,partial_record,sizeof partial_record,16);
+
+    assert(n_written == sizeof partial_record);
+    close(file_descriptor);
+  }
+
+  {
+    MessageJournal journal(directory.path);
+    assert(journal.committedSequence() == 1);
+    assert(append(journal,"next") == 1);
+    journal.commit();
+  }
+
+  MessageJournal journal(directory.path);
+
+  assert(
+    readAll(journal) ==
+    (vector<SequencedMessage>{{0,"complete"},{1,"next"}})
+  );
+}
+
+
+namespace {
+struct ClientHandler : JournalClient::EventInterface {
+  vector<SequencedMessage> messages;
+
+  void connectionRefused() override { assert(false); }
+  void connected() override {}
+
+  void
+    gotMessage(
+      Sequence sequence,
+      const char *message,
+      size_t message_size
+    ) override
+  {
+    messages.emplace_back(sequence,string(message,message_size));
+  }
+};
+}
+
+
+namespace {
+struct Tester {
+  FakeFileDescriptorAllocator file_descriptor_allocator;
+  FakeSockets sockets{file_descriptor_allocator};
+  FakeSelector selector{{&sockets}};
+  TemporaryDirectory directory;
+  MessageJournal journal{directory.path,smallSegmentOptions()};
+  JournalServer server{sockets,journal};
+  JournalClient client{sockets,/*subscriber_id*/1};
+  ClientHandler client_handler;
+
+  Tester()
+  {
+    server.startListening(server_port);
+  }
+
+  void connect()
+  {
+    client.startConnecting(server_port);
+
+    while (server.nClients() != 1 || !client.isConnected()) {
+      processEvents();
+    }
+  }
+
+  void publish(const string &message)
+  {
+    server.publish(message.data(),message.size());
+  }
+
+  void processEvents()
+  {
+    selector.beginSelect();
+    server.setupSelect(selector.preSelectParams());
+    client.setupSelect(selector.preSelectParams());
+    selector.callSelect();
+    server.handleSelect(selector.postSelectParams());
+    client.handleSelect(selector.postSelectParams(),client_handler);
+    selector.endSelect();
+  }
+
+  void waitForMessages(size_t n_messages)
+  {
+    while (client_handler.messages.size() != n_messages) {
+      processEvents();
+    }
+  }
+};
+}
+
+
+static void testResumingAfterReconnecting()
+{
+  Tester tester;
+  tester.publish("before connecting");
+  tester.connect();
+  tester.waitForMessages(1);
+  tester.client.disconnect();
+
+  while (tester.server.nClients() != 0) {
+    tester.processEvents();
+  }
+
+  tester.publish("while disconnected");
+  tester.connect();
+  tester.publish("after reconnecting");
+  tester.waitForMessages(3);
+
+  assert(
+    tester.client_handler.messages ==
+    (vector<SequencedMessage>{
+      {0,"before connecting"},
+      {1,"while disconnected"},
+      {2,"after reconnecting"}
+    })
+  );
+
+  assert(tester.client.nextSequence() == 3);
+}
+
+
+static void testDiscardingAcknowledgedMessages()
+{
+  Tester tester;
+  tester.connect();
+
+  for (int i=0; i!=6; ++i) {
+    tester.publish(string(24,'a' + i));
+  }
+
+  tester.waitForMessages(6);
+
+  // The last segment is kept, and there is room for two messages in each.
+  assert(tester.journal.nSegments() == 3);
+  tester.client.acknowledge(4);
+
+  while (tester.server.acknowledgedSequence() != 4) {
+    tester.processEvents();
+  }
+
+  assert(tester.journal.nSegments() == 1);
+  assert(tester.journal.firstSequence() == 4);
+
+  // A subscriber which hasn't acknowledged anything holds back the rest.
+  tester.server.addSubscriber(/*subscriber_id*/2);
+  assert(tester.server.acknowledgedSequence() == 0);
+  tester.server.removeSubscriber(/*subscriber_id*/2);
+  assert(tester.server.acknowledgedSequence() == 4);
+}
+
+
+int main()
+{
+  testAppendingAndReopening();
+  testReadingInPieces();
+  testDiscardingSegments();
+  testRecoveringFromATornWrite();
+  testResumingAfterReconnecting();
+  testDiscardingAcknowledgedMessages();
+}
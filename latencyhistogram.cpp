@@ -0,0 +1,95 @@
+#include "latencyhistogram.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+
+
+// Each power of two above sub_bucket_count is split into
+// sub_bucket_count/2 buckets.
+static const int sub_bucket_bits = 8;
+static const uint64_t sub_bucket_count = uint64_t(1) << sub_bucket_bits;
+static const uint64_t half_sub_bucket_count = sub_bucket_count/2;
+
+
+static int highestBit(uint64_t value)
+{
+  assert(value != 0);
+  return 63 - __builtin_clzll(value);
+}
+
+
+static size_t bucketIndex(uint64_t value)
+{
+  if (value < sub_bucket_count) {
+    return value;
+  }
+
+  int shift = highestBit(value) - (sub_bucket_bits - 1);
+  uint64_t sub_bucket = (value >> shift) - half_sub_bucket_count;
+  return sub_bucket_count + (shift - 1)*half_sub_bucket_count + sub_bucket;
+}
+
+
+static uint64_t highestValueInBucket(size_t index)
+{
+  if (index < sub_bucket_count) {
+    return index;
+  }
+
+  size_t offset = index - sub_bucket_count;
+  int shift = offset/half_sub_bucket_count + 1;
+  uint64_t sub_bucket = offset%half_sub_bucket_count + half_sub_bucket_count;
+  return ((sub_bucket + 1) << shift) - 1;
+}
+
+
+void LatencyHistogram::record(uint64_t value)
+{
+  size_t index = bucketIndex(value);
+
+  if (index >= counts.size()) {
+    counts.resize(index + 1,0);
+  }
+
+  ++counts[index];
+  ++total_count;
+  min_value = std::min(min_value,value);
+  max_value = std::max(max_value,value);
+  sum += value;
+}
+
+
+double LatencyHistogram::mean() const
+{
+  if (total_count == 0) {
+    return 0;
+  }
+
+  return double(sum/total_count);
+}
+
+
+uint64_t LatencyHistogram::valueAtPercentile(double percentile) const
+{
+  assert(percentile >= 0 && percentile <= 100);
+
+  if (total_count == 0) {
+    return 0;
+  }
+
+  uint64_t target_count =
+    std::max<uint64_t>(std::ceil(percentile/100*total_count),1);
+
+  uint64_t cumulative_count = 0;
+
+  for (size_t i=0; i!=counts.size(); ++i) {
+    cumulative_count += counts[i];
+
+    if (cumulative_count >= target_count) {
+      return std::min(highestValueInBucket(i),max_value);
+    }
+  }
+
+  return max_value;
+}
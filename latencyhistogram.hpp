@@ -0,0 +1,34 @@
+#ifndef LATENCYHISTOGRAM_HPP_
+#define LATENCYHISTOGRAM_HPP_
+
+#include <cstdint>
+#include <vector>
+
+
+// Counts values in buckets whose width grows with the value, as in
+// HdrHistogram, so that any value from one to the maximum of a uint64_t
+// is kept to within 1% using a few kilobytes.  Values below 256 are
+// exact.
+class LatencyHistogram {
+  public:
+    void record(uint64_t value);
+
+    uint64_t count() const { return total_count; }
+    uint64_t min() const { return total_count ? min_value : 0; }
+    uint64_t max() const { return max_value; }
+    double mean() const;
+
+    // The largest value which could have been counted in the bucket where
+    // the percentile falls, limited to the largest value seen.
+    uint64_t valueAtPercentile(double percentile) const;
+
+  private:
+    std::vector<uint64_t> counts;
+    uint64_t total_count = 0;
+    uint64_t min_value = UINT64_MAX;
+    uint64_t max_value = 0;
+    long double sum = 0;
+};
+
+
+#endif /* LATENCYHISTOGRAM_HPP_ */
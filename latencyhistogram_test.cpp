@@ -0,0 +1,52 @@
+#include "latencyhistogram.hpp"
+
+#include <cassert>
+#include <cmath>
+
+
+static bool isNear(uint64_t value,uint64_t expected)
+{
+  return std::abs(double(value) - double(expected)) <= expected*0.01;
+}
+
+
+static void testSmallValuesAreExact()
+{
+  LatencyHistogram histogram;
+
+  for (uint64_t value=1; value<=100; ++value) {
+    histogram.record(value);
+  }
+
+  assert(histogram.count() == 100);
+  assert(histogram.min() == 1);
+  assert(histogram.max() == 100);
+  assert(histogram.mean() == 50.5);
+  assert(histogram.valueAtPercentile(50) == 50);
+  assert(histogram.valueAtPercentile(99) == 99);
+  assert(histogram.valueAtPercentile(100) == 100);
+  assert(histogram.valueAtPercentile(0) == 1);
+}
+
+
+static void testLargeValuesAreClose()
+{
+  LatencyHistogram histogram;
+
+  for (uint64_t value=1; value<=1000000; ++value) {
+    histogram.record(value*1000);
+  }
+
+  assert(isNear(histogram.valueAtPercentile(50),500000000));
+  assert(isNear(histogram.valueAtPercentile(99.9),999000000));
+  assert(histogram.valueAtPercentile(100) == 1000000000);
+  histogram.record(UINT64_MAX);
+  assert(histogram.valueAtPercentile(100) == UINT64_MAX);
+}
+
+
+int main()
+{
+  testSmallValuesAreExact();
+  testLargeValuesAreClose();
+}
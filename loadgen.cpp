@@ -0,0 +1,698 @@
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cstdio>
+#include <deque>
+#include <iostream>
+#include <map>
+#include <optional>
+#include <random>
+#include <string>
+#include <vector>
+#include "messageservice.hpp"
+#include "systemsockets.hpp"
+#include "pollselector.hpp"
+#include "latencyhistogram.hpp"
+
+using std::cerr;
+using std::cout;
+using std::string;
+using std::vector;
+using Clock = std::chrono::steady_clock;
+using TimePoint = Clock::time_point;
+using Duration = Clock::duration;
+using ClientId = MessageServer::ClientId;
+
+// Each message starts with the time it should have been sent and the
+// time it was sent, in nanoseconds since the run started.
+static const size_t timestamps_size = 16;
+
+// Replies to messages which are still outstanding this long after the
+// run ends are given up on.
+static const Duration drain_time = std::chrono::seconds(2);
+
+
+namespace {
+struct SizeDistribution {
+  enum class Kind { fixed, uniform, exponential };
+
+  Kind kind = Kind::fixed;
+  size_t min_size = 128;
+  size_t max_size = 128;
+  double mean_size = 128;
+};
+}
+
+
+namespace {
+struct LoadOptions {
+  int n_connections = 100;
+  double n_seconds = 5;
+
+  // Messages per second over all the connections.  With zero, each
+  // connection sends whenever its window allows.
+  double rate = 0;
+
+  // With an open loop, messages are sent on schedule however many are
+  // waiting for replies.  With a closed loop, each connection only has
+  // window messages outstanding.
+  bool is_open_loop = false;
+  int window = 1;
+
+  SizeDistribution size_distribution;
+
+  // Each connection is closed and opened again after this many messages.
+  int churn = 0;
+
+  int port = 4160;
+  unsigned seed = 1;
+};
+}
+
+
+static void encodeUint64(char *p,uint64_t value)
+{
+  for (int i=0; i!=8; ++i) {
+    p[i] = char(value >> (56 - i*8));
+  }
+}
+
+
+static uint64_t decodeUint64(const char *message)
+{
+  const unsigned char *p = reinterpret_cast<const unsigned char *>(message);
+  uint64_t value = 0;
+
+  for (int i=0; i!=8; ++i) {
+    value = (value << 8) | p[i];
+  }
+
+  return value;
+}
+
+
+static bool parseSize(const string &text,size_t &size)
+{
+  char *end = nullptr;
+  unsigned long long value = strtoull(text.c_str(),&end,10);
+
+  if (text.empty() || *end != '\0') {
+    return false;
+  }
+
+  size = value;
+  return true;
+}
+
+
+static bool parseDouble(const string &text,double &value)
+{
+  char *end = nullptr;
+  value = strtod(text.c_str(),&end);
+  return !text.empty() && *end == '\0';
+}
+
+
+// Sizes are given as "128", "64-4096" for a uniform distribution, or
+// "exp512" for an exponential one with that mean.
+static bool
+  parseSizeDistribution(const string &text,SizeDistribution &distribution)
+{
+  using Kind = SizeDistribution::Kind;
+  size_t dash_index = text.find('-');
+
+  if (text.compare(0,3,"exp") == 0) {
+    distribution.kind = Kind::exponential;
+    distribution.min_size = timestamps_size;
+    distribution.max_size = 64*1024*1024;
+    return parseDouble(text.substr(3),distribution.mean_size);
+  }
+
+  if (dash_index != string::npos) {
+    distribution.kind = Kind::uniform;
+
+    return
+      parseSize(text.substr(0,dash_index),distribution.min_size) &&
+      parseSize(text.substr(dash_index + 1),distribution.max_size) &&
+      distribution.min_size <= distribution.max_size;
+  }
+
+  distribution.kind = Kind::fixed;
+
+  if (!parseSize(text,distribution.min_size)) {
+    return false;
+  }
+
+  distribution.max_size = distribution.min_size;
+  return true;
+}
+
+
+static bool parseOption(const string &argument,LoadOptions &options)
+{
+  size_t equals_index = argument.find('=');
+
+  if (equals_index == string::npos) {
+    return false;
+  }
+
+  string name = argument.substr(0,equals_index);
+  string value = argument.substr(equals_index + 1);
+  size_t size = 0;
+
+  if (name == "connections" && parseSize(value,size) && size > 0) {
+    options.n_connections = size;
+    return true;
+  }
+
+  if (name == "seconds") {
+    return parseDouble(value,options.n_seconds) && options.n_seconds > 0;
+  }
+
+  if (name == "rate") {
+    return parseDouble(value,options.rate) && options.rate >= 0;
+  }
+
+  if (name == "loop" && (value == "open" || value == "closed")) {
+    options.is_open_loop = (value == "open");
+    return true;
+  }
+
+  if (name == "window" && parseSize(value,size) && size > 0) {
+    options.window = size;
+    return true;
+  }
+
+  if (name == "size") {
+    return parseSizeDistribution(value,options.size_distribution);
+  }
+
+  if (name == "churn" && parseSize(value,size)) {
+    options.churn = size;
+    return true;
+  }
+
+  if (name == "port" && parseSize(value,size)) {
+    options.port = size;
+    return true;
+  }
+
+  if (name == "seed" && parseSize(value,size)) {
+    options.seed = size;
+    return true;
+  }
+
+  return false;
+}
+
+
+namespace {
+struct EchoServerHandler : MessageServer::EventInterface {
+  MessageServer &server;
+
+  EchoServerHandler(MessageServer &server_arg)
+  : server(server_arg)
+  {
+  }
+
+  void
+    gotMessage(
+      ClientId client_id,
+      const char *message,
+      size_t message_size
+    ) override
+  {
+    server.queueMessageToClient(client_id,message,message_size);
+  }
+
+  void clientConnected(ClientId) override {}
+  void clientDisconnected(ClientId) override {}
+};
+}
+
+
+namespace {
+struct Results {
+  // Measured from when each message should have been sent, so that a
+  // stall also counts against the messages it held back.
+  LatencyHistogram corrected_latencies;
+
+  // Measured from when each message was actually sent.
+  LatencyHistogram raw_latencies;
+
+  uint64_t n_messages_sent = 0;
+  uint64_t n_messages_received = 0;
+  uint64_t n_bytes_received = 0;
+  int n_connects = 0;
+  int n_refused_connections = 0;
+};
+}
+
+
+namespace {
+struct Connection {
+  MessageClient client;
+  std::optional<TimePoint> maybe_next_send_time;
+  int n_outstanding_messages = 0;
+  int n_messages_since_connecting = 0;
+
+  Connection(SocketsInterface &sockets)
+  : client(sockets)
+  {
+  }
+};
+}
+
+
+namespace {
+struct ClientHandler : MessageClient::EventInterface {
+  Connection &connection;
+  Results &results;
+  const TimePoint start_time;
+  const TimePoint now;
+
+  ClientHandler(
+    Connection &connection_arg,
+    Results &results_arg,
+    TimePoint start_time_arg,
+    TimePoint now_arg
+  )
+  : connection(connection_arg),
+    results(results_arg),
+    start_time(start_time_arg),
+    now(now_arg)
+  {
+  }
+
+  void connectionRefused() override
+  {
+    ++results.n_refused_connections;
+  }
+
+  void connected() override
+  {
+    ++results.n_connects;
+  }
+
+  void gotMessage(const char *message,size_t message_size) override
+  {
+    assert(message_size >= timestamps_size);
+    uint64_t receive_time = (now - start_time).count();
+    uint64_t intended_send_time = decodeUint64(message);
+    uint64_t send_time = decodeUint64(message + 8);
+    results.corrected_latencies.record(receive_time - intended_send_time);
+    results.raw_latencies.record(receive_time - send_time);
+    ++results.n_messages_received;
+    results.n_bytes_received += message_size;
+    --connection.n_outstanding_messages;
+  }
+};
+}
+
+
+namespace {
+class LoadGenerator {
+  public:
+    LoadGenerator(const LoadOptions &options_arg)
+    : options(options_arg),
+      random_engine(options.seed),
+      server(sockets),
+      server_handler(server)
+    {
+      if (options.rate > 0) {
+        send_interval =
+          std::chrono::duration_cast<Duration>(
+            std::chrono::duration<double>(options.n_connections/options.rate)
+          );
+      }
+    }
+
+    bool run();
+    const Results &results() const { return load_results; }
+    double seconds() const { return run_seconds; }
+
+  private:
+    const LoadOptions options;
+    std::mt19937_64 random_engine;
+    SystemSockets sockets;
+    PollSelector selector;
+    MessageServer server;
+    EchoServerHandler server_handler;
+    std::deque<Connection> connections;
+    std::optional<Duration> send_interval;
+    TimePoint start_time;
+    vector<char> message;
+    Results load_results;
+    double run_seconds = 0;
+
+    size_t randomMessageSize();
+    void sendMessage(Connection &,TimePoint intended_send_time,TimePoint now);
+    bool canSend(const Connection &) const;
+    void sendDueMessages(Connection &,TimePoint now,TimePoint end_time);
+    void churn(Connection &);
+    void processEvents(std::optional<TimePoint> maybe_wake_time);
+    bool connectAll();
+    void disconnectAll();
+};
+}
+
+
+size_t LoadGenerator::randomMessageSize()
+{
+  using Kind = SizeDistribution::Kind;
+  const SizeDistribution &distribution = options.size_distribution;
+  size_t size = distribution.min_size;
+
+  switch (distribution.kind) {
+    case Kind::fixed:
+      break;
+    case Kind::uniform:
+      size =
+        std::uniform_int_distribution<size_t>(
+          distribution.min_size,distribution.max_size
+        )(random_engine);
+      break;
+    case Kind::exponential:
+      size =
+        std::exponential_distribution<double>(
+          1/distribution.mean_size
+        )(random_engine);
+      break;
+  }
+
+  return std::clamp(size,timestamps_size,distribution.max_size);
+}
+
+
+void
+  LoadGenerator::sendMessage(
+    Connection &connection,
+    TimePoint intended_send_time,
+    TimePoint now
+  )
+{
+  message.resize(randomMessageSize());
+  encodeUint64(message.data(),(intended_send_time - start_time).count());
+  encodeUint64(message.data() + 8,(now - start_time).count());
+  connection.client.queueMessage(message.data(),message.size());
+  ++connection.n_outstanding_messages;
+  ++connection.n_messages_since_connecting;
+  ++load_results.n_messages_sent;
+}
+
+
+bool LoadGenerator::canSend(const Connection &connection) const
+{
+  bool window_is_full =
+    !options.is_open_loop &&
+    connection.n_outstanding_messages >= options.window;
+
+  bool churn_is_due =
+    options.churn != 0 &&
+    connection.n_messages_since_connecting >= options.churn;
+
+  return connection.client.isConnected() && !window_is_full && !churn_is_due;
+}
+
+
+void
+  LoadGenerator::sendDueMessages(
+    Connection &connection,
+    TimePoint now,
+    TimePoint end_time
+  )
+{
+  for (;;) {
+    if (!canSend(connection)) {
+      return;
+    }
+
+    if (!send_interval) {
+      sendMessage(connection,now,now);
+      continue;
+    }
+
+    // A message which couldn't be sent on time keeps the time it should
+    // have gone out.
+    TimePoint &next_send_time = *connection.maybe_next_send_time;
+
+    if (next_send_time > now || next_send_time >= end_time) {
+      return;
+    }
+
+    sendMessage(connection,next_send_time,now);
+    next_send_time += *send_interval;
+  }
+}
+
+
+void LoadGenerator::churn(Connection &connection)
+{
+  bool is_due =
+    options.churn != 0 &&
+    connection.n_messages_since_connecting >= options.churn &&
+    connection.n_outstanding_messages == 0 &&
+    connection.client.isConnected();
+
+  if (is_due) {
+    connection.client.disconnect();
+    connection.client.startConnecting(options.port);
+    connection.n_messages_since_connecting = 0;
+  }
+}
+
+
+void LoadGenerator::processEvents(std::optional<TimePoint> maybe_wake_time)
+{
+  selector.beginSelect();
+  server.setupSelect(selector.preSelectParams());
+
+  for (Connection &connection : connections) {
+    connection.client.setupSelect(selector.preSelectParams());
+  }
+
+  if (maybe_wake_time) {
+    selector.preSelectParams().setTimeout(
+      std::chrono::ceil<std::chrono::microseconds>(
+        *maybe_wake_time - Clock::now()
+      )
+    );
+  }
+
+  selector.callSelect();
+  server.handleSelect(selector.postSelectParams(),server_handler);
+  TimePoint now = Clock::now();
+
+  for (Connection &connection : connections) {
+    ClientHandler client_handler(connection,load_results,start_time,now);
+    connection.client.handleSelect(selector.postSelectParams(),client_handler);
+  }
+
+  selector.endSelect();
+}
+
+
+bool LoadGenerator::connectAll()
+{
+  server.startListening(options.port);
+
+  for (int i=0; i!=options.n_connections; ++i) {
+    connections.emplace_back(sockets);
+    connections.back().client.startConnecting(options.port);
+  }
+
+  // Clients count as connected before the server has accepted them.
+  while (
+    load_results.n_connects != options.n_connections ||
+    server.nClients() != options.n_connections
+  ) {
+    if (load_results.n_refused_connections != 0) {
+      cerr << "Connection refused.\n";
+      return false;
+    }
+
+    processEvents(/*maybe_wake_time*/std::nullopt);
+  }
+
+  return true;
+}
+
+
+void LoadGenerator::disconnectAll()
+{
+  for (Connection &connection : connections) {
+    if (connection.client.isActive()) {
+      connection.client.disconnect();
+    }
+  }
+
+  // Close our side first, so the server's port is free again.
+  while (server.nClients() != 0) {
+    processEvents(/*maybe_wake_time*/std::nullopt);
+  }
+}
+
+
+bool LoadGenerator::run()
+{
+  if (!connectAll()) {
+    return false;
+  }
+
+  start_time = Clock::now();
+
+  TimePoint end_time =
+    start_time +
+    std::chrono::duration_cast<Duration>(
+      std::chrono::duration<double>(options.n_seconds)
+    );
+
+  if (send_interval) {
+    // Spread the connections over the interval, so that they don't all
+    // send at once.
+    std::uniform_int_distribution<Duration::rep>
+      offset_distribution(0,send_interval->count() - 1);
+
+    for (Connection &connection : connections) {
+      connection.maybe_next_send_time =
+        start_time + Duration(offset_distribution(random_engine));
+    }
+  }
+
+  for (;;) {
+    TimePoint now = Clock::now();
+    bool is_sending = now < end_time;
+    std::optional<TimePoint> maybe_wake_time;
+
+    if (is_sending) {
+      maybe_wake_time = end_time;
+    }
+
+    uint64_t n_outstanding_messages = 0;
+
+    for (Connection &connection : connections) {
+      churn(connection);
+
+      if (is_sending) {
+        sendDueMessages(connection,now,end_time);
+
+        // Otherwise a reply or a connection has to come first.
+        if (connection.maybe_next_send_time && canSend(connection)) {
+          maybe_wake_time =
+            std::min(*maybe_wake_time,*connection.maybe_next_send_time);
+        }
+      }
+
+      n_outstanding_messages += connection.n_outstanding_messages;
+    }
+
+    if (!is_sending) {
+      if (n_outstanding_messages == 0 || now >= end_time + drain_time) {
+        break;
+      }
+
+      maybe_wake_time = end_time + drain_time;
+    }
+
+    processEvents(maybe_wake_time);
+  }
+
+  run_seconds =
+    std::chrono::duration<double>(Clock::now() - start_time).count();
+
+  disconnectAll();
+
+  return load_results.n_refused_connections == 0;
+}
+
+
+static void
+  printLatencies(const char *description,const LatencyHistogram &histogram)
+{
+  auto microseconds = [](uint64_t n_nanoseconds){
+    return n_nanoseconds/1000.0;
+  };
+
+  char line[256];
+
+  snprintf(
+    line,sizeof line,
+    "%-10s %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+    description,
+    microseconds(histogram.valueAtPercentile(50)),
+    microseconds(histogram.valueAtPercentile(90)),
+    microseconds(histogram.valueAtPercentile(99)),
+    microseconds(histogram.valueAtPercentile(99.9)),
+    microseconds(histogram.valueAtPercentile(99.99)),
+    microseconds(histogram.max())
+  );
+
+  cout << line;
+}
+
+
+static void printResults(const LoadGenerator &generator)
+{
+  const Results &results = generator.results();
+  double seconds = generator.seconds();
+
+  cout << results.n_messages_sent << " sent, " <<
+    results.n_messages_received << " received in " << seconds << " s: " <<
+    results.n_messages_received/seconds << " msgs/s, " <<
+    results.n_bytes_received/seconds/(1024*1024) << " MB/s, " <<
+    results.n_connects << " connects\n";
+
+  cout << "latency us        p50        p90        p99      p99.9     "
+    "p99.99        max\n";
+  printLatencies("corrected",results.corrected_latencies);
+  printLatencies("raw",results.raw_latencies);
+}
+
+
+static void printUsage()
+{
+  cerr <<
+    "Usage: loadgen [name=value...]\n"
+    "  connections=N   concurrent connections (100)\n"
+    "  seconds=S       how long to send (5)\n"
+    "  rate=R          messages per second over all connections, or 0 to\n"
+    "                  send as fast as the window allows (0)\n"
+    "  loop=open|closed  open sends on schedule regardless of replies,\n"
+    "                  closed keeps at most window messages outstanding\n"
+    "                  (closed)\n"
+    "  window=N        outstanding messages per connection (1)\n"
+    "  size=N|A-B|expM fixed, uniform, or exponential sizes (128)\n"
+    "  churn=N         reconnect after every N messages, or 0 (0)\n"
+    "  port=P          loopback port for the server (4160)\n"
+    "  seed=N          random seed (1)\n";
+}
+
+
+int main(int argc,char** argv)
+{
+  LoadOptions options;
+
+  for (int i=1; i!=argc; ++i) {
+    if (!parseOption(argv[i],options)) {
+      cerr << "Invalid option: " << argv[i] << "\n";
+      printUsage();
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (options.is_open_loop && options.rate == 0) {
+    cerr << "An open loop needs a rate.\n";
+    return EXIT_FAILURE;
+  }
+
+  LoadGenerator generator(options);
+
+  if (!generator.run()) {
+    return EXIT_FAILURE;
+  }
+
+  printResults(generator);
+  return EXIT_SUCCESS;
+}
@@ -1,13 +1,122 @@
 #include "messageservice.hpp"
 
 #include <string.h>
+#include <algorithm>
 #include <cassert>
 
 using SocketId = SocketsInterface::SocketId;
 using std::vector;
 
 
+// Each message is sent as a four byte big-endian payload size followed by
+// the payload.  A header with the top bit set is credit for flow control
+// instead, with the rest of it being the number of messages and no
+// payload.  A header with the next bit set has a compressed payload, which
+// is the four byte size of the message followed by the compressed message.
+// A header with both bits set is a ping or a pong, which also has no
+// payload.
+static const size_t message_header_size = 4;
+static const uint32_t credit_flag = 0x80000000;
+static const uint32_t compressed_flag = 0x40000000;
+static const uint32_t control_flags = credit_flag | compressed_flag;
+static const uint32_t ping_header_value = control_flags | 1;
+static const uint32_t pong_header_value = control_flags | 2;
+static const size_t original_size_size = 4;
+
+// Buffers up to this size are kept when a connection is closed.
+static const size_t max_kept_buffer_size = 64*1024;
+
+
+static void encodeHeaderValue(char *header,uint32_t value)
+{
+  header[0] = char(value >> 24);
+  header[1] = char(value >> 16);
+  header[2] = char(value >> 8);
+  header[3] = char(value);
+}
+
+
+static void
+  encodeMessageHeader(
+    char *header,
+    size_t payload_size,
+    bool is_compressed = false
+  )
+{
+  assert(payload_size < compressed_flag);
+  uint32_t flags = is_compressed ? compressed_flag : 0;
+  encodeHeaderValue(header,payload_size | flags);
+}
+
+
+static SharedMessage
+  makeSharedFrame(const char *payload,size_t payload_size,bool is_compressed)
+{
+  auto bytes_ptr =
+    std::make_shared<std::vector<char>>(message_header_size + payload_size);
+
+  encodeMessageHeader(bytes_ptr->data(), payload_size, is_compressed);
+  memcpy(bytes_ptr->data() + message_header_size, payload, payload_size);
+  return bytes_ptr;
+}
+
+
+SharedMessage makeSharedMessage(const char *message,size_t message_size)
+{
+  return makeSharedFrame(message,message_size,/*is_compressed*/false);
+}
+
+
+static uint32_t decodeHeaderValue(const char *header)
+{
+  const unsigned char *p = reinterpret_cast<const unsigned char *>(header);
+  return (uint32_t(p[0]) << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+
+static bool isCreditHeader(uint32_t header_value)
+{
+  return (header_value & control_flags) == credit_flag;
+}
+
+
+static bool isCompressedHeader(uint32_t header_value)
+{
+  return (header_value & control_flags) == compressed_flag;
+}
+
+
+static bool isControlHeader(uint32_t header_value)
+{
+  return (header_value & control_flags) == control_flags;
+}
+
+
+static size_t payloadSize(uint32_t header_value)
+{
+  if (isCreditHeader(header_value) || isControlHeader(header_value)) {
+    return 0;
+  }
+
+  return header_value & ~compressed_flag;
+}
+
+
 struct MessageReceiver::Impl {
+  static void clearBuffers(MessageReceiver &self)
+  {
+    self.n_bytes_read = 0;
+
+    bool kept_buffers_are_large =
+      self.buffer.size() > max_kept_buffer_size ||
+      self.decompression_buffer.size() > max_kept_buffer_size;
+
+    if (kept_buffers_are_large) {
+      self.buffer = Buffer(1024);
+      self.decompression_buffer = Buffer();
+    }
+  }
+
   static size_t bufferSize(const MessageReceiver &self)
   {
     return self.buffer.size();
@@ -25,10 +134,12 @@ struct MessageReceiver::Impl {
     assert(self.n_bytes_read <= bufferSize(self));
   }
 
-  static void reset(MessageReceiver &self,size_t n_bytes_to_keep)
+  static void discard(MessageReceiver &self,size_t n_bytes_to_discard)
   {
-    assert(n_bytes_to_keep <= chunkSize(self));
-    memmove(self.buffer.data(), chunkStart(self), n_bytes_to_keep);
+    assert(n_bytes_to_discard <= self.n_bytes_read);
+    size_t n_bytes_to_keep = self.n_bytes_read - n_bytes_to_discard;
+    char *buffer_start = self.buffer.data();
+    memmove(buffer_start, buffer_start + n_bytes_to_discard, n_bytes_to_keep);
     self.n_bytes_read = n_bytes_to_keep;
   }
 
@@ -47,54 +158,282 @@ struct MessageReceiver::Impl {
     assert(new_size >= self.n_bytes_read);
     self.buffer.resize(new_size);
   }
+
+  // The size in the header comes from the other end, so it can't be
+  // trusted.  A compressed payload also holds the original size.
+  static bool
+    payloadIsTooLarge(const MessageReceiver &self,uint32_t header_value)
+  {
+    size_t max_payload_size = self.max_message_size;
+
+    if (isCompressedHeader(header_value)) {
+      max_payload_size += original_size_size;
+    }
+
+    return payloadSize(header_value) > max_payload_size;
+  }
+
+  static bool
+    handleCompressedMessage(
+      MessageReceiver &self,
+      const char *payload,
+      size_t payload_size,
+      EventInterface &handler
+    )
+  {
+    if (payload_size < original_size_size) {
+      return false;
+    }
+
+    size_t message_size = decodeHeaderValue(payload);
+    size_t compressed_size = payload_size - original_size_size;
+
+    // Check the size before making room for the message, since it comes
+    // from the other end.
+    if (message_size > self.max_message_size) {
+      return false;
+    }
+
+    if (message_size > lzMaxDecompressedSize(compressed_size)) {
+      return false;
+    }
+
+    Buffer &message = self.decompression_buffer;
+    message.resize(message_size);
+
+    bool decompressed =
+      lzDecompress(
+        payload + original_size_size,
+        compressed_size,
+        message.data(),
+        message_size
+      );
+
+    if (!decompressed) {
+      return false;
+    }
+
+    handler.gotMessage(message.data(),message_size);
+    return true;
+  }
+
+  // Returns false if a message was invalid.
+  static bool
+    handleCompleteMessages(MessageReceiver &self,EventInterface &handler)
+  {
+    size_t position = 0;
+
+    for (;;) {
+      const char *message_start = bufferStart(self) + position;
+      size_t n_bytes_left = self.n_bytes_read - position;
+
+      if (n_bytes_left < message_header_size) {
+        break;
+      }
+
+      uint32_t header_value = decodeHeaderValue(message_start);
+
+      if (payloadIsTooLarge(self,header_value)) {
+        return false;
+      }
+
+      size_t payload_size = payloadSize(header_value);
+
+      if (n_bytes_left - message_header_size < payload_size) {
+        break;
+      }
+
+      const char *payload = message_start + message_header_size;
+
+      if (isCreditHeader(header_value)) {
+        handler.gotCredit(header_value & ~credit_flag);
+      }
+      else if (header_value == ping_header_value) {
+        handler.gotPing();
+      }
+      else if (isControlHeader(header_value)) {
+        // Pongs only show that the other end is alive, which receiving
+        // them already did.  Unknown control messages are ignored too.
+      }
+      else if (isCompressedHeader(header_value)) {
+        if (!handleCompressedMessage(self,payload,payload_size,handler)) {
+          return false;
+        }
+      }
+      else {
+        handler.gotMessage(payload,payload_size);
+      }
+
+      if (self.clear_is_pending) {
+        // The connection was closed, so the rest of the buffer is of no
+        // interest.
+        return true;
+      }
+
+      position += message_header_size + payload_size;
+    }
+
+    discard(self,position);
+    return true;
+  }
+
+  static int
+    receiveChunk(
+      MessageReceiver &self,
+      SocketsInterface &,
+      EventInterface &,
+      SocketId
+    );
+
+  static bool
+    receiveChunks(
+      MessageReceiver &self,
+      SocketsInterface &,
+      EventInterface &,
+      SocketId
+    );
 };
 
 
-bool
-  MessageReceiver::receiveMoreOfTheMessage(
+int
+  MessageReceiver::Impl::receiveChunk(
+    MessageReceiver &self,
     SocketsInterface &sockets,
     EventInterface &message_handler,
     SocketId server_socket_id
   )
 {
-  size_t read_count = Impl::chunkSize(*this);
+  size_t read_count = chunkSize(self);
   static const size_t minimum_read_size = 1024;
 
   if (read_count < minimum_read_size) {
-    size_t n_bytes_needed = minimum_read_size - read_count;
-    Impl::resizeBuffer(*this, Impl::bufferSize(*this) + n_bytes_needed);
-    read_count = Impl::chunkSize(*this);
+    // The buffer grows as bytes arrive, instead of by the size in the
+    // header, so that the other end can't make us allocate memory just
+    // by claiming that a message is large.  Doubling it means that large
+    // messages don't need many reallocations.
+    size_t new_size =
+      std::max(bufferSize(self)*2, self.n_bytes_read + minimum_read_size);
+
+    resizeBuffer(self, new_size);
+    read_count = chunkSize(self);
   }
 
   assert(read_count >= minimum_read_size);
 
-  char *chunk_start = Impl::chunkStart(*this);
+  char *chunk_start = chunkStart(self);
   int read_result = sockets.recv(server_socket_id, chunk_start, read_count);
 
   if (read_result <= 0) {
-    return false;
+    return read_result;
+  }
+
+  chunkReceived(self,read_result);
+
+  if (!handleCompleteMessages(self,message_handler)) {
+    // Nothing after a bad message can be trusted, so the connection fails.
+    errno = EPROTO;
+    return -1;
   }
 
-  if (read_result > 0) {
-    size_t n_bytes_read = read_result;
-    const void *memchr_result = memchr(chunk_start,'\0',n_bytes_read);
-    bool found_null_terminator = !!memchr_result;
+  return read_result;
+}
+
+
+bool
+  MessageReceiver::Impl::receiveChunks(
+    MessageReceiver &self,
+    SocketsInterface &sockets,
+    EventInterface &message_handler,
+    SocketId server_socket_id
+  )
+{
+  size_t n_bytes_received = 0;
+
+  for (;;) {
+    int read_result =
+      receiveChunk(self,sockets,message_handler,server_socket_id);
+
+    if (self.clear_is_pending) {
+      // The socket may have been closed, and even reused.
+      return true;
+    }
+
+    IoStatus status = ioStatus(read_result);
 
-    if (found_null_terminator) {
-      const char *p = static_cast<const char *>(memchr_result);
-      size_t n_message_bytes = p - chunk_start + 1;
-      size_t n_extra_bytes = n_bytes_read - n_message_bytes;
-      assert(n_bytes_read >= n_message_bytes);
-      Impl::chunkReceived(*this,n_message_bytes);
-      message_handler.gotMessage(Impl::bufferStart(*this));
-      Impl::reset(*this,n_extra_bytes);
+    if (status == IoStatus::interrupted) {
+      continue;
+    }
+
+    if (status == IoStatus::would_block) {
+      return true;
+    }
+
+    if (status != IoStatus::transferred) {
+      return false;
+    }
+
+    if (!self.maybe_drain_budget) {
+      return true;
+    }
+
+    n_bytes_received += read_result;
+
+    if (n_bytes_received >= *self.maybe_drain_budget) {
       return true;
     }
+  }
+}
+
+
+bool
+  MessageReceiver::receiveMoreOfTheMessage(
+    SocketsInterface &sockets,
+    EventInterface &message_handler,
+    SocketId server_socket_id
+  )
+{
+  is_receiving = true;
+
+  bool could_receive =
+    Impl::receiveChunks(*this,sockets,message_handler,server_socket_id);
+
+  is_receiving = false;
+
+  if (clear_is_pending) {
+    clear_is_pending = false;
+    Impl::clearBuffers(*this);
+  }
+
+  return could_receive;
+}
+
+
+void MessageReceiver::enableDraining(size_t max_bytes)
+{
+  maybe_drain_budget = max_bytes;
+}
 
-    Impl::chunkReceived(*this,n_bytes_read);
+
+void MessageReceiver::setMaxMessageSize(size_t max_size)
+{
+  max_message_size = max_size;
+}
+
+
+void MessageReceiver::clear()
+{
+  maybe_drain_budget.reset();
+  max_message_size = default_max_message_size;
+
+  if (is_receiving) {
+    // We are in the middle of delivering messages from the buffer, so the
+    // buffers are cleared afterwards.  The receiver can be set up for a
+    // new connection in the meantime.
+    clear_is_pending = true;
+    return;
   }
 
-  return true;
+  Impl::clearBuffers(*this);
 }
 
 
@@ -112,148 +451,1409 @@ struct MessageSender::Impl {
   static void reset(MessageSender &self)
   {
     self.message_being_sent = nullptr;
+    self.maybe_file_region.reset();
+  }
+
+  static size_t fileChunkSize(const MessageSender &self)
+  {
+    assert(self.maybe_file_region);
+    return self.maybe_file_region->length - self.n_file_bytes_sent;
+  }
+
+  static void fileChunkSent(MessageSender &self,size_t n)
+  {
+    assert(n <= fileChunkSize(self));
+    self.n_file_bytes_sent += n;
+  }
+
+  static bool isFinished(const MessageSender &self)
+  {
+    if (nBytesSent(self) != messageSize(self)) {
+      return false;
+    }
+
+    if (self.maybe_file_region && fileChunkSize(self) != 0) {
+      return false;
+    }
+
+    return true;
   }
 
+  static int
+    sendChunk(
+      MessageSender &self,
+      SocketsInterface &sockets,
+      const SocketId socket_id
+    );
+
+  static int
+    sendFileChunk(
+      MessageSender &self,
+      SocketsInterface &sockets,
+      const SocketId socket_id
+    );
+
   static const char *chunkStart(const MessageSender &self)
   {
     return self.message_being_sent + self.n_bytes_sent;
   }
 
-  static size_t chunkSize(const MessageSender &self)
+  static size_t chunkSize(const MessageSender &self)
+  {
+    return self.message_size - self.n_bytes_sent;
+  }
+
+  static void chunkSent(MessageSender &self,size_t n)
+  {
+    assert(n <= chunkSize(self));
+    self.n_bytes_sent += n;
+    assert(self.n_bytes_sent <= self.message_size);
+  }
+};
+
+
+void
+  MessageSender::queueMessage(
+    const char *message_arg,
+    int message_size_arg,
+    bool use_zero_copy_arg
+  )
+{
+  assert(!message_being_sent);
+  message_being_sent = message_arg;
+  message_size = message_size_arg;
+  use_zero_copy = use_zero_copy_arg;
+  n_bytes_sent = 0;
+}
+
+
+void MessageSender::queueFileRegion(const FileRegion &file_region)
+{
+  assert(message_being_sent);
+  assert(!maybe_file_region);
+  maybe_file_region = file_region;
+  n_file_bytes_sent = 0;
+}
+
+
+int
+  MessageSender::Impl::sendChunk(
+    MessageSender &self,
+    SocketsInterface &sockets,
+    const SocketId socket_id
+  )
+{
+  const char *chunk_start = chunkStart(self);
+  size_t chunk_size = chunkSize(self);
+
+  if (!self.use_zero_copy) {
+    return sockets.send(socket_id,chunk_start,chunk_size);
+  }
+
+  bool is_zero_copy = false;
+
+  int send_result =
+    sockets.sendZeroCopy(socket_id,chunk_start,chunk_size,is_zero_copy);
+
+  if (send_result > 0 && is_zero_copy) {
+    ++self.n_zero_copy_sends;
+  }
+
+  return send_result;
+}
+
+
+int
+  MessageSender::Impl::sendFileChunk(
+    MessageSender &self,
+    SocketsInterface &sockets,
+    const SocketId socket_id
+  )
+{
+  assert(self.maybe_file_region);
+  const FileRegion &file_region = *self.maybe_file_region;
+
+  return
+    sockets.sendFile(
+      socket_id,
+      file_region.file_descriptor,
+      file_region.offset + self.n_file_bytes_sent,
+      fileChunkSize(self)
+    );
+}
+
+
+int
+  MessageSender::sendMoreOfTheMessage(
+    SocketsInterface &sockets,
+    const SocketId client_socket_id
+  )
+{
+  // The message bytes go first, followed by the file contents if there
+  // are any.
+  bool is_sending_file = (Impl::chunkSize(*this) == 0);
+  bool is_starting = (n_bytes_sent == 0 && n_file_bytes_sent == 0);
+  int send_result = 0;
+
+  if (is_starting && maybe_file_region) {
+    // Don't send the header in a segment of its own.
+    sockets.setCork(client_socket_id,true);
+  }
+
+  if (!is_sending_file) {
+    send_result = Impl::sendChunk(*this,sockets,client_socket_id);
+  }
+  else {
+    send_result = Impl::sendFileChunk(*this,sockets,client_socket_id);
+  }
+
+  if (send_result <= 0) {
+    return send_result;
+  }
+
+  size_t n_bytes_sent = send_result;
+
+  if (!is_sending_file) {
+    Impl::chunkSent(*this,n_bytes_sent);
+  }
+  else {
+    Impl::fileChunkSent(*this,n_bytes_sent);
+  }
+
+  if (Impl::isFinished(*this)) {
+    if (maybe_file_region) {
+      sockets.setCork(client_socket_id,false);
+    }
+
+    Impl::reset(*this);
+  }
+
+  return send_result;
+}
+
+
+struct QueuedMessageSender::Impl {
+  static bool shouldUseZeroCopy(QueuedMessageSender &self,size_t message_size)
+  {
+    if (!self.maybe_zero_copy_threshold) {
+      return false;
+    }
+
+    return message_size >= *self.maybe_zero_copy_threshold;
+  }
+
+  static bool isBuffered(const QueuedMessage &message)
+  {
+    return message.n_buffered_bytes != 0;
+  }
+
+  static size_t messageSize(const QueuedMessage &message)
+  {
+    if (isBuffered(message)) {
+      return message.n_buffered_bytes;
+    }
+
+    size_t size = message.shared_message->size();
+
+    if (message.maybe_file_region) {
+      size += message.maybe_file_region->length;
+    }
+
+    return size;
+  }
+
+  static bool hasQueuedMessages(const QueuedMessageSender &self)
+  {
+    return self.message_queue_start != self.message_queue.size();
+  }
+
+  static const QueuedMessage &frontMessage(const QueuedMessageSender &self)
+  {
+    assert(hasQueuedMessages(self));
+    return self.message_queue[self.message_queue_start];
+  }
+
+  static size_t nQueuedMessages(const QueuedMessageSender &self)
+  {
+    return self.message_queue.size() - self.message_queue_start;
+  }
+
+  // Remove the part of the vector before start once it is at least half of
+  // the vector.  This keeps the cost of moving the rest constant per
+  // element.
+  template <typename T>
+  static void removeFront(std::vector<T> &v,size_t &start)
+  {
+    if (start == v.size()) {
+      v.clear();
+      start = 0;
+      return;
+    }
+
+    if (start*2 >= v.size()) {
+      v.erase(v.begin(),v.begin() + start);
+      start = 0;
+    }
+  }
+
+  static ClockInterface::TimePoint sendTime(const QueuedMessageSender &self)
+  {
+    assert(self.maybe_coalescing_options);
+    assert(self.coalescing_clock_ptr);
+    const CoalescingOptions &options = *self.maybe_coalescing_options;
+    return frontMessage(self).queue_time + options.max_delay;
+  }
+
+  static bool isHoldingMessages(const QueuedMessageSender &self)
+  {
+    if (!self.maybe_coalescing_options) {
+      return false;
+    }
+
+    if (!hasQueuedMessages(self)) {
+      return false;
+    }
+
+    if (self.n_released_messages != 0) {
+      return false;
+    }
+
+    if (self.n_bytes_queued >= self.maybe_coalescing_options->max_bytes) {
+      return false;
+    }
+
+    return self.coalescing_clock_ptr->now() < sendTime(self);
+  }
+
+  // The number of bytes at the start of the send buffer which can be sent
+  // before reaching a message which isn't buffered.
+  static size_t nBufferedBytesToSend(const QueuedMessageSender &self)
+  {
+    if (self.n_unbuffered_messages == 0) {
+      return self.send_buffer.size() - self.send_buffer_start;
+    }
+
+    size_t n_bytes = 0;
+    size_t n_messages = self.message_queue.size();
+
+    for (size_t i=self.message_queue_start; i!=n_messages; ++i) {
+      const QueuedMessage &message = self.message_queue[i];
+
+      if (!isBuffered(message)) {
+        break;
+      }
+
+      n_bytes += message.n_buffered_bytes;
+    }
+
+    return n_bytes - self.n_front_bytes_sent;
+  }
+
+  static void popMessage(QueuedMessageSender &self)
+  {
+    QueuedMessage &message = self.message_queue[self.message_queue_start];
+
+    if (!isBuffered(message)) {
+      --self.n_unbuffered_messages;
+    }
+
+    if (self.n_released_messages != 0) {
+      --self.n_released_messages;
+    }
+
+    if (!message.is_control) {
+      ++self.n_messages_sent;
+    }
+
+    // Release any shared message now rather than when the vector is
+    // compacted.
+    message = QueuedMessage();
+    ++self.message_queue_start;
+    removeFront(self.message_queue,self.message_queue_start);
+  }
+
+  static void bufferedBytesSent(QueuedMessageSender &self,size_t n_bytes)
+  {
+    self.send_buffer_start += n_bytes;
+    self.n_bytes_queued -= n_bytes;
+    self.n_front_bytes_sent += n_bytes;
+
+    while (hasQueuedMessages(self)) {
+      const QueuedMessage &message = frontMessage(self);
+
+      if (!isBuffered(message)) {
+        break;
+      }
+
+      if (self.n_front_bytes_sent < message.n_buffered_bytes) {
+        break;
+      }
+
+      self.n_front_bytes_sent -= message.n_buffered_bytes;
+      popMessage(self);
+    }
+
+    assert(self.n_front_bytes_sent == 0 || hasQueuedMessages(self));
+    removeFront(self.send_buffer,self.send_buffer_start);
+  }
+
+  static int
+    sendBufferedBytes(
+      QueuedMessageSender &self,
+      SocketsInterface &sockets,
+      SocketsInterface::SocketId socket_id
+    )
+  {
+    int send_result =
+      sockets.send(
+        socket_id,
+        self.send_buffer.data() + self.send_buffer_start,
+        nBufferedBytesToSend(self)
+      );
+
+    if (send_result > 0) {
+      bufferedBytesSent(self,send_result);
+    }
+
+    return send_result;
+  }
+
+  static void setupUnbufferedMessage(QueuedMessageSender &self)
+  {
+    const QueuedMessage &message = frontMessage(self);
+    const std::vector<char> &bytes = *message.shared_message;
+    bool use_zero_copy = shouldUseZeroCopy(self,bytes.size());
+
+    self.message_sender.queueMessage(
+      bytes.data(), bytes.size(), use_zero_copy
+    );
+
+    if (message.maybe_file_region) {
+      self.message_sender.queueFileRegion(*message.maybe_file_region);
+    }
+
+    self.n_zero_copy_sends_before_message =
+      self.message_sender.nZeroCopySends();
+  }
+
+  static void finishUnbufferedMessage(QueuedMessageSender &self)
+  {
+    uint32_t n_zero_copy_sends = self.message_sender.nZeroCopySends();
+
+    if (n_zero_copy_sends != self.n_zero_copy_sends_before_message) {
+      // The kernel may still be using the message, so keep it until we
+      // get a completion for its last send.
+      ZeroCopyMessage zero_copy_message;
+      zero_copy_message.message = frontMessage(self).shared_message;
+      zero_copy_message.last_send_id = n_zero_copy_sends - 1;
+      self.zero_copy_queue.push_back(std::move(zero_copy_message));
+    }
+
+    self.n_bytes_queued -= messageSize(frontMessage(self));
+    popMessage(self);
+  }
+
+  static int
+    sendUnbufferedMessage(
+      QueuedMessageSender &self,
+      SocketsInterface &sockets,
+      SocketsInterface::SocketId socket_id
+    )
+  {
+    if (!self.message_sender.messageIsBeingSent()) {
+      setupUnbufferedMessage(self);
+    }
+
+    int send_result =
+      self.message_sender.sendMoreOfTheMessage(sockets,socket_id);
+
+    if (send_result > 0 && !self.message_sender.messageIsBeingSent()) {
+      finishUnbufferedMessage(self);
+    }
+
+    return send_result;
+  }
+
+  // Returns the result of the send.
+  static int
+    sendMore(
+      QueuedMessageSender &self,
+      SocketsInterface &sockets,
+      SocketsInterface::SocketId socket_id
+    )
+  {
+    if (isBuffered(frontMessage(self))) {
+      return sendBufferedBytes(self,sockets,socket_id);
+    }
+
+    return sendUnbufferedMessage(self,sockets,socket_id);
+  }
+
+  static bool sendIsComplete(const QueuedMessageSender &self,uint32_t send_id)
+  {
+    // Compare in a way which allows for the send ids wrapping around.
+    return int32_t(self.n_zero_copy_sends_completed - send_id) > 0;
+  }
+
+  // Sends only count as completed once every send before them has too.
+  static void
+    addZeroCopyCompletion(
+      QueuedMessageSender &self,
+      const SocketsInterface::ZeroCopyCompletion &completion
+    )
+  {
+    std::vector<SocketsInterface::ZeroCopyCompletion> &pending =
+      self.pending_zero_copy_completions;
+
+    if (!sendIsComplete(self,completion.first_send_id - 1)) {
+      pending.push_back(completion);
+      return;
+    }
+
+    advanceCompletedSends(self,completion);
+    bool advanced = true;
+
+    while (advanced) {
+      advanced = false;
+
+      for (size_t i=0; i!=pending.size(); ++i) {
+        if (sendIsComplete(self,pending[i].first_send_id - 1)) {
+          advanceCompletedSends(self,pending[i]);
+          pending[i] = pending.back();
+          pending.pop_back();
+          advanced = true;
+          break;
+        }
+      }
+    }
+  }
+
+  static void
+    advanceCompletedSends(
+      QueuedMessageSender &self,
+      const SocketsInterface::ZeroCopyCompletion &completion
+    )
+  {
+    // The range may overlap sends which have already completed.
+    if (!sendIsComplete(self,completion.last_send_id)) {
+      self.n_zero_copy_sends_completed = completion.last_send_id + 1;
+    }
+  }
+
+  static void releaseCompletedMessages(QueuedMessageSender &self)
+  {
+    std::vector<ZeroCopyMessage> &queue = self.zero_copy_queue;
+    size_t &start = self.zero_copy_queue_start;
+
+    while (
+      start != queue.size() && sendIsComplete(self,queue[start].last_send_id)
+    ) {
+      queue[start] = ZeroCopyMessage();
+      ++start;
+    }
+
+    removeFront(queue,start);
+  }
+
+  static void queue(QueuedMessageSender &self,QueuedMessage &&message)
+  {
+    if (self.maybe_coalescing_options) {
+      message.queue_time = self.coalescing_clock_ptr->now();
+    }
+
+    if (!isBuffered(message)) {
+      ++self.n_unbuffered_messages;
+    }
+
+    self.n_bytes_queued += messageSize(message);
+    self.message_queue.push_back(std::move(message));
+  }
+
+  // Control messages are just a header, and go straight into the send
+  // buffer without waiting in a lane.
+  static void
+    queueControlMessage(QueuedMessageSender &self,uint32_t header_value)
+  {
+    size_t old_size = self.send_buffer.size();
+    self.send_buffer.resize(old_size + message_header_size);
+    encodeHeaderValue(self.send_buffer.data() + old_size,header_value);
+    QueuedMessage queued_message;
+    queued_message.n_buffered_bytes = message_header_size;
+    queued_message.is_control = true;
+    queue(self,std::move(queued_message));
+  }
+
+  static SharedMessage makeSharedHeader(size_t payload_size)
+  {
+    auto bytes_ptr = std::make_shared<std::vector<char>>(message_header_size);
+    encodeMessageHeader(bytes_ptr->data(), payload_size);
+    return bytes_ptr;
+  }
+
+  static void
+    appendFrame(
+      std::vector<char> &buffer,
+      const char *payload,
+      size_t payload_size,
+      bool is_compressed
+    )
+  {
+    size_t old_size = buffer.size();
+    buffer.resize(old_size + message_header_size + payload_size);
+    char *bytes = buffer.data() + old_size;
+    encodeMessageHeader(bytes, payload_size, is_compressed);
+    memcpy(bytes + message_header_size, payload, payload_size);
+  }
+
+  static void
+    queueFrame(
+      QueuedMessageSender &self,
+      const char *payload,
+      size_t payload_size,
+      bool is_compressed,
+      Lane lane
+    )
+  {
+    size_t n_bytes = message_header_size + payload_size;
+
+    if (shouldUseZeroCopy(self,n_bytes)) {
+      // The kernel keeps using the message after the send, so it can't be
+      // in the send buffer where it might be moved.
+      SharedMessage message =
+        makeSharedFrame(payload,payload_size,is_compressed);
+
+      self.queueSharedMessage(message,lane);
+      return;
+    }
+
+    QueuedMessage queued_message;
+    queued_message.n_buffered_bytes = n_bytes;
+
+    if (self.maybe_lane_options) {
+      std::vector<char> &lane_buffer = laneQueue(self,lane).buffer;
+      appendFrame(lane_buffer,payload,payload_size,is_compressed);
+      queueOnLane(self,lane,std::move(queued_message));
+      return;
+    }
+
+    assert(lane == 0);
+    appendFrame(self.send_buffer,payload,payload_size,is_compressed);
+    queue(self,std::move(queued_message));
+  }
+
+  // Leaves the payload of the compressed message in compressed_payload if
+  // the message should be sent compressed.
+  static bool
+    compressMessage(
+      QueuedMessageSender &self,
+      const char *message,
+      size_t message_size
+    )
+  {
+    if (!self.maybe_compression_options) {
+      return false;
+    }
+
+    if (message_size < self.maybe_compression_options->min_message_size) {
+      return false;
+    }
+
+    std::vector<char> &payload = self.compressed_payload;
+    payload.resize(original_size_size);
+    encodeHeaderValue(payload.data(),message_size);
+    self.compressor.compress(message,message_size,payload);
+
+    if (payload.size() >= message_size) {
+      return false;
+    }
+
+    CompressionStats &stats = self.compression_stats;
+    ++stats.n_compressed_messages;
+    stats.n_original_bytes += message_size;
+    stats.n_compressed_bytes += payload.size();
+    return true;
+  }
+
+  static bool hasMessages(const LaneQueue &lane)
+  {
+    return lane.messages_start != lane.messages.size();
+  }
+
+  static LaneQueue &laneQueue(QueuedMessageSender &self,Lane lane)
+  {
+    assert(lane >= 0 && size_t(lane) < self.lanes.size());
+    return self.lanes[lane];
+  }
+
+  static void
+    queueOnLane(
+      QueuedMessageSender &self,
+      Lane lane,
+      QueuedMessage &&message
+    )
+  {
+    laneQueue(self,lane).messages.push_back(std::move(message));
+    ++self.n_lane_messages;
+    commitLaneMessages(self);
+  }
+
+  static std::optional<Lane> nextStrictPriorityLane(QueuedMessageSender &self)
+  {
+    Lane n_lanes = self.lanes.size();
+
+    for (Lane lane=0; lane!=n_lanes; ++lane) {
+      if (hasMessages(self.lanes[lane])) {
+        return lane;
+      }
+    }
+
+    return std::nullopt;
+  }
+
+  // Deficit round robin: a lane can send its front message once the
+  // weights it has collected on its turns add up to the message size.
+  static std::optional<Lane> nextRoundRobinLane(QueuedMessageSender &self)
+  {
+    if (self.n_lane_messages == 0) {
+      return std::nullopt;
+    }
+
+    const std::vector<size_t> &weights = self.maybe_lane_options->weights;
+    Lane n_lanes = self.lanes.size();
+
+    for (;;) {
+      LaneQueue &lane = self.lanes[self.current_lane];
+
+      if (!hasMessages(lane)) {
+        // Lanes don't save up their turns while they are idle.
+        lane.deficit = 0;
+      }
+      else {
+        const QueuedMessage &message = lane.messages[lane.messages_start];
+        size_t message_size = messageSize(message);
+
+        if (lane.deficit >= message_size) {
+          lane.deficit -= message_size;
+          return self.current_lane;
+        }
+      }
+
+      self.current_lane = (self.current_lane + 1) % n_lanes;
+      self.lanes[self.current_lane].deficit += weights[self.current_lane];
+    }
+  }
+
+  static std::optional<Lane> nextLane(QueuedMessageSender &self)
+  {
+    assert(self.maybe_lane_options);
+
+    switch (self.maybe_lane_options->policy) {
+      case LaneOptions::Policy::strict_priority:
+        return nextStrictPriorityLane(self);
+      case LaneOptions::Policy::weighted_round_robin:
+        return nextRoundRobinLane(self);
+    }
+
+    assert(false);
+    return std::nullopt;
+  }
+
+  // Move the front message of the lane to the end of the message queue.
+  static void commitFrontMessage(QueuedMessageSender &self,LaneQueue &lane)
+  {
+    QueuedMessage message = std::move(lane.messages[lane.messages_start]);
+    lane.messages[lane.messages_start] = QueuedMessage();
+    ++lane.messages_start;
+    --self.n_lane_messages;
+    removeFront(lane.messages,lane.messages_start);
+
+    if (isBuffered(message)) {
+      const char *bytes = lane.buffer.data() + lane.buffer_start;
+      self.send_buffer.insert(
+        self.send_buffer.end(), bytes, bytes + message.n_buffered_bytes
+      );
+      lane.buffer_start += message.n_buffered_bytes;
+      removeFront(lane.buffer,lane.buffer_start);
+    }
+
+    queue(self,std::move(message));
+  }
+
+  static void commitLaneMessages(QueuedMessageSender &self)
+  {
+    if (!self.maybe_lane_options) {
+      return;
+    }
+
+    size_t max_committed_bytes = self.maybe_lane_options->max_committed_bytes;
+
+    while (self.n_bytes_queued < max_committed_bytes) {
+      if (self.maybe_send_credit && *self.maybe_send_credit == 0) {
+        if (self.n_lane_messages != 0) {
+          startStall(self);
+        }
+
+        break;
+      }
+
+      std::optional<Lane> maybe_lane = nextLane(self);
+
+      if (!maybe_lane) {
+        break;
+      }
+
+      if (self.maybe_send_credit) {
+        --*self.maybe_send_credit;
+      }
+
+      commitFrontMessage(self,self.lanes[*maybe_lane]);
+    }
+  }
+
+  static void startStall(QueuedMessageSender &self)
+  {
+    if (self.maybe_stall_start) {
+      return;
+    }
+
+    self.maybe_stall_start = self.flow_control_clock_ptr->now();
+    ++self.flow_control_stats.n_stalls;
+  }
+
+  static void endStall(QueuedMessageSender &self)
+  {
+    if (!self.maybe_stall_start) {
+      return;
+    }
+
+    self.flow_control_stats.stalled_time +=
+      self.flow_control_clock_ptr->now() - *self.maybe_stall_start;
+
+    self.maybe_stall_start.reset();
+  }
+
+  static void
+    queueUnbuffered(
+      QueuedMessageSender &self,
+      QueuedMessage &&message,
+      Lane lane
+    )
+  {
+    if (self.maybe_lane_options) {
+      queueOnLane(self,lane,std::move(message));
+    }
+    else {
+      assert(lane == 0);
+      queue(self,std::move(message));
+    }
+  }
+};
+
+
+bool QueuedMessageSender::isSendingAMessage() const
+{
+  return
+    Impl::hasQueuedMessages(*this) ||
+    n_lane_messages != 0 ||
+    zero_copy_queue_start != zero_copy_queue.size();
+}
+
+
+bool QueuedMessageSender::hasMessageToSend() const
+{
+  return Impl::hasQueuedMessages(*this) && !Impl::isHoldingMessages(*this);
+}
+
+
+std::optional<std::chrono::microseconds>
+  QueuedMessageSender::maybeTimeUntilSending() const
+{
+  if (!Impl::isHoldingMessages(*this)) {
+    return std::nullopt;
+  }
+
+  ClockInterface::Duration time_left =
+    Impl::sendTime(*this) - coalescing_clock_ptr->now();
+
+  return std::chrono::ceil<std::chrono::microseconds>(time_left);
+}
+
+
+bool
+  QueuedMessageSender::handleSendingMessage(
+    SocketsInterface &sockets,
+    SocketsInterface::SocketId socket_id,
+    const PostSelectParamsInterface &post_select_params
+  )
+{
+  assert(hasMessageToSend());
+
+  bool can_send = post_select_params.writeIsSet(socket_id);
+
+  if (!can_send) {
+    return true;
+  }
+
+  if (n_released_messages == 0) {
+    // Everything queued so far goes out without being held back again.
+    n_released_messages = Impl::nQueuedMessages(*this);
+  }
+
+  size_t n_bytes_sent = 0;
+
+  for (;;) {
+    int send_result = Impl::sendMore(*this,sockets,socket_id);
+    IoStatus status = ioStatus(send_result);
+
+    if (status == IoStatus::interrupted) {
+      continue;
+    }
+
+    if (status == IoStatus::would_block) {
+      return true;
+    }
+
+    if (status != IoStatus::transferred) {
+      return false;
+    }
+
+    // Sending made room for messages from the lanes.
+    Impl::commitLaneMessages(*this);
+
+    if (!maybe_drain_budget) {
+      return true;
+    }
+
+    n_bytes_sent += send_result;
+
+    if (n_bytes_sent >= *maybe_drain_budget || !hasMessageToSend()) {
+      return true;
+    }
+  }
+}
+
+
+bool
+  QueuedMessageSender::handleZeroCopyCompletions(
+    SocketsInterface &sockets,
+    SocketsInterface::SocketId socket_id,
+    const PostSelectParamsInterface &post_select_params
+  )
+{
+  if (!maybe_zero_copy_threshold) {
+    return false;
+  }
+
+  if (!post_select_params.readIsSet(socket_id)) {
+    return false;
+  }
+
+  bool got_completions = false;
+
+  while (
+    std::optional<SocketsInterface::ZeroCopyCompletion> maybe_completion =
+      sockets.readZeroCopyCompletion(socket_id)
+  ) {
+    Impl::addZeroCopyCompletion(*this,*maybe_completion);
+    got_completions = true;
+  }
+
+  Impl::releaseCompletedMessages(*this);
+  return got_completions;
+}
+
+
+void
+  QueuedMessageSender::queueMessage(
+    const char *message,
+    int message_size,
+    Lane lane
+  )
+{
+  // Compressing as the message is queued keeps the work out of
+  // handleSelect(), where it would hold up every other connection.
+  if (Impl::compressMessage(*this,message,message_size)) {
+    const char *payload = compressed_payload.data();
+    size_t payload_size = compressed_payload.size();
+    Impl::queueFrame(*this,payload,payload_size,/*is_compressed*/true,lane);
+    return;
+  }
+
+  Impl::queueFrame(*this,message,message_size,/*is_compressed*/false,lane);
+}
+
+
+void
+  QueuedMessageSender::queueSharedMessage(
+    const SharedMessage &message,
+    Lane lane
+  )
+{
+  assert(message);
+  QueuedMessage queued_message;
+  queued_message.shared_message = message;
+  Impl::queueUnbuffered(*this,std::move(queued_message),lane);
+}
+
+
+void
+  QueuedMessageSender::queueFile(
+    int file_descriptor,
+    off_t offset,
+    size_t length,
+    Lane lane
+  )
+{
+  QueuedMessage queued_message;
+  queued_message.shared_message = Impl::makeSharedHeader(length);
+  queued_message.maybe_file_region =
+    MessageSender::FileRegion{file_descriptor,offset,length};
+  Impl::queueUnbuffered(*this,std::move(queued_message),lane);
+}
+
+
+void QueuedMessageSender::enableZeroCopy(size_t minimum_message_size)
+{
+  maybe_zero_copy_threshold = minimum_message_size;
+}
+
+
+void
+  QueuedMessageSender::enableCoalescing(
+    const ClockInterface &clock,
+    const CoalescingOptions &options
+  )
+{
+  coalescing_clock_ptr = &clock;
+  maybe_coalescing_options = options;
+
+  // Messages which were already queued are treated as if they were
+  // queued now.
+  for (size_t i=message_queue_start; i!=message_queue.size(); ++i) {
+    message_queue[i].queue_time = clock.now();
+  }
+}
+
+
+void QueuedMessageSender::enableDraining(size_t max_bytes)
+{
+  maybe_drain_budget = max_bytes;
+}
+
+
+void QueuedMessageSender::enableLanes(const LaneOptions &options)
+{
+  assert(n_lane_messages == 0);
+  assert(!options.weights.empty());
+  assert(options.max_committed_bytes > 0);
+
+  for (size_t weight : options.weights) {
+    assert(weight > 0);
+  }
+
+  maybe_lane_options = options;
+  lanes.assign(options.weights.size(),LaneQueue());
+  current_lane = 0;
+}
+
+
+void QueuedMessageSender::enableFlowControl(const ClockInterface &clock)
+{
+  if (!maybe_lane_options) {
+    // Messages wait for credit in a lane.
+    LaneOptions options;
+    options.weights = {1};
+    options.max_committed_bytes = SIZE_MAX;
+    enableLanes(options);
+  }
+
+  flow_control_clock_ptr = &clock;
+  maybe_send_credit = 0;
+}
+
+
+void QueuedMessageSender::addCredit(uint32_t n_messages)
+{
+  if (!maybe_send_credit) {
+    // We aren't using flow control, so we don't need it.
+    return;
+  }
+
+  *maybe_send_credit += n_messages;
+  Impl::endStall(*this);
+  Impl::commitLaneMessages(*this);
+}
+
+
+void QueuedMessageSender::queueCredit(uint32_t n_messages)
+{
+  assert(n_messages != 0 && n_messages < compressed_flag);
+  Impl::queueControlMessage(*this,n_messages | credit_flag);
+}
+
+
+void QueuedMessageSender::queuePing()
+{
+  Impl::queueControlMessage(*this,ping_header_value);
+}
+
+
+void QueuedMessageSender::queuePong()
+{
+  Impl::queueControlMessage(*this,pong_header_value);
+}
+
+
+auto QueuedMessageSender::flowControlStats() const -> FlowControlStats
+{
+  FlowControlStats stats = flow_control_stats;
+
+  if (maybe_stall_start) {
+    stats.stalled_time += flow_control_clock_ptr->now() - *maybe_stall_start;
+  }
+
+  return stats;
+}
+
+
+void QueuedMessageSender::enableCompression(const CompressionOptions &options)
+{
+  maybe_compression_options = options;
+}
+
+
+void QueuedMessageSender::clear()
+{
+  std::vector<char> old_send_buffer = std::move(send_buffer);
+  std::vector<QueuedMessage> old_message_queue = std::move(message_queue);
+  *this = QueuedMessageSender();
+  old_send_buffer.clear();
+  old_message_queue.clear();
+
+  if (old_send_buffer.capacity() <= max_kept_buffer_size) {
+    send_buffer = std::move(old_send_buffer);
+  }
+
+  size_t max_kept_messages = max_kept_buffer_size / sizeof(QueuedMessage);
+
+  if (old_message_queue.capacity() <= max_kept_messages) {
+    message_queue = std::move(old_message_queue);
+  }
+}
+
+
+struct MessageServer::Client {
+  Client() = default;
+  Client(const Client &) = delete;
+  std::optional<SocketId> maybe_socket_id;
+
+  // Where the client is in connected_client_ids and sending_client_ids.
+  size_t connected_index = 0;
+  std::optional<size_t> maybe_sending_index;
+
+  MessageReceiver message_receiver;
+  QueuedMessageSender queued_message_sender;
+
+  // Messages which were delivered but not yet given back as credit.
+  uint32_t n_messages_to_credit = 0;
+
+  // Where the client is in idle_clients or pinged_clients, if idle
+  // timeouts were enabled when it connected.
+  IdleList *idle_list_ptr = nullptr;
+  std::optional<ClientId> maybe_previous_idle_client_id;
+  std::optional<ClientId> maybe_next_idle_client_id;
+  ClockInterface::TimePoint last_heard_time;
+};
+
+
+struct MessageServer::Impl {
+  struct MessageHandler : MessageReceiver::EventInterface {
+    MessageServer &server;
+    MessageServer::EventInterface &event_handler;
+    const ClientId client_id;
+
+    MessageHandler(
+      MessageServer &server_arg,
+      MessageServer::EventInterface &event_handler_arg,
+      ClientId client_id_arg
+    )
+    : server(server_arg),
+      event_handler(event_handler_arg),
+      client_id(client_id_arg)
+    {
+    }
+
+    void gotMessage(const char *message,size_t message_size) override
+    {
+      event_handler.gotMessage(client_id,message,message_size);
+      const auto &maybe_options = server.maybe_flow_control_options;
+
+      if (maybe_options && maybe_options->grant_on_delivery) {
+        messagesWereHandled(server,client_id,1);
+      }
+    }
+
+    void gotCredit(uint32_t n_messages) override
+    {
+      Client &client = server.clients[client_id];
+      client.queued_message_sender.addCredit(n_messages);
+    }
+
+    void gotPing() override
+    {
+      Client &client = server.clients[client_id];
+      client.queued_message_sender.queuePong();
+      addSendingClient(server,client_id);
+    }
+  };
+
+  static bool isListening(const MessageServer &self)
+  {
+    return self.maybe_listen_socket_id.has_value();
+  }
+
+  static void addConnectedClient(MessageServer &self,ClientId client_id)
+  {
+    Client &client = self.clients[client_id];
+    assert(client.maybe_socket_id);
+    client.connected_index = self.connected_client_ids.size();
+    self.connected_client_ids.push_back(client_id);
+    self.connected_socket_ids.push_back(*client.maybe_socket_id);
+    SocketId socket_id = *client.maybe_socket_id;
+    assert(socket_id >= 0);
+
+    if (size_t(socket_id) >= self.socket_client_ids.size()) {
+      self.socket_client_ids.resize(socket_id + 1);
+    }
+
+    self.socket_client_ids[socket_id] = client_id;
+  }
+
+  static void removeConnectedClient(MessageServer &self,ClientId client_id)
   {
-    return self.message_size - self.n_bytes_sent;
+    Client &client = self.clients[client_id];
+    assert(client.maybe_socket_id);
+    self.socket_client_ids[*client.maybe_socket_id].reset();
+
+    // Move the last client into the removed one's place.
+    size_t index = client.connected_index;
+    ClientId last_client_id = self.connected_client_ids.back();
+    self.connected_client_ids[index] = last_client_id;
+    self.connected_socket_ids[index] = self.connected_socket_ids.back();
+    self.clients[last_client_id].connected_index = index;
+    self.connected_client_ids.pop_back();
+    self.connected_socket_ids.pop_back();
   }
 
-  static void chunkSent(MessageSender &self,size_t n)
+  static void addSendingClient(MessageServer &self,ClientId client_id)
   {
-    assert(n <= chunkSize(self));
-    self.n_bytes_sent += n;
-    assert(self.n_bytes_sent <= self.message_size);
-  }
-};
+    Client &client = self.clients[client_id];
 
+    if (!client.maybe_sending_index) {
+      client.maybe_sending_index = self.sending_client_ids.size();
+      self.sending_client_ids.push_back(client_id);
+    }
+  }
 
-void MessageSender::queueMessage(const char *message_arg, int message_size_arg)
-{
-  assert(!message_being_sent);
-  message_being_sent = message_arg;
-  message_size = message_size_arg;
-  n_bytes_sent = 0;
-}
+  static void removeSendingClient(MessageServer &self,ClientId client_id)
+  {
+    Client &client = self.clients[client_id];
 
+    if (!client.maybe_sending_index) {
+      return;
+    }
 
-bool
-  MessageSender::sendMoreOfTheMessage(
-    SocketsInterface &sockets,
-    const SocketId client_socket_id
-  )
-{
-  const char *chunk_start = Impl::chunkStart(*this);
-  size_t chunk_size = Impl::chunkSize(*this);
+    size_t index = *client.maybe_sending_index;
+    ClientId last_client_id = self.sending_client_ids.back();
+    self.sending_client_ids[index] = last_client_id;
+    self.clients[last_client_id].maybe_sending_index = index;
+    self.sending_client_ids.pop_back();
+    client.maybe_sending_index.reset();
+  }
 
-  int send_result = sockets.send(client_socket_id,chunk_start,chunk_size);
+  static void
+    appendIdleClient(MessageServer &self,ClientId client_id,IdleList &list)
+  {
+    Client &client = self.clients[client_id];
+    assert(!client.idle_list_ptr);
+    client.maybe_previous_idle_client_id = list.maybe_last_client_id;
+    client.maybe_next_idle_client_id.reset();
+
+    if (list.maybe_last_client_id) {
+      self.clients[*list.maybe_last_client_id].maybe_next_idle_client_id =
+        client_id;
+    }
+    else {
+      list.maybe_first_client_id = client_id;
+    }
 
-  if (send_result <= 0) {
-    return false;
+    list.maybe_last_client_id = client_id;
+    client.idle_list_ptr = &list;
   }
 
-  size_t n_bytes_sent = send_result;
+  static void removeIdleClient(MessageServer &self,ClientId client_id)
+  {
+    Client &client = self.clients[client_id];
+    assert(client.idle_list_ptr);
+    IdleList &list = *client.idle_list_ptr;
+    std::optional<ClientId> maybe_previous_id =
+      client.maybe_previous_idle_client_id;
+    std::optional<ClientId> maybe_next_id = client.maybe_next_idle_client_id;
+
+    if (maybe_previous_id) {
+      self.clients[*maybe_previous_id].maybe_next_idle_client_id =
+        maybe_next_id;
+    }
+    else {
+      list.maybe_first_client_id = maybe_next_id;
+    }
 
-  Impl::chunkSent(*this,n_bytes_sent);
+    if (maybe_next_id) {
+      self.clients[*maybe_next_id].maybe_previous_idle_client_id =
+        maybe_previous_id;
+    }
+    else {
+      list.maybe_last_client_id = maybe_previous_id;
+    }
 
-  if (Impl::nBytesSent(*this) == Impl::messageSize(*this)) {
-    Impl::reset(*this);
+    client.idle_list_ptr = nullptr;
+    client.maybe_previous_idle_client_id.reset();
+    client.maybe_next_idle_client_id.reset();
   }
 
-  return true;
-}
+  static void heardFromClient(MessageServer &self,ClientId client_id)
+  {
+    Client &client = self.clients[client_id];
 
+    if (!client.idle_list_ptr) {
+      // The client connected before idle timeouts were enabled.
+      return;
+    }
 
-struct QueuedMessageSender::Impl {
-  static void setupNextMessage(QueuedMessageSender &self)
-  {
-    std::vector<char> &message = self.message_queue.front();
-    self.message_sender.queueMessage(message.data(), message.size());
+    removeIdleClient(self,client_id);
+    client.last_heard_time = self.idle_clock_ptr->now();
+    appendIdleClient(self,client_id,self.idle_clients);
   }
-};
 
+  // The time at which the first client in the list is due to be pinged or
+  // disconnected.
+  static std::optional<ClockInterface::TimePoint>
+    maybeIdleDeadline(const MessageServer &self,const IdleList &list)
+  {
+    if (!list.maybe_first_client_id) {
+      return std::nullopt;
+    }
 
-bool
-  QueuedMessageSender::handleSendingMessage(
-    SocketsInterface &sockets,
-    SocketsInterface::SocketId socket_id,
-    const PostSelectParamsInterface &post_select_params
-  )
-{
-  assert(message_sender.messageIsBeingSent());
+    const IdleTimeoutOptions &options = *self.maybe_idle_timeout_options;
+    std::chrono::microseconds time_limit = options.timeout;
 
-  bool can_send = post_select_params.writeIsSet(socket_id);
+    if (&list == &self.idle_clients && options.maybe_ping_time) {
+      time_limit = *options.maybe_ping_time;
+    }
 
-  if (!can_send) {
-    return true;
+    const Client &client = self.clients[*list.maybe_first_client_id];
+    return client.last_heard_time + time_limit;
   }
 
-  bool could_send =
-    message_sender.sendMoreOfTheMessage(sockets,socket_id);
+  static bool
+    firstIdleClientIsDue(
+      const MessageServer &self,
+      const IdleList &list,
+      ClockInterface::TimePoint now
+    )
+  {
+    std::optional<ClockInterface::TimePoint> maybe_deadline =
+      maybeIdleDeadline(self,list);
 
-  if (!could_send) {
-    return false;
+    return maybe_deadline && *maybe_deadline <= now;
   }
 
-  if (!message_sender.messageIsBeingSent()) {
-    message_queue.pop();
+  static void setupIdleTimeout(MessageServer &self,ClientId client_id)
+  {
+    if (!self.maybe_idle_timeout_options) {
+      return;
+    }
+
+    Client &client = self.clients[client_id];
+    const IdleTimeoutOptions &options = *self.maybe_idle_timeout_options;
 
-    if (!message_queue.empty()) {
-      Impl::setupNextMessage(*this);
+    if (options.maybe_keep_alive_time) {
+      self.sockets.setKeepAlive(
+        *client.maybe_socket_id,*options.maybe_keep_alive_time
+      );
     }
+
+    client.last_heard_time = self.idle_clock_ptr->now();
+    appendIdleClient(self,client_id,self.idle_clients);
   }
 
-  return true;
-}
+  static void
+    setupWaitingForIdleClients(
+      const MessageServer &self,
+      PreSelectParamsInterface &pre_select_params
+    )
+  {
+    if (!self.maybe_idle_timeout_options) {
+      return;
+    }
 
+    ClockInterface::TimePoint now = self.idle_clock_ptr->now();
 
-void QueuedMessageSender::queueMessage(const char *message,int message_size)
-{
-  message_queue.push(std::vector<char>(message,message + message_size));
+    const IdleList *list_ptrs[] = {&self.idle_clients,&self.pinged_clients};
+
+    for (const IdleList *list_ptr : list_ptrs) {
+      if (auto maybe_deadline = maybeIdleDeadline(self,*list_ptr)) {
+        ClockInterface::Duration time_left =
+          std::max(*maybe_deadline - now,ClockInterface::Duration(0));
 
-  if (!message_sender.messageIsBeingSent()) {
-    Impl::setupNextMessage(*this);
+        pre_select_params.setTimeout(
+          std::chrono::ceil<std::chrono::microseconds>(time_left)
+        );
+      }
+    }
   }
-}
 
+  static void
+    handleIdleClients(MessageServer &self,EventInterface &event_handler);
 
-struct MessageServer::Client {
-  Client() = default;
-  Client(Client &&) = default;
-  std::optional<SocketId> maybe_socket_id;
-  MessageReceiver message_receiver;
-  QueuedMessageSender queued_message_sender;
-};
+  static std::optional<ClientId>
+    maybeClientUsing(const MessageServer &self,SocketId socket_id)
+  {
+    if (socket_id < 0 || size_t(socket_id) >= self.socket_client_ids.size()) {
+      return std::nullopt;
+    }
 
+    return self.socket_client_ids[socket_id];
+  }
 
-struct MessageServer::Impl {
-  struct MessageHandler : MessageReceiver::EventInterface {
-    MessageServer::EventInterface &event_handler;
-    const ClientId client_id;
+  // Returns whether the socket was readable because of zero-copy
+  // completions, in which case it isn't read from until the next select.
+  static bool
+    handleSendingClient(
+      MessageServer &self,
+      ClientId,
+      const PostSelectParamsInterface &,
+      EventInterface &
+    );
 
-    MessageHandler(
-      MessageServer::EventInterface &event_handler_arg,
-      ClientId client_id_arg
-    )
-    : event_handler(event_handler_arg),
-      client_id(client_id_arg)
-    {
-    }
+  static void
+    handleReadyClient(
+      MessageServer &self,
+      ClientId,
+      const PostSelectParamsInterface &,
+      EventInterface &
+    );
 
-    void gotMessage(const char *message) override
-    {
-      event_handler.gotMessage(client_id,message);
+  static ClientId allocateClient(MessageServer &self)
+  {
+    if (self.free_client_ids.empty()) {
+      self.clients.emplace_back();
+      return self.clients.size() - 1;
     }
-  };
 
-  static bool isListening(const MessageServer &self)
-  {
-    return self.maybe_listen_socket_id.has_value();
+    ClientId client_id = self.free_client_ids.top();
+    self.free_client_ids.pop();
+    return client_id;
   }
 
   static void acceptConnection(MessageServer &self,EventInterface &);
@@ -270,15 +1870,18 @@ struct MessageServer::Impl {
 
   static void closeClientSockets(MessageServer &self)
   {
-    std::vector<Client> &clients = self.clients;
-    size_t n_clients = clients.size();
-
-    for (size_t i=0; i!=n_clients; ++i) {
-      if (clients[i].maybe_socket_id) {
-        self.sockets.close(*clients[i].maybe_socket_id);
-        clients[i].maybe_socket_id.reset();
-      }
+    for (ClientId client_id : self.connected_client_ids) {
+      Client &client = self.clients[client_id];
+      self.socket_client_ids[*client.maybe_socket_id].reset();
+      self.sockets.close(*client.maybe_socket_id);
+      client.maybe_socket_id.reset();
     }
+
+    self.connected_client_ids.clear();
+    self.connected_socket_ids.clear();
+    self.sending_client_ids.clear();
+    self.idle_clients = IdleList();
+    self.pinged_clients = IdleList();
   }
 
   static void closeListenSocket(MessageServer &self)
@@ -300,12 +1903,136 @@ struct MessageServer::Impl {
     return client.queued_message_sender.isSendingAMessage();
   }
 
+  static bool hasMessageToSend(const Client &client)
+  {
+    return client.queued_message_sender.hasMessageToSend();
+  }
+
+  static void setupZeroCopy(MessageServer &self,Client &client)
+  {
+    assert(client.maybe_socket_id);
+
+    if (!self.maybe_zero_copy_threshold) {
+      return;
+    }
+
+    if (self.sockets.enableZeroCopy(*client.maybe_socket_id)) {
+      client.queued_message_sender.enableZeroCopy(
+        *self.maybe_zero_copy_threshold
+      );
+    }
+  }
+
+  static void setupCoalescing(MessageServer &self,Client &client)
+  {
+    assert(client.maybe_socket_id);
+
+    if (!self.maybe_coalescing_options) {
+      return;
+    }
+
+    self.sockets.setNoDelay(*client.maybe_socket_id,true);
+
+    client.queued_message_sender.enableCoalescing(
+      *self.coalescing_clock_ptr,*self.maybe_coalescing_options
+    );
+  }
+
+  static void setupLanes(MessageServer &self,Client &client)
+  {
+    if (!self.maybe_lane_options) {
+      return;
+    }
+
+    client.queued_message_sender.enableLanes(*self.maybe_lane_options);
+  }
+
+  static void setupFlowControl(MessageServer &self,ClientId client_id)
+  {
+    if (!self.maybe_flow_control_options) {
+      return;
+    }
+
+    Client &client = self.clients[client_id];
+    QueuedMessageSender &sender = client.queued_message_sender;
+    sender.enableFlowControl(*self.flow_control_clock_ptr);
+    sender.queueCredit(self.maybe_flow_control_options->window);
+    addSendingClient(self,client_id);
+  }
+
+  // Credit is given back in batches of half a window.
+  static void
+    messagesWereHandled(
+      MessageServer &self,
+      ClientId client_id,
+      uint32_t n_messages
+    )
+  {
+    assert(self.maybe_flow_control_options);
+    Client &client = Impl::client(self,client_id);
+    client.n_messages_to_credit += n_messages;
+    uint32_t window = self.maybe_flow_control_options->window;
+
+    if (client.n_messages_to_credit*2 < window) {
+      return;
+    }
+
+    client.queued_message_sender.queueCredit(client.n_messages_to_credit);
+    client.n_messages_to_credit = 0;
+    addSendingClient(self,client_id);
+  }
+
+  static void setupCompression(MessageServer &self,Client &client)
+  {
+    if (!self.maybe_compression_options) {
+      return;
+    }
+
+    QueuedMessageSender &sender = client.queued_message_sender;
+    sender.enableCompression(*self.maybe_compression_options);
+  }
+
+  static void setupDraining(MessageServer &self,Client &client)
+  {
+    if (!self.maybe_drain_budget) {
+      return;
+    }
+
+    client.queued_message_sender.enableDraining(*self.maybe_drain_budget);
+    client.message_receiver.enableDraining(*self.maybe_drain_budget);
+  }
+
+  static void setupMaxMessageSize(MessageServer &self,Client &client)
+  {
+    if (!self.maybe_max_message_size) {
+      return;
+    }
+
+    client.message_receiver.setMaxMessageSize(*self.maybe_max_message_size);
+  }
+
+  static bool
+    handleZeroCopyCompletions(
+      MessageServer &self,
+      Client &client,
+      const PostSelectParamsInterface &post_select_params
+    )
+  {
+    assert(client.maybe_socket_id);
+
+    return
+      client.queued_message_sender.handleZeroCopyCompletions(
+        self.sockets,
+        *client.maybe_socket_id,
+        post_select_params
+      );
+  }
+
   static bool isConnected(const Client &client)
   {
     return client.maybe_socket_id.has_value();
   }
 
-  static void setupReceivingMessage(Client &,PreSelectParamsInterface &);
   static void setupSendingMessage(Client &,PreSelectParamsInterface &);
 
   static void
@@ -355,7 +2082,7 @@ void
     }
   }
 
-  MessageHandler message_handler{event_handler,client_id};
+  MessageHandler message_handler{self,event_handler,client_id};
 
   {
     bool could_receive =
@@ -364,6 +2091,7 @@ void
       );
 
     if (could_receive) {
+      heardFromClient(self,client_id);
       return;
     }
   }
@@ -372,55 +2100,154 @@ void
 }
 
 
-MessageServer::MessageServer(SocketsInterface &sockets_arg)
-: sockets(sockets_arg)
+MessageServer::MessageServer(SocketsInterface &sockets_arg)
+: sockets(sockets_arg)
+{
+}
+
+
+MessageServer::~MessageServer()
+{
+  Impl::closeSockets(*this);
+}
+
+
+void MessageServer::startListening(int port)
+{
+  InternetAddress server_address;
+  server_address.setPort(port);
+  startListening(server_address);
+}
+
+
+void MessageServer::startListening(const InternetAddress &server_address)
+{
+  SocketId listen_socket_id = sockets.create(server_address.family());
+  sockets.bind(listen_socket_id,server_address);
+  // With a short backlog, clients which connect at the same moment have
+  // their connections dropped and retried a second later.
+  sockets.listen(listen_socket_id,/*backlog*/SOMAXCONN);
+  maybe_listen_socket_id = listen_socket_id;
+}
+
+
+bool MessageServer::isActive() const
+{
+  if (maybe_listen_socket_id || nClients() != 0) return true;
+  return false;
+}
+
+
+void MessageServer::stopListening()
+{
+  assert(maybe_listen_socket_id);
+  sockets.close(*maybe_listen_socket_id);
+  maybe_listen_socket_id.reset();
+}
+
+
+bool MessageServer::isSendingAMessageTo(ClientId client_id) const
+{
+  return Impl::isSendingAMessage(clients[client_id]);
+}
+
+
+SocketId MessageServer::clientSocketId(ClientId client_id) const
+{
+  assert(clients[client_id].maybe_socket_id);
+  return *clients[client_id].maybe_socket_id;
+}
+
+
+void MessageServer::setZeroCopyThreshold(size_t minimum_message_size)
+{
+  maybe_zero_copy_threshold = minimum_message_size;
+}
+
+
+void
+  MessageServer::enableCoalescing(
+    const ClockInterface &clock,
+    const QueuedMessageSender::CoalescingOptions &options
+  )
+{
+  coalescing_clock_ptr = &clock;
+  maybe_coalescing_options = options;
+}
+
+
+void MessageServer::enableDraining(size_t max_bytes)
 {
+  maybe_drain_budget = max_bytes;
 }
 
 
-MessageServer::~MessageServer()
+void MessageServer::setMaxMessageSize(size_t max_size)
 {
-  Impl::closeSockets(*this);
+  maybe_max_message_size = max_size;
 }
 
 
-void MessageServer::startListening(int port)
+void
+  MessageServer::enableLanes(const QueuedMessageSender::LaneOptions &options)
 {
-  InternetAddress server_address;
-  server_address.setPort(port);
+  maybe_lane_options = options;
+}
 
-  SocketId listen_socket_id = sockets.create();
-  sockets.bind(listen_socket_id,server_address);
-  sockets.listen(listen_socket_id,/*backlog*/1);
-  maybe_listen_socket_id = listen_socket_id;
+
+void
+  MessageServer::enableFlowControl(
+    const ClockInterface &clock,
+    const QueuedMessageSender::FlowControlOptions &options
+  )
+{
+  assert(options.window > 0);
+  flow_control_clock_ptr = &clock;
+  maybe_flow_control_options = options;
 }
 
 
-bool MessageServer::isActive() const
+void MessageServer::grantCredit(ClientId client_id,uint32_t n_messages)
 {
-  if (maybe_listen_socket_id || nClients() != 0) return true;
-  return false;
+  assert(maybe_flow_control_options);
+  assert(!maybe_flow_control_options->grant_on_delivery);
+  Impl::messagesWereHandled(*this,client_id,n_messages);
 }
 
 
-void MessageServer::stopListening()
+QueuedMessageSender::FlowControlStats
+  MessageServer::flowControlStats(ClientId client_id) const
 {
-  assert(maybe_listen_socket_id);
-  sockets.close(*maybe_listen_socket_id);
-  maybe_listen_socket_id.reset();
+  assert(clients[client_id].maybe_socket_id);
+  return clients[client_id].queued_message_sender.flowControlStats();
 }
 
 
-bool MessageServer::isSendingAMessageTo(ClientId client_id) const
+void
+  MessageServer::enableCompression(
+    const QueuedMessageSender::CompressionOptions &options
+  )
 {
-  return Impl::isSendingAMessage(clients[client_id]);
+  maybe_compression_options = options;
 }
 
 
-SocketId MessageServer::clientSocketId(ClientId client_id) const
+QueuedMessageSender::CompressionStats
+  MessageServer::compressionStats(ClientId client_id) const
 {
   assert(clients[client_id].maybe_socket_id);
-  return *clients[client_id].maybe_socket_id;
+  return clients[client_id].queued_message_sender.compressionStats();
+}
+
+
+void
+  MessageServer::enableIdleTimeout(
+    const ClockInterface &clock,
+    const IdleTimeoutOptions &options
+  )
+{
+  idle_clock_ptr = &clock;
+  maybe_idle_timeout_options = options;
 }
 
 
@@ -432,24 +2259,30 @@ void
 {
   assert(self.maybe_listen_socket_id);
   const SocketId listen_socket_id = *self.maybe_listen_socket_id;
-  size_t client_index = 0;
-  vector<Client> &clients = self.clients;
-  size_t n_clients = clients.size();
-
-  for (;;) {
-    if (client_index >= n_clients) {
-      clients.emplace_back();
-    }
-
-    if (!clients[client_index].maybe_socket_id) {
-      clients[client_index].maybe_socket_id =
-        self.sockets.accept(listen_socket_id);
-      event_handler.clientConnected(client_index);
-      return;
-    }
+  SocketId socket_id = self.sockets.accept(listen_socket_id);
 
-    ++client_index;
+  if (socket_id < 0) {
+    // The connection went away before we got to it, or we are out of
+    // descriptors.  Either way, there is no client.
+    return;
   }
+
+  // Sends to one client shouldn't block the others.
+  self.sockets.setNonBlocking(socket_id,true);
+
+  ClientId client_id = allocateClient(self);
+  Client &client = self.clients[client_id];
+  client.maybe_socket_id = socket_id;
+  addConnectedClient(self,client_id);
+  setupZeroCopy(self,client);
+  setupCoalescing(self,client);
+  setupDraining(self,client);
+  setupMaxMessageSize(self,client);
+  setupLanes(self,client);
+  setupFlowControl(self,client_id);
+  setupCompression(self,client);
+  setupIdleTimeout(self,client_id);
+  event_handler.clientConnected(client_id);
 }
 
 
@@ -487,24 +2320,12 @@ void
     PreSelectParamsInterface &pre_select_params
   )
 {
-  assert(isSendingAMessage(client));
+  assert(hasMessageToSend(client));
   assert(client.maybe_socket_id);
   pre_select_params.setWrite(*client.maybe_socket_id);
 }
 
 
-void
-  MessageServer::Impl::setupReceivingMessage(
-    Client &client,
-    PreSelectParamsInterface &pre_select_params
-  )
-{
-  assert(client.maybe_socket_id);
-  const SocketId server_socket_id = *client.maybe_socket_id;
-  pre_select_params.setRead(server_socket_id);
-}
-
-
 MessageServer::Client &
   MessageServer::Impl::client(MessageServer &self,ClientId client_id)
 {
@@ -521,8 +2342,19 @@ void
   )
 {
   Client &client = Impl::client(self,client_id);
+  removeConnectedClient(self,client_id);
+  removeSendingClient(self,client_id);
+
+  if (client.idle_list_ptr) {
+    removeIdleClient(self,client_id);
+  }
+
   self.sockets.close(*client.maybe_socket_id);
   client.maybe_socket_id.reset();
+  client.queued_message_sender.clear();
+  client.message_receiver.clear();
+  client.n_messages_to_credit = 0;
+  self.free_client_ids.push(client_id);
   event_handler.clientDisconnected(client_id);
 }
 
@@ -551,15 +2383,23 @@ void MessageServer::setupSelect(PreSelectParamsInterface &pre_select_params)
     Impl::setupWaitingForConnection(*this,pre_select_params);
   }
 
-  for (Client &client : clients) {
-    if (Impl::isConnected(client)) {
-      if (Impl::isSendingAMessage(client)) {
-        Impl::setupSendingMessage(client,pre_select_params);
-      }
+  for (SocketId socket_id : connected_socket_ids) {
+    pre_select_params.setRead(socket_id);
+  }
 
-      Impl::setupReceivingMessage(client,pre_select_params);
+  for (ClientId client_id : sending_client_ids) {
+    Client &client = clients[client_id];
+    QueuedMessageSender &sender = client.queued_message_sender;
+
+    if (sender.hasMessageToSend()) {
+      Impl::setupSendingMessage(client,pre_select_params);
+    }
+    else if (auto maybe_time_left = sender.maybeTimeUntilSending()) {
+      pre_select_params.setTimeout(*maybe_time_left);
     }
   }
+
+  Impl::setupWaitingForIdleClients(*this,pre_select_params);
 }
 
 
@@ -567,53 +2407,163 @@ void
   MessageServer::queueMessageToClient(
     ClientId client_id,
     const char *message,
-    int message_size
+    int message_size,
+    QueuedMessageSender::Lane lane
+  )
+{
+  Client &client = MessageServer::Impl::client(*this,client_id);
+  client.queued_message_sender.queueMessage(message,message_size,lane);
+  Impl::addSendingClient(*this,client_id);
+}
+
+
+void
+  MessageServer::queueSharedMessageToClient(
+    ClientId client_id,
+    const SharedMessage &message,
+    QueuedMessageSender::Lane lane
+  )
+{
+  Client &client = MessageServer::Impl::client(*this,client_id);
+  client.queued_message_sender.queueSharedMessage(message,lane);
+  Impl::addSendingClient(*this,client_id);
+}
+
+
+void
+  MessageServer::queueFileToClient(
+    ClientId client_id,
+    int file_descriptor,
+    off_t offset,
+    size_t length
   )
 {
   Client &client = MessageServer::Impl::client(*this,client_id);
-  client.queued_message_sender.queueMessage(message,message_size);
+  client.queued_message_sender.queueFile(file_descriptor,offset,length);
+  Impl::addSendingClient(*this,client_id);
 }
 
 
 
 vector<MessageServer::ClientId> MessageServer::clientIds() const
 {
-  vector<ClientId> client_ids;
-  size_t n = clients.size();
+  vector<ClientId> client_ids = connected_client_ids;
+  std::sort(client_ids.begin(),client_ids.end());
+  return client_ids;
+}
+
+
+void
+  MessageServer::Impl::handleIdleClients(
+    MessageServer &self,
+    EventInterface &event_handler
+  )
+{
+  if (!self.maybe_idle_timeout_options) {
+    return;
+  }
 
-  for (size_t i=0; i!=n; ++i) {
-    if (Impl::isConnected(clients[i])) {
-      client_ids.push_back(i);
+  const IdleTimeoutOptions &options = *self.maybe_idle_timeout_options;
+  ClockInterface::TimePoint now = self.idle_clock_ptr->now();
+
+  while (firstIdleClientIsDue(self,self.idle_clients,now)) {
+    ClientId client_id = *self.idle_clients.maybe_first_client_id;
+
+    if (!options.maybe_ping_time) {
+      disconnectClient(self,client_id,event_handler);
+      continue;
     }
+
+    removeIdleClient(self,client_id);
+    appendIdleClient(self,client_id,self.pinged_clients);
+    self.clients[client_id].queued_message_sender.queuePing();
+    addSendingClient(self,client_id);
   }
 
-  return client_ids;
+  while (firstIdleClientIsDue(self,self.pinged_clients,now)) {
+    ClientId client_id = *self.pinged_clients.maybe_first_client_id;
+    disconnectClient(self,client_id,event_handler);
+  }
 }
 
 
-void
-  MessageServer::handleSelect(
+bool
+  MessageServer::Impl::handleSendingClient(
+    MessageServer &self,
+    ClientId client_id,
     const PostSelectParamsInterface &post_select_params,
     EventInterface &event_handler
   )
 {
-  size_t n = clients.size();
+  Client &client = self.clients[client_id];
+  bool got_completions =
+    handleZeroCopyCompletions(self,client,post_select_params);
 
-  for (size_t i=0; i!=n; ++i) {
-    Client &client = clients[i];
+  if (!got_completions && hasMessageToSend(client)) {
+    bool could_send = handleSendingMessage(self,client,post_select_params);
+
+    if (!could_send) {
+      disconnectClient(self,client_id,event_handler);
+      return false;
+    }
+  }
 
-    if (Impl::isSendingAMessage(client)) {
-      bool could_send =
-        Impl::handleSendingMessage(*this,client,post_select_params);
+  if (!isSendingAMessage(client)) {
+    removeSendingClient(self,client_id);
+  }
 
-      if (!could_send) {
-        Impl::disconnectClient(*this,i,event_handler);
-      }
+  return got_completions;
+}
+
+
+void
+  MessageServer::Impl::handleReadyClient(
+    MessageServer &self,
+    ClientId client_id,
+    const PostSelectParamsInterface &post_select_params,
+    EventInterface &event_handler
+  )
+{
+  Client &client = self.clients[client_id];
+  bool got_completions = false;
+
+  if (client.maybe_sending_index) {
+    got_completions =
+      handleSendingClient(self,client_id,post_select_params,event_handler);
+
+    if (!client.maybe_socket_id) {
+      return;
     }
+  }
+
+  if (got_completions) {
+    // Wait for the next select before receiving.
+    return;
+  }
 
-    if (Impl::isConnected(client)) {
-      Impl::handleReceivingMessage(
-        *this,client,event_handler,i,post_select_params
+  if (post_select_params.readIsSet(*client.maybe_socket_id)) {
+    handleReceivingMessage(
+      self,client,event_handler,client_id,post_select_params
+    );
+  }
+}
+
+
+void
+  MessageServer::handleSelect(
+    const PostSelectParamsInterface &post_select_params,
+    EventInterface &event_handler
+  )
+{
+  // Only the sockets which are ready can have anything to handle, so
+  // the cost doesn't depend on the number of idle clients.  Sockets which
+  // aren't ours, including the listen socket, are skipped.
+  for (SocketId socket_id : post_select_params.readyFds()) {
+    if (std::optional<ClientId> maybe_client_id =
+      Impl::maybeClientUsing(*this,socket_id)
+    ) {
+      Impl::handleReadyClient(
+        *this,*maybe_client_id,post_select_params,event_handler
       );
     }
   }
@@ -621,24 +2571,72 @@ void
   if (Impl::isListening(*this)) {
     Impl::handleWaitingForConnection(*this,post_select_params,event_handler);
   }
+
+  Impl::handleIdleClients(*this,event_handler);
 }
 
 
 struct MessageClient::Impl {
   struct MessageHandler : MessageReceiver::EventInterface {
+    MessageClient &client;
     MessageClient::EventInterface &event_handler;
 
-    MessageHandler(MessageClient::EventInterface &event_handler_arg)
-    : event_handler(event_handler_arg)
+    MessageHandler(
+      MessageClient &client_arg,
+      MessageClient::EventInterface &event_handler_arg
+    )
+    : client(client_arg),
+      event_handler(event_handler_arg)
+    {
+    }
+
+    void gotMessage(const char *message,size_t message_size) override
+    {
+      event_handler.gotMessage(message,message_size);
+      const auto &maybe_options = client.maybe_flow_control_options;
+
+      if (maybe_options && maybe_options->grant_on_delivery) {
+        messagesWereHandled(client,1);
+      }
+    }
+
+    void gotCredit(uint32_t n_messages) override
     {
+      client.queued_message_sender.addCredit(n_messages);
     }
 
-    void gotMessage(const char *message) override
+    void gotPing() override
     {
-      event_handler.gotMessage(message);
+      if (!client.maybe_socket_id) {
+        // The event handler disconnected.
+        return;
+      }
+
+      client.queued_message_sender.queuePong();
     }
   };
 
+  // Credit is given back in batches of half a window.
+  static void messagesWereHandled(MessageClient &self,uint32_t n_messages)
+  {
+    assert(self.maybe_flow_control_options);
+
+    if (!self.maybe_socket_id) {
+      // The event handler disconnected.
+      return;
+    }
+
+    self.n_messages_to_credit += n_messages;
+    uint32_t window = self.maybe_flow_control_options->window;
+
+    if (self.n_messages_to_credit*2 < window) {
+      return;
+    }
+
+    self.queued_message_sender.queueCredit(self.n_messages_to_credit);
+    self.n_messages_to_credit = 0;
+  }
+
   static void
     setupWaitingForConnection(MessageClient &,PreSelectParamsInterface &);
 
@@ -663,6 +2661,39 @@ struct MessageClient::Impl {
       EventInterface &,
       const PostSelectParamsInterface &
     );
+
+  static bool
+    handleZeroCopyCompletions(
+      MessageClient &self,
+      const PostSelectParamsInterface &post_select_params
+    )
+  {
+    assert(self.maybe_socket_id);
+
+    return
+      self.queued_message_sender.handleZeroCopyCompletions(
+        self.sockets,
+        *self.maybe_socket_id,
+        post_select_params
+      );
+  }
+
+  static void closeSocket(MessageClient &self)
+  {
+    assert(self.maybe_socket_id);
+    self.sockets.close(*self.maybe_socket_id);
+    self.maybe_socket_id.reset();
+    self.finished_connecting = false;
+
+    self.n_messages_sent_on_closed_connections +=
+      self.queued_message_sender.nMessagesSent();
+
+    self.queued_message_sender.clear();
+    self.n_messages_to_credit = 0;
+
+    // Don't combine part of a message from this connection with the next.
+    self.message_receiver.clear();
+  }
 };
 
 
@@ -708,6 +2739,20 @@ void
 }
 
 
+void MessageClient::queueSharedMessage(const SharedMessage &message)
+{
+  queued_message_sender.queueSharedMessage(message);
+}
+
+
+uint64_t MessageClient::nMessagesSent() const
+{
+  return
+    n_messages_sent_on_closed_connections +
+    queued_message_sender.nMessagesSent();
+}
+
+
 bool MessageClient::isActive() const
 {
   return !!maybe_socket_id;
@@ -736,9 +2781,14 @@ void MessageClient::setupSelect(PreSelectParamsInterface &pre_select_params)
     return;
   }
 
-  if (isSendingAMessage()) {
+  if (queued_message_sender.hasMessageToSend()) {
     Impl::setupSendingMessage(*this,pre_select_params);
   }
+  else if (
+    auto maybe_time_left = queued_message_sender.maybeTimeUntilSending()
+  ) {
+    pre_select_params.setTimeout(*maybe_time_left);
+  }
 
   Impl::setupReceivingMessage(*this,pre_select_params);
 }
@@ -755,10 +2805,21 @@ void
   if (!finished_connecting) {
     Impl::handleWaitingForConnection(*this,event_handler,post_select_params);
   }
-  else if (isSendingAMessage()) {
-    Impl::handleSendingMessage(*this,post_select_params);
+  else if (Impl::handleZeroCopyCompletions(*this,post_select_params)) {
+    // The socket may have only been selected because of the completions,
+    // so wait for the next select before sending or receiving.
   }
   else {
+    if (queued_message_sender.hasMessageToSend()) {
+      Impl::handleSendingMessage(*this,post_select_params);
+
+      if (!isActive()) {
+        return;
+      }
+    }
+
+    // Keep receiving while there are messages to send, so that replies
+    // aren't held up behind a long queue.
     Impl::handleReceivingMessage(*this,event_handler,post_select_params);
   }
 }
@@ -771,11 +2832,17 @@ void
   )
 {
   assert(self.maybe_socket_id);
-  self.queued_message_sender.handleSendingMessage(
-    self.sockets,
-    *self.maybe_socket_id,
-    post_select_params
-  );
+
+  bool could_send =
+    self.queued_message_sender.handleSendingMessage(
+      self.sockets,
+      *self.maybe_socket_id,
+      post_select_params
+    );
+
+  if (!could_send) {
+    closeSocket(self);
+  }
 }
 
 
@@ -786,7 +2853,7 @@ void
     const PostSelectParamsInterface &post_select_params
   )
 {
-  MessageHandler message_handler{event_handler};
+  MessageHandler message_handler{self,event_handler};
 
   assert(self.maybe_socket_id);
   SocketId socket_id = *self.maybe_socket_id;
@@ -810,32 +2877,140 @@ void
     }
   }
 
-  self.sockets.close(socket_id);
-  self.maybe_socket_id.reset();
-  self.finished_connecting = false;
+  closeSocket(self);
 }
 
 
 void MessageClient::disconnect()
 {
-  assert(finished_connecting);
+  // This also abandons a connection attempt.
   assert(maybe_socket_id);
-  sockets.close(*maybe_socket_id);
-  maybe_socket_id.reset();
-  finished_connecting = false;
+  Impl::closeSocket(*this);
+}
+
+
+void MessageClient::setZeroCopyThreshold(size_t minimum_message_size)
+{
+  maybe_zero_copy_threshold = minimum_message_size;
+}
+
+
+void
+  MessageClient::enableCoalescing(
+    const ClockInterface &clock,
+    const QueuedMessageSender::CoalescingOptions &options
+  )
+{
+  coalescing_clock_ptr = &clock;
+  maybe_coalescing_options = options;
+}
+
+
+void MessageClient::enableDraining(size_t max_bytes)
+{
+  maybe_drain_budget = max_bytes;
+}
+
+
+void MessageClient::setMaxMessageSize(size_t max_size)
+{
+  maybe_max_message_size = max_size;
+}
+
+
+void
+  MessageClient::enableFlowControl(
+    const ClockInterface &clock,
+    const QueuedMessageSender::FlowControlOptions &options
+  )
+{
+  assert(options.window > 0);
+  flow_control_clock_ptr = &clock;
+  maybe_flow_control_options = options;
+}
+
+
+void MessageClient::grantCredit(uint32_t n_messages)
+{
+  assert(maybe_flow_control_options);
+  assert(!maybe_flow_control_options->grant_on_delivery);
+  Impl::messagesWereHandled(*this,n_messages);
+}
+
+
+auto MessageClient::flowControlStats() const
+  -> QueuedMessageSender::FlowControlStats
+{
+  return queued_message_sender.flowControlStats();
+}
+
+
+void
+  MessageClient::enableCompression(
+    const QueuedMessageSender::CompressionOptions &options
+  )
+{
+  maybe_compression_options = options;
+}
+
+
+auto MessageClient::compressionStats() const
+  -> QueuedMessageSender::CompressionStats
+{
+  return queued_message_sender.compressionStats();
 }
 
 
 void MessageClient::startConnecting(int port)
 {
-  assert(!finished_connecting);
-  assert(!maybe_socket_id);
+  // No need to resolve "localhost" each time.
   InternetAddress server_address;
-  server_address.setHostname("localhost");
+  server_address.setLoopback();
   server_address.setPort(port);
+  startConnecting(server_address);
+}
 
-  SocketId client_socket_id = sockets.create();
+
+void MessageClient::startConnecting(const InternetAddress &server_address)
+{
+  assert(!finished_connecting);
+  assert(!maybe_socket_id);
+  SocketId client_socket_id = sockets.create(server_address.family());
   sockets.setNonBlocking(client_socket_id,true);
+
+  if (maybe_zero_copy_threshold) {
+    if (sockets.enableZeroCopy(client_socket_id)) {
+      queued_message_sender.enableZeroCopy(*maybe_zero_copy_threshold);
+    }
+  }
+
+  if (maybe_coalescing_options) {
+    sockets.setNoDelay(client_socket_id,true);
+
+    queued_message_sender.enableCoalescing(
+      *coalescing_clock_ptr,*maybe_coalescing_options
+    );
+  }
+
+  if (maybe_drain_budget) {
+    queued_message_sender.enableDraining(*maybe_drain_budget);
+    message_receiver.enableDraining(*maybe_drain_budget);
+  }
+
+  if (maybe_max_message_size) {
+    message_receiver.setMaxMessageSize(*maybe_max_message_size);
+  }
+
+  if (maybe_flow_control_options) {
+    // The credit goes out as soon as we are connected.
+    queued_message_sender.enableFlowControl(*flow_control_clock_ptr);
+    queued_message_sender.queueCredit(maybe_flow_control_options->window);
+  }
+
+  if (maybe_compression_options) {
+    queued_message_sender.enableCompression(*maybe_compression_options);
+  }
+
   sockets.connect(client_socket_id,server_address);
   maybe_socket_id = client_socket_id;
 }
@@ -865,9 +3040,10 @@ void
 
   if (can_send) {
     if (self.sockets.connectionWasRefused(client_socket_id)) {
-      self.sockets.close(client_socket_id);
-      self.maybe_socket_id.reset();
+      // The credit and anything else queued for this attempt mustn't be
+      // sent on the next one.
       assert(!self.finished_connecting);
+      closeSocket(self);
       event_handler.connectionRefused();
       return;
     }
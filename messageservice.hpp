@@ -3,17 +3,33 @@
 
 #include <vector>
 #include <queue>
+#include <deque>
+#include <functional>
+#include <memory>
 #include <optional>
+#include <chrono>
 #include "socketsinterface.hpp"
 #include "selectparams.hpp"
+#include "clock.hpp"
+#include "compression.hpp"
 
 
 class MessageReceiver {
   public:
     struct EventInterface {
-      virtual void gotMessage(const char *message) = 0;
+      virtual void gotMessage(const char *message,size_t message_size) = 0;
+
+      // The other end allows this many more messages to be sent to it.
+      // See QueuedMessageSender::enableFlowControl().
+      virtual void gotCredit(uint32_t n_messages) = 0;
+
+      // The other end wants to know that we are still here, and should
+      // be sent a pong.
+      virtual void gotPing() = 0;
     };
 
+    // Returns false if the connection was closed or failed.  A socket
+    // which turns out not to have anything to read is fine.
     bool
       receiveMoreOfTheMessage(
         SocketsInterface &,
@@ -21,25 +37,73 @@ class MessageReceiver {
         SocketsInterface::SocketId
       );
 
+    // Keep receiving until the socket has nothing more to read or
+    // max_bytes have been received, instead of doing a single recv.
+    void enableDraining(size_t max_bytes);
+
+    // A message which is larger than this, once decompressed, fails the
+    // connection.
+    void setMaxMessageSize(size_t max_size);
+
+    static const size_t default_max_message_size = 64*1024*1024;
+
+    // Discard any partial message, stop draining, and go back to the
+    // default maximum message size.  The buffer is kept unless it grew
+    // large, so that the receiver can be reused without allocating.  When
+    // called from an event handler, no more messages are delivered, and
+    // the receiver is cleared once receiveMoreOfTheMessage() returns.
+    void clear();
+
   private:
     struct Impl;
     using Buffer = std::vector<char>;
 
     Buffer buffer = Buffer(1024);
     size_t n_bytes_read = 0;
+    Buffer decompression_buffer;
+    std::optional<size_t> maybe_drain_budget;
+    size_t max_message_size = default_max_message_size;
+    bool is_receiving = false;
+    bool clear_is_pending = false;
 };
 
 
+// A message which can be queued on any number of connections without being
+// copied for each one.  The bytes include the message header.
+using SharedMessage = std::shared_ptr<const std::vector<char>>;
+
+extern SharedMessage makeSharedMessage(const char *message,size_t message_size);
+
+
 class MessageSender {
   public:
+    struct FileRegion {
+      int file_descriptor;
+      off_t offset;
+      size_t length;
+    };
+
     MessageSender() = default;
     MessageSender(const MessageSender &) = delete;
     MessageSender(MessageSender &&) = default;
+    MessageSender &operator=(MessageSender &&) = default;
+
+    void
+      queueMessage(
+        const char *message_arg,
+        int message_size_arg,
+        bool use_zero_copy_arg = false
+      );
+
+    // The contents of the file region are sent after the message.
+    void queueFileRegion(const FileRegion &);
 
-    void queueMessage(const char *message_arg, int message_size_arg);
     bool messageIsBeingSent() const { return !!message_being_sent; }
+    uint32_t nZeroCopySends() const { return n_zero_copy_sends; }
 
-    bool
+    // Returns the result of the send, which may be for the message or
+    // the file.
+    int
       sendMoreOfTheMessage(
         SocketsInterface &sockets,
         const SocketsInterface::SocketId client_socket_id
@@ -51,13 +115,101 @@ class MessageSender {
     size_t n_bytes_sent = 0;
     const char *message_being_sent = nullptr;
     size_t message_size = 0;
+    bool use_zero_copy = false;
+    uint32_t n_zero_copy_sends = 0;
+    std::optional<FileRegion> maybe_file_region;
+    size_t n_file_bytes_sent = 0;
 };
 
 
 
 class QueuedMessageSender {
   public:
-    bool isSendingAMessage() const { return !message_queue.empty(); }
+    using Lane = int;
+
+    // Messages can be queued on separate lanes, so that small urgent
+    // messages don't wait behind bulk ones.  Lanes are only switched
+    // between messages, since a message can't be interrupted once it has
+    // started, so bulk data needs to be sent as several smaller messages
+    // for this to help.  Messages are taken from the lanes whenever fewer
+    // than max_committed_bytes are waiting to be sent, which bounds how
+    // long a message waits for other lanes once it reaches the front of
+    // its own.
+    struct LaneOptions {
+      enum class Policy {
+        // The lowest numbered lane with a message goes first.
+        strict_priority,
+
+        // Each lane gets about its weight in bytes on each turn.
+        weighted_round_robin
+      };
+
+      Policy policy = Policy::strict_priority;
+      std::vector<size_t> weights = {1,1};
+      size_t max_committed_bytes = 64*1024;
+    };
+
+    // With flow control, the receiver says how many more messages it can
+    // take by sending credit, so that a fast sender can't swamp a slow
+    // receiver.  Both ends have to enable it.
+    struct FlowControlOptions {
+      // The number of messages the other end can send before it has to
+      // wait for more credit.
+      uint32_t window = 64;
+
+      // Give the credit for a message back as soon as it has been
+      // delivered.  Otherwise the application gives credit back once it
+      // has dealt with the messages, which also bounds how many
+      // messages it has to hold.
+      bool grant_on_delivery = true;
+    };
+
+    struct FlowControlStats {
+      // How often messages had to wait for credit, and for how long
+      // altogether, including any wait in progress.
+      uint64_t n_stalls = 0;
+      ClockInterface::Duration stalled_time{0};
+    };
+
+    // Copied messages at least min_message_size bytes long are compressed
+    // as they are queued, and sent compressed if that makes them smaller.
+    // Receivers always understand compressed messages, so only the sender
+    // needs to enable it.  Shared messages and files are sent as they are.
+    struct CompressionOptions {
+      size_t min_message_size = 1024;
+    };
+
+    struct CompressionStats {
+      uint64_t n_compressed_messages = 0;
+
+      // The sizes of the messages which were sent compressed, before and
+      // after compression.
+      uint64_t n_original_bytes = 0;
+      uint64_t n_compressed_bytes = 0;
+    };
+
+    // Small messages can be combined into one send, trading latency for
+    // fewer system calls.  A message is held back until enough bytes are
+    // queued to fill a send or it has waited for the maximum delay.
+    struct CoalescingOptions {
+      size_t max_bytes = 16*1024;
+      std::chrono::microseconds max_delay{200};
+    };
+
+    // Messages which were sent with zero-copy are still considered to be
+    // being sent until the kernel is done with them.
+    bool isSendingAMessage() const;
+
+    // False if there are no messages or they are being held back for
+    // coalescing.
+    bool hasMessageToSend() const;
+
+    // How long until messages which are being held back are sent.
+    std::optional<std::chrono::microseconds> maybeTimeUntilSending() const;
+
+    // The number of messages which have been completely sent since the
+    // sender was created or cleared.
+    uint64_t nMessagesSent() const { return n_messages_sent; }
 
     bool
       handleSendingMessage(
@@ -66,13 +218,146 @@ class QueuedMessageSender {
         const PostSelectParamsInterface &post_select_params
       );
 
-    void queueMessage(const char *message,int message_size);
+    // Returns true if any completions were handled.  In that case the
+    // socket may have only been selected because of the completions.
+    bool
+      handleZeroCopyCompletions(
+        SocketsInterface &sockets,
+        SocketsInterface::SocketId socket_id,
+        const PostSelectParamsInterface &post_select_params
+      );
+
+    // Without lanes, only lane 0 can be used.
+    void queueMessage(const char *message,int message_size,Lane = 0);
+    void queueSharedMessage(const SharedMessage &,Lane = 0);
+
+    // Queue the contents of part of a file as a message.  The file is sent
+    // directly from the file descriptor when possible, and it needs to
+    // stay open until the message has been sent.
+    void
+      queueFile(int file_descriptor,off_t offset,size_t length,Lane = 0);
+
+    // Messages at least this large are sent with zero-copy.
+    void enableZeroCopy(size_t minimum_message_size);
+
+    void enableCoalescing(const ClockInterface &,const CoalescingOptions &);
+
+    // Keep sending until the socket would block, there is nothing left to
+    // send, or max_bytes have been sent, instead of doing a single send.
+    void enableDraining(size_t max_bytes);
+
+    // Messages which were already queued are sent first.
+    void enableLanes(const LaneOptions &);
+
+    // Hold messages which are queued from now on until addCredit() allows
+    // them to be sent.  The clock is used for the statistics.
+    void enableFlowControl(const ClockInterface &);
+
+    void addCredit(uint32_t n_messages);
+
+    // Tell the other end that it may send more messages.  Credit doesn't
+    // need credit itself, so it goes ahead of messages which are waiting
+    // for it.
+    void queueCredit(uint32_t n_messages);
+
+    FlowControlStats flowControlStats() const;
+
+    // These go ahead of messages which are waiting for credit, like
+    // credit does.
+    void queuePing();
+    void queuePong();
+
+    void enableCompression(const CompressionOptions &);
+    CompressionStats compressionStats() const { return compression_stats; }
+
+    // Discard all messages.  This is used when the socket is closed, which
+    // also abandons any zero-copy sends in progress.  The buffers are kept
+    // unless they grew large.
+    void clear();
 
   private:
     struct Impl;
 
+    // Copied messages are framed directly into the send buffer, and
+    // consecutive ones are sent from there together.  Shared messages,
+    // files, and messages sent with zero-copy keep their own storage and
+    // are sent through message_sender.
+    struct QueuedMessage {
+      // Zero if the message isn't in the send buffer.
+      size_t n_buffered_bytes = 0;
+
+      SharedMessage shared_message;
+      std::optional<MessageSender::FileRegion> maybe_file_region;
+
+      // Only set when coalescing.
+      ClockInterface::TimePoint queue_time;
+
+      // Credit, pings and pongs aren't counted as messages.
+      bool is_control = false;
+    };
+
+    struct ZeroCopyMessage {
+      SharedMessage message;
+      uint32_t last_send_id = 0;
+    };
+
+    // Messages which haven't been taken from a lane yet.  Copied messages
+    // are framed into the lane's own buffer until then.
+    struct LaneQueue {
+      std::vector<char> buffer;
+      size_t buffer_start = 0;
+      std::vector<QueuedMessage> messages;
+      size_t messages_start = 0;
+      size_t deficit = 0;
+    };
+
+    // Sent bytes and messages are only removed from the front of these
+    // and zero_copy_queue once they make up half of the vector, so that
+    // after the vectors have grown, queueing and sending messages doesn't
+    // allocate.
+    std::vector<char> send_buffer;
+    size_t send_buffer_start = 0;
+    std::vector<QueuedMessage> message_queue;
+    size_t message_queue_start = 0;
+
+    // How much of the first message in the send buffer has been sent.
+    size_t n_front_bytes_sent = 0;
+
+    size_t n_unbuffered_messages = 0;
+
+    // The number of messages at the front which are no longer being held
+    // back for coalescing.
+    size_t n_released_messages = 0;
+
+    size_t n_bytes_queued = 0;
     MessageSender message_sender;
-    std::queue<std::vector<char>> message_queue;
+    std::optional<size_t> maybe_zero_copy_threshold;
+    uint32_t n_zero_copy_sends_before_message = 0;
+    uint32_t n_zero_copy_sends_completed = 0;
+
+    // Completions can arrive out of order, so ranges after a send which
+    // hasn't completed yet wait here until the gap is filled.
+    std::vector<SocketsInterface::ZeroCopyCompletion>
+      pending_zero_copy_completions;
+
+    std::vector<ZeroCopyMessage> zero_copy_queue;
+    size_t zero_copy_queue_start = 0;
+    uint64_t n_messages_sent = 0;
+    const ClockInterface *coalescing_clock_ptr = nullptr;
+    std::optional<CoalescingOptions> maybe_coalescing_options;
+    std::optional<size_t> maybe_drain_budget;
+    std::optional<LaneOptions> maybe_lane_options;
+    std::vector<LaneQueue> lanes;
+    size_t n_lane_messages = 0;
+    Lane current_lane = 0;
+    std::optional<uint64_t> maybe_send_credit;
+    const ClockInterface *flow_control_clock_ptr = nullptr;
+    std::optional<ClockInterface::TimePoint> maybe_stall_start;
+    FlowControlStats flow_control_stats;
+    std::optional<CompressionOptions> maybe_compression_options;
+    LzCompressor compressor;
+    std::vector<char> compressed_payload;
+    CompressionStats compression_stats;
 };
 
 
@@ -83,40 +368,185 @@ class MessageServer {
 
     struct EventInterface {
       using ClientId = MessageServer::ClientId;
-      virtual void gotMessage(ClientId,const char *) = 0;
+      virtual void gotMessage(ClientId,const char *,size_t message_size) = 0;
       virtual void clientConnected(ClientId) = 0;
       virtual void clientDisconnected(ClientId) = 0;
     };
 
+    // Clients which haven't sent anything for a while are disconnected,
+    // so that connections whose other end has gone away without closing
+    // them don't keep their slots and buffers forever.  Quiet clients can
+    // be pinged first, which MessageClient answers without the
+    // application seeing it, so only dead or stuck clients are lost.
+    struct IdleTimeoutOptions {
+      // Clients which have sent nothing for this long are disconnected.
+      std::chrono::microseconds timeout = std::chrono::seconds(60);
+
+      // Clients which have sent nothing for this long are pinged.  This
+      // needs to be less than the timeout to make a difference.
+      std::optional<std::chrono::microseconds> maybe_ping_time =
+        std::chrono::seconds(20);
+
+      // Have the kernel also probe connections which have been idle for
+      // this long, if the sockets support it, so that hosts which have
+      // gone away are noticed without pings.
+      std::optional<std::chrono::seconds> maybe_keep_alive_time;
+    };
+
     MessageServer(SocketsInterface &sockets_arg);
     MessageServer(const MessageServer &) = delete;
     MessageServer(MessageServer &&) = delete;
     ~MessageServer();
 
+    // Listens on any IPv4 address.
     void startListening(int port);
+
+    // Listens on the given address, which may be IPv6.
+    void startListening(const InternetAddress &);
     void stopListening();
     bool isActive() const;
     void setupSelect(PreSelectParamsInterface &);
     void handleSelect(const PostSelectParamsInterface &,EventInterface &);
     std::vector<ClientId> clientIds() const;
-    int nClients() const { return clientIds().size(); }
+    int nClients() const { return connected_client_ids.size(); }
     bool isSendingAMessageTo(ClientId client_id) const;
     SocketId clientSocketId(ClientId) const;
 
+    // Messages at least this large are sent to newly connected clients
+    // with zero-copy, if the sockets support it.
+    void setZeroCopyThreshold(size_t minimum_message_size);
+
+    // Coalesce small messages to newly connected clients.  Since messages
+    // are combined here, the sockets don't also delay them.
+    void
+      enableCoalescing(
+        const ClockInterface &,
+        const QueuedMessageSender::CoalescingOptions &
+      );
+
+    // Send and receive on each ready socket until it would block or
+    // max_bytes have been transferred in that direction, rather than
+    // doing one send and one recv per select.  The limit stops one busy
+    // client from starving the others, since a socket which reaches it
+    // is still ready at the next select.  This applies to newly connected
+    // clients.
+    void enableDraining(size_t max_bytes);
+
+    // Disconnect newly connected clients which send a message larger than
+    // this.  See MessageReceiver::default_max_message_size.
+    void setMaxMessageSize(size_t max_size);
+
+    // Give newly connected clients priority lanes.  See
+    // QueuedMessageSender::LaneOptions.
+    void enableLanes(const QueuedMessageSender::LaneOptions &);
+
+    // Use flow control with newly connected clients, which also have to
+    // enable it.  See QueuedMessageSender::FlowControlOptions.
+    void
+      enableFlowControl(
+        const ClockInterface &,
+        const QueuedMessageSender::FlowControlOptions &
+      );
+
+    // Without grant_on_delivery, tells the client that this many of its
+    // messages have been dealt with.
+    void grantCredit(ClientId,uint32_t n_messages);
+
+    QueuedMessageSender::FlowControlStats flowControlStats(ClientId) const;
+
+    // Compress large messages to newly connected clients.  See
+    // QueuedMessageSender::CompressionOptions.
+    void enableCompression(const QueuedMessageSender::CompressionOptions &);
+
+    QueuedMessageSender::CompressionStats compressionStats(ClientId) const;
+
+    // Time out idle clients which connect from now on.  Clients which
+    // time out are reported through clientDisconnected().
+    void enableIdleTimeout(const ClockInterface &,const IdleTimeoutOptions &);
+
     void
       queueMessageToClient(
         ClientId,
         const char *message_arg,
-        int message_size_arg
+        int message_size_arg,
+        QueuedMessageSender::Lane = 0
+      );
+
+    void
+      queueSharedMessageToClient(
+        ClientId,
+        const SharedMessage &,
+        QueuedMessageSender::Lane = 0
+      );
+
+    // Send part of a file to the client as a message, in order with any
+    // other messages.  The file descriptor needs to stay open until the
+    // message has been sent.
+    void
+      queueFileToClient(
+        ClientId,
+        int file_descriptor,
+        off_t offset,
+        size_t length
       );
 
   private:
     struct Impl;
     struct Client;
 
+    // A list of clients, linked through the clients, in the order that we
+    // last heard from them.
+    struct IdleList {
+      std::optional<ClientId> maybe_first_client_id;
+      std::optional<ClientId> maybe_last_client_id;
+    };
+
     SocketsInterface &sockets;
     std::optional<SocketId> maybe_listen_socket_id;
-    std::vector<Client> clients;
+
+    // Clients are never moved, and the slots of disconnected clients are
+    // reused along with their buffers, lowest id first.
+    std::deque<Client> clients;
+    std::priority_queue<
+      ClientId,std::vector<ClientId>,std::greater<ClientId>
+    > free_client_ids;
+
+    // The fields needed for each select are kept densely for the connected
+    // clients, in parallel, so that setupSelect() and handleSelect() scan
+    // contiguous memory and only look at a Client when its socket is ready.
+    std::vector<ClientId> connected_client_ids;
+    std::vector<SocketId> connected_socket_ids;
+
+    // The clients which have messages queued or zero-copy sends in
+    // progress.  These are the only ones which wait for writing.
+    std::vector<ClientId> sending_client_ids;
+
+    // The client using each socket, so that handleSelect() only visits
+    // the sockets which the selector reported as ready.
+    std::vector<std::optional<ClientId>> socket_client_ids;
+
+    std::optional<size_t> maybe_zero_copy_threshold;
+    const ClockInterface *coalescing_clock_ptr = nullptr;
+    std::optional<QueuedMessageSender::CoalescingOptions>
+      maybe_coalescing_options;
+    std::optional<size_t> maybe_drain_budget;
+    std::optional<size_t> maybe_max_message_size;
+    std::optional<QueuedMessageSender::LaneOptions> maybe_lane_options;
+    const ClockInterface *flow_control_clock_ptr = nullptr;
+    std::optional<QueuedMessageSender::FlowControlOptions>
+      maybe_flow_control_options;
+    std::optional<QueuedMessageSender::CompressionOptions>
+      maybe_compression_options;
+    const ClockInterface *idle_clock_ptr = nullptr;
+    std::optional<IdleTimeoutOptions> maybe_idle_timeout_options;
+
+    // Hearing from a client moves it to the end of idle_clients, and
+    // pinging it moves it to the end of pinged_clients, so each list stays
+    // in order of when the clients were last heard from.  The clients to
+    // ping or disconnect next are then always at the front, and keeping
+    // track of each client takes constant time however many there are.
+    IdleList idle_clients;
+    IdleList pinged_clients;
 };
 
 
@@ -125,30 +555,97 @@ struct MessageClient {
     struct EventInterface {
       virtual void connectionRefused() = 0;
       virtual void connected() = 0;
-      virtual void gotMessage(const char *) = 0;
+      virtual void gotMessage(const char *,size_t message_size) = 0;
     };
 
     MessageClient(SocketsInterface &sockets_arg);
     MessageClient(const MessageClient &) = delete;
     MessageClient(MessageClient &&) = delete;
 
+    // Connects to the port on the local host.
     void startConnecting(int port);
+
+    // Use Resolver to get addresses for other hosts.
+    void startConnecting(const InternetAddress &);
+
     bool isActive() const;
     bool isConnected() const;
     void setupSelect(PreSelectParamsInterface &);
     void handleSelect(const PostSelectParamsInterface &,EventInterface &);
     bool isSendingAMessage() const;
     void queueMessage(const char *message_arg,int message_size_arg);
+    void queueSharedMessage(const SharedMessage &);
+
+    // The number of messages which have been completely written to a
+    // connection, including earlier ones.  Queued messages which weren't
+    // are discarded when the connection is closed or refused.
+    uint64_t nMessagesSent() const;
+
     void disconnect();
 
+    // Messages at least this large are sent with zero-copy, if the
+    // sockets support it.  This applies to later connections.
+    void setZeroCopyThreshold(size_t minimum_message_size);
+
+    // Coalesce small messages on later connections.
+    void
+      enableCoalescing(
+        const ClockInterface &,
+        const QueuedMessageSender::CoalescingOptions &
+      );
+
+    // Send and receive until the socket would block or max_bytes have
+    // been transferred in that direction on later connections.  See
+    // MessageServer::enableDraining().
+    void enableDraining(size_t max_bytes);
+
+    // Close later connections if the server sends a message larger than
+    // this.
+    void setMaxMessageSize(size_t max_size);
+
+    // Use flow control on later connections.  The server has to enable it
+    // too.  See QueuedMessageSender::FlowControlOptions.
+    void
+      enableFlowControl(
+        const ClockInterface &,
+        const QueuedMessageSender::FlowControlOptions &
+      );
+
+    // Without grant_on_delivery, tells the server that this many of its
+    // messages have been dealt with.
+    void grantCredit(uint32_t n_messages);
+
+    QueuedMessageSender::FlowControlStats flowControlStats() const;
+
+    // Compress large messages on later connections.
+    void enableCompression(const QueuedMessageSender::CompressionOptions &);
+
+    QueuedMessageSender::CompressionStats compressionStats() const;
+
   private:
     struct Impl;
 
     SocketsInterface &sockets;
     std::optional<SocketsInterface::SocketId> maybe_socket_id;
     bool finished_connecting = false;
+    std::optional<size_t> maybe_zero_copy_threshold;
+    const ClockInterface *coalescing_clock_ptr = nullptr;
+    std::optional<QueuedMessageSender::CoalescingOptions>
+      maybe_coalescing_options;
+    std::optional<size_t> maybe_drain_budget;
+    std::optional<size_t> maybe_max_message_size;
+    const ClockInterface *flow_control_clock_ptr = nullptr;
+    std::optional<QueuedMessageSender::FlowControlOptions>
+      maybe_flow_control_options;
+    std::optional<QueuedMessageSender::CompressionOptions>
+      maybe_compression_options;
+
+    // Messages which were delivered but not yet given back as credit.
+    uint32_t n_messages_to_credit = 0;
+
     QueuedMessageSender queued_message_sender;
     MessageReceiver message_receiver;
+    uint64_t n_messages_sent_on_closed_connections = 0;
 };
 
 
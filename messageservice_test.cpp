@@ -1,12 +1,15 @@
 #include "messageservice.hpp"
 
 #include <string.h>
+#include <unistd.h>
+#include <algorithm>
 #include <iostream>
 #include <sstream>
 #include <random>
 #include <functional>
 #include "fakesockets.hpp"
 #include "fakeselector.hpp"
+#include "fakeclock.hpp"
 
 using std::deque;
 using std::ostream;
@@ -30,7 +33,7 @@ struct ServerEventCallbacks : MessageServer::EventInterface {
   std::function<void(ClientId)> client_disconnected
     = [](ClientId){ assert(false); };
 
-  void gotMessage(ClientId client_id,const char *message) override
+  void gotMessage(ClientId client_id,const char *message,size_t) override
   {
     got_message(client_id,message);
   }
@@ -69,7 +72,10 @@ struct ClientEventCallbacks : MessageClient::EventInterface {
 
   void connectionRefused() override { connection_refused(); }
   void connected() override { connected_callback(); }
-  void gotMessage(const char *message) override { got_message(message); }
+  void gotMessage(const char *message,size_t) override
+  {
+    got_message(message);
+  }
 };
 }
 
@@ -186,10 +192,11 @@ static void
   queueMessageToClientOn(
     TestServer &server,
     MessageServer::ClientId client_id,
-    const char *message
+    const char *message,
+    QueuedMessageSender::Lane lane = 0
   )
 {
-  server.queueMessageToClient(client_id, message, strlen(message) + 1);
+  server.queueMessageToClient(client_id, message, strlen(message) + 1, lane);
 }
 
 
@@ -461,6 +468,54 @@ static void testMultipleClients()
 }
 
 
+static void testDisconnectingOneOfSeveralClients()
+{
+  Tester tester;
+  TestServer &server = tester.createServer();
+  TestClient &client1 = tester.createClient();
+  TestClient &client2 = tester.createClient();
+  TestClient &client3 = tester.createClient();
+  server.callbacks.client_connected = do_nothing;
+  server.callbacks.client_disconnected = do_nothing;
+
+  while (server.nClients() != 3) {
+    tester.processEvents();
+  }
+
+  client1.disconnect();
+
+  while (server.nClients() != 2) {
+    tester.processEvents();
+  }
+
+  assert(server.clientIds() == (vector<MessageServer::ClientId>{1,2}));
+  vector<string> received_messages;
+
+  auto got_message_function =
+    [&received_messages](const char *message){
+      received_messages.push_back(message);
+    };
+
+  client2.callbacks.got_message = got_message_function;
+  client3.callbacks.got_message = got_message_function;
+  queueMessageToClientOn(server,1,"to client 2");
+  queueMessageToClientOn(server,2,"to client 3");
+
+  while (received_messages.size() != 2) {
+    tester.processEvents();
+  }
+
+  std::sort(received_messages.begin(),received_messages.end());
+
+  assert(
+    received_messages == (vector<string>{"to client 2","to client 3"})
+  );
+
+  assert(!server.isSendingAMessageTo(1));
+  assert(!server.isSendingAMessageTo(2));
+}
+
+
 static void testClientConnectingAfterDisconnect()
 {
   ClientServerTester tester;
@@ -626,6 +681,122 @@ static string randomMessageOfLength(size_t n,RandomEngine &engine)
 }
 
 
+static void testDisconnectingFromGotMessage()
+{
+  ClientServerTester tester;
+  tester.serverCallbacks().client_connected = do_nothing;
+  tester.serverCallbacks().client_disconnected = do_nothing;
+  tester.waitForConnection();
+  MessageServer::ClientId client_id = tester.clientId();
+
+  // Let both messages arrive with one recv.
+  tester.sockets.setBufferCapacity(
+    tester.server.clientSocketId(client_id),/*capacity*/64
+  );
+
+  vector<string> messages;
+
+  tester.clientCallbacks().got_message =
+    [&](const char *message){
+      messages.push_back(message);
+
+      if (messages.size() == 1) {
+        tester.client.disconnect();
+      }
+    };
+
+  queueMessageToClientOn(tester.server,client_id,"first");
+  queueMessageToClientOn(tester.server,client_id,"second");
+
+  while (tester.client.isActive()) {
+    tester.processEvents();
+  }
+
+  assert(messages == vector<string>{"first"});
+
+  while (tester.server.nClients() != 0) {
+    tester.processEvents();
+  }
+
+  // Nothing from the old connection is left to mix with the new one.
+  tester.client.startConnecting(server_port);
+
+  while (tester.server.nClients() != 1) {
+    tester.processEvents();
+  }
+
+  queueMessageToClientOn(tester.server,tester.clientId(),"third");
+
+  while (messages.size() != 2) {
+    tester.processEvents();
+  }
+
+  assert(messages == (vector<string>{"first","third"}));
+}
+
+
+static void testRejectingLargeMessages()
+{
+  Tester tester;
+  TestServer &server = tester.createServer();
+  server.setMaxMessageSize(8);
+  TestClient &client = tester.createClient();
+  vector<string> messages;
+  bool client_was_disconnected = false;
+  server.callbacks.client_connected = do_nothing;
+
+  server.callbacks.client_disconnected =
+    [&](MessageServer::ClientId){ client_was_disconnected = true; };
+
+  server.callbacks.got_message =
+    [&](MessageServer::ClientId,const char *message){
+      messages.push_back(message);
+    };
+
+  // With the terminator, the first message is at the limit.
+  queueMessageOn(client,"1234567");
+  queueMessageOn(client,"12345678");
+
+  while (!client_was_disconnected) {
+    tester.processEvents();
+  }
+
+  assert(messages == vector<string>{"1234567"});
+}
+
+
+static void testRejectingHugeHeader()
+{
+  ClientServerTester tester;
+  tester.serverCallbacks().client_connected = do_nothing;
+  tester.serverCallbacks().client_disconnected = do_nothing;
+  tester.waitForConnection();
+  SocketId socket_id = tester.server.clientSocketId(tester.clientId());
+
+  // A header claiming a message of about a gigabyte fails the connection
+  // at once, rather than waiting for the message.
+  const char header[] = {0x3f,char(0xff),char(0xff),char(0xff)};
+  size_t n_bytes_sent = 0;
+
+  while (n_bytes_sent != sizeof header) {
+    int send_result =
+      tester.sockets.send(
+        socket_id,header + n_bytes_sent,sizeof header - n_bytes_sent
+      );
+
+    if (send_result > 0) {
+      n_bytes_sent += send_result;
+    }
+
+    tester.processEvents();
+  }
+
+  while (tester.client.isActive()) {
+    tester.processEvents();
+  }
+}
+
+
 static void testSendingLongMessage()
 {
   ClientServerTester tester;
@@ -678,6 +849,54 @@ static void testReadError()
 }
 
 
+static void testReusingClientAfterReadError()
+{
+  ClientServerTester tester;
+  TestServer &server = tester.server;
+  vector<MessageServer::ClientId> connected_client_ids;
+  vector<string> received_messages;
+
+  server.callbacks.client_connected =
+    [&](MessageServer::ClientId client_id){
+      connected_client_ids.push_back(client_id);
+    };
+
+  server.callbacks.client_disconnected = do_nothing;
+
+  server.callbacks.got_message =
+    [&](MessageServer::ClientId,const char *message){
+      received_messages.push_back(message);
+    };
+
+  tester.waitForConnection();
+
+  // Leave part of a message in the server's receive buffer.
+  queueMessageOn(tester.client,"this is a message");
+  SocketId socket_id = server.clientSocketId(tester.clientId());
+  tester.sockets.setNBytesBeforeRecvError(socket_id, 10);
+
+  while (server.nClients() != 0) {
+    tester.processEvents();
+  }
+
+  TestClient &client2 = tester.createClient();
+
+  while (server.nClients() != 1) {
+    tester.processEvents();
+  }
+
+  // The new client gets the same slot, without the partial message.
+  assert(connected_client_ids == (vector<MessageServer::ClientId>{0,0}));
+  queueMessageOn(client2,"hello");
+
+  while (received_messages.empty()) {
+    tester.processEvents();
+  }
+
+  assert(received_messages == vector<string>{"hello"});
+}
+
+
 static void testSendEOF()
 {
   ClientServerTester tester;
@@ -710,6 +929,994 @@ static void testSendError()
 }
 
 
+static void testZeroCopySend()
+{
+  Tester tester;
+  TestServer &server = tester.createServer();
+  server.setZeroCopyThreshold(1000);
+  TestClient &client = tester.createClient();
+  server.callbacks.client_connected = do_nothing;
+
+  while (server.nClients() != 1) {
+    tester.processEvents();
+  }
+
+  MessageServer::ClientId client_id = onlyClientId(server);
+  RandomEngine engine;
+  engine.seed(1);
+  optional<string> maybe_received_message;
+
+  {
+    // Use a local scope so that the message has to be kept by the server
+    // until the kernel is done with it.
+    string sent_message = randomMessageOfLength(10000,engine);
+    queueMessageToClientOn(server,client_id,sent_message.c_str());
+  }
+
+  client.callbacks.got_message =
+    [&](const char *message){
+      maybe_received_message.emplace(message);
+    };
+
+  while (!maybe_received_message) {
+    tester.processEvents();
+  }
+
+  while (server.isSendingAMessageTo(client_id)) {
+    tester.processEvents();
+  }
+
+  engine.seed(1);
+  assert(*maybe_received_message == randomMessageOfLength(10000,engine));
+  assert(tester.sockets.nZeroCopySends(server.clientSocketId(client_id)) > 0);
+}
+
+
+static void testZeroCopyCompletionsOutOfOrder()
+{
+  Tester tester;
+  TestServer &server = tester.createServer();
+  server.setZeroCopyThreshold(1000);
+  TestClient &client = tester.createClient();
+  server.callbacks.client_connected = do_nothing;
+
+  while (server.nClients() != 1) {
+    tester.processEvents();
+  }
+
+  MessageServer::ClientId client_id = onlyClientId(server);
+  SocketsInterface::SocketId socket_id = server.clientSocketId(client_id);
+  tester.sockets.setBufferCapacity(socket_id,64*1024);
+  tester.sockets.reverseZeroCopyCompletions(socket_id);
+  vector<string> sent_messages;
+
+  for (char c : {'a','b','c'}) {
+    sent_messages.push_back(string(2000,c));
+    queueMessageToClientOn(server,client_id,sent_messages.back().c_str());
+  }
+
+  vector<string> received_messages;
+
+  client.callbacks.got_message =
+    [&](const char *message){
+      received_messages.push_back(message);
+    };
+
+  while (received_messages.size() != sent_messages.size()) {
+    tester.processEvents();
+  }
+
+  // The last send completes first, but the messages can't be released
+  // until the earlier ones have completed too.
+  while (server.isSendingAMessageTo(client_id)) {
+    tester.processEvents();
+  }
+
+  assert(received_messages == sent_messages);
+  assert(tester.sockets.nZeroCopySends(socket_id) == 3);
+}
+
+
+static int createTemporaryFile(const string &contents)
+{
+  char path[] = "/tmp/messageservice_test.XXXXXX";
+  int file_descriptor = mkstemp(path);
+  assert(file_descriptor >= 0);
+  unlink(path);
+  ssize_t write_result =
+    write(file_descriptor,contents.data(),contents.size());
+  assert(write_result == ssize_t(contents.size()));
+  return file_descriptor;
+}
+
+
+static void testQueueingFileToClient()
+{
+  ClientServerTester tester;
+  TestServer &server = tester.server;
+  server.callbacks.client_connected = do_nothing;
+  tester.waitForConnection();
+  MessageServer::ClientId client_id = tester.clientId();
+
+  // Only part of the file is sent, including the null terminator.
+  string file_contents = string("header,file message",20) + "trailer";
+  int file_descriptor = createTemporaryFile(file_contents);
+  queueMessageToClientOn(server,client_id,"before");
+  server.queueFileToClient(client_id,file_descriptor,/*offset*/7,13);
+  queueMessageToClientOn(server,client_id,"after");
+  vector<string> received_messages;
+
+  tester.clientCallbacks().got_message =
+    [&received_messages](const char *message){
+      received_messages.push_back(message);
+    };
+
+  while (received_messages.size() != 3) {
+    tester.processEvents();
+  }
+
+  vector<string> expected_messages = {"before","file message","after"};
+  assert(received_messages == expected_messages);
+  assert(!tester.sockets.isCorked(server.clientSocketId(client_id)));
+  close(file_descriptor);
+}
+
+
+static void testQueueingSharedMessage()
+{
+  Tester tester;
+  TestServer &server = tester.createServer();
+  TestClient &client1 = tester.createClient();
+  TestClient &client2 = tester.createClient();
+  server.callbacks.client_connected = do_nothing;
+
+  while (server.nClients() != 2) {
+    tester.processEvents();
+  }
+
+  const char message[] = "shared";
+  SharedMessage shared_message = makeSharedMessage(message,sizeof message);
+
+  for (MessageServer::ClientId client_id : server.clientIds()) {
+    server.queueSharedMessageToClient(client_id,shared_message);
+  }
+
+  // Nothing was copied.
+  assert(shared_message.use_count() == 3);
+
+  vector<string> received_messages;
+
+  auto got_message_function =
+    [&received_messages](const char *message){
+      received_messages.push_back(message);
+    };
+
+  client1.callbacks.got_message = got_message_function;
+  client2.callbacks.got_message = got_message_function;
+
+  while (received_messages.size() != 2) {
+    tester.processEvents();
+  }
+
+  assert(received_messages == (vector<string>{"shared","shared"}));
+  assert(shared_message.use_count() == 1);
+}
+
+
+static void testMixingCopiedAndSharedMessages()
+{
+  Tester tester;
+  TestServer &server = tester.createServer();
+  TestClient &client = tester.createClient();
+  server.callbacks.client_connected = do_nothing;
+
+  while (server.nClients() != 1) {
+    tester.processEvents();
+  }
+
+  MessageServer::ClientId client_id = onlyClientId(server);
+  const char message[] = "shared";
+  SharedMessage shared_message = makeSharedMessage(message,sizeof message);
+
+  // Copied messages are sent from one buffer, but they have to stay in
+  // order with the shared ones.
+  queueMessageToClientOn(server,client_id,"a");
+  server.queueSharedMessageToClient(client_id,shared_message);
+  queueMessageToClientOn(server,client_id,"b");
+  queueMessageToClientOn(server,client_id,"c");
+  server.queueSharedMessageToClient(client_id,shared_message);
+  queueMessageToClientOn(server,client_id,"d");
+  vector<string> received_messages;
+
+  client.callbacks.got_message =
+    [&received_messages](const char *message){
+      received_messages.push_back(message);
+    };
+
+  while (received_messages.size() != 6) {
+    tester.processEvents();
+  }
+
+  assert(
+    received_messages ==
+    (vector<string>{"a","shared","b","c","shared","d"})
+  );
+
+  assert(!server.isSendingAMessageTo(client_id));
+  assert(shared_message.use_count() == 1);
+}
+
+
+namespace {
+struct CoalescingTester : Tester {
+  FakeClock clock;
+  TestServer &server = createServer();
+  vector<string> received_messages;
+
+  CoalescingTester(size_t max_bytes,std::chrono::microseconds max_delay)
+  {
+    selector.setClock(clock);
+    QueuedMessageSender::CoalescingOptions options;
+    options.max_bytes = max_bytes;
+    options.max_delay = max_delay;
+    server.enableCoalescing(clock,options);
+    server.callbacks.client_connected = do_nothing;
+    TestClient &client = createClient();
+
+    client.callbacks.got_message =
+      [this](const char *message){
+        received_messages.push_back(message);
+      };
+
+    while (server.nClients() != 1) {
+      processEvents();
+    }
+  }
+};
+}
+
+
+static void testCoalescingUntilTheDelay()
+{
+  std::chrono::milliseconds max_delay(1);
+  CoalescingTester tester(/*max_bytes*/1000,max_delay);
+  MessageServer::ClientId client_id = onlyClientId(tester.server);
+  SocketId socket_id = tester.server.clientSocketId(client_id);
+
+  // We do our own batching, so the socket shouldn't also delay.
+  assert(tester.sockets.noDelayIsSet(socket_id));
+
+  FakeClock::TimePoint start_time = tester.clock.now();
+  queueMessageToClientOn(tester.server,client_id,"a");
+  queueMessageToClientOn(tester.server,client_id,"b");
+  queueMessageToClientOn(tester.server,client_id,"c");
+  assert(tester.server.isSendingAMessageTo(client_id));
+
+  while (tester.received_messages.size() != 3) {
+    tester.processEvents();
+  }
+
+  assert(tester.clock.now() - start_time == max_delay);
+  assert(tester.received_messages == (vector<string>{"a","b","c"}));
+}
+
+
+static void testCoalescingUntilTheSize()
+{
+  // Each message is a four byte header and two bytes of payload.
+  CoalescingTester tester(/*max_bytes*/12,std::chrono::milliseconds(1));
+  MessageServer::ClientId client_id = onlyClientId(tester.server);
+  FakeClock::TimePoint start_time = tester.clock.now();
+  queueMessageToClientOn(tester.server,client_id,"a");
+  queueMessageToClientOn(tester.server,client_id,"b");
+
+  while (tester.received_messages.size() != 2) {
+    tester.processEvents();
+  }
+
+  // There was no need to wait.
+  assert(tester.clock.now() == start_time);
+  assert(tester.received_messages == (vector<string>{"a","b"}));
+}
+
+
+static void testDraining()
+{
+  Tester tester;
+  TestServer &server = tester.createServer();
+  server.enableDraining(/*max_bytes*/64*1024);
+  tester.clients.emplace_back(tester.sockets);
+  TestClient &client = tester.clients.back();
+  client.enableDraining(/*max_bytes*/64*1024);
+  client.startConnecting(server_port);
+  server.callbacks.client_connected = do_nothing;
+
+  while (server.nClients() != 1 || !client.isConnected()) {
+    tester.processEvents();
+  }
+
+  RandomEngine engine;
+  engine.seed(1);
+  string request = randomMessageOfLength(1000,engine);
+  string reply = randomMessageOfLength(1000,engine);
+  optional<string> maybe_received_reply;
+
+  server.callbacks.got_message =
+    [&](MessageServer::ClientId client_id,const char *message){
+      assert(message == request);
+      queueMessageToClientOn(server,client_id,reply.c_str());
+    };
+
+  client.callbacks.got_message =
+    [&](const char *message){ maybe_received_reply.emplace(message); };
+
+  // The tiny fake socket buffers fill up on every select, which mustn't
+  // be mistaken for an error.
+  queueMessageOn(client,request.c_str());
+
+  while (!maybe_received_reply) {
+    tester.processEvents();
+  }
+
+  assert(*maybe_received_reply == reply);
+  assert(server.nClients() == 1);
+  assert(client.isConnected());
+}
+
+
+namespace {
+struct LaneTester : Tester {
+  TestServer &server = createServer();
+  vector<string> received_messages;
+
+  LaneTester(const QueuedMessageSender::LaneOptions &options)
+  {
+    server.enableLanes(options);
+    server.callbacks.client_connected = do_nothing;
+    TestClient &client = createClient();
+
+    client.callbacks.got_message =
+      [this](const char *message){
+        received_messages.push_back(message);
+      };
+
+    while (server.nClients() != 1) {
+      processEvents();
+    }
+  }
+
+  void waitForMessages(size_t n_messages)
+  {
+    while (received_messages.size() != n_messages) {
+      processEvents();
+    }
+
+    assert(!server.isSendingAMessageTo(onlyClientId(server)));
+  }
+};
+}
+
+
+static void testStrictPriorityLanes()
+{
+  // Each message is a four byte header and three bytes of payload, so
+  // two messages are committed at a time.
+  QueuedMessageSender::LaneOptions options;
+  options.policy = QueuedMessageSender::LaneOptions::Policy::strict_priority;
+  options.weights = {1,1};
+  options.max_committed_bytes = 8;
+  LaneTester tester(options);
+  MessageServer::ClientId client_id = onlyClientId(tester.server);
+  const char urgent_message[] = "u2";
+
+  SharedMessage shared_message =
+    makeSharedMessage(urgent_message,sizeof urgent_message);
+
+  for (const char *message : {"b1","b2","b3","b4","b5"}) {
+    queueMessageToClientOn(tester.server,client_id,message,/*lane*/1);
+  }
+
+  queueMessageToClientOn(tester.server,client_id,"u1",/*lane*/0);
+  tester.server.queueSharedMessageToClient(client_id,shared_message,0);
+  tester.waitForMessages(7);
+
+  // The urgent messages only wait for the ones which were committed.
+  assert(
+    tester.received_messages ==
+    (vector<string>{"b1","b2","u1","u2","b3","b4","b5"})
+  );
+}
+
+
+static void testRoundRobinLanes()
+{
+  // Each message is six bytes, so lane 1 gets two messages for each one
+  // from lane 0 while both have messages.  Messages are only committed
+  // when nothing else is waiting.
+  QueuedMessageSender::LaneOptions options;
+  options.policy =
+    QueuedMessageSender::LaneOptions::Policy::weighted_round_robin;
+  options.weights = {6,12};
+  options.max_committed_bytes = 1;
+  LaneTester tester(options);
+  MessageServer::ClientId client_id = onlyClientId(tester.server);
+
+  for (const char *message : {"a","b","c","d"}) {
+    queueMessageToClientOn(tester.server,client_id,message,/*lane*/0);
+  }
+
+  for (const char *message : {"w","x","y","z"}) {
+    queueMessageToClientOn(tester.server,client_id,message,/*lane*/1);
+  }
+
+  tester.waitForMessages(8);
+
+  assert(
+    tester.received_messages ==
+    (vector<string>{"a","w","x","b","y","z","c","d"})
+  );
+}
+
+
+namespace {
+struct FlowControlTester : Tester {
+  FakeClock clock;
+  TestServer &server = createServer();
+  TestClient &client;
+  vector<string> server_messages;
+  vector<string> client_messages;
+
+  FlowControlTester(
+    const QueuedMessageSender::FlowControlOptions &server_options,
+    const QueuedMessageSender::FlowControlOptions &client_options
+  )
+  : client(clients.emplace_back(sockets))
+  {
+    server.enableFlowControl(clock,server_options);
+    client.enableFlowControl(clock,client_options);
+    client.startConnecting(server_port);
+    server.callbacks.client_connected = do_nothing;
+
+    server.callbacks.got_message =
+      [this](MessageServer::ClientId,const char *message){
+        server_messages.push_back(message);
+      };
+
+    client.callbacks.got_message =
+      [this](const char *message){
+        client_messages.push_back(message);
+      };
+
+    while (server.nClients() != 1 || !client.isConnected()) {
+      processEvents();
+    }
+
+    // Let each end get its initial credit.
+    settle();
+  }
+
+  // Process events until nothing more happens.
+  void settle()
+  {
+    for (int i=0; i!=100; ++i) {
+      processEvents();
+    }
+  }
+};
+}
+
+
+static QueuedMessageSender::FlowControlOptions
+  flowControlOptions(uint32_t window,bool grant_on_delivery)
+{
+  QueuedMessageSender::FlowControlOptions options;
+  options.window = window;
+  options.grant_on_delivery = grant_on_delivery;
+  return options;
+}
+
+
+static void testFlowControlWithSlowReceiver()
+{
+  FlowControlTester tester(
+    flowControlOptions(/*window*/4,/*grant_on_delivery*/false),
+    flowControlOptions(/*window*/4,/*grant_on_delivery*/true)
+  );
+
+  MessageServer::ClientId client_id = onlyClientId(tester.server);
+  vector<string> messages;
+
+  for (int i=0; i!=10; ++i) {
+    messages.push_back(std::to_string(i));
+    queueMessageOn(tester.client,messages.back().c_str());
+  }
+
+  // The server hasn't said that it has dealt with any messages, so only
+  // the first window of them is sent.
+  tester.settle();
+  assert(tester.server_messages.size() == 4);
+  assert(tester.client.isSendingAMessage());
+  tester.clock.advance(std::chrono::milliseconds(5));
+  QueuedMessageSender::FlowControlStats stats =
+    tester.client.flowControlStats();
+  assert(stats.n_stalls == 1);
+  assert(stats.stalled_time == std::chrono::milliseconds(5));
+
+  tester.server.grantCredit(client_id,4);
+  tester.settle();
+  assert(tester.server_messages.size() == 8);
+  tester.server.grantCredit(client_id,4);
+  tester.settle();
+  assert(tester.server_messages == messages);
+  assert(!tester.client.isSendingAMessage());
+
+  // Only the first wait took any time.
+  stats = tester.client.flowControlStats();
+  assert(stats.n_stalls == 2);
+  assert(stats.stalled_time == std::chrono::milliseconds(5));
+}
+
+
+static void testFlowControlGrantingOnDelivery()
+{
+  FlowControlTester tester(
+    flowControlOptions(/*window*/4,/*grant_on_delivery*/true),
+    flowControlOptions(/*window*/4,/*grant_on_delivery*/true)
+  );
+
+  MessageServer::ClientId client_id = onlyClientId(tester.server);
+  vector<string> messages;
+
+  for (int i=0; i!=100; ++i) {
+    messages.push_back(std::to_string(i));
+    queueMessageToClientOn(tester.server,client_id,messages.back().c_str());
+  }
+
+  while (tester.client_messages.size() != messages.size()) {
+    tester.processEvents();
+  }
+
+  assert(tester.client_messages == messages);
+
+  // Credit messages aren't counted as messages.
+  assert(tester.client.nMessagesSent() == 0);
+}
+
+
+static void testFlowControlAfterRefusedConnections()
+{
+  Tester tester;
+  FakeClock clock;
+  QueuedMessageSender::FlowControlOptions options =
+    flowControlOptions(/*window*/4,/*grant_on_delivery*/false);
+  TestClient &client = tester.clients.emplace_back(tester.sockets);
+  client.enableFlowControl(clock,options);
+  client.callbacks.connection_refused = do_nothing;
+
+  // Nobody is listening yet.
+  for (int i=0; i!=3; ++i) {
+    client.startConnecting(server_port);
+
+    while (client.isActive()) {
+      tester.processEvents();
+    }
+  }
+
+  TestServer &server = tester.createServer();
+  server.enableFlowControl(clock,options);
+  server.callbacks.client_connected = do_nothing;
+  client.startConnecting(server_port);
+  vector<string> client_messages;
+
+  client.callbacks.got_message =
+    [&](const char *message){
+      client_messages.push_back(message);
+    };
+
+  while (server.nClients() != 1 || !client.isConnected()) {
+    tester.processEvents();
+  }
+
+  MessageServer::ClientId client_id = onlyClientId(server);
+
+  for (int i=0; i!=10; ++i) {
+    queueMessageToClientOn(server,client_id,std::to_string(i).c_str());
+  }
+
+  for (int i=0; i!=100; ++i) {
+    tester.processEvents();
+  }
+
+  // Only the window from the connection that succeeded was granted.
+  assert(client_messages.size() == 4);
+}
+
+
+namespace {
+struct CompressionTester : Tester {
+  TestServer &server = createServer();
+  TestClient &client;
+  vector<string> server_messages;
+  vector<string> client_messages;
+
+  CompressionTester(const QueuedMessageSender::CompressionOptions &options)
+  : client(clients.emplace_back(sockets))
+  {
+    server.enableCompression(options);
+    client.enableCompression(options);
+    client.startConnecting(server_port);
+    server.callbacks.client_connected = do_nothing;
+
+    server.callbacks.got_message =
+      [this](MessageServer::ClientId,const char *message){
+        server_messages.push_back(message);
+      };
+
+    client.callbacks.got_message =
+      [this](const char *message){
+        client_messages.push_back(message);
+      };
+
+    while (server.nClients() != 1 || !client.isConnected()) {
+      processEvents();
+    }
+  }
+};
+}
+
+
+static void testCompressingLargeMessages()
+{
+  QueuedMessageSender::CompressionOptions options;
+  options.min_message_size = 100;
+  CompressionTester tester(options);
+  MessageServer::ClientId client_id = onlyClientId(tester.server);
+  RandomEngine engine(1);
+  string text;
+
+  for (int i=0; i!=100; ++i) {
+    text += "line " + std::to_string(i) + " of some compressible text\n";
+  }
+
+  // Random bytes don't get smaller, so they are sent as they are.
+  vector<string> messages =
+    {text,"short",randomMessageOfLength(1000,engine),text};
+
+  for (const string &message : messages) {
+    queueMessageToClientOn(tester.server,client_id,message.c_str());
+    queueMessageOn(tester.client,message.c_str());
+  }
+
+  while (
+    tester.client_messages.size() != messages.size() ||
+    tester.server_messages.size() != messages.size()
+  ) {
+    tester.processEvents();
+  }
+
+  assert(tester.client_messages == messages);
+  assert(tester.server_messages == messages);
+
+  QueuedMessageSender::CompressionStats server_stats =
+    tester.server.compressionStats(client_id);
+
+  QueuedMessageSender::CompressionStats client_stats =
+    tester.client.compressionStats();
+
+  assert(server_stats.n_compressed_messages == 2);
+  assert(server_stats.n_original_bytes == 2*(text.size() + 1));
+  assert(server_stats.n_compressed_bytes*4 < server_stats.n_original_bytes);
+  assert(client_stats.n_compressed_messages == 2);
+}
+
+
+static void testBadCompressedMessage()
+{
+  CompressionTester tester(QueuedMessageSender::CompressionOptions{});
+  SocketId socket_id =
+    tester.server.clientSocketId(onlyClientId(tester.server));
+
+  // The payload claims to be six bytes, but only decompresses to five.
+  const char message[] = {0x40,0,0,9, 0,0,0,6, 0x50,'a','b','c','d'};
+  size_t n_bytes_sent = 0;
+
+  while (n_bytes_sent != sizeof message) {
+    int send_result =
+      tester.sockets.send(
+        socket_id,message + n_bytes_sent,sizeof message - n_bytes_sent
+      );
+
+    if (send_result > 0) {
+      n_bytes_sent += send_result;
+    }
+
+    tester.processEvents();
+  }
+
+  // The client doesn't get the message, and gives up on the connection.
+  while (tester.client.isActive()) {
+    tester.processEvents();
+  }
+
+  assert(tester.client_messages.empty());
+}
+
+
+namespace {
+struct IdleTimeoutTester : Tester {
+  FakeClock clock;
+  TestServer &server = createServer();
+  vector<MessageServer::ClientId> disconnected_client_ids;
+
+  IdleTimeoutTester(const MessageServer::IdleTimeoutOptions &options)
+  {
+    selector.setClock(clock);
+    server.enableIdleTimeout(clock,options);
+    server.callbacks.client_connected = do_nothing;
+
+    server.callbacks.client_disconnected =
+      [this](MessageServer::ClientId client_id){
+        disconnected_client_ids.push_back(client_id);
+      };
+  }
+
+  // A connection whose other end never reads or sends anything, as if
+  // its host had gone away.
+  SocketId connectSilently()
+  {
+    SocketId socket_id = sockets.create();
+    sockets.setNonBlocking(socket_id,true);
+    InternetAddress address;
+    address.setPort(server_port);
+    sockets.connect(socket_id,address);
+
+    // Fake connections are only made once the socket is selected.
+    selector.beginSelect();
+    selector.preSelectParams().setWrite(socket_id);
+    selector.callSelect();
+    assert(selector.postSelectParams().writeIsSet(socket_id));
+    selector.endSelect();
+    return socket_id;
+  }
+};
+}
+
+
+static void testPingingIdleClients()
+{
+  MessageServer::IdleTimeoutOptions options;
+  options.timeout = std::chrono::seconds(3);
+  options.maybe_ping_time = std::chrono::seconds(1);
+  options.maybe_keep_alive_time = std::chrono::seconds(60);
+  IdleTimeoutTester tester(options);
+  TestClient &client = tester.createClient();
+
+  while (tester.server.nClients() != 1 || !client.isConnected()) {
+    tester.processEvents();
+  }
+
+  MessageServer::ClientId client_id = onlyClientId(tester.server);
+  SocketId silent_socket_id = tester.connectSilently();
+
+  while (tester.server.nClients() != 2) {
+    tester.processEvents();
+  }
+
+  FakeClock::TimePoint start_time = tester.clock.now();
+
+  while (tester.disconnected_client_ids.empty()) {
+    tester.processEvents();
+  }
+
+  // The client which didn't answer its ping is disconnected once the
+  // timeout has passed, and the pings never reach either application.
+  assert(tester.clock.now() - start_time == options.timeout);
+  assert(tester.disconnected_client_ids.size() == 1);
+  assert(tester.disconnected_client_ids[0] != client_id);
+
+  assert(
+    tester.sockets.maybeKeepAliveTime(tester.server.clientSocketId(client_id))
+    == options.maybe_keep_alive_time
+  );
+
+  // The client which answers its pings stays connected.
+  while (tester.clock.now() - start_time < std::chrono::seconds(20)) {
+    tester.processEvents();
+  }
+
+  using ClientIds = vector<MessageServer::ClientId>;
+  assert(tester.server.clientIds() == ClientIds{client_id});
+  assert(client.isConnected());
+  tester.sockets.close(silent_socket_id);
+}
+
+
+static void testTimingOutWithoutPings()
+{
+  MessageServer::IdleTimeoutOptions options;
+  options.timeout = std::chrono::seconds(2);
+  options.maybe_ping_time.reset();
+  IdleTimeoutTester tester(options);
+  TestClient &client = tester.createClient();
+
+  while (tester.server.nClients() != 1 || !client.isConnected()) {
+    tester.processEvents();
+  }
+
+  FakeClock::TimePoint start_time = tester.clock.now();
+  bool got_message = false;
+
+  tester.server.callbacks.got_message =
+    [&](MessageServer::ClientId,const char *){ got_message = true; };
+
+  // Sending a message puts off the timeout.
+  tester.clock.advance(std::chrono::seconds(1));
+  queueMessageOn(client,"hello");
+
+  while (!got_message) {
+    tester.processEvents();
+  }
+
+  while (client.isActive()) {
+    tester.processEvents();
+  }
+
+  assert(tester.disconnected_client_ids.size() == 1);
+  assert(tester.clock.now() - start_time == std::chrono::seconds(3));
+}
+
+
+static void testRejectingLargeCompressedMessage()
+{
+  Tester tester;
+  TestServer &server = tester.createServer();
+  server.enableCompression(QueuedMessageSender::CompressionOptions{});
+  server.callbacks.client_connected = do_nothing;
+  server.callbacks.client_disconnected = do_nothing;
+  TestClient &client = tester.clients.emplace_back(tester.sockets);
+  client.setMaxMessageSize(100);
+  client.startConnecting(server_port);
+
+  while (server.nClients() != 1) {
+    tester.processEvents();
+  }
+
+  // The message is well under the limit when compressed, but not once it
+  // is decompressed, so the client gives up without getting it.
+  string message(2000,'a');
+  queueMessageToClientOn(server,onlyClientId(server),message.c_str());
+
+  while (client.isActive()) {
+    tester.processEvents();
+  }
+}
+
+
+// Exchanges a message each way between the server and two clients, with
+// an error injected on the server's socket for the first client.  Returns
+// whether the first client's connection survived.  The second client is
+// never affected.
+static bool
+  connectionSurvivesError(
+    bool is_send_error,
+    int error_number,
+    size_t n_bytes_before_error
+  )
+{
+  using ClientId = MessageServer::ClientId;
+  Tester tester;
+  TestServer &server = tester.createServer();
+  vector<ClientId> client_ids;
+
+  server.callbacks.client_connected =
+    [&](ClientId client_id){ client_ids.push_back(client_id); };
+
+  server.callbacks.client_disconnected = do_nothing;
+  TestClient &client1 = tester.createClient();
+
+  while (client_ids.size() != 1) {
+    tester.processEvents();
+  }
+
+  TestClient &client2 = tester.createClient();
+
+  while (client_ids.size() != 2) {
+    tester.processEvents();
+  }
+
+  const string message = "this is a message";
+  vector<int> n_server_messages(2);
+  vector<int> n_client_messages(2);
+
+  server.callbacks.got_message =
+    [&](ClientId client_id,const char *received_message){
+      assert(received_message == message);
+      size_t index = client_id == client_ids[0] ? 0 : 1;
+      ++n_server_messages[index];
+    };
+
+  client1.callbacks.got_message =
+    [&](const char *received_message){
+      assert(received_message == message);
+      ++n_client_messages[0];
+    };
+
+  client2.callbacks.got_message =
+    [&](const char *received_message){
+      assert(received_message == message);
+      ++n_client_messages[1];
+    };
+
+  SocketId socket_id = server.clientSocketId(client_ids[0]);
+
+  if (is_send_error) {
+    tester.sockets.setNBytesBeforeSendError(
+      socket_id,n_bytes_before_error,error_number
+    );
+  }
+  else {
+    tester.sockets.setNBytesBeforeRecvError(
+      socket_id,n_bytes_before_error,error_number
+    );
+  }
+
+  for (int index : {0,1}) {
+    queueMessageOn(index == 0 ? client1 : client2,message.c_str());
+    queueMessageToClientOn(server,client_ids[index],message.c_str());
+  }
+
+  auto is_done = [&](int index){
+    return n_server_messages[index] == 1 && n_client_messages[index] == 1;
+  };
+
+  while (!is_done(1) || (!is_done(0) && server.nClients() == 2)) {
+    tester.processEvents();
+  }
+
+  bool survived = (server.nClients() == 2);
+
+  if (!survived) {
+    // The client notices once the server has closed its side.
+    while (client1.isActive()) {
+      tester.processEvents();
+    }
+  }
+
+  return survived;
+}
+
+
+static void testInjectedErrors()
+{
+  RandomEngine engine;
+  engine.seed(1);
+  const size_t max_bytes_before_error = 30;
+
+  for (bool is_send_error : {false,true}) {
+    for (int error_number : {EINTR,EAGAIN,ECONNRESET,EPIPE,EIO}) {
+      bool is_transient = (error_number == EINTR || error_number == EAGAIN);
+
+      for (int i=0; i!=10; ++i) {
+        size_t n_bytes_before_error =
+          std::uniform_int_distribution<size_t>(
+            0,max_bytes_before_error
+          )(engine);
+
+        bool survived =
+          connectionSurvivesError(
+            is_send_error,error_number,n_bytes_before_error
+          );
+
+        // Each message is a four byte header and 18 bytes of payload.
+        // Errors after the whole message was transferred aren't seen.
+        bool error_was_seen = n_bytes_before_error < 4 + 18;
+        assert(survived == (is_transient || !error_was_seen));
+      }
+    }
+  }
+}
+
+
 static void runUnitTests()
 {
   testClientSendingAMessage();
@@ -717,15 +1924,39 @@ static void runUnitTests()
   testClientSendingMultipleMessages();
   testServerSendingMessage();
   testMultipleClients();
+  testDisconnectingOneOfSeveralClients();
   testClientConnectingAfterDisconnect();
   testDestroyingServerWhileConnected();
   testDestroyingServerWhileConnected2();
   testQueingMultipleMessagesFromServer();
   testQueingMultipleMessagesFromClient();
   testSendingLongMessage();
+  testRejectingLargeMessages();
+  testRejectingHugeHeader();
+  testDisconnectingFromGotMessage();
   testReadError();
+  testReusingClientAfterReadError();
   testSendEOF();
   testSendError();
+  testZeroCopySend();
+  testZeroCopyCompletionsOutOfOrder();
+  testQueueingFileToClient();
+  testQueueingSharedMessage();
+  testMixingCopiedAndSharedMessages();
+  testCoalescingUntilTheDelay();
+  testCoalescingUntilTheSize();
+  testDraining();
+  testStrictPriorityLanes();
+  testRoundRobinLanes();
+  testFlowControlWithSlowReceiver();
+  testFlowControlGrantingOnDelivery();
+  testFlowControlAfterRefusedConnections();
+  testCompressingLargeMessages();
+  testBadCompressedMessage();
+  testRejectingLargeCompressedMessage();
+  testPingingIdleClients();
+  testTimingOutWithoutPings();
+  testInjectedErrors();
 }
 
 int main()
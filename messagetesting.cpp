@@ -1,5 +1,6 @@
 #include "messagetesting.hpp"
 
+#include <cassert>
 #include <iostream>
 #include <sstream>
 
@@ -18,9 +19,9 @@ struct MessageTestClient::TerminalHandler : Terminal::EventInterface {
   {
   }
 
-  void gotLine(const std::string &line) override
+  void gotLine(Terminal::Line line) override
   {
-    message_test_client.gotLineFromTerminal(line);
+    message_test_client.gotLineFromTerminal(std::string(line));
   }
 
   void endOfFile() override
@@ -36,6 +37,28 @@ void MessageTestClient::start()
 }
 
 
+void MessageTestClient::start(const InternetAddress &server_address)
+{
+  start(std::vector<InternetAddress>{server_address});
+}
+
+
+void
+  MessageTestClient::start(const std::vector<InternetAddress> &server_addresses)
+{
+  assert(!server_addresses.empty());
+
+  // Kept in reverse so the next address can be popped from the back.
+  untried_server_addresses.assign(
+    server_addresses.rbegin(),server_addresses.rend()
+  );
+
+  InternetAddress server_address = untried_server_addresses.back();
+  untried_server_addresses.pop_back();
+  message_client.startConnecting(server_address);
+}
+
+
 void MessageTestClient::setupSelect(PreSelectParamsInterface &pre_select)
 {
   message_client.setupSelect(pre_select);
@@ -46,6 +69,17 @@ void MessageTestClient::setupSelect(PreSelectParamsInterface &pre_select)
 void MessageTestClient::connectionRefused()
 {
   ostringstream stream;
+
+  if (!untried_server_addresses.empty()) {
+    InternetAddress server_address = untried_server_addresses.back();
+    untried_server_addresses.pop_back();
+    stream << "Connection refused.  Trying " << server_address.hostString() <<
+      " port " << server_address.port() << ".\n";
+    terminal.show(stream.str());
+    message_client.startConnecting(server_address);
+    return;
+  }
+
   stream << "Connection refused.\n";
   terminal.show(stream.str());
 }
@@ -59,7 +93,7 @@ void MessageTestClient::connected()
 }
 
 
-void MessageTestClient::gotMessageFromServer(const char *message)
+void MessageTestClient::gotMessageFromServer(const string &message)
 {
   ostringstream stream;
   stream << "Got message: " << message << "\n";
@@ -85,9 +119,10 @@ struct MessageTestClient::ClientHandler : MessageClient::EventInterface {
     message_test_client.connected();
   }
 
-  void gotMessage(const char *message) override
+  void gotMessage(const char *message,size_t message_size) override
   {
-    message_test_client.gotMessageFromServer(message);
+    // Messages aren't terminated.
+    message_test_client.gotMessageFromServer(string(message,message_size));
   }
 };
 
@@ -108,7 +143,7 @@ void MessageTestClient::sendMessage(const string &message)
   ostringstream stream;
   stream << "Sending message " << message << "\n";
   terminal.show(stream.str());
-  message_client.queueMessage(message.c_str(),message.length() + 1);
+  message_client.queueMessage(message.data(),message.length());
 }
 
 
@@ -136,9 +171,12 @@ struct MessageTestServer::ServerHandler : MessageServer::EventInterface {
   {
   }
 
-  virtual void gotMessage(ClientId client_id,const char *message)
+  virtual void
+    gotMessage(ClientId client_id,const char *message,size_t message_size)
   {
-    message_test_server.gotMessageFromClient(client_id,message);
+    message_test_server.gotMessageFromClient(
+      client_id,string(message,message_size)
+    );
   }
 
   virtual void clientConnected(ClientId client_id)
@@ -163,9 +201,9 @@ struct MessageTestServer::TerminalHandler : Terminal::EventInterface {
   {
   }
 
-  void gotLine(const std::string &line) override
+  void gotLine(Terminal::Line line) override
   {
-    message_test_server.gotLineFromTerminal(line);
+    message_test_server.gotLineFromTerminal(std::string(line));
   }
 
   void endOfFile() override
@@ -193,7 +231,8 @@ void MessageTestServer::setupSelect(PreSelectParamsInterface &pre_select)
 }
 
 
-void MessageTestServer::gotMessageFromClient(ClientId,const char *message)
+void
+  MessageTestServer::gotMessageFromClient(ClientId,const string &message)
 {
   ostringstream stream;
   stream << "Got message: " << message << "\n";
@@ -232,7 +271,7 @@ void
   terminal.show(stream.str());
 
   message_server.queueMessageToClient(
-    client_id,message.c_str(),message.length()+1
+    client_id,message.data(),message.length()
   );
 }
 
@@ -256,9 +295,17 @@ MessageTestServer::MessageTestServer(
 
 
 bool MessageTestServer::start()
+{
+  InternetAddress listen_address;
+  listen_address.setPort(messageTestPort());
+  return start(listen_address);
+}
+
+
+bool MessageTestServer::start(const InternetAddress &listen_address)
 {
   try {
-    message_server.startListening(messageTestPort());
+    message_server.startListening(listen_address);
   }
   catch (std::runtime_error &error) {
     ostringstream stream;
@@ -268,7 +315,8 @@ bool MessageTestServer::start()
   }
 
   ostringstream stream;
-  stream << "Waiting for connection on port " << messageTestPort() << "\n";
+  stream << "Waiting for connection on port " << listen_address.port() <<
+    "\n";
   terminal.show(stream.str());
 
   return true;
@@ -4,6 +4,7 @@
 #include "socketsinterface.hpp"
 #include "terminal.hpp"
 #include "processevents.hpp"
+#include <vector>
 #include "messageservice.hpp"
 
 
@@ -12,6 +13,7 @@ public:
   MessageTestServer(SocketsInterface &,Terminal &);
 
   bool start();
+  bool start(const InternetAddress &listen_address);
   bool hasAClient() const;
   bool isActive() const;
   EventSinkInterface &eventSink() { return event_sink; }
@@ -46,7 +48,7 @@ private:
   MessageServer message_server{sockets};
   MyEventSink event_sink{*this};
 
-  void gotMessageFromClient(ClientId,const char *message);
+  void gotMessageFromClient(ClientId,const std::string &message);
   void clientConnected(ClientId client_id);
   void clientDisconnected(ClientId client_id);
   void gotLineFromTerminal(const std::string &);
@@ -61,6 +63,10 @@ public:
   MessageTestClient(SocketsInterface &,Terminal &);
 
   void start();
+  void start(const InternetAddress &server_address);
+
+  // Each address is tried in turn until one accepts the connection.
+  void start(const std::vector<InternetAddress> &server_addresses);
   void stop() { message_client.disconnect(); }
   bool isActive() { return message_client.isActive(); }
   EventSinkInterface &eventSink() { return event_sink; }
@@ -92,6 +98,7 @@ private:
   Terminal &terminal;
   MessageClient message_client{sockets};
   MyEventSink event_sink;
+  std::vector<InternetAddress> untried_server_addresses;
 
   void setupSelect(PreSelectParamsInterface &pre_select);
   void handleSelect(const PostSelectParamsInterface &post_select);
@@ -99,7 +106,7 @@ private:
   void gotEndOfFileFromTerminal() { message_client.disconnect(); }
   void connectionRefused();
   void connected();
-  void gotMessageFromServer(const char *message);
+  void gotMessageFromServer(const std::string &message);
   void sendMessage(const std::string &message);
 };
 
@@ -135,9 +135,46 @@ static void testFailureToConnect()
 }
 
 
+static void testTryingTheNextAddress()
+{
+  ClientServerTester tester;
+  tester.server.start();
+  tester.waitForServerTerminalOutput("Waiting for connection on port 4145\n");
+  InternetAddress unused_address;
+  unused_address.setLoopback();
+  unused_address.setPort(4144);
+  InternetAddress server_address;
+  server_address.setLoopback();
+  server_address.setPort(4145);
+  tester.client.start({unused_address,server_address});
+
+  tester.waitForClientTerminalOutput(
+    "Connection refused.  Trying 127.0.0.1 port 4145.\n"
+    "Connected.\n"
+  );
+
+  tester.waitForServerTerminalOutput("Client 0 connected.\n");
+}
+
+
+static void testListeningOnAnAddress()
+{
+  ClientServerTester tester;
+  InternetAddress listen_address;
+  listen_address.setLoopback(AF_INET6);
+  listen_address.setPort(4145);
+  tester.server.start(listen_address);
+  tester.waitForServerTerminalOutput("Waiting for connection on port 4145\n");
+  tester.client.start();
+  tester.waitForClientTerminalOutput("Connected.\n");
+}
+
+
 int main()
 {
   testNormalUsage();
   testFailureToListen();
   testFailureToConnect();
+  testTryingTheNextAddress();
+  testListeningOnAnAddress();
 }
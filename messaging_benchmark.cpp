@@ -0,0 +1,2226 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <ctime>
+#include <deque>
+#include <optional>
+#include <iostream>
+#include <new>
+#include <random>
+#include <string>
+#include <vector>
+#include "messageservice.hpp"
+#include "compression.hpp"
+#include "journal.hpp"
+#include "recordingsockets.hpp"
+#include "sessionreplayer.hpp"
+#include "datagramservice.hpp"
+#include "rpc.hpp"
+#include "pubsub.hpp"
+#include "reconnectingclient.hpp"
+#include "systemsockets.hpp"
+#include "systemselector.hpp"
+#include "sharedmemorysockets.hpp"
+#include "sharedmemoryselector.hpp"
+
+using std::cerr;
+using std::cout;
+using std::string;
+using std::vector;
+using Clock = std::chrono::steady_clock;
+
+static const int benchmark_port = 4146;
+static size_t n_allocations = 0;
+
+
+void *operator new(size_t size)
+{
+  ++n_allocations;
+
+  if (void *ptr = malloc(size ? size : 1)) {
+    return ptr;
+  }
+
+  throw std::bad_alloc();
+}
+
+
+// The deletes aren't inlined, since GCC then sees memory from operator new
+// being given to free() and warns about it.
+[[gnu::noinline]] void operator delete(void *ptr) noexcept
+{
+  free(ptr);
+}
+
+
+[[gnu::noinline]] void operator delete(void *ptr,size_t) noexcept
+{
+  free(ptr);
+}
+
+
+static double secondsSince(Clock::time_point start_time)
+{
+  return std::chrono::duration<double>(Clock::now() - start_time).count();
+}
+
+
+namespace {
+struct PingPong {
+  MessageServer &server;
+  MessageClient &client;
+  const string message;
+  const int n_round_trips;
+  int n_round_trips_completed = 0;
+
+  struct ServerHandler : MessageServer::EventInterface {
+    PingPong &ping_pong;
+
+    ServerHandler(PingPong &ping_pong_arg) : ping_pong(ping_pong_arg) {}
+
+    void
+      gotMessage(
+        ClientId client_id,const char *message,size_t message_size
+      ) override
+    {
+      // Echo the message back.
+      ping_pong.server.queueMessageToClient(client_id,message,message_size);
+    }
+
+    void clientConnected(ClientId) override {}
+    void clientDisconnected(ClientId) override {}
+  };
+
+  struct ClientHandler : MessageClient::EventInterface {
+    PingPong &ping_pong;
+
+    ClientHandler(PingPong &ping_pong_arg) : ping_pong(ping_pong_arg) {}
+
+    void connectionRefused() override
+    {
+      cerr << "Connection refused.\n";
+      exit(EXIT_FAILURE);
+    }
+
+    void connected() override {}
+
+    void gotMessage(const char *,size_t) override
+    {
+      ++ping_pong.n_round_trips_completed;
+      ping_pong.sendPing();
+    }
+  };
+
+  ServerHandler server_handler{*this};
+  ClientHandler client_handler{*this};
+
+  PingPong(
+    MessageServer &server_arg,
+    MessageClient &client_arg,
+    int message_size,
+    int n_round_trips_arg
+  )
+  : server(server_arg),
+    client(client_arg),
+    message(message_size - 1,'x'),
+    n_round_trips(n_round_trips_arg)
+  {
+  }
+
+  bool isDone() const { return n_round_trips_completed >= n_round_trips; }
+
+  void sendPing()
+  {
+    if (!isDone()) {
+      client.queueMessage(message.c_str(),message.size() + 1);
+    }
+  }
+
+  void processEvents(AbstractSelector &selector)
+  {
+    selector.beginSelect();
+    server.setupSelect(selector.preSelectParams());
+    client.setupSelect(selector.preSelectParams());
+    selector.callSelect();
+    server.handleSelect(selector.postSelectParams(),server_handler);
+    client.handleSelect(selector.postSelectParams(),client_handler);
+    selector.endSelect();
+  }
+};
+}
+
+
+static double
+  roundTripMicroseconds(
+    SocketsInterface &sockets,
+    AbstractSelector &selector,
+    int message_size,
+    int n_round_trips
+  )
+{
+  MessageServer server(sockets);
+  MessageClient client(sockets);
+  server.startListening(benchmark_port);
+  client.startConnecting(benchmark_port);
+  PingPong ping_pong(server,client,message_size,n_round_trips);
+
+  while (!client.isConnected()) {
+    ping_pong.processEvents(selector);
+  }
+
+  Clock::time_point start_time = Clock::now();
+  ping_pong.sendPing();
+
+  while (!ping_pong.isDone()) {
+    ping_pong.processEvents(selector);
+  }
+
+  double elapsed_seconds = secondsSince(start_time);
+  client.disconnect();
+
+  while (server.nClients() != 0) {
+    ping_pong.processEvents(selector);
+  }
+
+  return elapsed_seconds / n_round_trips * 1e6;
+}
+
+
+static int runLatencyBenchmark()
+{
+  const int n_round_trips = 20000;
+  vector<int> message_sizes = {16, 256, 4096};
+
+  for (int message_size : message_sizes) {
+    SystemSockets system_sockets;
+    SystemSelector system_selector;
+    SharedMemorySockets shared_memory_sockets;
+    SharedMemorySelector shared_memory_selector(shared_memory_sockets);
+
+    double tcp_microseconds =
+      roundTripMicroseconds(
+        system_sockets,system_selector,message_size,n_round_trips
+      );
+
+    double shared_memory_microseconds =
+      roundTripMicroseconds(
+        shared_memory_sockets,shared_memory_selector,message_size,n_round_trips
+      );
+
+    cout << "message size " << message_size << ": " <<
+      "loopback tcp " << tcp_microseconds << " us/round trip, " <<
+      "shared memory " << shared_memory_microseconds << " us/round trip\n";
+  }
+
+  return EXIT_SUCCESS;
+}
+
+
+namespace {
+struct Stream {
+  MessageServer &server;
+  MessageClient &client;
+  const string message;
+  const int n_messages;
+  int n_messages_queued = 0;
+  int n_messages_received = 0;
+
+  struct ServerHandler : MessageServer::EventInterface {
+    Stream &stream;
+
+    ServerHandler(Stream &stream_arg) : stream(stream_arg) {}
+
+    void gotMessage(ClientId,const char *,size_t) override
+    {
+      ++stream.n_messages_received;
+      stream.queueMessage();
+    }
+
+    void clientConnected(ClientId) override {}
+    void clientDisconnected(ClientId) override {}
+  };
+
+  struct ClientHandler : MessageClient::EventInterface {
+    void connectionRefused() override
+    {
+      cerr << "Connection refused.\n";
+      exit(EXIT_FAILURE);
+    }
+
+    void connected() override {}
+    void gotMessage(const char *,size_t) override {}
+  };
+
+  ServerHandler server_handler{*this};
+  ClientHandler client_handler;
+
+  Stream(
+    MessageServer &server_arg,
+    MessageClient &client_arg,
+    size_t message_size,
+    int n_messages_arg
+  )
+  : server(server_arg),
+    client(client_arg),
+    message(message_size - 1,'x'),
+    n_messages(n_messages_arg)
+  {
+  }
+
+  bool isDone() const { return n_messages_received >= n_messages; }
+
+  void queueMessage()
+  {
+    if (n_messages_queued < n_messages) {
+      client.queueMessage(message.c_str(),message.size() + 1);
+      ++n_messages_queued;
+    }
+  }
+
+  void processEvents(AbstractSelector &selector)
+  {
+    selector.beginSelect();
+    server.setupSelect(selector.preSelectParams());
+    client.setupSelect(selector.preSelectParams());
+    selector.callSelect();
+    server.handleSelect(selector.postSelectParams(),server_handler);
+    client.handleSelect(selector.postSelectParams(),client_handler);
+    selector.endSelect();
+  }
+};
+}
+
+
+static double
+  streamMegabytesPerSecond(
+    size_t message_size,
+    int n_messages,
+    std::optional<size_t> maybe_zero_copy_threshold
+  )
+{
+  SystemSockets sockets;
+  SystemSelector selector;
+  MessageServer server(sockets);
+  MessageClient client(sockets);
+
+  if (maybe_zero_copy_threshold) {
+    client.setZeroCopyThreshold(*maybe_zero_copy_threshold);
+  }
+
+  server.startListening(benchmark_port);
+  client.startConnecting(benchmark_port);
+  Stream stream(server,client,message_size,n_messages);
+
+  while (!client.isConnected()) {
+    stream.processEvents(selector);
+  }
+
+  Clock::time_point start_time = Clock::now();
+  const int n_messages_in_flight = 2;
+
+  for (int i=0; i!=n_messages_in_flight; ++i) {
+    stream.queueMessage();
+  }
+
+  while (!stream.isDone()) {
+    stream.processEvents(selector);
+  }
+
+  double elapsed_seconds = secondsSince(start_time);
+
+  while (client.isSendingAMessage()) {
+    stream.processEvents(selector);
+  }
+
+  client.disconnect();
+
+  while (server.nClients() != 0) {
+    stream.processEvents(selector);
+  }
+
+  return double(message_size) * n_messages / elapsed_seconds / 1e6;
+}
+
+
+// Note that on loopback the kernel copies zero-copy sends anyway, so this
+// mostly shows the overhead of the completion handling.  The benefit
+// only shows up on a real network device.
+static int runZeroCopyBenchmark()
+{
+  const size_t message_size = 8*1024*1024;
+  const int n_messages = 64;
+
+  double copying_rate =
+    streamMegabytesPerSecond(message_size,n_messages,std::nullopt);
+
+  double zero_copy_rate =
+    streamMegabytesPerSecond(message_size,n_messages,/*threshold*/64*1024);
+
+  cout << "message size " << message_size << ": " <<
+    "copying " << copying_rate << " MB/s, " <<
+    "zero-copy " << zero_copy_rate << " MB/s\n";
+
+  return EXIT_SUCCESS;
+}
+
+
+namespace {
+struct FileTransfer {
+  MessageServer &server;
+  MessageClient &client;
+  const int file_descriptor;
+  const size_t file_size;
+  const bool use_send_file;
+  const int n_transfers;
+  int n_transfers_queued = 0;
+  int n_transfers_received = 0;
+
+  struct ServerHandler : MessageServer::EventInterface {
+    void gotMessage(ClientId,const char *,size_t) override {}
+    void clientConnected(ClientId) override {}
+    void clientDisconnected(ClientId) override {}
+  };
+
+  struct ClientHandler : MessageClient::EventInterface {
+    FileTransfer &transfer;
+
+    ClientHandler(FileTransfer &transfer_arg) : transfer(transfer_arg) {}
+
+    void connectionRefused() override
+    {
+      cerr << "Connection refused.\n";
+      exit(EXIT_FAILURE);
+    }
+
+    void connected() override {}
+
+    void gotMessage(const char *,size_t message_size) override
+    {
+      assert(message_size == transfer.file_size);
+      ++transfer.n_transfers_received;
+      transfer.queueTransfer();
+    }
+  };
+
+  ServerHandler server_handler;
+  ClientHandler client_handler{*this};
+
+  FileTransfer(
+    MessageServer &server_arg,
+    MessageClient &client_arg,
+    int file_descriptor_arg,
+    size_t file_size_arg,
+    bool use_send_file_arg,
+    int n_transfers_arg
+  )
+  : server(server_arg),
+    client(client_arg),
+    file_descriptor(file_descriptor_arg),
+    file_size(file_size_arg),
+    use_send_file(use_send_file_arg),
+    n_transfers(n_transfers_arg)
+  {
+  }
+
+  bool isDone() const { return n_transfers_received >= n_transfers; }
+
+  void queueTransfer()
+  {
+    if (n_transfers_queued >= n_transfers) {
+      return;
+    }
+
+    MessageServer::ClientId client_id = server.clientIds()[0];
+
+    if (use_send_file) {
+      server.queueFileToClient(client_id,file_descriptor,0,file_size);
+    }
+    else {
+      // What a server would do without sendfile: read the file into
+      // memory and send it from there.
+      vector<char> contents(file_size);
+      ssize_t read_result =
+        pread(file_descriptor,contents.data(),file_size,/*offset*/0);
+      assert(read_result == ssize_t(file_size));
+      server.queueMessageToClient(client_id,contents.data(),file_size);
+    }
+
+    ++n_transfers_queued;
+  }
+
+  void processEvents(AbstractSelector &selector)
+  {
+    selector.beginSelect();
+    server.setupSelect(selector.preSelectParams());
+    client.setupSelect(selector.preSelectParams());
+    selector.callSelect();
+    server.handleSelect(selector.postSelectParams(),server_handler);
+    client.handleSelect(selector.postSelectParams(),client_handler);
+    selector.endSelect();
+  }
+};
+}
+
+
+static double
+  fileTransferMegabytesPerSecond(
+    int file_descriptor,
+    size_t file_size,
+    bool use_send_file,
+    int n_transfers
+  )
+{
+  SystemSockets sockets;
+  SystemSelector selector;
+  MessageServer server(sockets);
+  MessageClient client(sockets);
+  server.startListening(benchmark_port);
+  client.startConnecting(benchmark_port);
+
+  FileTransfer
+    transfer(
+      server,client,file_descriptor,file_size,use_send_file,n_transfers
+    );
+
+  while (server.nClients() != 1 || !client.isConnected()) {
+    transfer.processEvents(selector);
+  }
+
+  Clock::time_point start_time = Clock::now();
+  transfer.queueTransfer();
+
+  while (!transfer.isDone()) {
+    transfer.processEvents(selector);
+  }
+
+  double elapsed_seconds = secondsSince(start_time);
+  client.disconnect();
+
+  while (server.nClients() != 0) {
+    transfer.processEvents(selector);
+  }
+
+  return double(file_size) * n_transfers / elapsed_seconds / 1e6;
+}
+
+
+static int runSendFileBenchmark()
+{
+  const size_t file_size = 16*1024*1024;
+  const int n_transfers = 32;
+  char path[] = "/tmp/messaging_benchmark.XXXXXX";
+  int file_descriptor = mkstemp(path);
+
+  if (file_descriptor < 0) {
+    cerr << "Unable to create " << path << ": " << strerror(errno) << "\n";
+    return EXIT_FAILURE;
+  }
+
+  unlink(path);
+  vector<char> contents(file_size,'x');
+
+  if (write(file_descriptor,contents.data(),file_size) != ssize_t(file_size)) {
+    cerr << "Unable to write " << path << "\n";
+    return EXIT_FAILURE;
+  }
+
+  double copying_rate =
+    fileTransferMegabytesPerSecond(
+      file_descriptor,file_size,/*use_send_file*/false,n_transfers
+    );
+
+  double send_file_rate =
+    fileTransferMegabytesPerSecond(
+      file_descriptor,file_size,/*use_send_file*/true,n_transfers
+    );
+
+  cout << "file size " << file_size << ": " <<
+    "read and send " << copying_rate << " MB/s, " <<
+    "sendfile " << send_file_rate << " MB/s\n";
+
+  close(file_descriptor);
+  return EXIT_SUCCESS;
+}
+
+
+namespace {
+// The client sends windows of small messages, and the server acknowledges
+// each full window.  This keeps datagrams from being dropped when the
+// socket buffers overflow.
+template <typename Server,typename Client>
+struct Telemetry {
+  Server &server;
+  Client &client;
+  const string message = string(63,'x');
+  const int window_size;
+  const int n_messages;
+  int n_messages_sent = 0;
+  int n_messages_received = 0;
+
+  struct ServerHandler : Server::EventInterface {
+    Telemetry &telemetry;
+
+    ServerHandler(Telemetry &telemetry_arg) : telemetry(telemetry_arg) {}
+
+    void
+      gotMessage(typename Server::ClientId client_id,const char *,size_t)
+      override
+    {
+      Telemetry &t = telemetry;
+      ++t.n_messages_received;
+
+      if (t.n_messages_received % t.window_size == 0) {
+        t.server.queueMessageToClient(client_id,"ack",4);
+      }
+    }
+
+    // Only used for MessageServer.
+    void clientConnected(typename Server::ClientId) {}
+    void clientDisconnected(typename Server::ClientId) {}
+
+    // Only used for DatagramServer.
+    void clientForgotten(typename Server::ClientId) {}
+  };
+
+  struct ClientHandler : Client::EventInterface {
+    Telemetry &telemetry;
+
+    ClientHandler(Telemetry &telemetry_arg) : telemetry(telemetry_arg) {}
+
+    void gotMessage(const char *,size_t) override
+    {
+      telemetry.sendWindow();
+    }
+
+    // Only used for MessageClient.
+    void connectionRefused()
+    {
+      cerr << "Connection refused.\n";
+      exit(EXIT_FAILURE);
+    }
+
+    void connected() {}
+  };
+
+  ServerHandler server_handler{*this};
+  ClientHandler client_handler{*this};
+
+  Telemetry(
+    Server &server_arg,
+    Client &client_arg,
+    int window_size_arg,
+    int n_messages_arg
+  )
+  : server(server_arg),
+    client(client_arg),
+    window_size(window_size_arg),
+    n_messages(n_messages_arg)
+  {
+  }
+
+  bool isDone() const { return n_messages_received >= n_messages; }
+
+  void sendWindow()
+  {
+    for (int i=0; i!=window_size && n_messages_sent < n_messages; ++i) {
+      client.queueMessage(message.c_str(),message.size() + 1);
+      ++n_messages_sent;
+    }
+  }
+
+  void processEvents(AbstractSelector &selector)
+  {
+    selector.beginSelect();
+    server.setupSelect(selector.preSelectParams());
+    client.setupSelect(selector.preSelectParams());
+    selector.callSelect();
+    server.handleSelect(selector.postSelectParams(),server_handler);
+    client.handleSelect(selector.postSelectParams(),client_handler);
+    selector.endSelect();
+  }
+
+  double messagesPerSecond(AbstractSelector &selector)
+  {
+    Clock::time_point start_time = Clock::now();
+    sendWindow();
+
+    while (!isDone()) {
+      processEvents(selector);
+    }
+
+    return n_messages / secondsSince(start_time);
+  }
+};
+}
+
+
+static double tcpMessagesPerSecond(int n_messages)
+{
+  SystemSockets sockets;
+  SystemSelector selector;
+  MessageServer server(sockets);
+  MessageClient client(sockets);
+  server.startListening(benchmark_port);
+  client.startConnecting(benchmark_port);
+
+  // TCP doesn't lose messages, so they can all be sent at once.  Waiting
+  // for acknowledgements would mostly measure Nagle's algorithm.
+  Telemetry<MessageServer,MessageClient>
+    telemetry(server,client,/*window_size*/n_messages,n_messages);
+
+  while (server.nClients() != 1 || !client.isConnected()) {
+    telemetry.processEvents(selector);
+  }
+
+  double result = telemetry.messagesPerSecond(selector);
+  client.disconnect();
+
+  while (server.nClients() != 0) {
+    telemetry.processEvents(selector);
+  }
+
+  return result;
+}
+
+
+static double datagramMessagesPerSecond(int n_messages)
+{
+  SystemSockets sockets;
+  SystemSelector selector;
+  DatagramServer server(sockets);
+  DatagramClient client(sockets);
+  server.startListening(benchmark_port);
+  client.startSending(benchmark_port);
+
+  Telemetry<DatagramServer,DatagramClient>
+    telemetry(server,client,/*window_size*/128,n_messages);
+
+  return telemetry.messagesPerSecond(selector);
+}
+
+
+static int runDatagramBenchmark()
+{
+  const int n_messages = 200000;
+  double tcp_rate = tcpMessagesPerSecond(n_messages);
+  double datagram_rate = datagramMessagesPerSecond(n_messages);
+
+  cout << "64 byte messages: " <<
+    "tcp " << tcp_rate << " messages/s, " <<
+    "datagram " << datagram_rate << " messages/s\n";
+
+  return EXIT_SUCCESS;
+}
+
+
+namespace {
+// The server answers each request as soon as it arrives, and the client
+// keeps up to max_in_flight requests outstanding.  With one in flight, each
+// request waits for the previous response.
+struct RpcExchange {
+  RpcServer &server;
+  RpcClient &client;
+  const int max_in_flight;
+  const int n_requests;
+  int n_requests_sent = 0;
+  int n_responses = 0;
+  double total_latency = 0;
+  const string request = string(63,'x');
+
+  struct ServerHandler : RpcServer::EventInterface {
+    RpcServer &server;
+
+    ServerHandler(RpcServer &server_arg) : server(server_arg) {}
+
+    void
+      gotRequest(
+        ClientId client_id,
+        RequestId request_id,
+        const char *request,
+        size_t request_size
+      ) override
+    {
+      server.respond(client_id,request_id,request,request_size);
+    }
+
+    void clientConnected(ClientId) override {}
+    void clientDisconnected(ClientId) override {}
+  };
+
+  struct ClientHandler : RpcClient::EventInterface {
+    void connectionRefused() override
+    {
+      cerr << "Connection refused.\n";
+      exit(EXIT_FAILURE);
+    }
+
+    void connected() override {}
+  };
+
+  ServerHandler server_handler{server};
+  ClientHandler client_handler;
+
+  RpcExchange(
+    RpcServer &server_arg,
+    RpcClient &client_arg,
+    int max_in_flight_arg,
+    int n_requests_arg
+  )
+  : server(server_arg),
+    client(client_arg),
+    max_in_flight(max_in_flight_arg),
+    n_requests(n_requests_arg)
+  {
+  }
+
+  void sendRequest()
+  {
+    Clock::time_point send_time = Clock::now();
+
+    auto callback =
+      [this,send_time](RpcClient::Status status,const char *,size_t){
+        if (status != RpcClient::Status::ok) {
+          cerr << "Request failed.\n";
+          exit(EXIT_FAILURE);
+        }
+
+        total_latency += secondsSince(send_time);
+        ++n_responses;
+        sendRequests();
+      };
+
+    client.sendRequest(
+      request.c_str(),request.size() + 1,std::chrono::seconds(10),callback
+    );
+
+    ++n_requests_sent;
+  }
+
+  void sendRequests()
+  {
+    while (
+      n_requests_sent < n_requests &&
+      client.nPendingRequests() < max_in_flight
+    ) {
+      sendRequest();
+    }
+  }
+
+  void processEvents(AbstractSelector &selector)
+  {
+    selector.beginSelect();
+    server.setupSelect(selector.preSelectParams());
+    client.setupSelect(selector.preSelectParams());
+    selector.callSelect();
+    server.handleSelect(selector.postSelectParams(),server_handler);
+    client.handleSelect(selector.postSelectParams(),client_handler);
+    selector.endSelect();
+  }
+};
+}
+
+
+static void measureRpc(int max_in_flight,int n_requests)
+{
+  SystemSockets sockets;
+  SystemSelector selector;
+  SystemClock clock;
+  RpcServer server(sockets);
+  RpcClient client(sockets,clock);
+  server.startListening(benchmark_port);
+  client.startConnecting(benchmark_port);
+  RpcExchange exchange(server,client,max_in_flight,n_requests);
+
+  while (server.nClients() != 1 || !client.isConnected()) {
+    exchange.processEvents(selector);
+  }
+
+  Clock::time_point start_time = Clock::now();
+  exchange.sendRequests();
+
+  while (exchange.n_responses != n_requests) {
+    exchange.processEvents(selector);
+  }
+
+  double elapsed_time = secondsSince(start_time);
+  client.disconnect();
+
+  while (server.nClients() != 0) {
+    exchange.processEvents(selector);
+  }
+
+  double average_latency = exchange.total_latency / n_requests;
+
+  cout << max_in_flight << " in flight: " <<
+    n_requests / elapsed_time << " requests/s, " <<
+    average_latency * 1e6 << " us average latency\n";
+}
+
+
+static int runRpcBenchmark()
+{
+  const int n_requests = 100000;
+  measureRpc(/*max_in_flight*/1,n_requests);
+  measureRpc(/*max_in_flight*/16,n_requests);
+  measureRpc(/*max_in_flight*/256,n_requests);
+  return EXIT_SUCCESS;
+}
+
+
+namespace {
+// Each client subscribes to subscriptions_per_client topics, spread so
+// that every topic has about the same number of subscribers.  A few
+// clients also subscribe to every topic with a wildcard.
+struct Subscriptions {
+  const int n_clients = 10000;
+  const int n_topics = 10000;
+  const int subscriptions_per_client = 10;
+  const int n_wildcard_clients = 10;
+  vector<std::pair<int,string>> client_patterns;
+
+  Subscriptions()
+  {
+    for (int client_id=0; client_id!=n_clients; ++client_id) {
+      for (int i=0; i!=subscriptions_per_client; ++i) {
+        int topic_index = client_id + i*(n_topics/subscriptions_per_client);
+        client_patterns.emplace_back(client_id,topicName(topic_index));
+      }
+    }
+
+    for (int client_id=0; client_id!=n_wildcard_clients; ++client_id) {
+      client_patterns.emplace_back(client_id,"topic.*");
+    }
+  }
+
+  string topicName(int topic_index) const
+  {
+    return "topic." + std::to_string(topic_index % n_topics);
+  }
+};
+}
+
+
+static bool patternMatches(const string &pattern,const string &topic)
+{
+  if (!pattern.empty() && pattern.back() == '*') {
+    return topic.compare(0,pattern.size() - 1,pattern,0,pattern.size() - 1)
+      == 0;
+  }
+
+  return pattern == topic;
+}
+
+
+// Checking every subscription is what we would do without an index.
+static double
+  scanningPublishesPerSecond(
+    const Subscriptions &subscriptions,
+    int n_publishes,
+    size_t &n_deliveries
+  )
+{
+  vector<int> subscribers;
+  Clock::time_point start_time = Clock::now();
+
+  for (int i=0; i!=n_publishes; ++i) {
+    string topic = subscriptions.topicName(i);
+    subscribers.clear();
+
+    for (auto &client_and_pattern : subscriptions.client_patterns) {
+      if (patternMatches(client_and_pattern.second,topic)) {
+        int client_id = client_and_pattern.first;
+
+        if (
+          std::find(subscribers.begin(),subscribers.end(),client_id) ==
+          subscribers.end()
+        ) {
+          subscribers.push_back(client_id);
+        }
+      }
+    }
+
+    n_deliveries += subscribers.size();
+  }
+
+  return n_publishes / secondsSince(start_time);
+}
+
+
+static double
+  indexedPublishesPerSecond(
+    const Subscriptions &subscriptions,
+    int n_publishes,
+    size_t &n_deliveries
+  )
+{
+  TopicIndex index;
+
+  for (auto &client_and_pattern : subscriptions.client_patterns) {
+    index.subscribe(client_and_pattern.first,client_and_pattern.second);
+  }
+
+  vector<TopicIndex::SubscriberId> subscribers;
+  Clock::time_point start_time = Clock::now();
+
+  for (int i=0; i!=n_publishes; ++i) {
+    index.findSubscribers(subscriptions.topicName(i),subscribers);
+    n_deliveries += subscribers.size();
+  }
+
+  return n_publishes / secondsSince(start_time);
+}
+
+
+// Queue a message for a number of subscribers, either copying it for each
+// one or sharing a single copy.
+static double
+  queuedMessagesPerSecond(bool share_message,int n_subscribers)
+{
+  const int n_publishes = 100;
+  const string message(1024,'x');
+  vector<QueuedMessageSender> senders(n_subscribers);
+  Clock::time_point start_time = Clock::now();
+
+  for (int i=0; i!=n_publishes; ++i) {
+    if (share_message) {
+      SharedMessage shared_message =
+        makeSharedMessage(message.data(),message.size());
+
+      for (QueuedMessageSender &sender : senders) {
+        sender.queueSharedMessage(shared_message);
+      }
+    }
+    else {
+      for (QueuedMessageSender &sender : senders) {
+        sender.queueMessage(message.data(),message.size());
+      }
+    }
+  }
+
+  double result = n_publishes * n_subscribers / secondsSince(start_time);
+
+  for (QueuedMessageSender &sender : senders) {
+    sender.clear();
+  }
+
+  return result;
+}
+
+
+static int runPubSubBenchmark()
+{
+  Subscriptions subscriptions;
+  size_t n_scanned_deliveries = 0;
+  size_t n_indexed_deliveries = 0;
+
+  double scanning_rate =
+    scanningPublishesPerSecond(subscriptions,1000,n_scanned_deliveries);
+
+  double indexed_rate =
+    indexedPublishesPerSecond(subscriptions,1000,n_indexed_deliveries);
+
+  if (n_scanned_deliveries != n_indexed_deliveries) {
+    cerr << "Scanning and indexing found different subscribers.\n";
+    return EXIT_FAILURE;
+  }
+
+  cout << subscriptions.client_patterns.size() << " subscriptions, " <<
+    subscriptions.n_clients << " clients: " <<
+    "scanning " << scanning_rate << " publishes/s, " <<
+    "index " << indexed_rate << " publishes/s\n";
+
+  double copying_rate = queuedMessagesPerSecond(false,10000);
+  double sharing_rate = queuedMessagesPerSecond(true,10000);
+
+  cout << "1 KB message queued to 10000 clients: " <<
+    "copying " << copying_rate << " deliveries/s, " <<
+    "sharing " << sharing_rate << " deliveries/s\n";
+
+  return EXIT_SUCCESS;
+}
+
+
+namespace {
+struct CountingServerHandler : MessageServer::EventInterface {
+  int n_messages = 0;
+
+  void gotMessage(ClientId,const char *,size_t) override { ++n_messages; }
+  void clientConnected(ClientId) override {}
+  void clientDisconnected(ClientId) override {}
+};
+}
+
+
+namespace {
+struct PoolHandler : MessageClientPool::EventInterface {
+  void connected(ConnectionIndex) override {}
+
+  void disconnected(ConnectionIndex,Duration) override
+  {
+    cerr << "Disconnected.\n";
+    exit(EXIT_FAILURE);
+  }
+
+  void gotMessage(ConnectionIndex,const char *,size_t) override {}
+  void droppedMessages(ConnectionIndex,size_t) override {}
+};
+}
+
+
+static double poolMessagesPerSecond(int n_connections,int n_messages)
+{
+  SystemSockets sockets;
+  SystemSelector selector;
+  SystemClock clock;
+  MessageServer server(sockets);
+  MessageClientPool pool(sockets,clock,n_connections);
+  CountingServerHandler server_handler;
+  PoolHandler pool_handler;
+  server.startListening(benchmark_port);
+  pool.startConnecting(benchmark_port);
+
+  auto process_events = [&]{
+    selector.beginSelect();
+    server.setupSelect(selector.preSelectParams());
+    pool.setupSelect(selector.preSelectParams());
+    selector.callSelect();
+    server.handleSelect(selector.postSelectParams(),server_handler);
+    pool.handleSelect(selector.postSelectParams(),pool_handler);
+    selector.endSelect();
+  };
+
+  while (
+    server.nClients() != n_connections ||
+    pool.nConnected() != n_connections
+  ) {
+    process_events();
+  }
+
+  const string message(1023,'x');
+  Clock::time_point start_time = Clock::now();
+
+  for (int i=0; i!=n_messages; ++i) {
+    pool.queueMessage(message.c_str(),message.size() + 1);
+  }
+
+  while (server_handler.n_messages != n_messages) {
+    process_events();
+  }
+
+  double result = n_messages / secondsSince(start_time);
+  pool.stop();
+
+  while (server.nClients() != 0) {
+    process_events();
+  }
+
+  return result;
+}
+
+
+static int runPoolBenchmark()
+{
+  const int n_messages = 200000;
+
+  for (int n_connections : {1,2,4}) {
+    cout << n_connections << " connections: " <<
+      poolMessagesPerSecond(n_connections,n_messages) <<
+      " 1 KB messages/s\n";
+  }
+
+  return EXIT_SUCCESS;
+}
+
+
+namespace {
+struct CoalescingServerHandler : MessageServer::EventInterface {
+  vector<double> latencies;
+
+  void gotMessage(ClientId,const char *message,size_t message_size) override
+  {
+    Clock::time_point send_time;
+    assert(message_size == sizeof send_time);
+    memcpy(&send_time,message,sizeof send_time);
+    latencies.push_back(secondsSince(send_time));
+  }
+
+  void clientConnected(ClientId) override {}
+  void clientDisconnected(ClientId) override {}
+};
+}
+
+
+namespace {
+struct CoalescingClientHandler : MessageClient::EventInterface {
+  void connectionRefused() override
+  {
+    cerr << "Connection refused.\n";
+    exit(EXIT_FAILURE);
+  }
+
+  void connected() override {}
+  void gotMessage(const char *,size_t) override {}
+};
+}
+
+
+// Sends timestamps in small bursts, so there is something to coalesce,
+// and reports the rate along with the latency of individual messages.
+static void
+  measureCoalescing(
+    const std::optional<QueuedMessageSender::CoalescingOptions>
+      &maybe_options,
+    int n_messages
+  )
+{
+  const int burst_size = 4;
+  SystemSockets sockets;
+  SystemSelector selector;
+  SystemClock clock;
+  MessageServer server(sockets);
+  MessageClient client(sockets);
+  CoalescingServerHandler server_handler;
+  CoalescingClientHandler client_handler;
+
+  if (maybe_options) {
+    client.enableCoalescing(clock,*maybe_options);
+  }
+
+  server.startListening(benchmark_port);
+  client.startConnecting(benchmark_port);
+
+  auto process_events = [&]{
+    selector.beginSelect();
+    server.setupSelect(selector.preSelectParams());
+    client.setupSelect(selector.preSelectParams());
+    selector.callSelect();
+    server.handleSelect(selector.postSelectParams(),server_handler);
+    client.handleSelect(selector.postSelectParams(),client_handler);
+    selector.endSelect();
+  };
+
+  while (server.nClients() != 1 || !client.isConnected()) {
+    process_events();
+  }
+
+  Clock::time_point start_time = Clock::now();
+  int n_messages_queued = 0;
+
+  while (server_handler.latencies.size() != size_t(n_messages)) {
+    for (int i=0; i!=burst_size && n_messages_queued!=n_messages; ++i) {
+      Clock::time_point now = Clock::now();
+      client.queueMessage(reinterpret_cast<const char *>(&now),sizeof now);
+      ++n_messages_queued;
+    }
+
+    process_events();
+  }
+
+  double seconds = secondsSince(start_time);
+  client.disconnect();
+
+  while (server.nClients() != 0) {
+    process_events();
+  }
+
+  vector<double> &latencies = server_handler.latencies;
+  std::sort(latencies.begin(),latencies.end());
+  double p50 = latencies[latencies.size()/2];
+  double p99 = latencies[latencies.size()*99/100];
+
+  if (!maybe_options) {
+    cout << "not coalescing: ";
+  }
+  else {
+    cout << "coalescing up to " << maybe_options->max_bytes << " bytes/" <<
+      maybe_options->max_delay.count() << "us: ";
+  }
+
+  cout << n_messages/seconds << " msgs/s, " <<
+    "p50 " << p50*1e6 << "us, " <<
+    "p99 " << p99*1e6 << "us\n";
+}
+
+
+static int runCoalesceBenchmark()
+{
+  const int n_messages = 200000;
+  measureCoalescing(std::nullopt,n_messages);
+
+  for (int max_delay : {0,200,1000}) {
+    QueuedMessageSender::CoalescingOptions options;
+    options.max_bytes = 16*1024;
+    options.max_delay = std::chrono::microseconds(max_delay);
+    measureCoalescing(options,n_messages);
+  }
+
+  return EXIT_SUCCESS;
+}
+
+
+// Streams small messages from a client to a server, queueing them in
+// bursts so that the send queue is never empty for long.
+static int runSendQueueBenchmark()
+{
+  const int n_messages = 2000000;
+  const int burst_size = 64;
+  const string message(63,'x');
+  SystemSockets sockets;
+  SystemSelector selector;
+  MessageServer server(sockets);
+  MessageClient client(sockets);
+  CountingServerHandler server_handler;
+  CoalescingClientHandler client_handler;
+  server.startListening(benchmark_port);
+  client.startConnecting(benchmark_port);
+
+  auto process_events = [&]{
+    selector.beginSelect();
+    server.setupSelect(selector.preSelectParams());
+    client.setupSelect(selector.preSelectParams());
+    selector.callSelect();
+    server.handleSelect(selector.postSelectParams(),server_handler);
+    client.handleSelect(selector.postSelectParams(),client_handler);
+    selector.endSelect();
+  };
+
+  auto send_messages = [&](int n){
+    int n_messages_queued = 0;
+    int n_messages_expected = server_handler.n_messages + n;
+
+    while (server_handler.n_messages != n_messages_expected) {
+      for (
+        int i=0;
+        i!=burst_size && n_messages_queued!=n;
+        ++i, ++n_messages_queued
+      ) {
+        client.queueMessage(message.c_str(),message.size() + 1);
+      }
+
+      process_events();
+    }
+  };
+
+  while (server.nClients() != 1 || !client.isConnected()) {
+    process_events();
+  }
+
+  // Let the buffers grow to their working size first.
+  send_messages(n_messages/10);
+
+  size_t start_allocations = n_allocations;
+  Clock::time_point start_time = Clock::now();
+  send_messages(n_messages);
+  double seconds = secondsSince(start_time);
+  size_t allocations = n_allocations - start_allocations;
+  client.disconnect();
+
+  while (server.nClients() != 0) {
+    process_events();
+  }
+
+  cout << n_messages/seconds << " 64 byte msgs/s, " <<
+    double(allocations)/n_messages << " allocations/msg\n";
+
+  return EXIT_SUCCESS;
+}
+
+
+// Connects, sends a message, and disconnects repeatedly, to see what
+// setting up and tearing down a connection costs.
+static int runChurnBenchmark()
+{
+  const int n_connections = 5000;
+  const string message(1023,'x');
+  SystemSockets sockets;
+  SystemSelector selector;
+  MessageServer server(sockets);
+  MessageClient client(sockets);
+  CountingServerHandler server_handler;
+  CoalescingClientHandler client_handler;
+  server.startListening(benchmark_port);
+
+  auto process_events = [&]{
+    selector.beginSelect();
+    server.setupSelect(selector.preSelectParams());
+    client.setupSelect(selector.preSelectParams());
+    selector.callSelect();
+    server.handleSelect(selector.postSelectParams(),server_handler);
+    client.handleSelect(selector.postSelectParams(),client_handler);
+    selector.endSelect();
+  };
+
+  auto run_connection = [&]{
+    client.startConnecting(benchmark_port);
+    client.queueMessage(message.c_str(),message.size() + 1);
+    int n_messages_expected = server_handler.n_messages + 1;
+
+    while (server_handler.n_messages != n_messages_expected) {
+      process_events();
+    }
+
+    client.disconnect();
+
+    while (server.nClients() != 0) {
+      process_events();
+    }
+  };
+
+  run_connection();
+  size_t start_allocations = n_allocations;
+  Clock::time_point start_time = Clock::now();
+
+  for (int i=0; i!=n_connections; ++i) {
+    run_connection();
+  }
+
+  double seconds = secondsSince(start_time);
+  size_t allocations = n_allocations - start_allocations;
+
+  cout << n_connections/seconds << " connections/s, " <<
+    double(allocations)/n_connections << " allocations/connection\n";
+
+  return EXIT_SUCCESS;
+}
+
+
+namespace {
+// Lets the benchmark tell the server when its listen socket is ready
+// without going through select(), which is limited to small descriptors.
+struct ListenRecordingSockets : SystemSockets {
+  std::optional<SocketId> maybe_listen_socket_id;
+
+  void listen(SocketId socket_id,int backlog) override
+  {
+    SystemSockets::listen(socket_id,backlog);
+    maybe_listen_socket_id = socket_id;
+  }
+};
+}
+
+
+namespace {
+struct StubSelectParams : SelectParamsInterface {
+  std::optional<int> maybe_readable_fd;
+  std::vector<int> ready_fds;
+  size_t n_fds_set = 0;
+
+  void setReadable(std::optional<int> maybe_fd)
+  {
+    maybe_readable_fd = maybe_fd;
+    ready_fds.clear();
+
+    if (maybe_fd) {
+      ready_fds.push_back(*maybe_fd);
+    }
+  }
+
+  void setRead(int) override { ++n_fds_set; }
+  void setWrite(int) override { ++n_fds_set; }
+  void setTimeout(std::chrono::microseconds) override {}
+  bool readIsSet(int fd) const override { return fd == maybe_readable_fd; }
+  bool writeIsSet(int) const override { return false; }
+  const std::vector<int> &readyFds() const override { return ready_fds; }
+};
+}
+
+
+// The cost of setupSelect() and handleSelect() on a server where all the
+// connections are idle.
+static double idleServerPassMicroseconds(int n_connections)
+{
+  const int n_passes = 2000;
+  ListenRecordingSockets sockets;
+  StubSelectParams select_params;
+  CountingServerHandler server_handler;
+  vector<SystemSockets::SocketId> client_socket_ids;
+  MessageServer server(sockets);
+  server.startListening(benchmark_port);
+  InternetAddress server_address;
+  server_address.setLoopback();
+  server_address.setPort(benchmark_port);
+
+  for (int i=0; i!=n_connections; ++i) {
+    SystemSockets::SocketId socket_id = sockets.create();
+    sockets.connect(socket_id,server_address);
+    client_socket_ids.push_back(socket_id);
+    select_params.setReadable(sockets.maybe_listen_socket_id);
+    server.handleSelect(select_params,server_handler);
+  }
+
+  assert(server.nClients() == n_connections);
+  select_params.setReadable(std::nullopt);
+  Clock::time_point start_time = Clock::now();
+
+  for (int i=0; i!=n_passes; ++i) {
+    server.setupSelect(select_params);
+    server.handleSelect(select_params,server_handler);
+  }
+
+  double seconds = secondsSince(start_time);
+
+  // Close our side first, so the server's port is free again.
+  for (SystemSockets::SocketId socket_id : client_socket_ids) {
+    sockets.close(socket_id);
+  }
+
+  return seconds / n_passes * 1e6;
+}
+
+
+static int runIdleBenchmark()
+{
+  for (int n_connections : {100,1000,8000}) {
+    cout << n_connections << " idle connections: " <<
+      idleServerPassMicroseconds(n_connections) << " us/select\n";
+  }
+
+  return EXIT_SUCCESS;
+}
+
+
+// Streams bursts of small messages from a client to a server and reports
+// how many selects it took along with the rate.
+static void measureDraining(std::optional<size_t> maybe_max_bytes)
+{
+  const int n_bursts = 4000;
+  const int burst_size = 256;
+  const int n_messages = n_bursts*burst_size;
+  const string message(63,'x');
+  SystemSockets sockets;
+  SystemSelector selector;
+  MessageServer server(sockets);
+  MessageClient client(sockets);
+  CountingServerHandler server_handler;
+  CoalescingClientHandler client_handler;
+
+  if (maybe_max_bytes) {
+    server.enableDraining(*maybe_max_bytes);
+    client.enableDraining(*maybe_max_bytes);
+  }
+
+  server.startListening(benchmark_port);
+  client.startConnecting(benchmark_port);
+  int n_selects = 0;
+
+  auto process_events = [&]{
+    selector.beginSelect();
+    server.setupSelect(selector.preSelectParams());
+    client.setupSelect(selector.preSelectParams());
+    selector.callSelect();
+    server.handleSelect(selector.postSelectParams(),server_handler);
+    client.handleSelect(selector.postSelectParams(),client_handler);
+    selector.endSelect();
+    ++n_selects;
+  };
+
+  while (server.nClients() != 1 || !client.isConnected()) {
+    process_events();
+  }
+
+  n_selects = 0;
+  Clock::time_point start_time = Clock::now();
+
+  for (int burst=0; burst!=n_bursts; ++burst) {
+    for (int i=0; i!=burst_size; ++i) {
+      client.queueMessage(message.c_str(),message.size() + 1);
+    }
+
+    while (server_handler.n_messages != (burst + 1)*burst_size) {
+      process_events();
+    }
+  }
+
+  double seconds = secondsSince(start_time);
+  client.disconnect();
+
+  while (server.nClients() != 0) {
+    process_events();
+  }
+
+  if (!maybe_max_bytes) {
+    cout << "one recv/send per select: ";
+  }
+  else {
+    cout << "draining up to " << *maybe_max_bytes << " bytes: ";
+  }
+
+  cout << n_messages/seconds << " 64 byte msgs/s, " <<
+    double(n_selects)/n_bursts << " selects/burst\n";
+}
+
+
+static int runDrainBenchmark()
+{
+  measureDraining(std::nullopt);
+  measureDraining(64*1024);
+  return EXIT_SUCCESS;
+}
+
+
+namespace {
+struct SlowConsumerHandler : MessageServer::EventInterface {
+  // Only the number of messages matters here, so they aren't kept.
+  size_t backlog_size = 0;
+  size_t max_backlog_size = 0;
+
+  void gotMessage(ClientId,const char *,size_t) override
+  {
+    ++backlog_size;
+    max_backlog_size = std::max(max_backlog_size,backlog_size);
+  }
+
+  void clientConnected(ClientId) override {}
+  void clientDisconnected(ClientId) override {}
+};
+}
+
+
+// The client queues everything at once, but the server application only
+// deals with a few messages per select and has to keep the rest.
+static void
+  measureSlowConsumer(
+    const std::optional<QueuedMessageSender::FlowControlOptions>
+      &maybe_options
+  )
+{
+  const int n_messages = 200000;
+  const size_t n_handled_per_pass = 8;
+  const string message(63,'x');
+  SystemSockets sockets;
+  SystemSelector selector;
+  SystemClock clock;
+  MessageServer server(sockets);
+  MessageClient client(sockets);
+  SlowConsumerHandler server_handler;
+  CoalescingClientHandler client_handler;
+
+  // The server reads as much as it can, so only flow control keeps the
+  // backlog down.
+  server.enableDraining(64*1024);
+
+  if (maybe_options) {
+    server.enableFlowControl(clock,*maybe_options);
+    client.enableFlowControl(clock,*maybe_options);
+  }
+
+  server.startListening(benchmark_port);
+  client.startConnecting(benchmark_port);
+
+  auto process_events = [&]{
+    selector.beginSelect();
+    server.setupSelect(selector.preSelectParams());
+    client.setupSelect(selector.preSelectParams());
+
+    if (server_handler.backlog_size != 0) {
+      // Don't wait for the connection while there is work to do.
+      selector.preSelectParams().setTimeout(std::chrono::microseconds(0));
+    }
+
+    selector.callSelect();
+    server.handleSelect(selector.postSelectParams(),server_handler);
+    client.handleSelect(selector.postSelectParams(),client_handler);
+    selector.endSelect();
+  };
+
+  while (server.nClients() != 1 || !client.isConnected()) {
+    process_events();
+  }
+
+  MessageServer::ClientId client_id = server.clientIds()[0];
+  Clock::time_point start_time = Clock::now();
+
+  for (int i=0; i!=n_messages; ++i) {
+    client.queueMessage(message.c_str(),message.size() + 1);
+  }
+
+  int n_handled = 0;
+
+  while (n_handled != n_messages) {
+    process_events();
+    size_t n = std::min(server_handler.backlog_size,n_handled_per_pass);
+    server_handler.backlog_size -= n;
+    n_handled += n;
+
+    if (maybe_options && n != 0) {
+      server.grantCredit(client_id,n);
+    }
+  }
+
+  double seconds = secondsSince(start_time);
+  QueuedMessageSender::FlowControlStats stats = client.flowControlStats();
+  client.disconnect();
+
+  while (server.nClients() != 0) {
+    process_events();
+  }
+
+  if (!maybe_options) {
+    cout << "no flow control: ";
+  }
+  else {
+    cout << "window of " << maybe_options->window << " msgs: ";
+  }
+
+  double stalled_seconds =
+    std::chrono::duration<double>(stats.stalled_time).count();
+
+  cout << n_messages/seconds << " msgs/s, " <<
+    "peak backlog " << server_handler.max_backlog_size << " msgs, " <<
+    "stalled " << stalled_seconds*1e3 << "ms in " <<
+    stats.n_stalls << " waits\n";
+}
+
+
+static int runFlowControlBenchmark()
+{
+  measureSlowConsumer(std::nullopt);
+  QueuedMessageSender::FlowControlOptions options;
+  options.window = 256;
+  options.grant_on_delivery = false;
+  measureSlowConsumer(options);
+  return EXIT_SUCCESS;
+}
+
+
+// Log lines, as a stand-in for the text which is sent between sites.
+static string compressibleText(size_t size)
+{
+  static const char *const levels[] = {"INFO","WARN","DEBUG"};
+  std::mt19937 engine(1);
+  string text;
+
+  while (text.size() < size) {
+    unsigned value = engine();
+
+    text +=
+      "2026-10-18T12:" + std::to_string(value % 60) + ":" +
+      std::to_string(value / 60 % 60) + " " + levels[value % 3] +
+      " request " + std::to_string(value % 100000) +
+      " from host-" + std::to_string(value % 37) +
+      " completed with status " + std::to_string(200 + value % 5) +
+      " in " + std::to_string(value % 1000) + "ms\n";
+  }
+
+  text.resize(size);
+  return text;
+}
+
+
+static string incompressibleData(size_t size)
+{
+  std::mt19937 engine(1);
+  string data(size,'\0');
+
+  for (char &c : data) {
+    c = char(engine());
+  }
+
+  return data;
+}
+
+
+static double cpuSecondsSince(std::clock_t start_time)
+{
+  return double(std::clock() - start_time)/CLOCKS_PER_SEC;
+}
+
+
+// Compresses and decompresses the data in pieces of the message size, and
+// reports the ratio along with the CPU time per megabyte of original data.
+static void
+  measureCodec(const char *description,const string &data,size_t message_size)
+{
+  const int n_passes = 20;
+  size_t n_messages = data.size()/message_size;
+  LzCompressor compressor;
+  vector<vector<char>> compressed_messages(n_messages);
+  std::clock_t compress_start_time = std::clock();
+
+  for (int pass=0; pass!=n_passes; ++pass) {
+    for (size_t i=0; i!=n_messages; ++i) {
+      vector<char> &compressed = compressed_messages[i];
+      compressed.clear();
+
+      compressor.compress(
+        data.data() + i*message_size,message_size,compressed
+      );
+    }
+  }
+
+  double compress_seconds = cpuSecondsSince(compress_start_time);
+  vector<char> message(message_size);
+  std::clock_t decompress_start_time = std::clock();
+
+  for (int pass=0; pass!=n_passes; ++pass) {
+    for (const vector<char> &compressed : compressed_messages) {
+      bool worked =
+        lzDecompress(
+          compressed.data(),compressed.size(),message.data(),message_size
+        );
+
+      if (!worked) {
+        cerr << "Decompression failed.\n";
+        exit(EXIT_FAILURE);
+      }
+    }
+  }
+
+  double decompress_seconds = cpuSecondsSince(decompress_start_time);
+  size_t n_compressed_bytes = 0;
+
+  for (const vector<char> &compressed : compressed_messages) {
+    n_compressed_bytes += compressed.size();
+  }
+
+  double n_megabytes = double(n_messages*message_size)*n_passes/(1024*1024);
+
+  cout << description << ", " << message_size << " byte msgs: " <<
+    "ratio " << double(n_messages*message_size)/n_compressed_bytes << ", " <<
+    "compress " << compress_seconds*1e3/n_megabytes << " ms/MB, " <<
+    "decompress " << decompress_seconds*1e3/n_megabytes << " ms/MB\n";
+}
+
+
+// Streams large text messages from a client to a server and reports the
+// rate along with the bytes which were actually sent.
+static void measureCompressedStreaming(bool use_compression)
+{
+  const int n_bursts = 100;
+  const int burst_size = 16;
+  const int n_messages = n_bursts*burst_size;
+  const string message = compressibleText(64*1024 - 1);
+  SystemSockets sockets;
+  SystemSelector selector;
+  MessageServer server(sockets);
+  MessageClient client(sockets);
+  CountingServerHandler server_handler;
+  CoalescingClientHandler client_handler;
+
+  if (use_compression) {
+    client.enableCompression(QueuedMessageSender::CompressionOptions());
+  }
+
+  server.enableDraining(1024*1024);
+  client.enableDraining(1024*1024);
+  server.startListening(benchmark_port);
+  client.startConnecting(benchmark_port);
+
+  auto process_events = [&]{
+    selector.beginSelect();
+    server.setupSelect(selector.preSelectParams());
+    client.setupSelect(selector.preSelectParams());
+    selector.callSelect();
+    server.handleSelect(selector.postSelectParams(),server_handler);
+    client.handleSelect(selector.postSelectParams(),client_handler);
+    selector.endSelect();
+  };
+
+  while (server.nClients() != 1 || !client.isConnected()) {
+    process_events();
+  }
+
+  Clock::time_point start_time = Clock::now();
+
+  for (int burst=0; burst!=n_bursts; ++burst) {
+    for (int i=0; i!=burst_size; ++i) {
+      client.queueMessage(message.c_str(),message.size() + 1);
+    }
+
+    while (server_handler.n_messages != (burst + 1)*burst_size) {
+      process_events();
+    }
+  }
+
+  double seconds = secondsSince(start_time);
+  QueuedMessageSender::CompressionStats stats = client.compressionStats();
+  client.disconnect();
+
+  while (server.nClients() != 0) {
+    process_events();
+  }
+
+  double n_megabytes = double(n_messages)*(message.size() + 1)/(1024*1024);
+  double n_bytes_per_message = message.size() + 1;
+
+  if (stats.n_compressed_messages != 0) {
+    n_bytes_per_message =
+      double(stats.n_compressed_bytes)/stats.n_compressed_messages;
+  }
+
+  cout << (use_compression ? "compressed: " : "uncompressed: ") <<
+    n_megabytes/seconds << " MB/s of messages, " <<
+    n_bytes_per_message << " payload bytes sent per 64KB msg\n";
+}
+
+
+static int runCompressionBenchmark()
+{
+  const size_t data_size = 16*1024*1024;
+  string text = compressibleText(data_size);
+  string random_data = incompressibleData(data_size);
+  measureCodec("log text",text,1024);
+  measureCodec("log text",text,64*1024);
+  measureCodec("random bytes",random_data,64*1024);
+  measureCompressedStreaming(/*use_compression*/false);
+  measureCompressedStreaming(/*use_compression*/true);
+  return EXIT_SUCCESS;
+}
+
+
+// A journal directory under the current directory, so that the benchmark
+// measures the disk the user chose instead of a tmpfs.
+namespace {
+struct JournalDirectory {
+  string path;
+
+  JournalDirectory()
+  {
+    char name[] = "journal_benchmark.XXXXXX";
+
+    if (!mkdtemp(name)) {
+      cerr << "Unable to create " << name << ": " << strerror(errno) << "\n";
+      exit(EXIT_FAILURE);
+    }
+
+    path = name;
+  }
+
+  ~JournalDirectory()
+  {
+    if (DIR *dir_ptr = opendir(path.c_str())) {
+      while (dirent *entry_ptr = readdir(dir_ptr)) {
+        string name = entry_ptr->d_name;
+
+        if (name != "." && name != "..") {
+          unlink((path + "/" + name).c_str());
+        }
+      }
+
+      closedir(dir_ptr);
+    }
+
+    rmdir(path.c_str());
+  }
+};
+}
+
+
+namespace {
+struct JournalByteCounter : MessageJournal::ReadHandlerInterface {
+  size_t n_messages = 0;
+  size_t n_bytes = 0;
+
+  void gotMessage(MessageJournal::Sequence,const char *,size_t size) override
+  {
+    ++n_messages;
+    n_bytes += size;
+  }
+};
+}
+
+
+// Appends messages in batches of the given size, committing after each
+// batch, and then replays them through the mappings.
+static void measureJournal(int batch_size,bool sync_on_commit,int n_messages)
+{
+  const string message = compressibleText(128);
+  JournalDirectory directory;
+  MessageJournal::Options options;
+  options.sync_on_commit = sync_on_commit;
+  double append_seconds = 0;
+
+  {
+    MessageJournal journal(directory.path,options);
+    Clock::time_point start_time = Clock::now();
+
+    for (int i=0; i!=n_messages; ++i) {
+      journal.append(message.data(),message.size());
+
+      if ((i + 1) % batch_size == 0) {
+        journal.commit();
+      }
+    }
+
+    journal.commit();
+    append_seconds = secondsSince(start_time);
+  }
+
+  // Reopening also measures recovery, which scans every record.
+  Clock::time_point replay_start_time = Clock::now();
+  MessageJournal journal(directory.path,options);
+  JournalByteCounter counter;
+
+  journal.read(/*first_sequence*/0,/*max_bytes*/SIZE_MAX,counter);
+
+  double replay_seconds = secondsSince(replay_start_time);
+
+  if (counter.n_messages != size_t(n_messages)) {
+    cerr << "Replayed " << counter.n_messages << " messages instead of " <<
+      n_messages << ".\n";
+    exit(EXIT_FAILURE);
+  }
+
+  double n_megabytes = double(counter.n_bytes)/(1024*1024);
+  int n_commits = (n_messages + batch_size - 1)/batch_size;
+
+  cout << "batch " << batch_size <<
+    (sync_on_commit ? ", fdatasync: " : ", no sync: ") <<
+    n_messages/append_seconds << " msgs/s, " <<
+    n_megabytes/append_seconds << " MB/s, " <<
+    n_commits/append_seconds << " commits/s; " <<
+    "open and replay " << n_messages/replay_seconds << " msgs/s\n";
+}
+
+
+static int runJournalBenchmark()
+{
+  // Fewer messages are used when each commit waits for the disk.
+  measureJournal(/*batch_size*/1,/*sync_on_commit*/true,2000);
+  measureJournal(/*batch_size*/16,/*sync_on_commit*/true,20000);
+  measureJournal(/*batch_size*/256,/*sync_on_commit*/true,400000);
+  measureJournal(/*batch_size*/256,/*sync_on_commit*/false,400000);
+  return EXIT_SUCCESS;
+}
+
+
+// Records a server while several clients send bursts of messages with
+// pauses between them, as a stand-in for a captured production session.
+// Returns the number of messages.
+static int recordBurstySession(const string &path)
+{
+  const int n_clients = 4;
+  const int n_bursts = 50;
+  const int burst_size = 200;
+  const string message(100,'x');
+  SystemSockets sockets;
+  SystemSelector selector;
+  SystemClock clock;
+  RecordingSockets recording_sockets(sockets,clock,path);
+  MessageServer server(recording_sockets);
+  std::deque<MessageClient> clients;
+  CountingServerHandler server_handler;
+  CoalescingClientHandler client_handler;
+  server.startListening(benchmark_port);
+
+  for (int i=0; i!=n_clients; ++i) {
+    clients.emplace_back(sockets);
+    clients.back().startConnecting(benchmark_port);
+  }
+
+  auto process_events = [&]{
+    selector.beginSelect();
+    server.setupSelect(selector.preSelectParams());
+
+    for (MessageClient &client : clients) {
+      client.setupSelect(selector.preSelectParams());
+    }
+
+    selector.callSelect();
+    server.handleSelect(selector.postSelectParams(),server_handler);
+
+    for (MessageClient &client : clients) {
+      client.handleSelect(selector.postSelectParams(),client_handler);
+    }
+
+    selector.endSelect();
+  };
+
+  while (server.nClients() != n_clients) {
+    process_events();
+  }
+
+  for (int burst=0; burst!=n_bursts; ++burst) {
+    for (MessageClient &client : clients) {
+      for (int i=0; i!=burst_size; ++i) {
+        client.queueMessage(message.data(),message.size());
+      }
+    }
+
+    int n_messages = (burst + 1)*n_clients*burst_size;
+
+    while (server_handler.n_messages != n_messages) {
+      process_events();
+    }
+
+    usleep(2000);
+  }
+
+  for (MessageClient &client : clients) {
+    client.disconnect();
+  }
+
+  while (server.nClients() != 0) {
+    process_events();
+  }
+
+  return server_handler.n_messages;
+}
+
+
+static void
+  measureReplay(const vector<SocketEvent> &events,double speed,int n_messages)
+{
+  SystemSockets sockets;
+  SystemSelector selector;
+  SystemClock clock;
+  MessageServer server(sockets);
+  SessionReplayer::Options options;
+  options.speed = speed;
+  SessionReplayer replayer(sockets,clock,events,options);
+  CountingServerHandler server_handler;
+  server.startListening(benchmark_port);
+  Clock::time_point start_time = Clock::now();
+  replayer.startReplaying(benchmark_port);
+
+  while (!replayer.isFinished() || server_handler.n_messages != n_messages) {
+    selector.beginSelect();
+    server.setupSelect(selector.preSelectParams());
+    replayer.setupSelect(selector.preSelectParams());
+    selector.callSelect();
+    server.handleSelect(selector.postSelectParams(),server_handler);
+    replayer.handleSelect(selector.postSelectParams());
+    selector.endSelect();
+  }
+
+  double seconds = secondsSince(start_time);
+  const SessionReplayer::Stats &stats = replayer.stats();
+  double max_lateness_ms =
+    std::chrono::duration<double,std::milli>(stats.max_lateness).count();
+
+  cout << "speed ";
+
+  if (speed == 0) {
+    cout << "unlimited";
+  }
+  else {
+    cout << speed << "x";
+  }
+
+  cout << ": " << seconds*1e3 << " ms, " <<
+    n_messages/seconds << " msgs/s, " <<
+    stats.n_bytes_sent << " bytes in " << stats.n_connections <<
+    " connections, max lateness " << max_lateness_ms << " ms\n";
+}
+
+
+static int runReplayBenchmark()
+{
+  char path[] = "replay_benchmark.XXXXXX";
+  int file_descriptor = mkstemp(path);
+
+  if (file_descriptor < 0) {
+    cerr << "Unable to create " << path << ": " << strerror(errno) << "\n";
+    return EXIT_FAILURE;
+  }
+
+  close(file_descriptor);
+  Clock::time_point record_start_time = Clock::now();
+  int n_messages = recordBurstySession(path);
+  double record_seconds = secondsSince(record_start_time);
+  vector<SocketEvent> events = readSocketRecording(path);
+  struct stat status;
+  stat(path,&status);
+  unlink(path);
+
+  cout << "recorded " << n_messages << " msgs in " <<
+    record_seconds*1e3 << " ms: " << events.size() << " events, " <<
+    status.st_size << " bytes\n";
+
+  measureReplay(events,/*speed*/1,n_messages);
+  measureReplay(events,/*speed*/4,n_messages);
+  measureReplay(events,/*speed*/0,n_messages);
+  return EXIT_SUCCESS;
+}
+
+
+static int handleOperation(const string &operation)
+{
+  if (operation == "latency") {
+    return runLatencyBenchmark();
+  }
+
+  if (operation == "zerocopy") {
+    return runZeroCopyBenchmark();
+  }
+
+  if (operation == "sendfile") {
+    return runSendFileBenchmark();
+  }
+
+  if (operation == "datagram") {
+    return runDatagramBenchmark();
+  }
+
+  if (operation == "rpc") {
+    return runRpcBenchmark();
+  }
+
+  if (operation == "pubsub") {
+    return runPubSubBenchmark();
+  }
+
+  if (operation == "pool") {
+    return runPoolBenchmark();
+  }
+
+  if (operation == "coalesce") {
+    return runCoalesceBenchmark();
+  }
+
+  if (operation == "sendqueue") {
+    return runSendQueueBenchmark();
+  }
+
+  if (operation == "churn") {
+    return runChurnBenchmark();
+  }
+
+  if (operation == "idle") {
+    return runIdleBenchmark();
+  }
+
+  if (operation == "drain") {
+    return runDrainBenchmark();
+  }
+
+  if (operation == "flowcontrol") {
+    return runFlowControlBenchmark();
+  }
+
+  if (operation == "compression") {
+    return runCompressionBenchmark();
+  }
+
+  if (operation == "journal") {
+    return runJournalBenchmark();
+  }
+
+  if (operation == "replay") {
+    return runReplayBenchmark();
+  }
+
+  cerr << "Unknown operation: " << operation << "\n";
+  return EXIT_FAILURE;
+}
+
+
+int main(int argc,char** argv)
+{
+  if (argc == 2) {
+    string operation = argv[1];
+    return handleOperation(operation);
+  }
+
+  cerr <<
+    "Usage: messaging_benchmark "
+    "<latency|zerocopy|sendfile|datagram|rpc|pubsub|pool|coalesce|"
+    "sendqueue|churn|idle|drain|flowcontrol|compression|journal|"
+    "replay>\n";
+  return EXIT_FAILURE;
+}
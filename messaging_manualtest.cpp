@@ -1,17 +1,67 @@
 #include <iostream>
+#include <optional>
 #include "messageservice.hpp"
 #include "systemsockets.hpp"
 #include "systemselector.hpp"
 #include "systemterminal.hpp"
 #include "processevents.hpp"
 #include "messagetesting.hpp"
+#include "resolver.hpp"
 
 using std::cerr;
+using std::optional;
 using std::string;
 using std::vector;
 
 
-static int runServer()
+// A host may resolve to both IPv6 and IPv4 addresses, and only some of
+// them may be reachable, so all of them are returned.
+static optional<vector<InternetAddress>> resolve(const string &host_and_port)
+{
+  string host;
+  int port = 0;
+
+  if (!splitHostAndPort(host_and_port,host,port)) {
+    cerr << "Invalid address: " << host_and_port << "\n";
+    return std::nullopt;
+  }
+
+  struct Handler : Resolver::EventInterface {
+    optional<Resolver::Result> maybe_result;
+
+    void resolved(Resolver::RequestId,const Resolver::Result &result) override
+    {
+      maybe_result = result;
+    }
+  };
+
+  SystemClock clock;
+  Resolver resolver(clock);
+  SystemSelector selector;
+  Handler handler;
+  resolver.startResolving(host,port);
+
+  while (!handler.maybe_result) {
+    selector.beginSelect();
+    resolver.setupSelect(selector.preSelectParams());
+    selector.callSelect();
+    resolver.handleSelect(selector.postSelectParams(),handler);
+    selector.endSelect();
+  }
+
+  const Resolver::Result &result = *handler.maybe_result;
+
+  if (result.addresses.empty()) {
+    cerr << "Unable to resolve " << host << ": " << result.error_message <<
+      "\n";
+    return std::nullopt;
+  }
+
+  return result.addresses;
+}
+
+
+static int runServer(const optional<string> &maybe_host_and_port)
 {
   SystemSockets sockets;
   SystemSelector selector;
@@ -19,7 +69,23 @@ static int runServer()
   MessageTestServer server{sockets,terminal};
   vector<EventSinkInterface*> event_sinks{&server.eventSink()};
 
-  server.start();
+  if (maybe_host_and_port) {
+    optional<vector<InternetAddress>> maybe_addresses =
+      resolve(*maybe_host_and_port);
+
+    if (!maybe_addresses) {
+      return EXIT_FAILURE;
+    }
+
+    // Listening on more than one address isn't supported, so use the
+    // first one.
+    if (!server.start((*maybe_addresses)[0])) {
+      return EXIT_FAILURE;
+    }
+  }
+  else if (!server.start()) {
+    return EXIT_FAILURE;
+  }
 
   while (server.isActive()) {
     processEvents(selector,event_sinks);
@@ -30,7 +96,7 @@ static int runServer()
 
 
 
-static int runClient()
+static int runClient(const optional<string> &maybe_host_and_port)
 {
   SystemSockets sockets;
   SystemTerminal terminal;
@@ -38,7 +104,19 @@ static int runClient()
   MessageTestClient client{sockets,terminal};
   vector<EventSinkInterface *> event_sinks = {&client.eventSink()};
 
-  client.start();
+  if (maybe_host_and_port) {
+    optional<vector<InternetAddress>> maybe_addresses =
+      resolve(*maybe_host_and_port);
+
+    if (!maybe_addresses) {
+      return EXIT_FAILURE;
+    }
+
+    client.start(*maybe_addresses);
+  }
+  else {
+    client.start();
+  }
 
   while (client.isActive()) {
     processEvents(selector,event_sinks);
@@ -49,14 +127,18 @@ static int runClient()
 
 
 
-static int handleOperation(const string &operation)
+static int
+  handleOperation(
+    const string &operation,
+    const optional<string> &maybe_host_and_port
+  )
 {
   if (operation == "server") {
-    return runServer();
+    return runServer(maybe_host_and_port);
   }
 
   if (operation == "client") {
-    return runClient();
+    return runClient(maybe_host_and_port);
   }
 
   cerr << "Unknown operation: " << operation << "\n";
@@ -68,9 +150,14 @@ int main(int argc,char** argv)
 {
   if (argc == 2) {
     string operation = argv[1];
-    return handleOperation(operation);
+    return handleOperation(operation,std::nullopt);
+  }
+
+  if (argc == 3) {
+    string operation = argv[1];
+    return handleOperation(operation,string(argv[2]));
   }
 
-  cerr << "Usage: main <server|client>\n";
+  cerr << "Usage: main <server|client> [host:port]\n";
   return EXIT_FAILURE;
 }
@@ -0,0 +1,135 @@
+#ifndef POLLSELECTOR_HPP_
+#define POLLSELECTOR_HPP_
+
+
+#include <poll.h>
+#include <time.h>
+#include <algorithm>
+#include <optional>
+#include <vector>
+#include "selector.hpp"
+
+
+// Like SystemSelectParams, but using ppoll(), which has no limit on
+// descriptor numbers, so it can be used with thousands of connections.
+struct PollSelectParams {
+  std::vector<pollfd> poll_fds;
+
+  // The index in poll_fds for each descriptor, or -1.
+  std::vector<int> poll_fd_indices;
+
+  std::optional<std::chrono::microseconds> maybe_timeout;
+  std::vector<int> ready_fds;
+
+  void setupSelect()
+  {
+    for (const pollfd &poll_fd : poll_fds) {
+      poll_fd_indices[poll_fd.fd] = -1;
+    }
+
+    poll_fds.clear();
+    maybe_timeout.reset();
+    ready_fds.clear();
+  }
+
+  void doSelect()
+  {
+    timespec timeout;
+    timespec *timeout_ptr = nullptr;
+
+    if (maybe_timeout) {
+      long long n_microseconds = std::max<long long>(maybe_timeout->count(),0);
+      timeout.tv_sec = n_microseconds / 1000000;
+      timeout.tv_nsec = n_microseconds % 1000000 * 1000;
+      timeout_ptr = &timeout;
+    }
+
+    int poll_result =
+      ppoll(poll_fds.data(),poll_fds.size(),timeout_ptr,/*sigmask*/nullptr);
+
+    ready_fds.clear();
+
+    for (pollfd &poll_fd : poll_fds) {
+      if (poll_result <= 0) {
+        // Nothing is meaningful if nothing was ready.
+        poll_fd.revents = 0;
+      }
+      else if (readIsSet(poll_fd.fd) || writeIsSet(poll_fd.fd)) {
+        ready_fds.push_back(poll_fd.fd);
+      }
+    }
+
+    std::sort(ready_fds.begin(),ready_fds.end());
+  }
+
+  void setEvents(int fd,short events)
+  {
+    if (fd >= int(poll_fd_indices.size())) {
+      poll_fd_indices.resize(fd + 1,-1);
+    }
+
+    int &index = poll_fd_indices[fd];
+
+    if (index < 0) {
+      index = poll_fds.size();
+      poll_fds.push_back(pollfd{fd,0,0});
+    }
+
+    poll_fds[index].events |= events;
+  }
+
+  void setTimeout(std::chrono::microseconds duration)
+  {
+    if (!maybe_timeout || duration < *maybe_timeout) {
+      maybe_timeout = duration;
+    }
+  }
+
+  // Errors and hangups make a descriptor both readable and writable, as
+  // they do with select().
+  bool isSet(int fd,short events) const
+  {
+    if (fd >= int(poll_fd_indices.size()) || poll_fd_indices[fd] < 0) {
+      return false;
+    }
+
+    const pollfd &poll_fd = poll_fds[poll_fd_indices[fd]];
+
+    if (!(poll_fd.events & events)) {
+      return false;
+    }
+
+    return poll_fd.revents & (events | POLLERR | POLLHUP);
+  }
+
+  void setRead(int fd) { setEvents(fd,POLLIN); }
+  void setWrite(int fd) { setEvents(fd,POLLOUT); }
+  bool readIsSet(int fd) const { return isSet(fd,POLLIN); }
+  bool writeIsSet(int fd) const { return isSet(fd,POLLOUT); }
+};
+
+
+class PollSelector : public AbstractSelector {
+  private:
+    PollSelectParams select_params;
+    BasicSelectParamsWrapper<PollSelectParams>
+      select_params_wrapper{select_params};
+
+    SelectParamsInterface &_selectParams() override
+    {
+      return select_params_wrapper;
+    }
+
+    void _setupSelect() override
+    {
+      select_params.setupSelect();
+    }
+
+    void _doSelect() override
+    {
+      select_params.doSelect();
+    }
+};
+
+
+#endif /* POLLSELECTOR_HPP_ */
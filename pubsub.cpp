@@ -0,0 +1,450 @@
+#include "pubsub.hpp"
+
+#include <string.h>
+#include <algorithm>
+#include <cassert>
+
+using std::string;
+using std::vector;
+using SubscriberId = TopicIndex::SubscriberId;
+
+
+// Messages from clients start with one of these, followed by the topic.
+// Published messages have a null character and then the message after
+// the topic.  Messages to clients are the topic, a null character, and the
+// message.
+static const char subscribe_command = 's';
+static const char unsubscribe_command = 'u';
+static const char publish_command = 'p';
+
+
+static void
+  buildMessage(
+    vector<char> &buffer,
+    const string &prefix,
+    const string &topic,
+    const char *message,
+    size_t message_size
+  )
+{
+  assert(topic.find('\0') == string::npos);
+  buffer.resize(prefix.size() + topic.size() + 1 + message_size);
+  char *p = buffer.data();
+  memcpy(p, prefix.data(), prefix.size());
+  p += prefix.size();
+  memcpy(p, topic.data(), topic.size());
+  p += topic.size();
+  *p++ = '\0';
+  memcpy(p, message, message_size);
+}
+
+
+// Splits "topic\0message".  Returns false if there is no null character.
+static bool
+  splitTopic(
+    const char *message,
+    size_t message_size,
+    string &topic,
+    const char *&body,
+    size_t &body_size
+  )
+{
+  const char *null_ptr =
+    static_cast<const char *>(memchr(message,'\0',message_size));
+
+  if (!null_ptr) {
+    return false;
+  }
+
+  topic.assign(message,null_ptr);
+  body = null_ptr + 1;
+  body_size = message_size - (body - message);
+  return true;
+}
+
+
+struct TopicIndex::Impl {
+  static bool isPrefixPattern(const string &pattern)
+  {
+    return !pattern.empty() && pattern.back() == '*';
+  }
+
+  static bool insert(SubscriberSet &set,SubscriberId subscriber_id)
+  {
+    if (set.indices.count(subscriber_id)) {
+      return false;
+    }
+
+    set.indices[subscriber_id] = set.members.size();
+    set.members.push_back(subscriber_id);
+    return true;
+  }
+
+  static void remove(SubscriberSet &set,SubscriberId subscriber_id)
+  {
+    auto iter = set.indices.find(subscriber_id);
+    assert(iter != set.indices.end());
+    size_t index = iter->second;
+    set.indices.erase(iter);
+
+    // Move the last member into the empty slot.
+    SubscriberId last_id = set.members.back();
+    set.members.pop_back();
+
+    if (last_id != subscriber_id) {
+      set.members[index] = last_id;
+      set.indices[last_id] = index;
+    }
+  }
+
+  static void
+    removeFromMap(
+      std::unordered_map<string,SubscriberSet> &map,
+      const string &key,
+      SubscriberId subscriber_id
+    )
+  {
+    auto iter = map.find(key);
+    assert(iter != map.end());
+    remove(iter->second,subscriber_id);
+
+    if (iter->second.members.empty()) {
+      map.erase(iter);
+    }
+  }
+
+  static void
+    addMembers(
+      TopicIndex &self,
+      const SubscriberSet &set,
+      vector<SubscriberId> &subscribers
+    )
+  {
+    for (SubscriberId subscriber_id : set.members) {
+      uint32_t &find_count = self.subscriber_find_counts[subscriber_id];
+
+      if (find_count != self.find_count) {
+        find_count = self.find_count;
+        subscribers.push_back(subscriber_id);
+      }
+    }
+  }
+
+  static void startFind(TopicIndex &self)
+  {
+    ++self.find_count;
+
+    if (self.find_count == 0) {
+      // The count wrapped around, so old marks could look current.
+      std::fill(
+        self.subscriber_find_counts.begin(),
+        self.subscriber_find_counts.end(),
+        0
+      );
+
+      self.find_count = 1;
+    }
+  }
+};
+
+
+bool TopicIndex::subscribe(SubscriberId subscriber_id,const string &pattern)
+{
+  assert(subscriber_id >= 0);
+
+  if (size_t(subscriber_id) >= subscriber_patterns.size()) {
+    subscriber_patterns.resize(subscriber_id + 1);
+    subscriber_find_counts.resize(subscriber_id + 1);
+  }
+
+  if (!subscriber_patterns[subscriber_id].insert(pattern).second) {
+    return false;
+  }
+
+  if (Impl::isPrefixPattern(pattern)) {
+    string prefix = pattern.substr(0,pattern.size() - 1);
+    Impl::insert(prefix_subscribers[prefix],subscriber_id);
+    ++prefix_length_counts[prefix.size()];
+  }
+  else {
+    Impl::insert(topic_subscribers[pattern],subscriber_id);
+  }
+
+  ++n_subscriptions;
+  return true;
+}
+
+
+bool
+  TopicIndex::unsubscribe(SubscriberId subscriber_id,const string &pattern)
+{
+  if (size_t(subscriber_id) >= subscriber_patterns.size()) {
+    return false;
+  }
+
+  if (!subscriber_patterns[subscriber_id].erase(pattern)) {
+    return false;
+  }
+
+  if (Impl::isPrefixPattern(pattern)) {
+    string prefix = pattern.substr(0,pattern.size() - 1);
+    Impl::removeFromMap(prefix_subscribers,prefix,subscriber_id);
+    auto iter = prefix_length_counts.find(prefix.size());
+    assert(iter != prefix_length_counts.end());
+
+    if (--iter->second == 0) {
+      prefix_length_counts.erase(iter);
+    }
+  }
+  else {
+    Impl::removeFromMap(topic_subscribers,pattern,subscriber_id);
+  }
+
+  --n_subscriptions;
+  return true;
+}
+
+
+void TopicIndex::unsubscribeAll(SubscriberId subscriber_id)
+{
+  if (size_t(subscriber_id) >= subscriber_patterns.size()) {
+    return;
+  }
+
+  const std::unordered_set<string> &patterns =
+    subscriber_patterns[subscriber_id];
+
+  // Copy them, since unsubscribing removes them.
+  vector<string> patterns_copy(patterns.begin(),patterns.end());
+
+  for (const string &pattern : patterns_copy) {
+    bool was_subscribed = unsubscribe(subscriber_id,pattern);
+    assert(was_subscribed);
+  }
+}
+
+
+void
+  TopicIndex::findSubscribers(
+    const string &topic,
+    vector<SubscriberId> &subscribers
+  )
+{
+  subscribers.clear();
+  Impl::startFind(*this);
+  auto topic_iter = topic_subscribers.find(topic);
+
+  if (topic_iter != topic_subscribers.end()) {
+    Impl::addMembers(*this,topic_iter->second,subscribers);
+  }
+
+  string prefix;
+
+  for (auto &length_and_count : prefix_length_counts) {
+    size_t prefix_length = length_and_count.first;
+
+    if (prefix_length > topic.size()) {
+      break;
+    }
+
+    prefix.assign(topic,0,prefix_length);
+    auto prefix_iter = prefix_subscribers.find(prefix);
+
+    if (prefix_iter != prefix_subscribers.end()) {
+      Impl::addMembers(*this,prefix_iter->second,subscribers);
+    }
+  }
+}
+
+
+struct PubSubServer::Impl {
+  struct MessageHandler : MessageServer::EventInterface {
+    PubSubServer &server;
+
+    MessageHandler(PubSubServer &server_arg)
+    : server(server_arg)
+    {
+    }
+
+    void
+      gotMessage(
+        ClientId client_id,
+        const char *message,
+        size_t message_size
+      ) override
+    {
+      if (message_size < 1) {
+        return;
+      }
+
+      char command = message[0];
+      const char *rest = message + 1;
+      size_t rest_size = message_size - 1;
+
+      if (command == subscribe_command) {
+        server.topic_index.subscribe(client_id,string(rest,rest_size));
+      }
+      else if (command == unsubscribe_command) {
+        server.topic_index.unsubscribe(client_id,string(rest,rest_size));
+      }
+      else if (command == publish_command) {
+        string topic;
+        const char *body = nullptr;
+        size_t body_size = 0;
+
+        if (splitTopic(rest,rest_size,topic,body,body_size)) {
+          server.publish(topic,body,body_size);
+        }
+      }
+    }
+
+    void clientConnected(ClientId) override
+    {
+    }
+
+    void clientDisconnected(ClientId client_id) override
+    {
+      server.topic_index.unsubscribeAll(client_id);
+    }
+  };
+};
+
+
+PubSubServer::PubSubServer(SocketsInterface &sockets_arg)
+: message_server(sockets_arg)
+{
+}
+
+
+void PubSubServer::setupSelect(PreSelectParamsInterface &pre_select_params)
+{
+  message_server.setupSelect(pre_select_params);
+}
+
+
+void
+  PubSubServer::handleSelect(const PostSelectParamsInterface &post_select_params)
+{
+  Impl::MessageHandler message_handler(*this);
+  message_server.handleSelect(post_select_params,message_handler);
+}
+
+
+int
+  PubSubServer::publish(
+    const string &topic,
+    const char *message,
+    size_t message_size
+  )
+{
+  topic_index.findSubscribers(topic,subscribers);
+
+  if (subscribers.empty()) {
+    return 0;
+  }
+
+  buildMessage(message_buffer,/*prefix*/"",topic,message,message_size);
+
+  SharedMessage shared_message =
+    makeSharedMessage(message_buffer.data(),message_buffer.size());
+
+  for (ClientId client_id : subscribers) {
+    message_server.queueSharedMessageToClient(client_id,shared_message);
+  }
+
+  return subscribers.size();
+}
+
+
+struct PubSubClient::Impl {
+  struct MessageHandler : MessageClient::EventInterface {
+    PubSubClient::EventInterface &event_handler;
+    string topic;
+
+    MessageHandler(PubSubClient::EventInterface &event_handler_arg)
+    : event_handler(event_handler_arg)
+    {
+    }
+
+    void connectionRefused() override
+    {
+      event_handler.connectionRefused();
+    }
+
+    void connected() override
+    {
+      event_handler.connected();
+    }
+
+    void gotMessage(const char *message,size_t message_size) override
+    {
+      const char *body = nullptr;
+      size_t body_size = 0;
+
+      if (splitTopic(message,message_size,topic,body,body_size)) {
+        event_handler.gotMessage(topic,body,body_size);
+      }
+    }
+  };
+
+  static void
+    queueCommand(PubSubClient &self,char command,const string &pattern)
+  {
+    assert(pattern.find('\0') == string::npos);
+    vector<char> &buffer = self.message_buffer;
+    buffer.resize(1 + pattern.size());
+    buffer[0] = command;
+    memcpy(buffer.data() + 1, pattern.data(), pattern.size());
+    self.message_client.queueMessage(buffer.data(),buffer.size());
+  }
+};
+
+
+PubSubClient::PubSubClient(SocketsInterface &sockets_arg)
+: message_client(sockets_arg)
+{
+}
+
+
+void PubSubClient::setupSelect(PreSelectParamsInterface &pre_select_params)
+{
+  message_client.setupSelect(pre_select_params);
+}
+
+
+void
+  PubSubClient::handleSelect(
+    const PostSelectParamsInterface &post_select_params,
+    EventInterface &event_handler
+  )
+{
+  Impl::MessageHandler message_handler(event_handler);
+  message_client.handleSelect(post_select_params,message_handler);
+}
+
+
+void PubSubClient::subscribe(const string &pattern)
+{
+  Impl::queueCommand(*this,subscribe_command,pattern);
+}
+
+
+void PubSubClient::unsubscribe(const string &pattern)
+{
+  Impl::queueCommand(*this,unsubscribe_command,pattern);
+}
+
+
+void
+  PubSubClient::publish(
+    const string &topic,
+    const char *message,
+    size_t message_size
+  )
+{
+  buildMessage(
+    message_buffer,string(1,publish_command),topic,message,message_size
+  );
+
+  message_client.queueMessage(message_buffer.data(),message_buffer.size());
+}
@@ -0,0 +1,157 @@
+#ifndef PUBSUB_HPP_
+#define PUBSUB_HPP_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <unordered_set>
+#include "messageservice.hpp"
+
+
+// Clients send subscribe, unsubscribe, and publish messages to the server,
+// and the server forwards each published message to the clients which
+// are subscribed to its topic.  A subscription to a topic ending in '*'
+// matches every topic which starts with the rest of it.  Topics can't
+// contain null characters.
+
+
+// Maps topics to subscribers.  Subscribers are small integers, like the
+// client ids of a MessageServer.
+class TopicIndex {
+  public:
+    using SubscriberId = int;
+
+    // Returns false if the subscriber was already subscribed.
+    bool subscribe(SubscriberId,const std::string &pattern);
+
+    // Returns false if the subscriber wasn't subscribed.
+    bool unsubscribe(SubscriberId,const std::string &pattern);
+
+    void unsubscribeAll(SubscriberId);
+
+    // Each matching subscriber is listed once, even if more than one of
+    // its subscriptions match.
+    void
+      findSubscribers(
+        const std::string &topic,
+        std::vector<SubscriberId> &subscribers
+      );
+
+    int nSubscriptions() const { return n_subscriptions; }
+
+  private:
+    struct Impl;
+
+    // Members can be added and removed in constant time, and iterating
+    // over them doesn't need to skip empty slots.
+    struct SubscriberSet {
+      std::vector<SubscriberId> members;
+      std::unordered_map<SubscriberId,size_t> indices;
+    };
+
+    std::unordered_map<std::string,SubscriberSet> topic_subscribers;
+
+    // Keyed by the pattern without the '*'.
+    std::unordered_map<std::string,SubscriberSet> prefix_subscribers;
+
+    // Only prefixes of these lengths need to be looked up.
+    std::map<size_t,int> prefix_length_counts;
+
+    std::vector<std::unordered_set<std::string>> subscriber_patterns;
+
+    // Used to avoid finding a subscriber twice.
+    std::vector<uint32_t> subscriber_find_counts;
+    uint32_t find_count = 0;
+
+    int n_subscriptions = 0;
+};
+
+
+class PubSubServer {
+  public:
+    using ClientId = MessageServer::ClientId;
+
+    PubSubServer(SocketsInterface &sockets_arg);
+
+    void startListening(int port) { message_server.startListening(port); }
+    void stopListening() { message_server.stopListening(); }
+    bool isActive() const { return message_server.isActive(); }
+    int nClients() const { return message_server.nClients(); }
+    int nSubscriptions() const { return topic_index.nSubscriptions(); }
+    void setupSelect(PreSelectParamsInterface &);
+    void handleSelect(const PostSelectParamsInterface &);
+
+    // The message isn't copied for each subscriber.  Returns the number of
+    // subscribers.
+    int
+      publish(
+        const std::string &topic,
+        const char *message,
+        size_t message_size
+      );
+
+  private:
+    struct Impl;
+
+    MessageServer message_server;
+    TopicIndex topic_index;
+    std::vector<TopicIndex::SubscriberId> subscribers;
+    std::vector<char> message_buffer;
+};
+
+
+class PubSubClient {
+  public:
+    struct EventInterface {
+      virtual void connectionRefused() = 0;
+      virtual void connected() = 0;
+
+      virtual void
+        gotMessage(
+          const std::string &topic,
+          const char *message,
+          size_t message_size
+        ) = 0;
+    };
+
+    PubSubClient(SocketsInterface &sockets_arg);
+
+    void startConnecting(int port) { message_client.startConnecting(port); }
+
+    void startConnecting(const InternetAddress &address)
+    {
+      message_client.startConnecting(address);
+    }
+
+    bool isActive() const { return message_client.isActive(); }
+    bool isConnected() const { return message_client.isConnected(); }
+
+    bool isSendingAMessage() const
+    {
+      return message_client.isSendingAMessage();
+    }
+
+    void disconnect() { message_client.disconnect(); }
+    void setupSelect(PreSelectParamsInterface &);
+    void handleSelect(const PostSelectParamsInterface &,EventInterface &);
+    void subscribe(const std::string &pattern);
+    void unsubscribe(const std::string &pattern);
+
+    void
+      publish(
+        const std::string &topic,
+        const char *message,
+        size_t message_size
+      );
+
+  private:
+    struct Impl;
+
+    MessageClient message_client;
+    std::vector<char> message_buffer;
+};
+
+
+#endif /* PUBSUB_HPP_ */
@@ -0,0 +1,190 @@
+#include "pubsub.hpp"
+
+#include <algorithm>
+#include <string>
+#include <vector>
+#include "fakesockets.hpp"
+#include "fakeselector.hpp"
+
+using std::string;
+using std::vector;
+using SubscriberId = TopicIndex::SubscriberId;
+
+static const int server_port = 4149;
+
+
+static vector<SubscriberId>
+  sortedSubscribers(TopicIndex &index,const string &topic)
+{
+  vector<SubscriberId> subscribers;
+  index.findSubscribers(topic,subscribers);
+  std::sort(subscribers.begin(),subscribers.end());
+  return subscribers;
+}
+
+
+static void testTopicIndex()
+{
+  TopicIndex index;
+  assert(index.subscribe(0,"prices.apple"));
+  assert(index.subscribe(1,"prices.apple"));
+  assert(index.subscribe(2,"prices.*"));
+  assert(!index.subscribe(1,"prices.apple"));
+  assert(index.nSubscriptions() == 3);
+  assert(sortedSubscribers(index,"prices.apple") == (vector<int>{0,1,2}));
+  assert(sortedSubscribers(index,"prices.pear") == (vector<int>{2}));
+  assert(sortedSubscribers(index,"prices") == (vector<int>{}));
+  assert(sortedSubscribers(index,"news") == (vector<int>{}));
+  assert(index.unsubscribe(0,"prices.apple"));
+  assert(!index.unsubscribe(0,"prices.apple"));
+  assert(sortedSubscribers(index,"prices.apple") == (vector<int>{1,2}));
+}
+
+
+static void testWildcardMatchingEverything()
+{
+  TopicIndex index;
+  index.subscribe(3,"*");
+  assert(sortedSubscribers(index,"") == (vector<int>{3}));
+  assert(sortedSubscribers(index,"anything") == (vector<int>{3}));
+}
+
+
+static void testOverlappingSubscriptions()
+{
+  TopicIndex index;
+  index.subscribe(0,"a.b.c");
+  index.subscribe(0,"a.*");
+  index.subscribe(0,"a.b.*");
+  index.subscribe(1,"a.b.*");
+
+  // Each subscriber is only found once.
+  assert(sortedSubscribers(index,"a.b.c") == (vector<int>{0,1}));
+
+  index.unsubscribeAll(0);
+  assert(index.nSubscriptions() == 1);
+  assert(sortedSubscribers(index,"a.b.c") == (vector<int>{1}));
+  assert(sortedSubscribers(index,"a.x") == (vector<int>{}));
+}
+
+
+namespace {
+struct ClientHandler : PubSubClient::EventInterface {
+  vector<string> messages;
+
+  void connectionRefused() override { assert(false); }
+  void connected() override {}
+
+  void
+    gotMessage(
+      const string &topic,
+      const char *message,
+      size_t message_size
+    ) override
+  {
+    messages.push_back(topic + ":" + string(message,message_size));
+  }
+};
+}
+
+
+namespace {
+struct Tester {
+  FakeFileDescriptorAllocator file_descriptor_allocator;
+  FakeSockets sockets{file_descriptor_allocator};
+  FakeSelector selector{{&sockets}};
+  PubSubServer server{sockets};
+  PubSubClient client1{sockets};
+  PubSubClient client2{sockets};
+  ClientHandler client1_handler;
+  ClientHandler client2_handler;
+
+  Tester()
+  {
+    server.startListening(server_port);
+    client1.startConnecting(server_port);
+    client2.startConnecting(server_port);
+  }
+
+  void processEvents()
+  {
+    selector.beginSelect();
+    server.setupSelect(selector.preSelectParams());
+    client1.setupSelect(selector.preSelectParams());
+    client2.setupSelect(selector.preSelectParams());
+    selector.callSelect();
+    server.handleSelect(selector.postSelectParams());
+    client1.handleSelect(selector.postSelectParams(),client1_handler);
+    client2.handleSelect(selector.postSelectParams(),client2_handler);
+    selector.endSelect();
+  }
+
+  void waitForSubscriptions(int n_subscriptions)
+  {
+    while (server.nSubscriptions() != n_subscriptions) {
+      processEvents();
+    }
+  }
+};
+}
+
+
+static void testRouting()
+{
+  Tester tester;
+  tester.client1.subscribe("prices.*");
+  tester.client2.subscribe("prices.pear");
+  tester.waitForSubscriptions(2);
+  tester.client2.publish("prices.apple","1",1);
+  tester.client2.publish("prices.pear","2",1);
+  tester.client2.publish("news","3",1);
+
+  while (tester.client2_handler.messages.size() != 1) {
+    tester.processEvents();
+  }
+
+  while (tester.client1_handler.messages.size() != 2) {
+    tester.processEvents();
+  }
+
+  assert(
+    tester.client1_handler.messages ==
+    (vector<string>{"prices.apple:1","prices.pear:2"})
+  );
+
+  assert(tester.client2_handler.messages == vector<string>{"prices.pear:2"});
+
+  // Publishing from the server.
+  assert(tester.server.publish("prices.pear","4",1) == 2);
+  assert(tester.server.publish("news","5",1) == 0);
+
+  while (tester.client2_handler.messages.size() != 2) {
+    tester.processEvents();
+  }
+
+  assert(tester.client2_handler.messages.back() == "prices.pear:4");
+}
+
+
+static void testDisconnectingRemovesSubscriptions()
+{
+  Tester tester;
+  tester.client1.subscribe("a");
+  tester.client1.subscribe("b*");
+  tester.client2.subscribe("a");
+  tester.waitForSubscriptions(3);
+  tester.client1.disconnect();
+  tester.waitForSubscriptions(1);
+  tester.client2.unsubscribe("a");
+  tester.waitForSubscriptions(0);
+}
+
+
+int main()
+{
+  testTopicIndex();
+  testWildcardMatchingEverything();
+  testOverlappingSubscriptions();
+  testRouting();
+  testDisconnectingRemovesSubscriptions();
+}
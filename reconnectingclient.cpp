@@ -0,0 +1,393 @@
+#include "reconnectingclient.hpp"
+
+#include <cmath>
+#include <cassert>
+#include <algorithm>
+
+using Duration = ClockInterface::Duration;
+
+
+struct ReconnectingMessageClient::Impl {
+  struct MessageHandler : MessageClient::EventInterface {
+    ReconnectingMessageClient &client;
+    ReconnectingMessageClient::EventInterface &event_handler;
+
+    MessageHandler(
+      ReconnectingMessageClient &client_arg,
+      ReconnectingMessageClient::EventInterface &event_handler_arg
+    )
+    : client(client_arg),
+      event_handler(event_handler_arg)
+    {
+    }
+
+    void connectionRefused() override
+    {
+      handleFailure(client,event_handler);
+    }
+
+    void connected() override
+    {
+      client.n_failed_attempts = 0;
+      giveMessagesToClient(client);
+      event_handler.connected();
+    }
+
+    void gotMessage(const char *message,size_t message_size) override
+    {
+      event_handler.gotMessage(message,message_size);
+    }
+  };
+
+  static void connect(ReconnectingMessageClient &self)
+  {
+    assert(self.maybe_server_address);
+    self.message_client.startConnecting(*self.maybe_server_address);
+    ++self.n_connection_attempts;
+  }
+
+  static void giveMessagesToClient(ReconnectingMessageClient &self)
+  {
+    size_t n_messages = self.unsent_messages.size();
+
+    for (size_t i=self.n_messages_given_to_client; i!=n_messages; ++i) {
+      self.message_client.queueSharedMessage(self.unsent_messages[i]);
+    }
+
+    self.n_messages_given_to_client = n_messages;
+  }
+
+  static void removeSentMessages(ReconnectingMessageClient &self)
+  {
+    uint64_t n_messages_sent = self.message_client.nMessagesSent();
+
+    while (self.n_messages_sent_by_client != n_messages_sent) {
+      assert(self.n_messages_given_to_client > 0);
+      self.unsent_messages.pop_front();
+      --self.n_messages_given_to_client;
+      ++self.n_messages_sent_by_client;
+    }
+  }
+
+  static Duration nextDelay(ReconnectingMessageClient &self)
+  {
+    const Options &options = self.options;
+
+    double delay =
+      options.initial_delay.count() *
+      std::pow(options.delay_multiplier,self.n_failed_attempts);
+
+    delay = std::min(delay,double(options.maximum_delay.count()));
+
+    // Anywhere from half the delay to the full delay.
+    std::uniform_real_distribution<double> distribution(delay/2,delay);
+    ++self.n_failed_attempts;
+    return Duration(Duration::rep(distribution(self.random_engine)));
+  }
+
+  static void
+    handleFailure(
+      ReconnectingMessageClient &self,
+      ReconnectingMessageClient::EventInterface &event_handler
+    )
+  {
+    // The client discarded whatever it hadn't sent.
+    assert(!self.message_client.isActive());
+    self.n_messages_given_to_client = 0;
+
+    Duration delay = nextDelay(self);
+    self.maybe_reconnect_time = self.clock.now() + delay;
+    bool should_drop =
+      self.options.unsent_message_policy == UnsentMessagePolicy::drop;
+
+    if (should_drop && !self.unsent_messages.empty()) {
+      size_t n_messages = self.unsent_messages.size();
+      self.unsent_messages.clear();
+      event_handler.droppedMessages(n_messages);
+    }
+
+    event_handler.disconnected(delay);
+  }
+};
+
+
+ReconnectingMessageClient::ReconnectingMessageClient(
+  SocketsInterface &sockets_arg,
+  const ClockInterface &clock_arg
+)
+: ReconnectingMessageClient(sockets_arg,clock_arg,Options())
+{
+}
+
+
+ReconnectingMessageClient::ReconnectingMessageClient(
+  SocketsInterface &sockets_arg,
+  const ClockInterface &clock_arg,
+  const Options &options_arg
+)
+: message_client(sockets_arg),
+  clock(clock_arg),
+  options(options_arg),
+  random_engine(options_arg.random_seed)
+{
+}
+
+
+void ReconnectingMessageClient::startConnecting(int port)
+{
+  InternetAddress server_address;
+  server_address.setLoopback();
+  server_address.setPort(port);
+  startConnecting(server_address);
+}
+
+
+void
+  ReconnectingMessageClient::startConnecting(
+    const InternetAddress &server_address
+  )
+{
+  assert(!isActive());
+  maybe_server_address = server_address;
+  n_failed_attempts = 0;
+  Impl::connect(*this);
+}
+
+
+void ReconnectingMessageClient::stop()
+{
+  maybe_reconnect_time.reset();
+
+  if (message_client.isActive()) {
+    Impl::removeSentMessages(*this);
+    message_client.disconnect();
+    n_messages_given_to_client = 0;
+  }
+}
+
+
+bool ReconnectingMessageClient::isActive() const
+{
+  return message_client.isActive() || maybe_reconnect_time;
+}
+
+
+void
+  ReconnectingMessageClient::setupSelect(
+    PreSelectParamsInterface &pre_select_params
+  )
+{
+  if (message_client.isActive()) {
+    message_client.setupSelect(pre_select_params);
+    return;
+  }
+
+  if (maybe_reconnect_time) {
+    Duration time_left = *maybe_reconnect_time - clock.now();
+
+    pre_select_params.setTimeout(
+      std::chrono::ceil<std::chrono::microseconds>(time_left)
+    );
+  }
+}
+
+
+void
+  ReconnectingMessageClient::handleSelect(
+    const PostSelectParamsInterface &post_select_params,
+    EventInterface &event_handler
+  )
+{
+  if (message_client.isActive()) {
+    bool was_connected = message_client.isConnected();
+    Impl::MessageHandler message_handler(*this,event_handler);
+    message_client.handleSelect(post_select_params,message_handler);
+    Impl::removeSentMessages(*this);
+
+    if (was_connected && !message_client.isActive()) {
+      Impl::handleFailure(*this,event_handler);
+    }
+
+    return;
+  }
+
+  if (maybe_reconnect_time && clock.now() >= *maybe_reconnect_time) {
+    maybe_reconnect_time.reset();
+    Impl::connect(*this);
+  }
+}
+
+
+void
+  ReconnectingMessageClient::queueMessage(
+    const char *message,
+    size_t message_size
+  )
+{
+  unsent_messages.push_back(makeSharedMessage(message,message_size));
+
+  if (message_client.isConnected()) {
+    Impl::giveMessagesToClient(*this);
+  }
+}
+
+
+struct MessageClientPool::Impl {
+  struct ConnectionHandler : ReconnectingMessageClient::EventInterface {
+    MessageClientPool::EventInterface &event_handler;
+    const ConnectionIndex index;
+
+    ConnectionHandler(
+      MessageClientPool::EventInterface &event_handler_arg,
+      ConnectionIndex index_arg
+    )
+    : event_handler(event_handler_arg),
+      index(index_arg)
+    {
+    }
+
+    void connected() override
+    {
+      event_handler.connected(index);
+    }
+
+    void disconnected(Duration reconnect_delay) override
+    {
+      event_handler.disconnected(index,reconnect_delay);
+    }
+
+    void gotMessage(const char *message,size_t message_size) override
+    {
+      event_handler.gotMessage(index,message,message_size);
+    }
+
+    void droppedMessages(size_t n_messages) override
+    {
+      event_handler.droppedMessages(index,n_messages);
+    }
+  };
+
+  // Prefer connections which are connected, then the ones with the
+  // fewest messages waiting.
+  static bool
+    isBetter(
+      const ReconnectingMessageClient &a,
+      const ReconnectingMessageClient &b
+    )
+  {
+    if (a.isConnected() != b.isConnected()) {
+      return a.isConnected();
+    }
+
+    return a.nUnsentMessages() < b.nUnsentMessages();
+  }
+};
+
+
+MessageClientPool::MessageClientPool(
+  SocketsInterface &sockets_arg,
+  const ClockInterface &clock_arg,
+  int n_connections,
+  const Options &options_arg
+)
+{
+  assert(n_connections > 0);
+
+  for (int i=0; i!=n_connections; ++i) {
+    // Each connection gets its own delays.
+    Options options = options_arg;
+    options.random_seed += i;
+    connections.emplace_back(sockets_arg,clock_arg,options);
+  }
+}
+
+
+void MessageClientPool::startConnecting(int port)
+{
+  for (ReconnectingMessageClient &connection : connections) {
+    connection.startConnecting(port);
+  }
+}
+
+
+void MessageClientPool::startConnecting(const InternetAddress &address)
+{
+  for (ReconnectingMessageClient &connection : connections) {
+    connection.startConnecting(address);
+  }
+}
+
+
+void MessageClientPool::stop()
+{
+  for (ReconnectingMessageClient &connection : connections) {
+    connection.stop();
+  }
+}
+
+
+int MessageClientPool::nConnected() const
+{
+  int count = 0;
+
+  for (const ReconnectingMessageClient &connection : connections) {
+    if (connection.isConnected()) {
+      ++count;
+    }
+  }
+
+  return count;
+}
+
+
+bool MessageClientPool::isSendingAMessage() const
+{
+  for (const ReconnectingMessageClient &connection : connections) {
+    if (connection.isSendingAMessage()) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+
+void MessageClientPool::setupSelect(PreSelectParamsInterface &pre_select_params)
+{
+  for (ReconnectingMessageClient &connection : connections) {
+    connection.setupSelect(pre_select_params);
+  }
+}
+
+
+void
+  MessageClientPool::handleSelect(
+    const PostSelectParamsInterface &post_select_params,
+    EventInterface &event_handler
+  )
+{
+  ConnectionIndex n_connections = connections.size();
+
+  for (ConnectionIndex index=0; index!=n_connections; ++index) {
+    Impl::ConnectionHandler connection_handler(event_handler,index);
+    connections[index].handleSelect(post_select_params,connection_handler);
+  }
+}
+
+
+auto
+  MessageClientPool::queueMessage(const char *message,size_t message_size)
+  -> ConnectionIndex
+{
+  ConnectionIndex best_index = 0;
+  ConnectionIndex n_connections = connections.size();
+
+  for (ConnectionIndex index=1; index!=n_connections; ++index) {
+    if (Impl::isBetter(connections[index],connections[best_index])) {
+      best_index = index;
+    }
+  }
+
+  connections[best_index].queueMessage(message,message_size);
+  return best_index;
+}
@@ -0,0 +1,156 @@
+#ifndef RECONNECTINGCLIENT_HPP_
+#define RECONNECTINGCLIENT_HPP_
+
+#include <deque>
+#include <random>
+#include <optional>
+#include "messageservice.hpp"
+#include "clock.hpp"
+
+
+// A MessageClient which connects again when the connection fails or is
+// lost.  The delay before each attempt grows exponentially with the number
+// of failed attempts, and is randomized so that many clients which lost
+// their connections at the same time don't all reconnect together.
+//
+// Messages which weren't completely written to the connection are either
+// sent again after reconnecting or dropped, depending on the policy.
+// Messages which were written but never read by the server are lost
+// either way.
+class ReconnectingMessageClient {
+  public:
+    using Duration = ClockInterface::Duration;
+
+    enum class UnsentMessagePolicy {
+      replay,
+      drop
+    };
+
+    struct Options {
+      Duration initial_delay = std::chrono::milliseconds(100);
+      Duration maximum_delay = std::chrono::seconds(30);
+      double delay_multiplier = 2;
+      UnsentMessagePolicy unsent_message_policy = UnsentMessagePolicy::replay;
+
+      // Used to randomize the delays.
+      unsigned random_seed = std::random_device()();
+    };
+
+    struct EventInterface {
+      virtual void connected() = 0;
+
+      // Called when a connection attempt fails or the connection is lost.
+      // Another attempt is made after the returned delay.
+      virtual void disconnected(Duration reconnect_delay) = 0;
+
+      virtual void gotMessage(const char *,size_t message_size) = 0;
+
+      // Only called with UnsentMessagePolicy::drop.
+      virtual void droppedMessages(size_t n_messages) = 0;
+    };
+
+    ReconnectingMessageClient(
+      SocketsInterface &sockets_arg,
+      const ClockInterface &clock_arg
+    );
+
+    ReconnectingMessageClient(
+      SocketsInterface &sockets_arg,
+      const ClockInterface &clock_arg,
+      const Options &options_arg
+    );
+
+    ReconnectingMessageClient(const ReconnectingMessageClient &) = delete;
+
+    void startConnecting(int port);
+    void startConnecting(const InternetAddress &);
+
+    // Closes the connection and stops reconnecting.  Unsent messages are
+    // kept in case startConnecting() is called again.
+    void stop();
+
+    bool isActive() const;
+    bool isConnected() const { return message_client.isConnected(); }
+    bool isSendingAMessage() const { return !unsent_messages.empty(); }
+    size_t nUnsentMessages() const { return unsent_messages.size(); }
+    int nConnectionAttempts() const { return n_connection_attempts; }
+    void setupSelect(PreSelectParamsInterface &);
+    void handleSelect(const PostSelectParamsInterface &,EventInterface &);
+    void queueMessage(const char *message,size_t message_size);
+
+  private:
+    struct Impl;
+    using TimePoint = ClockInterface::TimePoint;
+
+    MessageClient message_client;
+    const ClockInterface &clock;
+    const Options options;
+    std::mt19937 random_engine;
+    std::optional<InternetAddress> maybe_server_address;
+    std::optional<TimePoint> maybe_reconnect_time;
+    int n_failed_attempts = 0;
+    int n_connection_attempts = 0;
+
+    // The messages which haven't been completely sent, in order.  The
+    // ones which have been given to message_client come first.
+    std::deque<SharedMessage> unsent_messages;
+    size_t n_messages_given_to_client = 0;
+    uint64_t n_messages_sent_by_client = 0;
+};
+
+
+// Spreads messages over a number of connections to the same server, for
+// when one connection can't carry all the traffic.  Messages on different
+// connections can arrive in any order.
+class MessageClientPool {
+  public:
+    using ConnectionIndex = int;
+    using Duration = ReconnectingMessageClient::Duration;
+    using Options = ReconnectingMessageClient::Options;
+
+    struct EventInterface {
+      using ConnectionIndex = MessageClientPool::ConnectionIndex;
+      using Duration = MessageClientPool::Duration;
+
+      virtual void connected(ConnectionIndex) = 0;
+      virtual void disconnected(ConnectionIndex,Duration reconnect_delay) = 0;
+
+      virtual void
+        gotMessage(ConnectionIndex,const char *,size_t message_size) = 0;
+
+      virtual void droppedMessages(ConnectionIndex,size_t n_messages) = 0;
+    };
+
+    MessageClientPool(
+      SocketsInterface &sockets_arg,
+      const ClockInterface &clock_arg,
+      int n_connections,
+      const Options &options_arg = Options()
+    );
+
+    void startConnecting(int port);
+    void startConnecting(const InternetAddress &);
+    void stop();
+    int nConnections() const { return connections.size(); }
+    int nConnected() const;
+    bool isSendingAMessage() const;
+    void setupSelect(PreSelectParamsInterface &);
+    void handleSelect(const PostSelectParamsInterface &,EventInterface &);
+
+    // The message goes on the connected connection with the fewest unsent
+    // messages.
+    ConnectionIndex queueMessage(const char *message,size_t message_size);
+
+    ReconnectingMessageClient &connection(ConnectionIndex index)
+    {
+      return connections[index];
+    }
+
+  private:
+    struct Impl;
+
+    std::deque<ReconnectingMessageClient> connections;
+};
+
+
+#endif /* RECONNECTINGCLIENT_HPP_ */
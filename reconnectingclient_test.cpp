@@ -0,0 +1,306 @@
+#include "reconnectingclient.hpp"
+
+#include <string>
+#include <vector>
+#include <set>
+#include "fakesockets.hpp"
+#include "fakeselector.hpp"
+#include "fakeclock.hpp"
+
+using std::string;
+using std::vector;
+using Duration = ClockInterface::Duration;
+using std::chrono::milliseconds;
+using UnsentMessagePolicy = ReconnectingMessageClient::UnsentMessagePolicy;
+
+static const int server_port = 4150;
+
+
+namespace {
+struct ServerHandler : MessageServer::EventInterface {
+  vector<string> messages;
+  std::set<ClientId> client_ids;
+
+  void
+    gotMessage(
+      ClientId client_id,
+      const char *message,
+      size_t message_size
+    ) override
+  {
+    messages.push_back(string(message,message_size));
+    client_ids.insert(client_id);
+  }
+
+  void clientConnected(ClientId) override {}
+  void clientDisconnected(ClientId) override {}
+};
+}
+
+
+namespace {
+struct ClientHandler : ReconnectingMessageClient::EventInterface {
+  int n_connects = 0;
+  vector<Duration> reconnect_delays;
+  size_t n_dropped_messages = 0;
+
+  void connected() override { ++n_connects; }
+
+  void disconnected(Duration reconnect_delay) override
+  {
+    reconnect_delays.push_back(reconnect_delay);
+  }
+
+  void gotMessage(const char *,size_t) override {}
+
+  void droppedMessages(size_t n_messages) override
+  {
+    n_dropped_messages += n_messages;
+  }
+};
+}
+
+
+namespace {
+struct PoolHandler : MessageClientPool::EventInterface {
+  void connected(ConnectionIndex) override {}
+  void disconnected(ConnectionIndex,Duration) override {}
+  void gotMessage(ConnectionIndex,const char *,size_t) override {}
+  void droppedMessages(ConnectionIndex,size_t) override {}
+};
+}
+
+
+static ReconnectingMessageClient::Options
+  testOptions(UnsentMessagePolicy policy = UnsentMessagePolicy::replay)
+{
+  ReconnectingMessageClient::Options options;
+  options.initial_delay = milliseconds(100);
+  options.maximum_delay = milliseconds(1000);
+  options.unsent_message_policy = policy;
+  options.random_seed = 1;
+  return options;
+}
+
+
+namespace {
+struct Tester {
+  FakeFileDescriptorAllocator file_descriptor_allocator;
+  FakeSockets sockets{file_descriptor_allocator};
+  FakeClock clock;
+  FakeSelector selector{{&sockets}};
+  std::optional<MessageServer> maybe_server;
+  ServerHandler server_handler;
+
+  Tester()
+  {
+    selector.setClock(clock);
+  }
+
+  void startServer()
+  {
+    assert(!maybe_server);
+    maybe_server.emplace(sockets);
+    maybe_server->startListening(server_port);
+    server_handler = ServerHandler();
+  }
+
+  template <typename Client,typename Handler>
+  void processEvents(Client &client,Handler &handler)
+  {
+    selector.beginSelect();
+
+    if (maybe_server) {
+      maybe_server->setupSelect(selector.preSelectParams());
+    }
+
+    client.setupSelect(selector.preSelectParams());
+    selector.callSelect();
+
+    if (maybe_server) {
+      maybe_server->handleSelect(selector.postSelectParams(),server_handler);
+    }
+
+    client.handleSelect(selector.postSelectParams(),handler);
+    selector.endSelect();
+  }
+};
+}
+
+
+static void queueMessageOn(ReconnectingMessageClient &client,const string &s)
+{
+  client.queueMessage(s.data(),s.size());
+}
+
+
+static void testBackingOff()
+{
+  Tester tester;
+  ReconnectingMessageClient client(tester.sockets,tester.clock,testOptions());
+  ClientHandler handler;
+  queueMessageOn(client,"hello");
+  client.startConnecting(server_port);
+  const int n_attempts = 6;
+
+  while (client.nConnectionAttempts() != n_attempts) {
+    tester.processEvents(client,handler);
+  }
+
+  assert(handler.reconnect_delays.size() == n_attempts - 1);
+  Duration maximum_delay = milliseconds(100);
+
+  for (Duration delay : handler.reconnect_delays) {
+    assert(delay >= maximum_delay/2 && delay <= maximum_delay);
+    maximum_delay = std::min<Duration>(maximum_delay*2,milliseconds(1000));
+  }
+
+  // The message is sent once the server is there.
+  tester.startServer();
+
+  while (tester.server_handler.messages.empty()) {
+    tester.processEvents(client,handler);
+  }
+
+  assert(handler.n_connects == 1);
+  assert(tester.server_handler.messages == vector<string>{"hello"});
+  assert(!client.isSendingAMessage());
+
+  // Failures after connecting start with a short delay again.
+  tester.maybe_server.reset();
+
+  while (client.isConnected()) {
+    tester.processEvents(client,handler);
+  }
+
+  assert(handler.reconnect_delays.back() <= milliseconds(100));
+}
+
+
+static void
+  loseConnectionWithMessagesQueued(
+    Tester &tester,
+    ReconnectingMessageClient &client,
+    ClientHandler &handler
+  )
+{
+  tester.startServer();
+  client.startConnecting(server_port);
+
+  while (tester.maybe_server->nClients() != 1 || !client.isConnected()) {
+    tester.processEvents(client,handler);
+  }
+
+  tester.maybe_server.reset();
+  queueMessageOn(client,"a");
+  queueMessageOn(client,"b");
+
+  while (client.isConnected()) {
+    tester.processEvents(client,handler);
+  }
+}
+
+
+static void testReplayingUnsentMessages()
+{
+  Tester tester;
+  ReconnectingMessageClient client(tester.sockets,tester.clock,testOptions());
+  ClientHandler handler;
+  loseConnectionWithMessagesQueued(tester,client,handler);
+  assert(client.nUnsentMessages() == 2);
+  tester.startServer();
+
+  while (tester.server_handler.messages.size() != 2) {
+    tester.processEvents(client,handler);
+  }
+
+  assert(tester.server_handler.messages == (vector<string>{"a","b"}));
+  assert(handler.n_connects == 2);
+  assert(handler.n_dropped_messages == 0);
+}
+
+
+static void testDroppingUnsentMessages()
+{
+  Tester tester;
+
+  ReconnectingMessageClient
+    client(tester.sockets,tester.clock,testOptions(UnsentMessagePolicy::drop));
+
+  ClientHandler handler;
+  loseConnectionWithMessagesQueued(tester,client,handler);
+  assert(handler.n_dropped_messages == 2);
+  assert(client.nUnsentMessages() == 0);
+  tester.startServer();
+
+  while (handler.n_connects != 2) {
+    tester.processEvents(client,handler);
+  }
+
+  queueMessageOn(client,"c");
+
+  while (tester.server_handler.messages.empty()) {
+    tester.processEvents(client,handler);
+  }
+
+  assert(tester.server_handler.messages == vector<string>{"c"});
+}
+
+
+static void testStopping()
+{
+  Tester tester;
+  ReconnectingMessageClient client(tester.sockets,tester.clock,testOptions());
+  ClientHandler handler;
+  client.startConnecting(server_port);
+
+  while (handler.reconnect_delays.empty()) {
+    tester.processEvents(client,handler);
+  }
+
+  assert(client.isActive());
+  client.stop();
+  assert(!client.isActive());
+  assert(tester.sockets.nAllocated() == 0);
+}
+
+
+static void testPool()
+{
+  Tester tester;
+  tester.startServer();
+  MessageClientPool pool(tester.sockets,tester.clock,3,testOptions());
+  PoolHandler handler;
+  pool.startConnecting(server_port);
+
+  while (pool.nConnected() != 3) {
+    tester.processEvents(pool,handler);
+  }
+
+  vector<int> n_messages_per_connection(3);
+
+  for (int i=0; i!=6; ++i) {
+    string message = std::to_string(i);
+    int index = pool.queueMessage(message.data(),message.size());
+    ++n_messages_per_connection[index];
+  }
+
+  assert(n_messages_per_connection == (vector<int>{2,2,2}));
+
+  while (tester.server_handler.messages.size() != 6) {
+    tester.processEvents(pool,handler);
+  }
+
+  assert(tester.server_handler.client_ids.size() == 3);
+  assert(!pool.isSendingAMessage());
+}
+
+
+int main()
+{
+  testBackingOff();
+  testReplayingUnsentMessages();
+  testDroppingUnsentMessages();
+  testStopping();
+  testPool();
+}
@@ -0,0 +1,449 @@
+#include "recordingsockets.hpp"
+
+#include <string.h>
+#include <fcntl.h>
+#include <cassert>
+#include <stdexcept>
+
+using std::string;
+using std::vector;
+using SocketId = SocketsInterface::SocketId;
+using Type = SocketEvent::Type;
+
+
+static const char file_signature[8] = {'S','O','C','K','R','E','C','1'};
+static const size_t flush_size = 64*1024;
+
+
+static void appendVarint(vector<char> &buffer,uint64_t value)
+{
+  while (value >= 0x80) {
+    buffer.push_back(char(0x80 | (value & 0x7f)));
+    value >>= 7;
+  }
+
+  buffer.push_back(char(value));
+}
+
+
+// Results can be negative, so they are zigzag encoded to keep small
+// magnitudes small.
+static uint64_t zigzagEncoded(int64_t value)
+{
+  return (uint64_t(value) << 1) ^ uint64_t(value >> 63);
+}
+
+
+static int64_t zigzagDecoded(uint64_t value)
+{
+  return int64_t(value >> 1) ^ -int64_t(value & 1);
+}
+
+
+static bool readVarint(const char *&p,const char *end,uint64_t &value)
+{
+  value = 0;
+
+  for (int shift=0; shift<64; shift+=7) {
+    if (p == end) {
+      return false;
+    }
+
+    unsigned char byte = *p++;
+    value |= uint64_t(byte & 0x7f) << shift;
+
+    if (!(byte & 0x80)) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+
+static bool hasData(Type type)
+{
+  return type == Type::send || type == Type::recv;
+}
+
+
+// Whether a send or receive is worth recording.
+static bool isRecorded(int result)
+{
+  IoStatus status = ioStatus(result);
+  return status != IoStatus::would_block && status != IoStatus::interrupted;
+}
+
+
+struct RecordingSockets::Impl {
+  // Returns false with errno set if the buffer couldn't all be written.
+  static bool writeBuffer(RecordingSockets &self)
+  {
+    const char *p = self.buffer.data();
+    size_t n_bytes_left = self.buffer.size();
+
+    while (n_bytes_left != 0) {
+      ssize_t write_result = write(self.file_descriptor,p,n_bytes_left);
+
+      if (write_result < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+
+        return false;
+      }
+
+      p += write_result;
+      n_bytes_left -= write_result;
+    }
+
+    self.buffer.clear();
+    return true;
+  }
+
+  static void
+    record(
+      RecordingSockets &self,
+      Type type,
+      SocketId socket_id,
+      int result = 0,
+      const void *data = nullptr
+    )
+  {
+    if (self.recording_failed) {
+      return;
+    }
+
+    // Writing the file mustn't change what the caller sees.
+    int saved_errno = errno;
+
+    std::chrono::microseconds time =
+      std::chrono::duration_cast<std::chrono::microseconds>(
+        self.clock.now() - self.start_time
+      );
+
+    vector<char> &buffer = self.buffer;
+    buffer.push_back(char(type));
+    appendVarint(buffer,(time - self.last_event_time).count());
+    appendVarint(buffer,socket_id);
+    appendVarint(buffer,zigzagEncoded(result));
+    self.last_event_time = time;
+
+    if (hasData(type) && result > 0) {
+      const char *bytes = static_cast<const char *>(data);
+      buffer.insert(buffer.end(),bytes,bytes + result);
+    }
+
+    if (buffer.size() >= flush_size && !writeBuffer(self)) {
+      self.recording_failed = true;
+      buffer.clear();
+    }
+
+    errno = saved_errno;
+  }
+};
+
+
+RecordingSockets::RecordingSockets(
+  SocketsInterface &sockets_arg,
+  const ClockInterface &clock_arg,
+  const string &path
+)
+: sockets(sockets_arg),
+  clock(clock_arg),
+  start_time(clock.now()),
+  file_descriptor(open(path.c_str(),O_WRONLY | O_CREAT | O_TRUNC,0644))
+{
+  if (file_descriptor < 0) {
+    throw std::runtime_error(
+      "Unable to create " + path + ": " + strerror(errno)
+    );
+  }
+
+  buffer.assign(file_signature,file_signature + sizeof file_signature);
+}
+
+
+RecordingSockets::~RecordingSockets()
+{
+  try {
+    flush();
+  }
+  catch (std::runtime_error &) {
+    // There's no one to tell, and the recording is as complete as it can
+    // be.
+  }
+
+  ::close(file_descriptor);
+}
+
+
+void RecordingSockets::flush()
+{
+  if (recording_failed) {
+    return;
+  }
+
+  if (!Impl::writeBuffer(*this)) {
+    recording_failed = true;
+    buffer.clear();
+
+    throw std::runtime_error(
+      string("Unable to write recording: ") + strerror(errno)
+    );
+  }
+}
+
+
+SocketId RecordingSockets::create(int address_family)
+{
+  SocketId socket_id = sockets.create(address_family);
+  Impl::record(*this,Type::create,socket_id);
+  return socket_id;
+}
+
+
+void RecordingSockets::setNonBlocking(SocketId socket_id,bool non_blocking)
+{
+  sockets.setNonBlocking(socket_id,non_blocking);
+}
+
+
+void RecordingSockets::setNoDelay(SocketId socket_id,bool no_delay)
+{
+  sockets.setNoDelay(socket_id,no_delay);
+}
+
+
+void RecordingSockets::setCork(SocketId socket_id,bool cork)
+{
+  sockets.setCork(socket_id,cork);
+}
+
+
+void
+  RecordingSockets::setKeepAlive(
+    SocketId socket_id,
+    std::chrono::seconds idle_time
+  )
+{
+  sockets.setKeepAlive(socket_id,idle_time);
+}
+
+
+void
+  RecordingSockets::connect(
+    SocketId socket_id,
+    const InternetAddress &address
+  )
+{
+  sockets.connect(socket_id,address);
+  Impl::record(*this,Type::connect,socket_id);
+}
+
+
+bool RecordingSockets::connectionWasRefused(SocketId socket_id)
+{
+  return sockets.connectionWasRefused(socket_id);
+}
+
+
+void RecordingSockets::bind(SocketId socket_id,const InternetAddress &address)
+{
+  sockets.bind(socket_id,address);
+}
+
+
+void RecordingSockets::listen(SocketId socket_id,int backlog)
+{
+  sockets.listen(socket_id,backlog);
+}
+
+
+SocketId RecordingSockets::accept(SocketId socket_id)
+{
+  SocketId result = sockets.accept(socket_id);
+
+  if (isRecorded(result)) {
+    Impl::record(*this,Type::accept,socket_id,result);
+  }
+
+  return result;
+}
+
+
+int RecordingSockets::recv(SocketId socket_id,void *buf,size_t len)
+{
+  int result = sockets.recv(socket_id,buf,len);
+
+  if (isRecorded(result)) {
+    Impl::record(*this,Type::recv,socket_id,result,buf);
+  }
+
+  return result;
+}
+
+
+int RecordingSockets::send(SocketId socket_id,const void *buf,size_t len)
+{
+  int result = sockets.send(socket_id,buf,len);
+
+  if (isRecorded(result)) {
+    Impl::record(*this,Type::send,socket_id,result,buf);
+  }
+
+  return result;
+}
+
+
+void RecordingSockets::close(SocketId socket_id)
+{
+  sockets.close(socket_id);
+  Impl::record(*this,Type::close,socket_id);
+}
+
+
+SocketId RecordingSockets::createDatagram()
+{
+  return sockets.createDatagram();
+}
+
+
+int
+  RecordingSockets::recvDatagrams(
+    SocketId socket_id,
+    ReceivedDatagram *datagrams,
+    int n
+  )
+{
+  return sockets.recvDatagrams(socket_id,datagrams,n);
+}
+
+
+int
+  RecordingSockets::sendDatagrams(
+    SocketId socket_id,
+    const DatagramToSend *datagrams,
+    int n
+  )
+{
+  return sockets.sendDatagrams(socket_id,datagrams,n);
+}
+
+
+int
+  RecordingSockets::sendFile(
+    SocketId socket_id,
+    int file_descriptor,
+    off_t offset,
+    size_t len
+  )
+{
+  return sendFileBySending(*this,socket_id,file_descriptor,offset,len);
+}
+
+
+int
+  RecordingSockets::sendZeroCopy(
+    SocketId socket_id,
+    const void *buf,
+    size_t len,
+    bool &is_zero_copy
+  )
+{
+  is_zero_copy = false;
+  return send(socket_id,buf,len);
+}
+
+
+vector<SocketEvent> readSocketRecording(const string &path)
+{
+  int file_descriptor = open(path.c_str(),O_RDONLY);
+
+  if (file_descriptor < 0) {
+    throw std::runtime_error(
+      "Unable to open " + path + ": " + strerror(errno)
+    );
+  }
+
+  string contents;
+  char chunk[64*1024];
+
+  for (;;) {
+    ssize_t read_result = read(file_descriptor,chunk,sizeof chunk);
+
+    if (read_result < 0 && errno == EINTR) {
+      continue;
+    }
+
+    if (read_result <= 0) {
+      if (read_result < 0) {
+        int error_number = errno;
+        close(file_descriptor);
+
+        throw std::runtime_error(
+          "Unable to read " + path + ": " + strerror(error_number)
+        );
+      }
+
+      break;
+    }
+
+    contents.append(chunk,read_result);
+  }
+
+  close(file_descriptor);
+
+  bool has_signature =
+    contents.size() >= sizeof file_signature &&
+    memcmp(contents.data(),file_signature,sizeof file_signature) == 0;
+
+  if (!has_signature) {
+    throw std::runtime_error(path + " isn't a socket recording.");
+  }
+
+  const char *p = contents.data() + sizeof file_signature;
+  const char *end = contents.data() + contents.size();
+  vector<SocketEvent> events;
+  std::chrono::microseconds time{0};
+
+  while (p != end) {
+    SocketEvent event;
+    event.type = Type(static_cast<unsigned char>(*p++));
+
+    if (event.type < Type::create || event.type > Type::close) {
+      throw std::runtime_error(path + " has an unknown event type.");
+    }
+
+    uint64_t time_delta = 0;
+    uint64_t socket_id = 0;
+    uint64_t result = 0;
+
+    bool has_fields =
+      readVarint(p,end,time_delta) &&
+      readVarint(p,end,socket_id) &&
+      readVarint(p,end,result);
+
+    if (!has_fields) {
+      break;
+    }
+
+    time += std::chrono::microseconds(time_delta);
+    event.time = time;
+    event.socket_id = socket_id;
+    event.result = zigzagDecoded(result);
+
+    if (hasData(event.type) && event.result > 0) {
+      if (size_t(end - p) < size_t(event.result)) {
+        break;
+      }
+
+      event.data.assign(p,event.result);
+      p += event.result;
+    }
+
+    events.push_back(std::move(event));
+  }
+
+  return events;
+}
@@ -0,0 +1,126 @@
+#ifndef RECORDINGSOCKETS_HPP_
+#define RECORDINGSOCKETS_HPP_
+
+#include <chrono>
+#include <string>
+#include <vector>
+#include "socketsinterface.hpp"
+#include "clock.hpp"
+
+
+// One call on RecordingSockets.
+struct SocketEvent {
+  enum class Type : uint8_t {
+    create = 1,
+    connect,
+    accept,
+    send,
+    recv,
+    close
+  };
+
+  Type type = Type::create;
+
+  // Since the recording started.
+  std::chrono::microseconds time{0};
+
+  // For create, this is the new socket.  For accept, it is the listening
+  // socket.
+  SocketsInterface::SocketId socket_id = -1;
+
+  // The new socket for accept, or what send or recv returned.
+  int result = 0;
+
+  // The bytes which were sent or received.
+  std::string data;
+};
+
+
+// Passes calls through to other sockets, writing each stream socket call
+// to a file along with the time and any data, so that a session can be
+// replayed later with SessionReplayer.
+//
+// Events are encoded as a type byte followed by variable-length integers
+// for the time since the previous event, the socket id, and the result,
+// and then any data, so a recording is barely larger than the traffic.
+// Sends and receives which would block or were interrupted aren't
+// recorded.  Datagram sockets aren't recorded.
+//
+// Zero-copy sends aren't supported, and files are sent through send(), so
+// that every byte which is sent is recorded.
+class RecordingSockets : public SocketsInterface {
+  public:
+    RecordingSockets(
+      SocketsInterface &sockets_arg,
+      const ClockInterface &clock_arg,
+      const std::string &path
+    );
+
+    RecordingSockets(const RecordingSockets &) = delete;
+
+    // Writes what is buffered.
+    ~RecordingSockets();
+
+    SocketId create(int address_family = AF_INET) override;
+    void setNonBlocking(SocketId,bool non_blocking) override;
+    void setNoDelay(SocketId,bool no_delay) override;
+    void setCork(SocketId,bool cork) override;
+    void setKeepAlive(SocketId,std::chrono::seconds idle_time) override;
+    void connect(SocketId,const InternetAddress &) override;
+    bool connectionWasRefused(SocketId) override;
+    void bind(SocketId,const InternetAddress &) override;
+    void listen(SocketId,int backlog) override;
+    SocketId accept(SocketId) override;
+    int recv(SocketId,void *buf,size_t len) override;
+    int send(SocketId,const void *buf,size_t len) override;
+    void close(SocketId) override;
+
+    SocketId createDatagram() override;
+    int recvDatagrams(SocketId,ReceivedDatagram *,int n) override;
+    int sendDatagrams(SocketId,const DatagramToSend *,int n) override;
+
+    int
+      sendFile(
+        SocketId,int file_descriptor,off_t offset,size_t len
+      ) override;
+
+    bool enableZeroCopy(SocketId) override { return false; }
+
+    int
+      sendZeroCopy(
+        SocketId,const void *buf,size_t len,bool &is_zero_copy
+      ) override;
+
+    std::optional<ZeroCopyCompletion>
+      readZeroCopyCompletion(SocketId) override
+    {
+      return std::nullopt;
+    }
+
+    // Events are buffered, and are written when enough have built up.
+    // Throws std::runtime_error if they can't be written.
+    void flush();
+
+    // If writing fails while passing a call through, the call still
+    // succeeds, but nothing more is recorded.
+    bool recordingFailed() const { return recording_failed; }
+
+  private:
+    struct Impl;
+
+    SocketsInterface &sockets;
+    const ClockInterface &clock;
+    const ClockInterface::TimePoint start_time;
+    std::chrono::microseconds last_event_time{0};
+    int file_descriptor;
+    std::vector<char> buffer;
+    bool recording_failed = false;
+};
+
+
+// Throws std::runtime_error if the file can't be read or isn't a
+// recording.  An event which was cut off at the end is left out.
+extern std::vector<SocketEvent> readSocketRecording(const std::string &path);
+
+
+#endif /* RECORDINGSOCKETS_HPP_ */
@@ -0,0 +1,304 @@
+#include "recordingsockets.hpp"
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <cassert>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "fakesockets.hpp"
+#include "fakeselector.hpp"
+#include "fakeclock.hpp"
+#include "messageservice.hpp"
+#include "sessionreplayer.hpp"
+
+using std::string;
+using std::vector;
+using ClientId = MessageServer::ClientId;
+using SocketId = SocketsInterface::SocketId;
+using Type = SocketEvent::Type;
+
+static const int server_port = 4153;
+
+
+namespace {
+struct TemporaryFile {
+  string path;
+
+  TemporaryFile()
+  {
+    char name[] = "/tmp/recordingsockets_test.XXXXXX";
+    int file_descriptor = mkstemp(name);
+    assert(file_descriptor >= 0);
+    close(file_descriptor);
+    path = name;
+  }
+
+  ~TemporaryFile()
+  {
+    unlink(path.c_str());
+  }
+};
+}
+
+
+namespace {
+struct ServerHandler : MessageServer::EventInterface {
+  vector<string> messages;
+  int n_disconnects = 0;
+
+  void
+    gotMessage(
+      ClientId,
+      const char *message,
+      size_t message_size
+    ) override
+  {
+    messages.push_back(string(message,message_size));
+  }
+
+  void clientConnected(ClientId) override {}
+  void clientDisconnected(ClientId) override { ++n_disconnects; }
+};
+}
+
+
+namespace {
+struct ClientHandler : MessageClient::EventInterface {
+  void connectionRefused() override { assert(false); }
+  void connected() override {}
+  void gotMessage(const char *,size_t) override {}
+};
+}
+
+
+namespace {
+struct Tester {
+  FakeFileDescriptorAllocator file_descriptor_allocator;
+  FakeSockets sockets{file_descriptor_allocator};
+  FakeClock clock;
+  FakeSelector selector{{&sockets}};
+  ServerHandler server_handler;
+
+  Tester()
+  {
+    selector.setClock(clock);
+  }
+
+  template <typename Function>
+  void processEvents(MessageServer &server,Function setup_and_handle_others)
+  {
+    selector.beginSelect();
+    server.setupSelect(selector.preSelectParams());
+    setup_and_handle_others(/*is_setup*/true);
+    selector.callSelect();
+    server.handleSelect(selector.postSelectParams(),server_handler);
+    setup_and_handle_others(/*is_setup*/false);
+    selector.endSelect();
+  }
+};
+}
+
+
+static const vector<string> &recordedMessages()
+{
+  static const vector<string> messages = {"first","second","third"};
+  return messages;
+}
+
+
+// Records a server which gets a message each second from one client.
+static void recordSession(const string &path)
+{
+  Tester tester;
+  ClientHandler client_handler;
+
+  {
+    RecordingSockets recording_sockets(tester.sockets,tester.clock,path);
+    MessageServer server(recording_sockets);
+    MessageClient client(tester.sockets);
+    server.startListening(server_port);
+    client.startConnecting(server_port);
+
+    auto process_events = [&]{
+      tester.processEvents(server,[&](bool is_setup){
+        if (is_setup) {
+          client.setupSelect(tester.selector.preSelectParams());
+        }
+        else {
+          client.handleSelect(
+            tester.selector.postSelectParams(),client_handler
+          );
+        }
+      });
+    };
+
+    while (server.nClients() != 1 || !client.isConnected()) {
+      process_events();
+    }
+
+    for (const string &message : recordedMessages()) {
+      tester.clock.advance(std::chrono::seconds(1));
+      client.queueMessage(message.data(),message.size());
+
+      while (client.isSendingAMessage()) {
+        process_events();
+      }
+    }
+
+    while (tester.server_handler.messages.size() != 3) {
+      process_events();
+    }
+
+    client.disconnect();
+
+    while (server.nClients() != 0) {
+      process_events();
+    }
+  }
+
+  assert(tester.server_handler.messages == recordedMessages());
+}
+
+
+static void testRecording()
+{
+  TemporaryFile file;
+  recordSession(file.path);
+  vector<SocketEvent> events = readSocketRecording(file.path);
+  string received_data;
+  vector<Type> connection_events;
+  std::chrono::microseconds last_time{0};
+
+  for (const SocketEvent &event : events) {
+    assert(event.time >= last_time);
+    last_time = event.time;
+
+    if (event.type == Type::recv) {
+      received_data += event.data;
+    }
+    else {
+      connection_events.push_back(event.type);
+    }
+  }
+
+  assert(
+    connection_events ==
+    (vector<Type>{Type::create,Type::accept,Type::close,Type::close})
+  );
+
+  assert(events.back().time == std::chrono::seconds(3));
+
+  for (const string &message : recordedMessages()) {
+    assert(received_data.find(message) != string::npos);
+  }
+}
+
+
+static void testReadingBadRecordings()
+{
+  TemporaryFile file;
+  recordSession(file.path);
+  size_t n_events = readSocketRecording(file.path).size();
+
+  struct stat status;
+  int stat_result = stat(file.path.c_str(),&status);
+  assert(stat_result == 0);
+
+  // Cut off the last event.
+  int truncate_result = truncate(file.path.c_str(),status.st_size - 1);
+  assert(truncate_result == 0);
+  assert(readSocketRecording(file.path).size() == n_events - 1);
+  truncate_result = truncate(file.path.c_str(),4);
+  assert(truncate_result == 0);
+  bool threw = false;
+
+  try {
+    readSocketRecording(file.path);
+  }
+  catch (const std::runtime_error &) {
+    threw = true;
+  }
+
+  assert(threw);
+}
+
+
+static void testFailingToWrite()
+{
+  Tester tester;
+
+  {
+    // Every write to /dev/full fails.
+    RecordingSockets recording_sockets(tester.sockets,tester.clock,"/dev/full");
+
+    // The calls keep working once enough events have built up to be
+    // written.
+    while (!recording_sockets.recordingFailed()) {
+      SocketId socket_id = recording_sockets.create();
+      assert(socket_id >= 0);
+      recording_sockets.close(socket_id);
+    }
+
+    SocketId socket_id = recording_sockets.create();
+    assert(socket_id >= 0);
+    recording_sockets.close(socket_id);
+  }
+}
+
+
+static void testReplaying(double speed)
+{
+  TemporaryFile file;
+  recordSession(file.path);
+  vector<SocketEvent> events = readSocketRecording(file.path);
+  Tester tester;
+  MessageServer server(tester.sockets);
+  SessionReplayer::Options options;
+  options.speed = speed;
+  SessionReplayer replayer(tester.sockets,tester.clock,events,options);
+  server.startListening(server_port);
+  FakeClock::TimePoint start_time = tester.clock.now();
+  replayer.startReplaying(server_port);
+
+  auto process_events = [&]{
+    tester.processEvents(server,[&](bool is_setup){
+      if (is_setup) {
+        replayer.setupSelect(tester.selector.preSelectParams());
+      }
+      else {
+        replayer.handleSelect(tester.selector.postSelectParams());
+      }
+    });
+  };
+
+  while (!replayer.isFinished() || tester.server_handler.n_disconnects != 1) {
+    process_events();
+  }
+
+  assert(tester.server_handler.messages == recordedMessages());
+  const SessionReplayer::Stats &stats = replayer.stats();
+  assert(stats.n_connections == 1);
+  assert(stats.n_lost_connections == 0);
+  assert(stats.n_bytes_sent == 3*4 + 5 + 6 + 5);
+  FakeClock::Duration duration = tester.clock.now() - start_time;
+
+  if (speed == 0) {
+    assert(duration == FakeClock::Duration(0));
+  }
+  else {
+    assert(duration == std::chrono::seconds(3)/speed);
+  }
+}
+
+
+int main()
+{
+  testRecording();
+  testReadingBadRecordings();
+  testFailingToWrite();
+  testReplaying(/*speed*/1);
+  testReplaying(/*speed*/2);
+  testReplaying(/*speed*/0);
+}
@@ -0,0 +1,325 @@
+#include "resolver.hpp"
+
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/eventfd.h>
+#include <cerrno>
+#include <cassert>
+#include <stdexcept>
+
+using std::string;
+using std::vector;
+
+
+struct Resolver::Impl {
+  static int createEventFd()
+  {
+    int event_fd = eventfd(0,EFD_NONBLOCK | EFD_CLOEXEC);
+
+    if (event_fd == -1) {
+      throw std::runtime_error("Unable to create eventfd.");
+    }
+
+    return event_fd;
+  }
+
+  static void signal(Resolver &self)
+  {
+    uint64_t one = 1;
+    ssize_t write_result = write(self.event_fd,&one,sizeof one);
+    assert(write_result == sizeof one);
+  }
+
+  static void clearSignal(Resolver &self)
+  {
+    uint64_t count = 0;
+    ssize_t read_result = read(self.event_fd,&count,sizeof count);
+
+    // The signal may have already been cleared.
+    assert(read_result == sizeof count || errno == EAGAIN);
+  }
+
+  static Lookup lookUp(const string &hostname)
+  {
+    Lookup lookup;
+    lookup.hostname = hostname;
+    addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo *result_ptr = nullptr;
+
+    int getaddrinfo_result =
+      getaddrinfo(hostname.c_str(),/*service*/nullptr,&hints,&result_ptr);
+
+    if (getaddrinfo_result != 0) {
+      lookup.error_message = gai_strerror(getaddrinfo_result);
+      return lookup;
+    }
+
+    addrinfo *info_ptr = result_ptr;
+
+    for (; info_ptr; info_ptr = info_ptr->ai_next) {
+      InternetAddress address;
+      address.setSockaddr(info_ptr->ai_addr,info_ptr->ai_addrlen);
+      lookup.addresses.push_back(address);
+    }
+
+    freeaddrinfo(result_ptr);
+    return lookup;
+  }
+
+  static void runThread(Resolver &self)
+  {
+    std::unique_lock<std::mutex> lock(self.mutex);
+
+    for (;;) {
+      self.condition.wait(lock,[&]{
+        return self.is_stopping || !self.hostnames_to_look_up.empty();
+      });
+
+      if (self.is_stopping) {
+        return;
+      }
+
+      string hostname = std::move(self.hostnames_to_look_up.front());
+      self.hostnames_to_look_up.pop_front();
+      lock.unlock();
+      Lookup lookup = lookUp(hostname);
+      lock.lock();
+      self.finished_lookups.push_back(std::move(lookup));
+      signal(self);
+    }
+  }
+
+  static bool isBeingLookedUp(const Resolver &self,const string &hostname)
+  {
+    for (auto &pending_request : self.pending_requests) {
+      if (pending_request.second.hostname == hostname) {
+        return true;
+      }
+    }
+
+    return false;
+  }
+
+  static const CacheEntry *
+    maybeCacheEntry(const Resolver &self,const string &hostname)
+  {
+    auto iter = self.cache.find(hostname);
+
+    if (iter == self.cache.end()) {
+      return nullptr;
+    }
+
+    if (self.clock.now() >= iter->second.expiration_time) {
+      return nullptr;
+    }
+
+    return &iter->second;
+  }
+
+  static Result
+    resultWithPort(const vector<InternetAddress> &addresses,int port)
+  {
+    Result result;
+    result.addresses = addresses;
+
+    for (InternetAddress &address : result.addresses) {
+      address.setPort(port);
+    }
+
+    return result;
+  }
+
+  static void startLookup(Resolver &self,const string &hostname)
+  {
+    if (!self.thread.joinable()) {
+      self.thread = std::thread([&self]{ runThread(self); });
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(self.mutex);
+      self.hostnames_to_look_up.push_back(hostname);
+    }
+
+    self.condition.notify_one();
+    ++self.n_lookups;
+  }
+
+  static vector<std::pair<RequestId,Result>>
+    takeFinishedResults(Resolver &self)
+  {
+    vector<Lookup> lookups;
+
+    {
+      std::lock_guard<std::mutex> lock(self.mutex);
+      lookups.swap(self.finished_lookups);
+    }
+
+    vector<std::pair<RequestId,Result>> results;
+    results.swap(self.cached_results);
+
+    for (Lookup &lookup : lookups) {
+      if (lookup.error_message.empty()) {
+        CacheEntry &entry = self.cache[lookup.hostname];
+        entry.addresses = lookup.addresses;
+        entry.expiration_time = self.clock.now() + self.cache_ttl;
+      }
+
+      auto iter = self.pending_requests.begin();
+
+      while (iter != self.pending_requests.end()) {
+        const Request &request = iter->second;
+
+        if (request.hostname != lookup.hostname) {
+          ++iter;
+          continue;
+        }
+
+        Result result = resultWithPort(lookup.addresses,request.port);
+        result.error_message = lookup.error_message;
+        results.emplace_back(iter->first,std::move(result));
+        iter = self.pending_requests.erase(iter);
+      }
+    }
+
+    return results;
+  }
+};
+
+
+Resolver::Resolver(
+  const ClockInterface &clock_arg,
+  ClockInterface::Duration cache_ttl_arg
+)
+: clock(clock_arg),
+  cache_ttl(cache_ttl_arg),
+  event_fd(Impl::createEventFd())
+{
+}
+
+
+Resolver::~Resolver()
+{
+  if (thread.joinable()) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      is_stopping = true;
+    }
+
+    condition.notify_one();
+    thread.join();
+  }
+
+  close(event_fd);
+}
+
+
+auto Resolver::startResolving(const string &hostname,int port) -> RequestId
+{
+  RequestId request_id = next_request_id++;
+
+  if (const CacheEntry *entry_ptr = Impl::maybeCacheEntry(*this,hostname)) {
+    // Report the result from handleSelect() like any other.
+    Result result = Impl::resultWithPort(entry_ptr->addresses,port);
+    cached_results.emplace_back(request_id,std::move(result));
+    Impl::signal(*this);
+    return request_id;
+  }
+
+  if (!Impl::isBeingLookedUp(*this,hostname)) {
+    Impl::startLookup(*this,hostname);
+  }
+
+  pending_requests[request_id] = Request{hostname,port};
+  return request_id;
+}
+
+
+bool Resolver::isResolving() const
+{
+  return !pending_requests.empty() || !cached_results.empty();
+}
+
+
+void Resolver::setupSelect(PreSelectParamsInterface &pre_select_params)
+{
+  if (isResolving()) {
+    pre_select_params.setRead(event_fd);
+  }
+}
+
+
+void
+  Resolver::handleSelect(
+    const PostSelectParamsInterface &post_select_params,
+    EventInterface &event_handler
+  )
+{
+  if (!isResolving()) {
+    return;
+  }
+
+  if (!post_select_params.readIsSet(event_fd)) {
+    return;
+  }
+
+  Impl::clearSignal(*this);
+
+  // The handler may start new requests, so take the results first.
+  vector<std::pair<RequestId,Result>> results =
+    Impl::takeFinishedResults(*this);
+
+  for (auto &request_result : results) {
+    event_handler.resolved(request_result.first,request_result.second);
+  }
+}
+
+
+bool
+  splitHostAndPort(
+    const string &host_and_port,
+    string &host,
+    int &port
+  )
+{
+  string::size_type colon_index = host_and_port.rfind(':');
+
+  if (colon_index == string::npos) {
+    return false;
+  }
+
+  string port_string = host_and_port.substr(colon_index + 1);
+
+  if (port_string.empty() || port_string.size() > 5) {
+    return false;
+  }
+
+  for (char c : port_string) {
+    if (c < '0' || c > '9') {
+      return false;
+    }
+  }
+
+  port = std::stoi(port_string);
+
+  if (port > 65535) {
+    return false;
+  }
+
+  host = host_and_port.substr(0,colon_index);
+
+  if (!host.empty() && host.front() == '[') {
+    if (host.back() != ']') {
+      return false;
+    }
+
+    host = host.substr(1,host.size() - 2);
+  }
+  else if (host.find(':') != string::npos) {
+    // IPv6 addresses need brackets.
+    return false;
+  }
+
+  return !host.empty();
+}
@@ -0,0 +1,99 @@
+#ifndef RESOLVER_HPP_
+#define RESOLVER_HPP_
+
+#include <string>
+#include <vector>
+#include <map>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include "internetaddress.hpp"
+#include "selectparams.hpp"
+#include "clock.hpp"
+
+
+// Resolves hostnames with getaddrinfo() on a helper thread, so that a slow
+// lookup doesn't stall the event loop.  Results are reported from
+// handleSelect().  Successful lookups are cached for cache_ttl, since
+// getaddrinfo() doesn't tell us the real time to live.
+class Resolver {
+  public:
+    using RequestId = int;
+
+    struct Result {
+      // Empty if the lookup failed.
+      std::vector<InternetAddress> addresses;
+      std::string error_message;
+    };
+
+    struct EventInterface {
+      virtual void resolved(RequestId,const Result &) = 0;
+    };
+
+    Resolver(
+      const ClockInterface &clock_arg,
+      ClockInterface::Duration cache_ttl_arg = std::chrono::seconds(60)
+    );
+
+    Resolver(const Resolver &) = delete;
+
+    // Waits for any lookup in progress to finish.
+    ~Resolver();
+
+    RequestId startResolving(const std::string &hostname,int port);
+    bool isResolving() const;
+    void setupSelect(PreSelectParamsInterface &);
+    void handleSelect(const PostSelectParamsInterface &,EventInterface &);
+    int nLookups() const { return n_lookups; }
+
+  private:
+    struct Impl;
+
+    struct Request {
+      std::string hostname;
+      int port;
+    };
+
+    struct CacheEntry {
+      std::vector<InternetAddress> addresses;
+      ClockInterface::TimePoint expiration_time;
+    };
+
+    struct Lookup {
+      std::string hostname;
+      std::vector<InternetAddress> addresses;
+      std::string error_message;
+    };
+
+    const ClockInterface &clock;
+    const ClockInterface::Duration cache_ttl;
+    const int event_fd;
+    RequestId next_request_id = 0;
+    int n_lookups = 0;
+    std::map<RequestId,Request> pending_requests;
+    std::vector<std::pair<RequestId,Result>> cached_results;
+    std::map<std::string,CacheEntry> cache;
+
+    // These are shared with the helper thread.
+    std::mutex mutex;
+    std::condition_variable condition;
+    std::deque<std::string> hostnames_to_look_up;
+    std::vector<Lookup> finished_lookups;
+    bool is_stopping = false;
+
+    std::thread thread;
+};
+
+
+// Splits "host:port" or "[IPv6 address]:port".  Returns false if the
+// string isn't in either form.
+extern bool
+  splitHostAndPort(
+    const std::string &host_and_port,
+    std::string &host,
+    int &port
+  );
+
+
+#endif /* RESOLVER_HPP_ */
@@ -0,0 +1,142 @@
+#include "resolver.hpp"
+
+#include <map>
+#include "systemselector.hpp"
+#include "fakeclock.hpp"
+
+using std::map;
+using std::string;
+using RequestId = Resolver::RequestId;
+
+
+namespace {
+struct Tester : Resolver::EventInterface {
+  FakeClock clock;
+  Resolver resolver{clock,/*cache_ttl*/std::chrono::seconds(10)};
+  SystemSelector selector;
+  map<RequestId,Resolver::Result> results;
+
+  void resolved(RequestId request_id,const Resolver::Result &result) override
+  {
+    results[request_id] = result;
+  }
+
+  void processEvents()
+  {
+    selector.beginSelect();
+    resolver.setupSelect(selector.preSelectParams());
+    selector.callSelect();
+    resolver.handleSelect(selector.postSelectParams(),*this);
+    selector.endSelect();
+  }
+
+  // Only uses /etc/hosts or numeric addresses, so it works offline.
+  const Resolver::Result &resolve(const string &hostname,int port)
+  {
+    RequestId request_id = resolver.startResolving(hostname,port);
+
+    while (!results.count(request_id)) {
+      processEvents();
+    }
+
+    assert(!resolver.isResolving());
+    return results[request_id];
+  }
+};
+}
+
+
+static void testResolvingLocalhost()
+{
+  Tester tester;
+  const Resolver::Result &result = tester.resolve("localhost",1234);
+  assert(result.error_message.empty());
+  assert(!result.addresses.empty());
+
+  for (const InternetAddress &address : result.addresses) {
+    assert(address.port() == 1234);
+  }
+}
+
+
+static void testResolvingIPv6Address()
+{
+  Tester tester;
+  const Resolver::Result &result = tester.resolve("::1",80);
+  assert(result.addresses.size() == 1);
+  const InternetAddress &address = result.addresses[0];
+  assert(address.family() == AF_INET6);
+  assert(address.hostString() == "::1");
+  assert(address.port() == 80);
+}
+
+
+static void testFailure()
+{
+  Tester tester;
+  const Resolver::Result &result = tester.resolve("",80);
+  assert(result.addresses.empty());
+  assert(!result.error_message.empty());
+}
+
+
+static void testCaching()
+{
+  Tester tester;
+  tester.resolve("127.0.0.1",1);
+  assert(tester.resolver.nLookups() == 1);
+
+  // A cached result still gets reported through handleSelect(), with the
+  // new port.
+  const Resolver::Result &result = tester.resolve("127.0.0.1",2);
+  assert(tester.resolver.nLookups() == 1);
+  assert(result.addresses.size() == 1);
+  assert(result.addresses[0].port() == 2);
+
+  tester.clock.advance(std::chrono::seconds(10));
+  tester.resolve("127.0.0.1",3);
+  assert(tester.resolver.nLookups() == 2);
+}
+
+
+static void testSimultaneousRequests()
+{
+  Tester tester;
+  RequestId request1 = tester.resolver.startResolving("127.0.0.1",1);
+  RequestId request2 = tester.resolver.startResolving("127.0.0.1",2);
+
+  while (tester.resolver.isResolving()) {
+    tester.processEvents();
+  }
+
+  assert(tester.resolver.nLookups() == 1);
+  assert(tester.results[request1].addresses[0].port() == 1);
+  assert(tester.results[request2].addresses[0].port() == 2);
+}
+
+
+static void testSplittingHostAndPort()
+{
+  string host;
+  int port = 0;
+  assert(splitHostAndPort("example.com:80",host,port));
+  assert(host == "example.com" && port == 80);
+  assert(splitHostAndPort("[::1]:8080",host,port));
+  assert(host == "::1" && port == 8080);
+  assert(!splitHostAndPort("::1:8080",host,port));
+  assert(!splitHostAndPort("example.com",host,port));
+  assert(!splitHostAndPort("example.com:",host,port));
+  assert(!splitHostAndPort("example.com:99999",host,port));
+  assert(!splitHostAndPort(":80",host,port));
+}
+
+
+int main()
+{
+  testResolvingLocalhost();
+  testResolvingIPv6Address();
+  testFailure();
+  testCaching();
+  testSimultaneousRequests();
+  testSplittingHostAndPort();
+}
@@ -0,0 +1,291 @@
+#include "rpc.hpp"
+
+#include <string.h>
+#include <cassert>
+
+using std::vector;
+
+
+static const size_t rpc_header_size = 4;
+
+
+static void
+  buildMessage(
+    vector<char> &message,
+    uint32_t request_id,
+    const char *payload,
+    size_t payload_size
+  )
+{
+  message.resize(rpc_header_size + payload_size);
+  message[0] = char(request_id >> 24);
+  message[1] = char(request_id >> 16);
+  message[2] = char(request_id >> 8);
+  message[3] = char(request_id);
+  memcpy(message.data() + rpc_header_size, payload, payload_size);
+}
+
+
+static uint32_t decodeRequestId(const char *message)
+{
+  const unsigned char *p = reinterpret_cast<const unsigned char *>(message);
+  return (uint32_t(p[0]) << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+
+struct RpcServer::Impl {
+  struct MessageHandler : MessageServer::EventInterface {
+    RpcServer &server;
+    RpcServer::EventInterface &event_handler;
+
+    MessageHandler(
+      RpcServer &server_arg,
+      RpcServer::EventInterface &event_handler_arg
+    )
+    : server(server_arg),
+      event_handler(event_handler_arg)
+    {
+    }
+
+    void
+      gotMessage(
+        ClientId client_id,
+        const char *message,
+        size_t message_size
+      ) override
+    {
+      if (message_size < rpc_header_size) {
+        // Not a request, so there's nothing we could respond to.
+        return;
+      }
+
+      uint64_t generation = server.client_generations[client_id];
+
+      event_handler.gotRequest(
+        client_id,
+        (generation << 32) | decodeRequestId(message),
+        message + rpc_header_size,
+        message_size - rpc_header_size
+      );
+    }
+
+    void clientConnected(ClientId client_id) override
+    {
+      if (server.client_generations.size() <= size_t(client_id)) {
+        server.client_generations.resize(client_id + 1);
+      }
+
+      event_handler.clientConnected(client_id);
+    }
+
+    void clientDisconnected(ClientId client_id) override
+    {
+      // Invalidates the request ids which haven't been responded to.
+      ++server.client_generations[client_id];
+      event_handler.clientDisconnected(client_id);
+    }
+  };
+};
+
+
+RpcServer::RpcServer(SocketsInterface &sockets_arg)
+: message_server(sockets_arg)
+{
+}
+
+
+void RpcServer::setupSelect(PreSelectParamsInterface &pre_select_params)
+{
+  message_server.setupSelect(pre_select_params);
+}
+
+
+void
+  RpcServer::handleSelect(
+    const PostSelectParamsInterface &post_select_params,
+    EventInterface &event_handler
+  )
+{
+  Impl::MessageHandler message_handler(*this,event_handler);
+  message_server.handleSelect(post_select_params,message_handler);
+}
+
+
+void
+  RpcServer::respond(
+    ClientId client_id,
+    RequestId request_id,
+    const char *response,
+    size_t response_size
+  )
+{
+  uint32_t generation = request_id >> 32;
+
+  if (client_generations[client_id] != generation) {
+    // The client has disconnected since the request.
+    return;
+  }
+
+  buildMessage(message_buffer,uint32_t(request_id),response,response_size);
+
+  message_server.queueMessageToClient(
+    client_id,message_buffer.data(),message_buffer.size()
+  );
+}
+
+
+struct RpcClient::Impl {
+  struct MessageHandler : MessageClient::EventInterface {
+    RpcClient &client;
+    RpcClient::EventInterface &event_handler;
+
+    MessageHandler(
+      RpcClient &client_arg,
+      RpcClient::EventInterface &event_handler_arg
+    )
+    : client(client_arg),
+      event_handler(event_handler_arg)
+    {
+    }
+
+    void connectionRefused() override
+    {
+      event_handler.connectionRefused();
+    }
+
+    void connected() override
+    {
+      event_handler.connected();
+    }
+
+    void gotMessage(const char *message,size_t message_size) override
+    {
+      if (message_size < rpc_header_size) {
+        return;
+      }
+
+      RequestId request_id = decodeRequestId(message);
+      auto iter = client.pending_requests.find(request_id);
+
+      if (iter == client.pending_requests.end()) {
+        // The request already timed out.
+        return;
+      }
+
+      ResponseCallback callback = takeRequest(client,iter);
+
+      callback(
+        Status::ok,
+        message + rpc_header_size,
+        message_size - rpc_header_size
+      );
+    }
+  };
+
+  using PendingRequests = std::unordered_map<RequestId,PendingRequest>;
+
+  static ResponseCallback
+    takeRequest(RpcClient &self,PendingRequests::iterator iter)
+  {
+    RequestId request_id = iter->first;
+    PendingRequest &request = iter->second;
+    ResponseCallback callback = std::move(request.callback);
+    self.deadlines.erase({request.deadline,request_id});
+    self.pending_requests.erase(iter);
+    return callback;
+  }
+
+  static void failAllRequests(RpcClient &self,Status status)
+  {
+    // The callbacks may make new requests, so take the old ones first.
+    PendingRequests requests;
+    requests.swap(self.pending_requests);
+    self.deadlines.clear();
+
+    for (auto &id_and_request : requests) {
+      id_and_request.second.callback(status,nullptr,0);
+    }
+  }
+
+  static void expireRequests(RpcClient &self)
+  {
+    TimePoint now = self.clock.now();
+
+    while (!self.deadlines.empty() && self.deadlines.begin()->first <= now) {
+      RequestId request_id = self.deadlines.begin()->second;
+      auto iter = self.pending_requests.find(request_id);
+      assert(iter != self.pending_requests.end());
+      ResponseCallback callback = takeRequest(self,iter);
+      callback(Status::deadline_exceeded,nullptr,0);
+    }
+  }
+};
+
+
+RpcClient::RpcClient(
+  SocketsInterface &sockets_arg,
+  const ClockInterface &clock_arg
+)
+: message_client(sockets_arg),
+  clock(clock_arg)
+{
+}
+
+
+void RpcClient::setupSelect(PreSelectParamsInterface &pre_select_params)
+{
+  message_client.setupSelect(pre_select_params);
+
+  if (!deadlines.empty()) {
+    ClockInterface::Duration time_left =
+      deadlines.begin()->first - clock.now();
+
+    // Round up so that we don't wake up just before the deadline.
+    pre_select_params.setTimeout(
+      std::chrono::ceil<std::chrono::microseconds>(time_left)
+    );
+  }
+}
+
+
+void
+  RpcClient::handleSelect(
+    const PostSelectParamsInterface &post_select_params,
+    EventInterface &event_handler
+  )
+{
+  bool was_active = message_client.isActive();
+  Impl::MessageHandler message_handler(*this,event_handler);
+  message_client.handleSelect(post_select_params,message_handler);
+
+  if (was_active && !message_client.isActive()) {
+    Impl::failAllRequests(*this,Status::disconnected);
+  }
+
+  Impl::expireRequests(*this);
+}
+
+
+auto
+  RpcClient::sendRequest(
+    const char *request,
+    size_t request_size,
+    ClockInterface::Duration timeout,
+    ResponseCallback callback
+  ) -> RequestId
+{
+  RequestId request_id = next_request_id++;
+  TimePoint deadline = clock.now() + timeout;
+  pending_requests[request_id] = PendingRequest{deadline,std::move(callback)};
+  deadlines.insert({deadline,request_id});
+  buildMessage(message_buffer,request_id,request,request_size);
+  message_client.queueMessage(message_buffer.data(),message_buffer.size());
+  return request_id;
+}
+
+
+void RpcClient::disconnect()
+{
+  message_client.disconnect();
+  Impl::failAllRequests(*this,Status::disconnected);
+}
@@ -0,0 +1,134 @@
+#ifndef RPC_HPP_
+#define RPC_HPP_
+
+#include <cstdint>
+#include <functional>
+#include <set>
+#include <unordered_map>
+#include <vector>
+#include "messageservice.hpp"
+#include "clock.hpp"
+
+
+// Requests and responses are messages which start with a four byte
+// correlation id, so that any number of requests can be in flight on one
+// connection and responses can come back in any order.
+
+
+class RpcServer {
+  public:
+    using ClientId = MessageServer::ClientId;
+
+    // The correlation id is in the low 32 bits.  The high bits count the
+    // connections which have used the client id, so that a response to a
+    // client which has gone is never given to a later one with the same id.
+    using RequestId = uint64_t;
+
+    struct EventInterface {
+      using ClientId = RpcServer::ClientId;
+      using RequestId = RpcServer::RequestId;
+
+      // The request is answered by calling respond(), which may be done
+      // later.  Once clientDisconnected() is called, the client's request
+      // ids are no longer valid, and responding to them does nothing.
+      virtual void
+        gotRequest(
+          ClientId,RequestId,const char *request,size_t request_size
+        ) = 0;
+
+      virtual void clientConnected(ClientId) = 0;
+      virtual void clientDisconnected(ClientId) = 0;
+    };
+
+    RpcServer(SocketsInterface &sockets_arg);
+
+    void startListening(int port) { message_server.startListening(port); }
+    void stopListening() { message_server.stopListening(); }
+    bool isActive() const { return message_server.isActive(); }
+    int nClients() const { return message_server.nClients(); }
+    void setupSelect(PreSelectParamsInterface &);
+    void handleSelect(const PostSelectParamsInterface &,EventInterface &);
+
+    void
+      respond(
+        ClientId,RequestId,const char *response,size_t response_size
+      );
+
+  private:
+    struct Impl;
+
+    MessageServer message_server;
+    std::vector<char> message_buffer;
+    std::vector<uint32_t> client_generations;
+};
+
+
+class RpcClient {
+  public:
+    using RequestId = uint32_t;
+
+    enum class Status {
+      ok,
+      deadline_exceeded,
+      disconnected
+    };
+
+    // The response is only valid for the call.  It is empty unless the
+    // status is ok.
+    using ResponseCallback =
+      std::function<void(Status,const char *response,size_t response_size)>;
+
+    struct EventInterface {
+      virtual void connectionRefused() = 0;
+      virtual void connected() = 0;
+    };
+
+    RpcClient(SocketsInterface &sockets_arg,const ClockInterface &clock_arg);
+    RpcClient(const RpcClient &) = delete;
+
+    void startConnecting(int port) { message_client.startConnecting(port); }
+
+    void startConnecting(const InternetAddress &address)
+    {
+      message_client.startConnecting(address);
+    }
+
+    bool isActive() const { return message_client.isActive(); }
+    bool isConnected() const { return message_client.isConnected(); }
+    int nPendingRequests() const { return pending_requests.size(); }
+    void setupSelect(PreSelectParamsInterface &);
+    void handleSelect(const PostSelectParamsInterface &,EventInterface &);
+
+    // The callback is called from handleSelect() with the response, or
+    // with an error if there is no response before the timeout.
+    RequestId
+      sendRequest(
+        const char *request,
+        size_t request_size,
+        ClockInterface::Duration timeout,
+        ResponseCallback
+      );
+
+    // Pending requests fail with Status::disconnected.
+    void disconnect();
+
+  private:
+    struct Impl;
+
+    using TimePoint = ClockInterface::TimePoint;
+
+    struct PendingRequest {
+      TimePoint deadline;
+      ResponseCallback callback;
+    };
+
+    MessageClient message_client;
+    const ClockInterface &clock;
+    RequestId next_request_id = 0;
+    std::unordered_map<RequestId,PendingRequest> pending_requests;
+    std::set<std::pair<TimePoint,RequestId>> deadlines;
+    std::vector<char> message_buffer;
+};
+
+
+#endif /* RPC_HPP_ */
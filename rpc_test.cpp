@@ -0,0 +1,286 @@
+#include "rpc.hpp"
+
+#include <string>
+#include <vector>
+#include <optional>
+#include "fakesockets.hpp"
+#include "fakeselector.hpp"
+#include "fakeclock.hpp"
+
+using std::string;
+using std::vector;
+using Status = RpcClient::Status;
+
+static const int server_port = 4148;
+
+
+namespace {
+struct ServerHandler : RpcServer::EventInterface {
+  struct Request {
+    ClientId client_id;
+    RequestId request_id;
+    string body;
+  };
+
+  vector<Request> requests;
+
+  void
+    gotRequest(
+      ClientId client_id,
+      RequestId request_id,
+      const char *request,
+      size_t request_size
+    ) override
+  {
+    requests.push_back({client_id,request_id,string(request,request_size)});
+  }
+
+  void clientConnected(ClientId) override {}
+  void clientDisconnected(ClientId) override {}
+};
+}
+
+
+namespace {
+struct ClientHandler : RpcClient::EventInterface {
+  void connectionRefused() override { assert(false); }
+  void connected() override {}
+};
+}
+
+
+namespace {
+struct Response {
+  Status status;
+  string body;
+
+  bool operator==(const Response &arg) const
+  {
+    return status == arg.status && body == arg.body;
+  }
+};
+}
+
+
+namespace {
+struct Tester {
+  FakeFileDescriptorAllocator file_descriptor_allocator;
+  FakeSockets sockets{file_descriptor_allocator};
+  FakeClock clock;
+  FakeSelector selector{{&sockets}};
+  std::optional<RpcServer> maybe_server;
+  RpcClient client{sockets,clock};
+  RpcClient other_client{sockets,clock};
+  ServerHandler server_handler;
+  ClientHandler client_handler;
+  vector<Response> responses;
+
+  Tester()
+  {
+    selector.setClock(clock);
+    maybe_server.emplace(sockets);
+    maybe_server->startListening(server_port);
+    client.startConnecting(server_port);
+  }
+
+  void sendRequest(const string &body,std::chrono::milliseconds timeout)
+  {
+    sendRequest(client,body,timeout);
+  }
+
+  void
+    sendRequest(
+      RpcClient &sending_client,
+      const string &body,
+      std::chrono::milliseconds timeout
+    )
+  {
+    sending_client.sendRequest(
+      body.data(),body.size(),timeout,
+      [this](Status status,const char *response,size_t response_size){
+        responses.push_back({status,string(response,response_size)});
+      }
+    );
+  }
+
+  void respond(const ServerHandler::Request &request,const string &body)
+  {
+    maybe_server->respond(
+      request.client_id,request.request_id,body.data(),body.size()
+    );
+  }
+
+  void processEvents()
+  {
+    selector.beginSelect();
+
+    if (maybe_server) {
+      maybe_server->setupSelect(selector.preSelectParams());
+    }
+
+    client.setupSelect(selector.preSelectParams());
+    other_client.setupSelect(selector.preSelectParams());
+    selector.callSelect();
+
+    if (maybe_server) {
+      maybe_server->handleSelect(selector.postSelectParams(),server_handler);
+    }
+
+    client.handleSelect(selector.postSelectParams(),client_handler);
+    other_client.handleSelect(selector.postSelectParams(),client_handler);
+    selector.endSelect();
+  }
+
+  void waitForRequests(size_t n_requests)
+  {
+    while (server_handler.requests.size() != n_requests) {
+      processEvents();
+    }
+  }
+
+  void waitForResponses(size_t n_responses)
+  {
+    while (responses.size() != n_responses) {
+      processEvents();
+    }
+  }
+};
+}
+
+
+static void testPipelining()
+{
+  Tester tester;
+  std::chrono::seconds timeout(1);
+  tester.sendRequest("one",timeout);
+  tester.sendRequest("two",timeout);
+  tester.sendRequest("three",timeout);
+  tester.waitForRequests(3);
+  assert(tester.server_handler.requests[0].body == "one");
+  assert(tester.server_handler.requests[1].body == "two");
+  assert(tester.server_handler.requests[2].body == "three");
+
+  // Respond out of order.
+  tester.respond(tester.server_handler.requests[2],"THREE");
+  tester.respond(tester.server_handler.requests[0],"ONE");
+  tester.respond(tester.server_handler.requests[1],"TWO");
+  tester.waitForResponses(3);
+
+  vector<Response> expected_responses = {
+    {Status::ok,"THREE"},
+    {Status::ok,"ONE"},
+    {Status::ok,"TWO"},
+  };
+
+  assert(tester.responses == expected_responses);
+  assert(tester.client.nPendingRequests() == 0);
+}
+
+
+static void testDeadlineExceeded()
+{
+  Tester tester;
+  FakeClock::TimePoint start_time = tester.clock.now();
+  tester.sendRequest("slow",std::chrono::milliseconds(100));
+  tester.sendRequest("fast",std::chrono::milliseconds(200));
+  tester.waitForRequests(2);
+  tester.respond(tester.server_handler.requests[1],"FAST");
+  tester.waitForResponses(1);
+  assert(tester.clock.now() == start_time);
+
+  // Nothing else happens, so the selector waits until the deadline.
+  tester.waitForResponses(2);
+  assert(tester.clock.now() - start_time == std::chrono::milliseconds(100));
+
+  vector<Response> expected_responses = {
+    {Status::ok,"FAST"},
+    {Status::deadline_exceeded,""},
+  };
+
+  assert(tester.responses == expected_responses);
+
+  // A late response is ignored.
+  tester.respond(tester.server_handler.requests[0],"SLOW");
+
+  for (int i=0; i!=3; ++i) {
+    tester.processEvents();
+  }
+
+  assert(tester.responses.size() == 2);
+}
+
+
+static void testDisconnecting()
+{
+  Tester tester;
+  std::chrono::seconds timeout(1);
+  tester.sendRequest("one",timeout);
+  tester.sendRequest("two",timeout);
+  tester.waitForRequests(2);
+  tester.client.disconnect();
+
+  vector<Response> expected_responses = {
+    {Status::disconnected,""},
+    {Status::disconnected,""},
+  };
+
+  assert(tester.responses == expected_responses);
+  assert(tester.client.nPendingRequests() == 0);
+}
+
+
+static void testServerGoingAway()
+{
+  Tester tester;
+  tester.sendRequest("one",std::chrono::seconds(1));
+  tester.waitForRequests(1);
+  tester.maybe_server.reset();
+  tester.waitForResponses(1);
+  assert(tester.responses[0] == (Response{Status::disconnected,""}));
+  assert(!tester.client.isActive());
+}
+
+
+static void testRespondingAfterTheClientDisconnects()
+{
+  Tester tester;
+  tester.sendRequest("one",std::chrono::seconds(1));
+  tester.waitForRequests(1);
+  ServerHandler::Request old_request = tester.server_handler.requests[0];
+  tester.client.disconnect();
+
+  while (tester.maybe_server->nClients() != 0) {
+    tester.processEvents();
+  }
+
+  // The client is gone, so this does nothing.
+  tester.respond(old_request,"ONE");
+
+  // A new client gets the same client id and sends the same correlation id,
+  // but mustn't get the old client's response.
+  tester.other_client.startConnecting(server_port);
+  tester.sendRequest(tester.other_client,"two",std::chrono::seconds(1));
+  tester.waitForRequests(2);
+  ServerHandler::Request new_request = tester.server_handler.requests[1];
+  assert(new_request.client_id == old_request.client_id);
+  tester.respond(old_request,"ONE");
+  tester.respond(new_request,"TWO");
+  tester.waitForResponses(2);
+
+  vector<Response> expected_responses = {
+    {Status::disconnected,""},
+    {Status::ok,"TWO"},
+  };
+
+  assert(tester.responses == expected_responses);
+}
+
+
+int main()
+{
+  testPipelining();
+  testDeadlineExceeded();
+  testDisconnecting();
+  testServerGoingAway();
+  testRespondingAfterTheClientDisconnects();
+}
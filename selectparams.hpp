@@ -1,16 +1,28 @@
 #ifndef SELECTPARAMS_HPP_
 #define SELECTPARAMS_HPP_
 
+#include <chrono>
+#include <vector>
+
 
 struct PreSelectParamsInterface {
   virtual void setRead(int) = 0;
   virtual void setWrite(int) = 0;
+
+  // Select returns after at most this long, even if nothing is ready.  The
+  // shortest timeout that is set is used.
+  virtual void setTimeout(std::chrono::microseconds) = 0;
 };
 
 
 struct PostSelectParamsInterface {
   virtual bool readIsSet(int) const = 0;
   virtual bool writeIsSet(int) const = 0;
+
+  // The descriptors which are ready for reading or writing, each listed
+  // once, so that callers with many descriptors can visit just the ready
+  // ones.
+  virtual const std::vector<int> &readyFds() const = 0;
 };
 
 
@@ -39,6 +51,11 @@ struct BasicSelectParamsWrapper : SelectParamsInterface {
     select_params.setWrite(fd);
   }
 
+  void setTimeout(std::chrono::microseconds duration) override
+  {
+    select_params.setTimeout(duration);
+  }
+
   bool readIsSet(int fd) const override
   {
     return select_params.readIsSet(fd);
@@ -48,6 +65,11 @@ struct BasicSelectParamsWrapper : SelectParamsInterface {
   {
     return select_params.writeIsSet(fd);
   }
+
+  const std::vector<int> &readyFds() const override
+  {
+    return select_params.ready_fds;
+  }
 };
 
 
@@ -0,0 +1,439 @@
+#include "sessionreplayer.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <unordered_map>
+
+using std::vector;
+using Duration = SessionReplayer::Duration;
+using SocketId = SessionReplayer::SocketId;
+
+
+struct SessionReplayer::Impl {
+  struct RecordedConnection {
+    int connection_index;
+    bool was_accepted;
+  };
+
+  static void
+    addStep(
+      SessionReplayer &self,
+      Step::Type type,
+      const SocketEvent &event,
+      int connection_index
+    )
+  {
+    self.steps.push_back(Step{type,event.time,connection_index,event.data});
+  }
+
+  static void
+    addCloseStep(
+      SessionReplayer &self,
+      const SocketEvent &event,
+      const RecordedConnection &connection
+    )
+  {
+    addStep(self,Step::Type::close,event,connection.connection_index);
+  }
+
+  // The data which went toward the recorded server.
+  static SocketEvent::Type inboundDataType(const RecordedConnection &connection)
+  {
+    if (connection.was_accepted) {
+      return SocketEvent::Type::recv;
+    }
+
+    return SocketEvent::Type::send;
+  }
+
+  static void makeSteps(SessionReplayer &self,const vector<SocketEvent> &events)
+  {
+    // Socket ids are reused once they are closed, so they only stand for
+    // a connection while it is open.
+    std::unordered_map<SocketId,RecordedConnection> open_connections;
+    int n_connections = 0;
+
+    for (const SocketEvent &event : events) {
+      auto iter = open_connections.find(event.socket_id);
+
+      if (iter != open_connections.end() && !event.data.empty()) {
+        const RecordedConnection &connection = iter->second;
+
+        if (event.type == inboundDataType(connection)) {
+          addStep(self,Step::Type::send,event,connection.connection_index);
+        }
+
+        continue;
+      }
+
+      switch (event.type) {
+        case SocketEvent::Type::accept:
+          if (event.result >= 0) {
+            open_connections[event.result] = {n_connections,true};
+            addStep(self,Step::Type::open,event,n_connections);
+            ++n_connections;
+          }
+          break;
+        case SocketEvent::Type::connect:
+          open_connections[event.socket_id] = {n_connections,false};
+          addStep(self,Step::Type::open,event,n_connections);
+          ++n_connections;
+          break;
+        case SocketEvent::Type::recv:
+          // When the peer of an accepted connection closed it, that is
+          // when our connection should close.
+          if (
+            iter != open_connections.end() &&
+            iter->second.was_accepted &&
+            event.result == 0
+          ) {
+            addCloseStep(self,event,iter->second);
+            open_connections.erase(iter);
+          }
+          break;
+        case SocketEvent::Type::close:
+          if (iter != open_connections.end()) {
+            addCloseStep(self,event,iter->second);
+            open_connections.erase(iter);
+          }
+          break;
+        case SocketEvent::Type::create:
+        case SocketEvent::Type::send:
+          break;
+      }
+    }
+
+    self.connections.resize(n_connections);
+  }
+
+  static TimePoint dueTime(const SessionReplayer &self,const Step &step)
+  {
+    if (self.options.speed == 0) {
+      return self.start_time;
+    }
+
+    return
+      self.start_time +
+      std::chrono::duration_cast<Duration>(step.time/self.options.speed);
+  }
+
+  static bool hasUnsentBytes(const Connection &connection)
+  {
+    return connection.n_unsent_bytes_sent != connection.unsent_bytes.size();
+  }
+
+  static void closeConnection(SessionReplayer &self,Connection &connection)
+  {
+    assert(connection.maybe_socket_id);
+    self.sockets.close(*connection.maybe_socket_id);
+    connection.maybe_socket_id.reset();
+    connection.is_connecting = false;
+    connection.unsent_bytes.clear();
+    connection.n_unsent_bytes_sent = 0;
+  }
+
+  static void closeIfDone(SessionReplayer &self,Connection &connection)
+  {
+    bool is_done =
+      connection.maybe_socket_id &&
+      connection.is_closing &&
+      !connection.is_connecting &&
+      !hasUnsentBytes(connection);
+
+    if (is_done) {
+      closeConnection(self,connection);
+    }
+  }
+
+  static void openConnection(SessionReplayer &self,Connection &connection)
+  {
+    assert(self.maybe_server_address);
+    const InternetAddress &address = *self.maybe_server_address;
+    SocketId socket_id = self.sockets.create(address.family());
+    self.sockets.setNonBlocking(socket_id,true);
+    self.sockets.connect(socket_id,address);
+    connection.maybe_socket_id = socket_id;
+    connection.is_connecting = true;
+    ++self.replay_stats.n_connections;
+  }
+
+  static void doStep(SessionReplayer &self,const Step &step,TimePoint now)
+  {
+    Connection &connection = self.connections[step.connection_index];
+
+    switch (step.type) {
+      case Step::Type::open:
+        openConnection(self,connection);
+        break;
+      case Step::Type::send:
+        if (connection.maybe_socket_id) {
+          connection.unsent_bytes.insert(
+            connection.unsent_bytes.end(),step.data.begin(),step.data.end()
+          );
+        }
+
+        self.replay_stats.max_lateness =
+          std::max(self.replay_stats.max_lateness,now - dueTime(self,step));
+        break;
+      case Step::Type::close:
+        connection.is_closing = true;
+        closeIfDone(self,connection);
+        break;
+    }
+  }
+
+  static void doDueSteps(SessionReplayer &self)
+  {
+    TimePoint now = self.clock.now();
+
+    while (self.n_steps_done != self.steps.size()) {
+      const Step &step = self.steps[self.n_steps_done];
+
+      if (dueTime(self,step) > now) {
+        break;
+      }
+
+      doStep(self,step,now);
+      ++self.n_steps_done;
+    }
+  }
+
+  static void
+    handleConnecting(
+      SessionReplayer &self,
+      Connection &connection,
+      const PostSelectParamsInterface &post_select_params
+    )
+  {
+    SocketId socket_id = *connection.maybe_socket_id;
+
+    if (!post_select_params.writeIsSet(socket_id)) {
+      return;
+    }
+
+    if (self.sockets.connectionWasRefused(socket_id)) {
+      ++self.replay_stats.n_refused_connections;
+      closeConnection(self,connection);
+      return;
+    }
+
+    connection.is_connecting = false;
+  }
+
+  // Returns false if the connection was lost.
+  static bool receive(SessionReplayer &self,Connection &connection)
+  {
+    char buffer[64*1024];
+    int result =
+      self.sockets.recv(*connection.maybe_socket_id,buffer,sizeof buffer);
+
+    IoStatus status = ioStatus(result);
+
+    if (status == IoStatus::transferred) {
+      self.replay_stats.n_bytes_received += result;
+      return true;
+    }
+
+    return status == IoStatus::would_block || status == IoStatus::interrupted;
+  }
+
+  // Returns false if the connection was lost.
+  static bool send(SessionReplayer &self,Connection &connection)
+  {
+    int result =
+      self.sockets.send(
+        *connection.maybe_socket_id,
+        connection.unsent_bytes.data() + connection.n_unsent_bytes_sent,
+        connection.unsent_bytes.size() - connection.n_unsent_bytes_sent
+      );
+
+    IoStatus status = ioStatus(result);
+
+    if (status == IoStatus::transferred) {
+      self.replay_stats.n_bytes_sent += result;
+      connection.n_unsent_bytes_sent += result;
+
+      if (!hasUnsentBytes(connection)) {
+        connection.unsent_bytes.clear();
+        connection.n_unsent_bytes_sent = 0;
+      }
+
+      return true;
+    }
+
+    return status == IoStatus::would_block || status == IoStatus::interrupted;
+  }
+
+  static void
+    handleConnection(
+      SessionReplayer &self,
+      Connection &connection,
+      const PostSelectParamsInterface &post_select_params
+    )
+  {
+    if (!connection.maybe_socket_id) {
+      return;
+    }
+
+    if (connection.is_connecting) {
+      handleConnecting(self,connection,post_select_params);
+      return;
+    }
+
+    SocketId socket_id = *connection.maybe_socket_id;
+    bool is_lost = false;
+
+    if (post_select_params.readIsSet(socket_id)) {
+      is_lost = !receive(self,connection);
+    }
+
+    bool can_send =
+      !is_lost &&
+      hasUnsentBytes(connection) &&
+      post_select_params.writeIsSet(socket_id);
+
+    if (can_send) {
+      is_lost = !send(self,connection);
+    }
+
+    if (is_lost) {
+      if (!connection.is_closing) {
+        ++self.replay_stats.n_lost_connections;
+      }
+
+      closeConnection(self,connection);
+      return;
+    }
+
+    closeIfDone(self,connection);
+  }
+};
+
+
+SessionReplayer::SessionReplayer(
+  SocketsInterface &sockets_arg,
+  const ClockInterface &clock_arg,
+  const vector<SocketEvent> &events
+)
+: SessionReplayer(sockets_arg,clock_arg,events,Options())
+{
+}
+
+
+SessionReplayer::SessionReplayer(
+  SocketsInterface &sockets_arg,
+  const ClockInterface &clock_arg,
+  const vector<SocketEvent> &events,
+  const Options &options_arg
+)
+: sockets(sockets_arg),
+  clock(clock_arg),
+  options(options_arg)
+{
+  assert(options.speed >= 0);
+  Impl::makeSteps(*this,events);
+}
+
+
+SessionReplayer::~SessionReplayer()
+{
+  for (Connection &connection : connections) {
+    if (connection.maybe_socket_id) {
+      Impl::closeConnection(*this,connection);
+    }
+  }
+}
+
+
+void SessionReplayer::startReplaying(int port)
+{
+  InternetAddress server_address;
+  server_address.setLoopback();
+  server_address.setPort(port);
+  startReplaying(server_address);
+}
+
+
+void SessionReplayer::startReplaying(const InternetAddress &server_address)
+{
+  assert(!maybe_server_address);
+  maybe_server_address = server_address;
+  start_time = clock.now();
+  Impl::doDueSteps(*this);
+}
+
+
+bool SessionReplayer::isFinished() const
+{
+  if (n_steps_done != steps.size()) {
+    return false;
+  }
+
+  for (const Connection &connection : connections) {
+    if (!connection.maybe_socket_id) {
+      continue;
+    }
+
+    bool is_busy =
+      connection.is_connecting ||
+      connection.is_closing ||
+      Impl::hasUnsentBytes(connection);
+
+    if (is_busy) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+
+void SessionReplayer::setupSelect(PreSelectParamsInterface &pre_select_params)
+{
+  for (const Connection &connection : connections) {
+    if (!connection.maybe_socket_id) {
+      continue;
+    }
+
+    SocketId socket_id = *connection.maybe_socket_id;
+
+    if (connection.is_connecting) {
+      pre_select_params.setWrite(socket_id);
+      continue;
+    }
+
+    pre_select_params.setRead(socket_id);
+
+    if (Impl::hasUnsentBytes(connection)) {
+      pre_select_params.setWrite(socket_id);
+    }
+  }
+
+  if (maybe_server_address && n_steps_done != steps.size()) {
+    Duration time_left =
+      Impl::dueTime(*this,steps[n_steps_done]) - clock.now();
+
+    pre_select_params.setTimeout(
+      std::chrono::ceil<std::chrono::microseconds>(
+        std::max(time_left,Duration(0))
+      )
+    );
+  }
+}
+
+
+void
+  SessionReplayer::handleSelect(
+    const PostSelectParamsInterface &post_select_params
+  )
+{
+  for (Connection &connection : connections) {
+    Impl::handleConnection(*this,connection,post_select_params);
+  }
+
+  // Sockets are only created here, so that they aren't missing from the
+  // select which is being set up.
+  if (maybe_server_address) {
+    Impl::doDueSteps(*this);
+  }
+}
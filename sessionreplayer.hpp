@@ -0,0 +1,107 @@
+#ifndef SESSIONREPLAYER_HPP_
+#define SESSIONREPLAYER_HPP_
+
+#include <optional>
+#include <string>
+#include <vector>
+#include "recordingsockets.hpp"
+#include "selectparams.hpp"
+
+
+// Plays a recorded session against a server, such as a MessageServer
+// built from newer code, by acting as its clients.  Each connection in
+// the recording becomes a new connection to the server, and the bytes
+// which were sent over it toward the recorded server are sent again at
+// the same times, scaled by the speed.
+//
+// The recording can be made on either side.  For a connection which the
+// recorded process accepted, the bytes it received are replayed, and for
+// one it connected, the bytes it sent are.  What the server sends back is
+// read and counted, but not checked.
+class SessionReplayer {
+  public:
+    using Duration = ClockInterface::Duration;
+    using SocketId = SocketsInterface::SocketId;
+
+    struct Options {
+      // Twice as fast with 2.  With 0, nothing waits for its time.
+      double speed = 1;
+    };
+
+    struct Stats {
+      int n_connections = 0;
+      int n_refused_connections = 0;
+
+      // Connections which the server closed before the recording did.
+      int n_lost_connections = 0;
+
+      size_t n_bytes_sent = 0;
+      size_t n_bytes_received = 0;
+
+      // How far sending fell behind the recorded times.
+      Duration max_lateness{0};
+    };
+
+    SessionReplayer(
+      SocketsInterface &sockets_arg,
+      const ClockInterface &clock_arg,
+      const std::vector<SocketEvent> &events
+    );
+
+    SessionReplayer(
+      SocketsInterface &sockets_arg,
+      const ClockInterface &clock_arg,
+      const std::vector<SocketEvent> &events,
+      const Options &options_arg
+    );
+
+    SessionReplayer(const SessionReplayer &) = delete;
+
+    // Connections which are still open are closed.
+    ~SessionReplayer();
+
+    void startReplaying(int port);
+    void startReplaying(const InternetAddress &);
+
+    // Everything has been sent, and the connections which the recording
+    // closed have been closed.
+    bool isFinished() const;
+
+    void setupSelect(PreSelectParamsInterface &);
+    void handleSelect(const PostSelectParamsInterface &);
+    const Stats &stats() const { return replay_stats; }
+
+  private:
+    struct Impl;
+    using TimePoint = ClockInterface::TimePoint;
+
+    struct Step {
+      enum class Type { open, send, close };
+
+      Type type;
+      std::chrono::microseconds time;
+      int connection_index;
+      std::string data;
+    };
+
+    struct Connection {
+      std::optional<SocketId> maybe_socket_id;
+      bool is_connecting = false;
+      bool is_closing = false;
+      std::vector<char> unsent_bytes;
+      size_t n_unsent_bytes_sent = 0;
+    };
+
+    SocketsInterface &sockets;
+    const ClockInterface &clock;
+    const Options options;
+    std::vector<Step> steps;
+    std::vector<Connection> connections;
+    std::optional<InternetAddress> maybe_server_address;
+    TimePoint start_time;
+    size_t n_steps_done = 0;
+    Stats replay_stats;
+};
+
+
+#endif /* SESSIONREPLAYER_HPP_ */
@@ -0,0 +1,230 @@
+#ifndef SHAREDMEMORYSELECTOR_HPP_
+#define SHAREDMEMORYSELECTOR_HPP_
+
+
+#include <vector>
+#include "systemselector.hpp"
+#include "sharedmemorysockets.hpp"
+
+
+// A selector which can wait on SharedMemorySockets connections as well as
+// ordinary file descriptors.  Readiness of shared memory connections is
+// determined by looking at the rings directly, and select() is only used
+// to sleep when none of them are ready.
+class SharedMemorySelector : public AbstractSelector {
+  public:
+    SharedMemorySelector(SharedMemorySockets &sockets_arg)
+    : sockets(sockets_arg)
+    {
+    }
+
+  private:
+    struct Params : SelectParamsInterface {
+      SharedMemorySelector &selector;
+
+      Params(SharedMemorySelector &selector_arg)
+      : selector(selector_arg)
+      {
+      }
+
+      void setRead(int fd) override
+      {
+        if (selector.sockets.hasOwnReadiness(fd)) {
+          selector.shared_read_fds.push_back(fd);
+        }
+        else {
+          selector.system_params.setRead(fd);
+        }
+      }
+
+      void setWrite(int fd) override
+      {
+        if (selector.sockets.hasOwnReadiness(fd)) {
+          selector.shared_write_fds.push_back(fd);
+        }
+        else {
+          selector.system_params.setWrite(fd);
+        }
+      }
+
+      void setTimeout(std::chrono::microseconds duration) override
+      {
+        selector.system_params.setTimeout(duration);
+      }
+
+      bool readIsSet(int fd) const override
+      {
+        if (selector.sockets.hasOwnReadiness(fd)) {
+          return isSet(selector.ready_read_set,fd);
+        }
+
+        return selector.system_params.readIsSet(fd);
+      }
+
+      bool writeIsSet(int fd) const override
+      {
+        if (selector.sockets.hasOwnReadiness(fd)) {
+          return isSet(selector.ready_write_set,fd);
+        }
+
+        return selector.system_params.writeIsSet(fd);
+      }
+
+      const std::vector<int> &readyFds() const override
+      {
+        return selector.ready_fds;
+      }
+
+      static bool isSet(const std::vector<bool> &set,int fd)
+      {
+        return size_t(fd) < set.size() && set[fd];
+      }
+    };
+
+    SharedMemorySockets &sockets;
+    SystemSelectParams system_params;
+    std::vector<int> shared_read_fds;
+    std::vector<int> shared_write_fds;
+    std::vector<bool> ready_read_set;
+    std::vector<bool> ready_write_set;
+    std::vector<int> ready_fds;
+    Params params{*this};
+
+    SelectParamsInterface &_selectParams() override
+    {
+      return params;
+    }
+
+    void _setupSelect() override
+    {
+      system_params.setupSelect();
+      shared_read_fds.clear();
+      shared_write_fds.clear();
+      ready_fds.clear();
+    }
+
+    static void markReady(std::vector<bool> &set,int fd)
+    {
+      if (size_t(fd) >= set.size()) {
+        set.resize(fd + 1);
+      }
+
+      set[fd] = true;
+    }
+
+    bool updateReadySets()
+    {
+      ready_read_set.assign(ready_read_set.size(),false);
+      ready_write_set.assign(ready_write_set.size(),false);
+      bool any_are_ready = false;
+
+      for (int fd : shared_read_fds) {
+        if (sockets.canRead(fd)) {
+          markReady(ready_read_set,fd);
+          any_are_ready = true;
+        }
+      }
+
+      for (int fd : shared_write_fds) {
+        if (sockets.canWrite(fd)) {
+          markReady(ready_write_set,fd);
+          any_are_ready = true;
+        }
+      }
+
+      return any_are_ready;
+    }
+
+    bool beginWaiting()
+    {
+      bool any_are_ready = false;
+
+      for (int fd : shared_read_fds) {
+        if (sockets.beginWaitingToRead(fd)) {
+          any_are_ready = true;
+        }
+
+        system_params.setRead(fd);
+      }
+
+      for (int fd : shared_write_fds) {
+        if (sockets.beginWaitingToWrite(fd)) {
+          any_are_ready = true;
+        }
+
+        // The peer writes to our socket when space becomes available, so
+        // we wait for it to become readable.
+        system_params.setRead(fd);
+      }
+
+      return any_are_ready;
+    }
+
+    void endWaiting()
+    {
+      for (int fd : shared_read_fds) {
+        sockets.endWaiting(fd);
+      }
+
+      for (int fd : shared_write_fds) {
+        sockets.endWaiting(fd);
+      }
+    }
+
+    void updateReadyFds()
+    {
+      ready_fds.clear();
+
+      // The sockets of shared memory connections may have been selected
+      // for waiting, but their readiness comes from the rings.
+      for (int fd : system_params.ready_fds) {
+        if (!sockets.hasOwnReadiness(fd)) {
+          ready_fds.push_back(fd);
+        }
+      }
+
+      for (int fd : shared_read_fds) {
+        if (Params::isSet(ready_read_set,fd)) {
+          ready_fds.push_back(fd);
+        }
+      }
+
+      for (int fd : shared_write_fds) {
+        bool is_listed = Params::isSet(ready_read_set,fd);
+
+        if (Params::isSet(ready_write_set,fd) && !is_listed) {
+          ready_fds.push_back(fd);
+        }
+      }
+    }
+
+    void selectSystemDescriptors()
+    {
+      if (updateReadySets()) {
+        // Something is already ready, so only poll the other descriptors.
+        if (system_params.n_fds != 0) {
+          system_params.timeout = timeval{0,0};
+          system_params.doSelect();
+        }
+
+        return;
+      }
+
+      if (beginWaiting()) {
+        system_params.timeout = timeval{0,0};
+      }
+
+      system_params.doSelect();
+      endWaiting();
+      updateReadySets();
+    }
+
+    void _doSelect() override
+    {
+      selectSystemDescriptors();
+      updateReadyFds();
+    }
+};
+
+
+#endif /* SHAREDMEMORYSELECTOR_HPP_ */
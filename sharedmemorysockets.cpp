@@ -0,0 +1,918 @@
+#include "sharedmemorysockets.hpp"
+
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <algorithm>
+#include <atomic>
+#include <new>
+#include <stdexcept>
+#include <cassert>
+
+using SocketId = SharedMemorySockets::SocketId;
+using std::string;
+
+
+// The producer and consumer halves are kept on separate cache lines so
+// that each side only writes to lines that it owns.
+struct SharedMemorySockets::Ring {
+  alignas(64) std::atomic<uint64_t> write_count{0};
+  std::atomic<uint32_t> writer_is_waiting{0};
+  std::atomic<uint32_t> writer_closed{0};
+
+  alignas(64) std::atomic<uint64_t> read_count{0};
+  std::atomic<uint32_t> reader_is_waiting{0};
+  std::atomic<uint32_t> reader_closed{0};
+
+  alignas(64) char data[ring_capacity];
+
+  // The counts are in memory which the peer can write, so a ring which
+  // claims to hold more than its capacity is a protocol error.
+  std::optional<size_t> maybeNBytesAvailable() const
+  {
+    uint64_t n_bytes = write_count.load() - read_count.load();
+
+    if (n_bytes > ring_capacity) {
+      return std::nullopt;
+    }
+
+    return n_bytes;
+  }
+};
+
+
+namespace {
+struct Region {
+  SharedMemorySockets::Ring client_to_server;
+  SharedMemorySockets::Ring server_to_client;
+};
+}
+
+
+// Wake the peer by writing a byte to the unix socket.  Returns false if
+// the peer has gone.  If the socket buffer is full, the peer already has
+// bytes waiting, so it is going to wake up anyway.
+static bool ringDoorbell(int unix_socket_fd)
+{
+  char byte = 0;
+
+  ssize_t send_result =
+    ::send(unix_socket_fd, &byte, 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+
+  return send_result == 1 || errno == EAGAIN;
+}
+
+
+// Returns false if the peer has gone.
+static bool drainDoorbell(int unix_socket_fd)
+{
+  for (;;) {
+    char buffer[64];
+
+    ssize_t recv_result =
+      ::recv(unix_socket_fd, buffer, sizeof buffer, MSG_DONTWAIT);
+
+    if (recv_result > 0) {
+      continue;
+    }
+
+    return recv_result == -1 && errno == EAGAIN;
+  }
+}
+
+
+static void copyIntoRing(SharedMemorySockets::Ring &ring,const char *p,size_t n)
+{
+  const size_t capacity = SharedMemorySockets::ring_capacity;
+  uint64_t write_count = ring.write_count.load(std::memory_order_relaxed);
+  size_t position = write_count % capacity;
+  size_t first_part = std::min(n, capacity - position);
+  memcpy(ring.data + position, p, first_part);
+  memcpy(ring.data, p + first_part, n - first_part);
+  ring.write_count.store(write_count + n, std::memory_order_release);
+}
+
+
+static void copyFromRing(SharedMemorySockets::Ring &ring,char *p,size_t n)
+{
+  const size_t capacity = SharedMemorySockets::ring_capacity;
+  uint64_t read_count = ring.read_count.load(std::memory_order_relaxed);
+  size_t position = read_count % capacity;
+  size_t first_part = std::min(n, capacity - position);
+  memcpy(p, ring.data + position, first_part);
+  memcpy(p + first_part, ring.data, n - first_part);
+  ring.read_count.store(read_count + n, std::memory_order_release);
+}
+
+
+static void *maybeMapRegion(int memory_fd,size_t size)
+{
+  void *region =
+    mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, memory_fd, 0);
+
+  if (region == MAP_FAILED) {
+    return nullptr;
+  }
+
+  return region;
+}
+
+
+static void *mapRegion(int memory_fd,size_t size)
+{
+  void *region = maybeMapRegion(memory_fd,size);
+
+  if (!region) {
+    throw std::runtime_error("Unable to map shared memory.");
+  }
+
+  return region;
+}
+
+
+// Make socket_id refer to the same file as fd and release fd.  This keeps
+// socket ids stable across the change from a unix socket to an epoll
+// instance.
+static void replaceWithFd(SocketId socket_id,int fd)
+{
+  if (dup2(fd,socket_id) == -1) {
+    throw std::runtime_error("Unable to replace socket.");
+  }
+
+  ::close(fd);
+}
+
+
+namespace {
+struct AbstractUnixAddress {
+  sockaddr_un address;
+  socklen_t size;
+
+  AbstractUnixAddress(const string &name)
+  {
+    memset(&address,0,sizeof address);
+    address.sun_family = AF_UNIX;
+    assert(name.size() + 1 < sizeof address.sun_path);
+    // A leading null character puts the name in the abstract namespace,
+    // so nothing is left behind in the filesystem.
+    memcpy(address.sun_path + 1, name.data(), name.size());
+    size = offsetof(sockaddr_un,sun_path) + 1 + name.size();
+  }
+
+  const sockaddr *sockaddrPtr() const
+  {
+    return reinterpret_cast<const sockaddr *>(&address);
+  }
+};
+}
+
+
+// The handshake is a single byte carrying the shared memory region.
+static void sendHandshake(int unix_socket_fd,int memory_fd)
+{
+  char byte = 0;
+  iovec iov{&byte,1};
+  char control[CMSG_SPACE(sizeof(int))] = {};
+  msghdr message = {};
+  message.msg_iov = &iov;
+  message.msg_iovlen = 1;
+  message.msg_control = control;
+  message.msg_controllen = sizeof control;
+  cmsghdr *cmsg = CMSG_FIRSTHDR(&message);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &memory_fd, sizeof memory_fd);
+
+  if (sendmsg(unix_socket_fd, &message, MSG_NOSIGNAL) != 1) {
+    throw std::runtime_error("Unable to send shared memory handshake.");
+  }
+}
+
+
+static std::vector<int> receivedFds(msghdr &message)
+{
+  std::vector<int> fds;
+  cmsghdr *cmsg = CMSG_FIRSTHDR(&message);
+
+  for (; cmsg; cmsg = CMSG_NXTHDR(&message,cmsg)) {
+    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+      continue;
+    }
+
+    size_t n_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+
+    for (size_t i=0; i!=n_fds; ++i) {
+      int fd = -1;
+      memcpy(&fd, CMSG_DATA(cmsg) + i*sizeof fd, sizeof fd);
+      fds.push_back(fd);
+    }
+  }
+
+  return fds;
+}
+
+
+// Returns false with errno set if the handshake couldn't be received,
+// which is EAGAIN if it hasn't arrived yet and EPROTO if the peer sent
+// something else.  Any descriptors from a bad handshake are closed.
+static bool receiveHandshake(int unix_socket_fd,int &memory_fd)
+{
+  char byte = 0;
+  iovec iov{&byte,1};
+
+  // Room for a few more descriptors than we expect, so that they are
+  // received and closed here.
+  char control[CMSG_SPACE(sizeof(int) * 4)] = {};
+  msghdr message = {};
+  message.msg_iov = &iov;
+  message.msg_iovlen = 1;
+  message.msg_control = control;
+  message.msg_controllen = sizeof control;
+
+  ssize_t recvmsg_result =
+    recvmsg(unix_socket_fd, &message, MSG_CMSG_CLOEXEC | MSG_DONTWAIT);
+
+  if (recvmsg_result == -1) {
+    return false;
+  }
+
+  std::vector<int> fd_vector = receivedFds(message);
+
+  bool is_valid =
+    recvmsg_result == 1 &&
+    !(message.msg_flags & MSG_CTRUNC) &&
+    fd_vector.size() == 1;
+
+  if (!is_valid) {
+    for (int fd : fd_vector) {
+      ::close(fd);
+    }
+
+    errno = EPROTO;
+    return false;
+  }
+
+  memory_fd = fd_vector[0];
+  return true;
+}
+
+
+// The region has to be exactly the size we expect, and sealed so that the
+// peer can't shrink it out from under us later.
+static bool isValidRegion(int memory_fd)
+{
+  struct stat memory_stat;
+
+  if (fstat(memory_fd,&memory_stat) == -1) {
+    return false;
+  }
+
+  if (!S_ISREG(memory_stat.st_mode)) {
+    return false;
+  }
+
+  if (size_t(memory_stat.st_size) != sizeof(Region)) {
+    return false;
+  }
+
+  int seals = fcntl(memory_fd, F_GET_SEALS);
+  return seals != -1 && (seals & F_SEAL_SHRINK);
+}
+
+
+SharedMemorySockets::SharedMemorySockets(const string &name_prefix_arg)
+: name_prefix(name_prefix_arg)
+{
+}
+
+
+auto SharedMemorySockets::socket(SocketId socket_id) -> Socket &
+{
+  assert(socket_id >= 0 && size_t(socket_id) < sockets.size());
+  assert(sockets[socket_id]);
+  return *sockets[socket_id];
+}
+
+
+auto SharedMemorySockets::socket(SocketId socket_id) const -> const Socket &
+{
+  assert(socket_id >= 0 && size_t(socket_id) < sockets.size());
+  assert(sockets[socket_id]);
+  return *sockets[socket_id];
+}
+
+
+auto SharedMemorySockets::maybeConnection(SocketId socket_id) const
+  -> const Connection *
+{
+  const Socket &socket = this->socket(socket_id);
+
+  if (!socket.maybe_connection) {
+    return nullptr;
+  }
+
+  return &*socket.maybe_connection;
+}
+
+
+auto SharedMemorySockets::connection(SocketId socket_id) -> Connection &
+{
+  Socket &socket = this->socket(socket_id);
+  assert(socket.maybe_connection);
+  return *socket.maybe_connection;
+}
+
+
+string SharedMemorySockets::addressName(const InternetAddress &address) const
+{
+  return name_prefix + "." + std::to_string(address.port());
+}
+
+
+void SharedMemorySockets::addSocket(SocketId socket_id)
+{
+  assert(socket_id >= 0);
+
+  if (size_t(socket_id) >= sockets.size()) {
+    sockets.resize(socket_id + 1);
+  }
+
+  assert(!sockets[socket_id]);
+  sockets[socket_id].emplace();
+}
+
+
+void SharedMemorySockets::removeSocket(SocketId socket_id)
+{
+  assert(sockets[socket_id]);
+  sockets[socket_id].reset();
+}
+
+
+SocketId SharedMemorySockets::create(int /*address_family*/)
+{
+  int socket_result = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+  if (socket_result == -1) {
+    throw std::runtime_error("Failed to create socket.");
+  }
+
+  addSocket(socket_result);
+  return socket_result;
+}
+
+
+void SharedMemorySockets::setNonBlocking(SocketId socket_id,bool non_blocking)
+{
+  int flags = fcntl(socket_id, F_GETFL, 0);
+
+  if (flags == -1) {
+    throw std::runtime_error("Unable to set non-blocking");
+  }
+
+  if (non_blocking) {
+    flags |= O_NONBLOCK;
+  }
+  else {
+    flags &= ~O_NONBLOCK;
+  }
+
+  if (fcntl(socket_id, F_SETFL, flags) != 0) {
+    throw std::runtime_error("Unable to set non-blocking");
+  }
+}
+
+
+void
+  SharedMemorySockets::bind(
+    SocketId socket_id,
+    const InternetAddress &address
+  )
+{
+  AbstractUnixAddress unix_address(addressName(address));
+
+  int bind_result =
+    ::bind(socket_id, unix_address.sockaddrPtr(), unix_address.size);
+
+  if (bind_result == -1) {
+    throw std::runtime_error("Unable to bind socket.");
+  }
+}
+
+
+void SharedMemorySockets::listen(SocketId socket_id, int backlog)
+{
+  if (::listen(socket_id,backlog) == -1) {
+    throw std::runtime_error("Unable to listen.");
+  }
+
+  int unix_socket_fd = fcntl(socket_id, F_DUPFD_CLOEXEC, 0);
+
+  if (unix_socket_fd == -1) {
+    throw std::runtime_error("Unable to listen.");
+  }
+
+  socket(socket_id).maybe_listener.emplace().unix_socket_fd = unix_socket_fd;
+
+  if (fcntl(unix_socket_fd, F_SETFL, O_NONBLOCK) == -1) {
+    throw std::runtime_error("Unable to listen.");
+  }
+
+  int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+
+  if (epoll_fd == -1) {
+    throw std::runtime_error("Unable to create epoll instance.");
+  }
+
+  replaceWithFd(socket_id,epoll_fd);
+  epoll_event event = {};
+  event.events = EPOLLIN;
+  event.data.fd = unix_socket_fd;
+
+  if (epoll_ctl(socket_id, EPOLL_CTL_ADD, unix_socket_fd, &event) == -1) {
+    throw std::runtime_error("Unable to listen.");
+  }
+}
+
+
+void
+  SharedMemorySockets::connect(
+    SocketId socket_id,
+    const InternetAddress &address
+  )
+{
+  Socket &socket = this->socket(socket_id);
+  assert(!socket.maybe_connection);
+  AbstractUnixAddress unix_address(addressName(address));
+
+  int connect_result =
+    ::connect(socket_id, unix_address.sockaddrPtr(), unix_address.size);
+
+  if (connect_result == -1) {
+    if (errno == ECONNREFUSED || errno == EAGAIN) {
+      // Nobody is listening, or the backlog is full.
+      socket.connection_was_refused = true;
+      return;
+    }
+
+    throw std::runtime_error("Unable to connect to server.");
+  }
+
+  int memory_fd =
+    memfd_create("protocol_testing", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+
+  if (memory_fd == -1) {
+    throw std::runtime_error("Unable to create shared memory.");
+  }
+
+  size_t region_size = sizeof(Region);
+
+  if (ftruncate(memory_fd, region_size) == -1) {
+    ::close(memory_fd);
+    throw std::runtime_error("Unable to size shared memory.");
+  }
+
+  if (fcntl(memory_fd, F_ADD_SEALS, F_SEAL_SHRINK) == -1) {
+    ::close(memory_fd);
+    throw std::runtime_error("Unable to seal shared memory.");
+  }
+
+  void *region_ptr = mapRegion(memory_fd,region_size);
+  Region *region = new (region_ptr) Region;
+  sendHandshake(socket_id,memory_fd);
+  ::close(memory_fd);
+
+  Connection &connection = socket.maybe_connection.emplace();
+  connection.region = region_ptr;
+  connection.region_size = region_size;
+  connection.input_ring = &region->server_to_client;
+  connection.output_ring = &region->client_to_server;
+}
+
+
+bool SharedMemorySockets::connectionWasRefused(SocketId socket_id)
+{
+  return socket(socket_id).connection_was_refused;
+}
+
+
+void SharedMemorySockets::removeHandshakingFd(SocketId listen_socket_id,int fd)
+{
+  Listener &listener = *socket(listen_socket_id).maybe_listener;
+  std::vector<int> &fds = listener.handshaking_fds;
+  fds.erase(std::find(fds.begin(),fds.end(),fd));
+  epoll_ctl(listen_socket_id, EPOLL_CTL_DEL, fd, nullptr);
+}
+
+
+// Returns the new connection if its handshake has already arrived, which
+// it usually has, since the client sends it as soon as it connects.
+SocketId
+  SharedMemorySockets::acceptPendingConnection(SocketId listen_socket_id)
+{
+  Listener &listener = *socket(listen_socket_id).maybe_listener;
+
+  int fd =
+    ::accept4(
+      listener.unix_socket_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC
+    );
+
+  if (fd == -1) {
+    return -1;
+  }
+
+  epoll_event event = {};
+  event.events = EPOLLIN;
+  event.data.fd = fd;
+
+  if (epoll_ctl(listen_socket_id, EPOLL_CTL_ADD, fd, &event) == -1) {
+    int error_number = errno;
+    ::close(fd);
+    errno = error_number;
+    return -1;
+  }
+
+  listener.handshaking_fds.push_back(fd);
+
+  if (listener.handshaking_fds.size() > max_pending_handshakes) {
+    int oldest_fd = listener.handshaking_fds.front();
+    removeHandshakingFd(listen_socket_id,oldest_fd);
+    ::close(oldest_fd);
+  }
+
+  return finishHandshake(listen_socket_id,fd);
+}
+
+
+SocketId SharedMemorySockets::finishHandshake(SocketId listen_socket_id,int fd)
+{
+  const std::vector<int> &handshaking_fds =
+    socket(listen_socket_id).maybe_listener->handshaking_fds;
+
+  auto end = handshaking_fds.end();
+
+  if (std::find(handshaking_fds.begin(),end,fd) == end) {
+    // It was closed earlier in the same accept().
+    errno = EAGAIN;
+    return -1;
+  }
+
+  int memory_fd = -1;
+
+  if (!receiveHandshake(fd,memory_fd)) {
+    if (errno != EAGAIN) {
+      int error_number = errno;
+      removeHandshakingFd(listen_socket_id,fd);
+      ::close(fd);
+      errno = error_number;
+    }
+
+    return -1;
+  }
+
+  removeHandshakingFd(listen_socket_id,fd);
+  size_t region_size = sizeof(Region);
+  void *region_ptr = nullptr;
+
+  if (isValidRegion(memory_fd)) {
+    region_ptr = maybeMapRegion(memory_fd,region_size);
+  }
+
+  ::close(memory_fd);
+
+  if (!region_ptr) {
+    ::close(fd);
+    errno = EPROTO;
+    return -1;
+  }
+
+  Region *region = static_cast<Region *>(region_ptr);
+
+  SocketId socket_id = fd;
+  addSocket(socket_id);
+  Connection &connection = socket(socket_id).maybe_connection.emplace();
+  connection.region = region_ptr;
+  connection.region_size = region_size;
+  connection.input_ring = &region->client_to_server;
+  connection.output_ring = &region->server_to_client;
+  return socket_id;
+}
+
+
+SocketId SharedMemorySockets::accept(SocketId listen_socket_id)
+{
+  assert(socket(listen_socket_id).maybe_listener);
+  const Listener &listener = *socket(listen_socket_id).maybe_listener;
+  const int unix_socket_fd = listener.unix_socket_fd;
+  const int max_events = 16;
+  epoll_event events[max_events];
+
+  int n_events =
+    epoll_wait(listen_socket_id, events, max_events, /*timeout*/0);
+
+  if (n_events == -1) {
+    return -1;
+  }
+
+  // Only one connection is returned at a time.  Any other descriptors
+  // which are ready keep the listening socket readable.
+  int error_number = EAGAIN;
+
+  for (int i=0; i!=n_events; ++i) {
+    int fd = events[i].data.fd;
+    SocketId socket_id = -1;
+
+    if (fd == unix_socket_fd) {
+      socket_id = acceptPendingConnection(listen_socket_id);
+    }
+    else {
+      socket_id = finishHandshake(listen_socket_id,fd);
+    }
+
+    if (socket_id != -1) {
+      return socket_id;
+    }
+
+    if (errno != EAGAIN) {
+      error_number = errno;
+    }
+  }
+
+  errno = error_number;
+  return -1;
+}
+
+
+int SharedMemorySockets::send(SocketId socket_id, const void *buf, size_t len)
+{
+  Connection &connection = this->connection(socket_id);
+  Ring &ring = *connection.output_ring;
+
+  if (ring.reader_closed.load() || connection.peer_has_gone) {
+    errno = EPIPE;
+    return -1;
+  }
+
+  std::optional<size_t> maybe_n_bytes_available = ring.maybeNBytesAvailable();
+
+  if (!maybe_n_bytes_available) {
+    errno = EPROTO;
+    return -1;
+  }
+
+  size_t n_bytes_free = ring_capacity - *maybe_n_bytes_available;
+
+  if (n_bytes_free == 0) {
+    errno = EAGAIN;
+    return -1;
+  }
+
+  size_t n_bytes_to_send = std::min(len, n_bytes_free);
+  copyIntoRing(ring, static_cast<const char *>(buf), n_bytes_to_send);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+
+  if (ring.reader_is_waiting.load() && ring.reader_is_waiting.exchange(0)) {
+    wakePeer(socket_id);
+  }
+
+  return n_bytes_to_send;
+}
+
+
+int SharedMemorySockets::recv(SocketId socket_id, void *buf, size_t len)
+{
+  Connection &connection = this->connection(socket_id);
+  Ring &ring = *connection.input_ring;
+  std::optional<size_t> maybe_n_bytes_available = ring.maybeNBytesAvailable();
+
+  if (!maybe_n_bytes_available) {
+    errno = EPROTO;
+    return -1;
+  }
+
+  size_t n_bytes_available = *maybe_n_bytes_available;
+
+  if (n_bytes_available == 0) {
+    if (ring.writer_closed.load() || connection.peer_has_gone) {
+      return 0;
+    }
+
+    errno = EAGAIN;
+    return -1;
+  }
+
+  size_t n_bytes_to_receive = std::min(len, n_bytes_available);
+  copyFromRing(ring, static_cast<char *>(buf), n_bytes_to_receive);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+
+  if (ring.writer_is_waiting.load() && ring.writer_is_waiting.exchange(0)) {
+    wakePeer(socket_id);
+  }
+
+  return n_bytes_to_receive;
+}
+
+
+void SharedMemorySockets::close(SocketId socket_id)
+{
+  Socket &socket = this->socket(socket_id);
+
+  if (socket.maybe_connection) {
+    Connection &connection = *socket.maybe_connection;
+    connection.output_ring->writer_closed.store(1);
+    connection.input_ring->reader_closed.store(1);
+    munmap(connection.region, connection.region_size);
+  }
+
+  if (socket.maybe_listener) {
+    Listener &listener = *socket.maybe_listener;
+
+    for (int fd : listener.handshaking_fds) {
+      ::close(fd);
+    }
+
+    ::close(listener.unix_socket_fd);
+  }
+
+  removeSocket(socket_id);
+
+  if (::close(socket_id) == -1) {
+    throw std::runtime_error("Error closing socket.");
+  }
+}
+
+
+SocketId SharedMemorySockets::createDatagram()
+{
+  throw std::runtime_error("Datagrams aren't supported over shared memory.");
+}
+
+
+int SharedMemorySockets::recvDatagrams(SocketId,ReceivedDatagram *,int)
+{
+  assert(false);
+  return 0;
+}
+
+
+int SharedMemorySockets::sendDatagrams(SocketId,const DatagramToSend *,int)
+{
+  assert(false);
+  return 0;
+}
+
+
+int
+  SharedMemorySockets::sendFile(
+    SocketId socket_id,
+    int file_descriptor,
+    off_t offset,
+    size_t len
+  )
+{
+  // The data has to be copied into the ring anyway.
+  return sendFileBySending(*this,socket_id,file_descriptor,offset,len);
+}
+
+
+bool SharedMemorySockets::enableZeroCopy(SocketId)
+{
+  // Data always has to be copied into the ring.
+  return false;
+}
+
+
+int
+  SharedMemorySockets::sendZeroCopy(
+    SocketId socket_id,
+    const void *buf,
+    size_t len,
+    bool &is_zero_copy
+  )
+{
+  is_zero_copy = false;
+  return send(socket_id,buf,len);
+}
+
+
+auto SharedMemorySockets::readZeroCopyCompletion(SocketId)
+  -> std::optional<ZeroCopyCompletion>
+{
+  return std::nullopt;
+}
+
+
+bool SharedMemorySockets::hasOwnReadiness(SocketId socket_id) const
+{
+  if (socket_id < 0 || size_t(socket_id) >= sockets.size()) {
+    return false;
+  }
+
+  if (!sockets[socket_id]) {
+    return false;
+  }
+
+  const Socket &socket = *sockets[socket_id];
+  return socket.maybe_connection || socket.connection_was_refused;
+}
+
+
+bool SharedMemorySockets::canRead(SocketId socket_id) const
+{
+  const Connection *connection_ptr = maybeConnection(socket_id);
+
+  if (!connection_ptr) {
+    return false;
+  }
+
+  const Ring &ring = *connection_ptr->input_ring;
+  std::optional<size_t> maybe_n_bytes_available = ring.maybeNBytesAvailable();
+
+  if (!maybe_n_bytes_available) {
+    // Let recv() report it.
+    return true;
+  }
+
+  return
+    *maybe_n_bytes_available != 0 ||
+    ring.writer_closed.load() ||
+    connection_ptr->peer_has_gone;
+}
+
+
+bool SharedMemorySockets::canWrite(SocketId socket_id) const
+{
+  const Connection *connection_ptr = maybeConnection(socket_id);
+
+  if (!connection_ptr) {
+    // A refused connection is reported as writable, just like a real
+    // socket.
+    return socket(socket_id).connection_was_refused;
+  }
+
+  const Ring &ring = *connection_ptr->output_ring;
+  std::optional<size_t> maybe_n_bytes_available = ring.maybeNBytesAvailable();
+
+  if (!maybe_n_bytes_available) {
+    // Let send() report it.
+    return true;
+  }
+
+  bool is_full = (*maybe_n_bytes_available == ring_capacity);
+
+  return
+    !is_full || ring.reader_closed.load() || connection_ptr->peer_has_gone;
+}
+
+
+bool SharedMemorySockets::beginWaitingToRead(SocketId socket_id)
+{
+  if (Socket &socket = this->socket(socket_id); socket.maybe_connection) {
+    socket.maybe_connection->input_ring->reader_is_waiting.store(1);
+  }
+
+  // Check again after setting the flag, since the peer may have written
+  // before it could see that we were waiting.
+  return canRead(socket_id);
+}
+
+
+bool SharedMemorySockets::beginWaitingToWrite(SocketId socket_id)
+{
+  if (Socket &socket = this->socket(socket_id); socket.maybe_connection) {
+    socket.maybe_connection->output_ring->writer_is_waiting.store(1);
+  }
+
+  return canWrite(socket_id);
+}
+
+
+void SharedMemorySockets::endWaiting(SocketId socket_id)
+{
+  Socket &socket = this->socket(socket_id);
+
+  if (!socket.maybe_connection) {
+    return;
+  }
+
+  Connection &connection = *socket.maybe_connection;
+  connection.input_ring->reader_is_waiting.store(0);
+  connection.output_ring->writer_is_waiting.store(0);
+
+  if (!drainDoorbell(socket_id)) {
+    connection.peer_has_gone = true;
+  }
+}
+
+
+void SharedMemorySockets::wakePeer(SocketId socket_id)
+{
+  if (!ringDoorbell(socket_id)) {
+    connection(socket_id).peer_has_gone = true;
+  }
+}
@@ -0,0 +1,123 @@
+#ifndef SHAREDMEMORYSOCKETS_HPP_
+#define SHAREDMEMORYSOCKETS_HPP_
+
+#include <optional>
+#include <string>
+#include <vector>
+#include "socketsinterface.hpp"
+
+
+// Sockets for peers on the same host.  Connections are set up over a
+// unix domain socket, after which data flows through a pair of
+// single-producer/single-consumer rings in a shared memory region.  The
+// kernel is only involved when one side has to wake up the other, which
+// happens only when the other side is idle in select().
+//
+// Each connected socket id is the unix socket, and one side wakes the
+// other by writing a byte to it, so the ids can be used with
+// SharedMemorySelector alongside ordinary file descriptors.  The region
+// is the only descriptor the peer sends us, and the socket is never read
+// or written in a way that could block, so a misbehaving peer can't make
+// us wait.  A listening socket id is an epoll instance holding the
+// unix socket and the connections whose handshake hasn't arrived yet, so
+// that it becomes readable when accept() has something to do, and
+// accept() never has to wait for a peer.
+class SharedMemorySockets : public SocketsInterface {
+  public:
+    struct Ring;
+
+    SharedMemorySockets(const std::string &name_prefix = "protocol_testing");
+    SharedMemorySockets(const SharedMemorySockets &) = delete;
+
+    SocketId create(int address_family = AF_INET) override;
+    void setNonBlocking(SocketId,bool non_blocking) override;
+    void connect(SocketId, const InternetAddress &) override;
+    bool connectionWasRefused(SocketId) override;
+    void bind(SocketId,const InternetAddress &) override;
+    void listen(SocketId, int backlog) override;
+    SocketId accept(SocketId) override;
+    int recv(SocketId, void *buf, size_t len) override;
+    int send(SocketId, const void *buf, size_t len) override;
+    void close(SocketId) override;
+
+    SocketId createDatagram() override;
+    int recvDatagrams(SocketId, ReceivedDatagram *, int n) override;
+    int sendDatagrams(SocketId, const DatagramToSend *, int n) override;
+
+    int
+      sendFile(
+        SocketId, int file_descriptor, off_t offset, size_t len
+      ) override;
+
+    bool enableZeroCopy(SocketId) override;
+
+    // There are no segments, so there is nothing to delay.
+    void setNoDelay(SocketId,bool) override {}
+    void setCork(SocketId,bool) override {}
+
+    // There is no network connection to probe.
+    void setKeepAlive(SocketId,std::chrono::seconds) override {}
+
+    int
+      sendZeroCopy(
+        SocketId, const void *buf, size_t len, bool &is_zero_copy
+      ) override;
+
+    std::optional<ZeroCopyCompletion>
+      readZeroCopyCompletion(SocketId) override;
+
+    // These are used by SharedMemorySelector.
+    bool hasOwnReadiness(SocketId) const;
+    bool canRead(SocketId) const;
+    bool canWrite(SocketId) const;
+    bool beginWaitingToRead(SocketId);
+    bool beginWaitingToWrite(SocketId);
+    void endWaiting(SocketId);
+
+    static const size_t ring_capacity = 256*1024;
+
+    // Connections which haven't sent their handshake are closed, oldest
+    // first, once there are more than this many.
+    static const size_t max_pending_handshakes = 64;
+
+  private:
+    struct Connection {
+      void *region = nullptr;
+      size_t region_size = 0;
+      Ring *input_ring = nullptr;
+      Ring *output_ring = nullptr;
+
+      // The peer closed its end of the unix socket without closing the
+      // connection, or we couldn't wake it.
+      bool peer_has_gone = false;
+    };
+
+    struct Listener {
+      int unix_socket_fd = -1;
+      std::vector<int> handshaking_fds;
+    };
+
+    struct Socket {
+      bool connection_was_refused = false;
+      std::optional<Listener> maybe_listener;
+      std::optional<Connection> maybe_connection;
+    };
+
+    const std::string name_prefix;
+    std::vector<std::optional<Socket>> sockets;
+
+    Socket &socket(SocketId);
+    const Socket &socket(SocketId) const;
+    const Connection *maybeConnection(SocketId) const;
+    Connection &connection(SocketId);
+    std::string addressName(const InternetAddress &) const;
+    void addSocket(SocketId);
+    void removeSocket(SocketId);
+    SocketId acceptPendingConnection(SocketId listen_socket_id);
+    SocketId finishHandshake(SocketId listen_socket_id,int fd);
+    void removeHandshakingFd(SocketId listen_socket_id,int fd);
+    void wakePeer(SocketId);
+};
+
+
+#endif /* SHAREDMEMORYSOCKETS_HPP_ */
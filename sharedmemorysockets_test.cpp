@@ -0,0 +1,396 @@
+#include "sharedmemorysockets.hpp"
+
+#include <unistd.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/un.h>
+#include <cstddef>
+#include <string>
+#include <vector>
+#include "sharedmemoryselector.hpp"
+#include "messageservice.hpp"
+
+using std::string;
+using std::vector;
+using SocketId = SharedMemorySockets::SocketId;
+
+
+static int testPort()
+{
+  return 1234;
+}
+
+
+static string testNamePrefix()
+{
+  return "protocol_testing_test." + std::to_string(getpid());
+}
+
+
+static InternetAddress testAddress()
+{
+  InternetAddress address;
+  address.setPort(testPort());
+  return address;
+}
+
+
+namespace {
+struct Connection {
+  const SocketId server_socket_id;
+  const SocketId client_socket_id;
+};
+}
+
+
+static Connection
+  createConnection(SharedMemorySockets &sockets,SocketId listen_socket_id)
+{
+  SocketId client_socket_id = sockets.create();
+  sockets.setNonBlocking(client_socket_id,true);
+  sockets.connect(client_socket_id,testAddress());
+  assert(!sockets.connectionWasRefused(client_socket_id));
+  SocketId server_socket_id = sockets.accept(listen_socket_id);
+  return Connection{server_socket_id,client_socket_id};
+}
+
+
+static SocketId listenOn(SharedMemorySockets &sockets)
+{
+  SocketId listen_socket_id = sockets.create();
+  sockets.bind(listen_socket_id,testAddress());
+  sockets.listen(listen_socket_id,/*backlog*/1);
+  return listen_socket_id;
+}
+
+
+static void testSendingAndReceiving()
+{
+  SharedMemorySockets sockets(testNamePrefix());
+  SocketId listen_socket_id = listenOn(sockets);
+  Connection connection = createConnection(sockets,listen_socket_id);
+
+  assert(!sockets.canRead(connection.server_socket_id));
+  int send_result = sockets.send(connection.client_socket_id,"test",5);
+  assert(send_result == 5);
+  assert(sockets.canRead(connection.server_socket_id));
+
+  char buffer[16] = {};
+  int recv_result =
+    sockets.recv(connection.server_socket_id,buffer,sizeof buffer);
+  assert(recv_result == 5);
+  assert(strcmp(buffer,"test") == 0);
+
+  recv_result = sockets.recv(connection.server_socket_id,buffer,sizeof buffer);
+  assert(recv_result == -1);
+  assert(errno == EAGAIN);
+
+  sockets.close(connection.client_socket_id);
+  recv_result = sockets.recv(connection.server_socket_id,buffer,sizeof buffer);
+  assert(recv_result == 0);
+  sockets.close(connection.server_socket_id);
+  sockets.close(listen_socket_id);
+}
+
+
+static void testFillingTheRing()
+{
+  SharedMemorySockets sockets(testNamePrefix());
+  SocketId listen_socket_id = listenOn(sockets);
+  Connection connection = createConnection(sockets,listen_socket_id);
+  vector<char> data(SharedMemorySockets::ring_capacity + 100, 'x');
+
+  int send_result =
+    sockets.send(connection.client_socket_id,data.data(),data.size());
+
+  assert(size_t(send_result) == SharedMemorySockets::ring_capacity);
+  assert(!sockets.canWrite(connection.client_socket_id));
+
+  // If we wait now, the reader should wake us up when it makes space.
+  assert(!sockets.beginWaitingToWrite(connection.client_socket_id));
+  char buffer[100];
+  sockets.recv(connection.server_socket_id,buffer,sizeof buffer);
+  assert(sockets.canWrite(connection.client_socket_id));
+  sockets.endWaiting(connection.client_socket_id);
+
+  sockets.close(connection.client_socket_id);
+  sockets.close(connection.server_socket_id);
+  sockets.close(listen_socket_id);
+}
+
+
+static void testConnectionRefused()
+{
+  SharedMemorySockets sockets(testNamePrefix());
+  SocketId socket_id = sockets.create();
+  sockets.setNonBlocking(socket_id,true);
+  sockets.connect(socket_id,testAddress());
+  assert(sockets.connectionWasRefused(socket_id));
+  assert(sockets.canWrite(socket_id));
+  sockets.close(socket_id);
+}
+
+
+// A client which connects without going through SharedMemorySockets, so
+// that it can misbehave.
+static int connectRawClient()
+{
+  int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+  assert(fd >= 0);
+  string name = testNamePrefix() + "." + std::to_string(testPort());
+  sockaddr_un address = {};
+  address.sun_family = AF_UNIX;
+  memcpy(address.sun_path + 1, name.data(), name.size());
+  socklen_t size = offsetof(sockaddr_un,sun_path) + 1 + name.size();
+
+  int connect_result =
+    ::connect(fd, reinterpret_cast<const sockaddr *>(&address), size);
+
+  assert(connect_result == 0);
+  return fd;
+}
+
+
+static void sendRawHandshake(int socket_fd,const vector<int> &fds)
+{
+  char byte = 0;
+  iovec iov{&byte,1};
+  char control[CMSG_SPACE(sizeof(int) * 3)] = {};
+  msghdr message = {};
+  message.msg_iov = &iov;
+  message.msg_iovlen = 1;
+
+  if (!fds.empty()) {
+    message.msg_control = control;
+    message.msg_controllen = CMSG_SPACE(sizeof(int) * fds.size());
+    cmsghdr *cmsg = CMSG_FIRSTHDR(&message);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+    memcpy(CMSG_DATA(cmsg), fds.data(), sizeof(int) * fds.size());
+  }
+
+  ssize_t sendmsg_result = sendmsg(socket_fd, &message, 0);
+  assert(sendmsg_result == 1);
+}
+
+
+static bool peerHasClosed(int socket_fd)
+{
+  char byte = 0;
+  return recv(socket_fd, &byte, 1, MSG_DONTWAIT) == 0;
+}
+
+
+static void testSilentClient()
+{
+  SharedMemorySockets sockets(testNamePrefix());
+  SocketId listen_socket_id = listenOn(sockets);
+  int raw_fd = connectRawClient();
+
+  // The server doesn't wait for the handshake.
+  SocketId accept_result = sockets.accept(listen_socket_id);
+  assert(accept_result == -1);
+  assert(errno == EAGAIN);
+
+  // Other clients can still connect.
+  Connection connection = createConnection(sockets,listen_socket_id);
+  assert(connection.server_socket_id >= 0);
+
+  // A handshake without the descriptors is rejected.
+  sendRawHandshake(raw_fd,{});
+  accept_result = sockets.accept(listen_socket_id);
+  assert(accept_result == -1);
+  assert(errno == EPROTO);
+  assert(peerHasClosed(raw_fd));
+
+  ::close(raw_fd);
+  sockets.close(connection.client_socket_id);
+  sockets.close(connection.server_socket_id);
+  sockets.close(listen_socket_id);
+}
+
+
+static void testRejectingWrongRegionSize()
+{
+  SharedMemorySockets sockets(testNamePrefix());
+  SocketId listen_socket_id = listenOn(sockets);
+  int raw_fd = connectRawClient();
+  int memory_fd = memfd_create("sharedmemorysockets_test", MFD_CLOEXEC);
+  assert(memory_fd >= 0);
+  int ftruncate_result = ftruncate(memory_fd, /*length*/1);
+  assert(ftruncate_result == 0);
+  sendRawHandshake(raw_fd,{memory_fd});
+  SocketId accept_result = sockets.accept(listen_socket_id);
+  assert(accept_result == -1);
+  assert(errno == EPROTO);
+  assert(peerHasClosed(raw_fd));
+
+  ::close(memory_fd);
+  ::close(raw_fd);
+  sockets.close(listen_socket_id);
+}
+
+
+static void testRejectingPipeInHandshake()
+{
+  SharedMemorySockets sockets(testNamePrefix());
+  SocketId listen_socket_id = listenOn(sockets);
+  int raw_fd = connectRawClient();
+  int pipe_fds[2];
+  int pipe_result = pipe(pipe_fds);
+  assert(pipe_result == 0);
+  sendRawHandshake(raw_fd,{pipe_fds[0]});
+  SocketId accept_result = sockets.accept(listen_socket_id);
+  assert(accept_result == -1);
+  assert(errno == EPROTO);
+  assert(peerHasClosed(raw_fd));
+
+  ::close(pipe_fds[1]);
+  ::close(pipe_fds[0]);
+  ::close(raw_fd);
+  sockets.close(listen_socket_id);
+}
+
+
+static void testPeerGoingAway()
+{
+  SharedMemorySockets sockets(testNamePrefix());
+  SocketId listen_socket_id = listenOn(sockets);
+  Connection connection = createConnection(sockets,listen_socket_id);
+  SocketId server_socket_id = connection.server_socket_id;
+
+  // Like the client process exiting without closing the connection.
+  ::shutdown(connection.client_socket_id,SHUT_RDWR);
+  assert(!sockets.canRead(server_socket_id));
+  sockets.beginWaitingToRead(server_socket_id);
+  sockets.endWaiting(server_socket_id);
+  assert(sockets.canRead(server_socket_id));
+
+  char buffer[16];
+  int recv_result = sockets.recv(server_socket_id,buffer,sizeof buffer);
+  assert(recv_result == 0);
+  int send_result = sockets.send(server_socket_id,"test",4);
+  assert(send_result == -1);
+  assert(errno == EPIPE);
+
+  sockets.close(connection.client_socket_id);
+  sockets.close(server_socket_id);
+  sockets.close(listen_socket_id);
+}
+
+
+static void testReadyFds()
+{
+  SharedMemorySockets sockets(testNamePrefix());
+  SharedMemorySelector selector(sockets);
+  SocketId listen_socket_id = listenOn(sockets);
+  Connection connection = createConnection(sockets,listen_socket_id);
+  sockets.send(connection.client_socket_id,"test",5);
+
+  selector.beginSelect();
+  selector.preSelectParams().setRead(connection.server_socket_id);
+  selector.preSelectParams().setWrite(connection.server_socket_id);
+  selector.preSelectParams().setRead(connection.client_socket_id);
+  selector.callSelect();
+
+  // Readable and writable, but only listed once.
+  assert(
+    selector.postSelectParams().readyFds() ==
+    vector<int>{connection.server_socket_id}
+  );
+
+  selector.endSelect();
+  sockets.close(connection.client_socket_id);
+  sockets.close(connection.server_socket_id);
+  sockets.close(listen_socket_id);
+}
+
+
+namespace {
+struct ServerHandler : MessageServer::EventInterface {
+  vector<string> messages;
+  int n_connects = 0;
+
+  void gotMessage(ClientId,const char *message,size_t) override
+  {
+    messages.push_back(message);
+  }
+
+  void clientConnected(ClientId) override { ++n_connects; }
+  void clientDisconnected(ClientId) override {}
+};
+}
+
+
+namespace {
+struct ClientHandler : MessageClient::EventInterface {
+  vector<string> messages;
+  bool is_connected = false;
+
+  void connectionRefused() override { assert(false); }
+  void connected() override { is_connected = true; }
+
+  void gotMessage(const char *message,size_t) override
+  {
+    messages.push_back(message);
+  }
+};
+}
+
+
+static void testMessageServiceOverSharedMemory()
+{
+  SharedMemorySockets sockets(testNamePrefix());
+  SharedMemorySelector selector(sockets);
+  MessageServer server(sockets);
+  MessageClient client(sockets);
+  ServerHandler server_handler;
+  ClientHandler client_handler;
+
+  auto process_events = [&]{
+    selector.beginSelect();
+    server.setupSelect(selector.preSelectParams());
+    client.setupSelect(selector.preSelectParams());
+    selector.callSelect();
+    server.handleSelect(selector.postSelectParams(),server_handler);
+    client.handleSelect(selector.postSelectParams(),client_handler);
+    selector.endSelect();
+  };
+
+  server.startListening(testPort());
+  client.startConnecting(testPort());
+  client.queueMessage("ping",5);
+
+  while (server_handler.messages.empty()) {
+    process_events();
+  }
+
+  assert(server_handler.messages == vector<string>{"ping"});
+  server.queueMessageToClient(server.clientIds()[0],"pong",5);
+
+  while (client_handler.messages.empty()) {
+    process_events();
+  }
+
+  assert(client_handler.messages == vector<string>{"pong"});
+  client.disconnect();
+
+  while (server.nClients() != 0) {
+    process_events();
+  }
+}
+
+
+int main()
+{
+  testSendingAndReceiving();
+  testFillingTheRing();
+  testConnectionRefused();
+  testSilentClient();
+  testRejectingWrongRegionSize();
+  testRejectingPipeInHandshake();
+  testPeerGoingAway();
+  testReadyFds();
+  testMessageServiceOverSharedMemory();
+}
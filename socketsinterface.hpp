@@ -2,23 +2,171 @@
 #define SOCKETSINTERFACE_HPP_
 
 
+#include <unistd.h>
+#include <cerrno>
+#include <cstdint>
+#include <chrono>
+#include <optional>
+#include <algorithm>
 #include "internetaddress.hpp"
 
 
 struct SocketsInterface {
   using SocketId = int;
 
-  virtual SocketId create() = 0;
+  // A range of zero-copy sends which the kernel no longer needs the data
+  // for.  Sends are numbered from zero for each socket.
+  struct ZeroCopyCompletion {
+    uint32_t first_send_id;
+    uint32_t last_send_id;
+  };
+
+  struct DatagramToSend {
+    const void *data;
+    size_t size;
+    InternetAddress address;
+  };
+
+  // The datagram is received into buffer, and size is set to its size.
+  // A datagram which didn't fit only gets the part that did, and is
+  // marked as truncated.
+  struct ReceivedDatagram {
+    void *buffer;
+    size_t buffer_size;
+    size_t size;
+    bool is_truncated;
+    InternetAddress address;
+  };
+
+  virtual SocketId create(int address_family = AF_INET) = 0;
   virtual void setNonBlocking(SocketId,bool non_blocking) = 0;
+
+  // With no_delay, small sends go out without waiting for earlier data to
+  // be acknowledged.  While corked, only full segments are sent.  Sockets
+  // without these options ignore them.
+  virtual void setNoDelay(SocketId,bool no_delay) = 0;
+  virtual void setCork(SocketId,bool cork) = 0;
+
+  // Have the kernel probe the peer once the connection has been idle for
+  // idle_time, and fail the connection if the peer has gone.  Sockets
+  // which have nothing to probe ignore it.
+  virtual void setKeepAlive(SocketId,std::chrono::seconds idle_time) = 0;
+
   virtual void connect(SocketId, const InternetAddress &) = 0;
   virtual bool connectionWasRefused(SocketId) = 0;
   virtual void bind(SocketId,const InternetAddress &) = 0;
   virtual void listen(SocketId, int backlog) = 0;
+
+  // Returns -1 with errno set if the connection couldn't be accepted,
+  // which only affects that connection.
   virtual SocketId accept(SocketId) = 0;
+
+  // Like the system calls, these return -1 with errno set when the socket
+  // isn't ready or the connection failed, and recv() returns 0 once the
+  // peer has closed the connection.  Use ioStatus() to tell these apart.
+  // Sending to a peer which has gone away doesn't raise SIGPIPE.
   virtual int recv(SocketId, void *buf, size_t len) = 0;
   virtual int send(SocketId, const void *buf, size_t len) = 0;
   virtual void close(SocketId) = 0;
+
+  // Datagram sockets are created unconnected.  The batch calls don't
+  // block, and return how many datagrams were received or sent, which is
+  // zero if none could be.  They return -1 with errno set if the first
+  // datagram failed; a later failure just ends the batch early.
+  virtual SocketId createDatagram() = 0;
+  virtual int recvDatagrams(SocketId, ReceivedDatagram *, int n) = 0;
+  virtual int sendDatagrams(SocketId, const DatagramToSend *, int n) = 0;
+
+  // Send up to len bytes of the file starting at offset.
+  virtual int
+    sendFile(SocketId, int file_descriptor, off_t offset, size_t len) = 0;
+
+  // Returns false if zero-copy sends aren't supported for the socket.
+  virtual bool enableZeroCopy(SocketId) = 0;
+
+  // Like send(), but the data may be transmitted directly from buf, which
+  // must not change until a completion for the send has been read.
+  // is_zero_copy is set to false if the data was copied instead, in
+  // which case the send doesn't get an id and there is no completion.
+  virtual int
+    sendZeroCopy(
+      SocketId, const void *buf, size_t len, bool &is_zero_copy
+    ) = 0;
+
+  virtual std::optional<ZeroCopyCompletion>
+    readZeroCopyCompletion(SocketId) = 0;
 };
 
 
+// How a recv(), send(), or one of the other stream sends went.  Only
+// would_block and interrupted leave the connection usable.
+enum class IoStatus {
+  transferred,
+  would_block,
+  interrupted,
+  closed,
+  reset,
+  broken_pipe,
+  error
+};
+
+
+// Must be called before anything else can change errno.
+inline IoStatus ioStatus(int result)
+{
+  if (result > 0) {
+    return IoStatus::transferred;
+  }
+
+  if (result == 0) {
+    return IoStatus::closed;
+  }
+
+  switch (errno) {
+    case EAGAIN:
+#if EWOULDBLOCK != EAGAIN
+    case EWOULDBLOCK:
+#endif
+      return IoStatus::would_block;
+    case EINTR:
+      return IoStatus::interrupted;
+    case ECONNRESET:
+      return IoStatus::reset;
+    case EPIPE:
+      return IoStatus::broken_pipe;
+  }
+
+  return IoStatus::error;
+}
+
+
+// An implementation of sendFile() for sockets which can't send directly
+// from a file.  The data is read into a buffer and sent normally.
+inline int
+  sendFileBySending(
+    SocketsInterface &sockets,
+    SocketsInterface::SocketId socket_id,
+    int file_descriptor,
+    off_t offset,
+    size_t len
+  )
+{
+  char buffer[64*1024];
+  size_t read_size = std::min(len, sizeof buffer);
+  ssize_t read_result = pread(file_descriptor, buffer, read_size, offset);
+
+  if (read_result < 0) {
+    return -1;
+  }
+
+  if (read_result == 0) {
+    // The file is shorter than expected.
+    errno = EIO;
+    return -1;
+  }
+
+  return sockets.send(socket_id, buffer, read_result);
+}
+
+
 #endif /* SOCKETSINTERFACE_HPP_ */
@@ -2,6 +2,11 @@
 #define SYSTEMSELECTOR_HPP_
 
 
+#include <limits>
+#include <algorithm>
+#include <vector>
+#include <sys/select.h>
+#include <sys/time.h>
 #include "selector.hpp"
 
 
@@ -11,6 +16,7 @@ struct SystemSelectParams {
   fd_set write_fds;
   fd_set except_fds;
   timeval timeout;
+  std::vector<int> ready_fds;
 
   SystemSelectParams()
   : n_fds(0),
@@ -29,11 +35,27 @@ struct SystemSelectParams {
     n_fds = 0;
     timeout.tv_sec = std::numeric_limits<time_t>::max();
     timeout.tv_usec = 999999;
+    ready_fds.clear();
   }
 
   void doSelect()
   {
+    int n_fds_selected = n_fds;
     n_fds = select(n_fds, &read_fds, &write_fds, &except_fds, &timeout);
+    ready_fds.clear();
+
+    if (n_fds <= 0) {
+      // The sets are only meaningful if something was ready.
+      FD_ZERO(&read_fds);
+      FD_ZERO(&write_fds);
+      return;
+    }
+
+    for (int fd=0; fd!=n_fds_selected; ++fd) {
+      if (readIsSet(fd) || writeIsSet(fd)) {
+        ready_fds.push_back(fd);
+      }
+    }
   }
 
   void setFD(int fd,fd_set &set)
@@ -45,6 +67,18 @@ struct SystemSelectParams {
     }
   }
 
+  void setTimeout(std::chrono::microseconds duration)
+  {
+    long long n_microseconds = std::max<long long>(duration.count(),0);
+    timeval new_timeout;
+    new_timeout.tv_sec = n_microseconds / 1000000;
+    new_timeout.tv_usec = n_microseconds % 1000000;
+
+    if (timercmp(&new_timeout,&timeout,<)) {
+      timeout = new_timeout;
+    }
+  }
+
   void setRead(int fd) { setFD(fd,read_fds); }
   void setWrite(int fd) { setFD(fd,write_fds); }
   bool readIsSet(int fd) const { return FD_ISSET(fd,&read_fds); }
@@ -3,6 +3,11 @@
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/sendfile.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/errqueue.h>
+#include <algorithm>
 #include <stdexcept>
 #include <iostream>
 #include <cassert>
@@ -24,19 +29,152 @@ void SystemSockets::bind(SocketId sockfd,const InternetAddress &address)
 }
 
 
+static void setTcpOption(SocketId socket_id,int option,int value)
+{
+  int setsockopt_result =
+    setsockopt(socket_id, IPPROTO_TCP, option, &value, sizeof value);
+
+  if (setsockopt_result == -1) {
+    throw std::runtime_error("Unable to set TCP option.");
+  }
+}
+
+
+void SystemSockets::setNoDelay(SocketId socket_id,bool no_delay)
+{
+  setTcpOption(socket_id,TCP_NODELAY,no_delay);
+}
+
+
+void SystemSockets::setCork(SocketId socket_id,bool cork)
+{
+  setTcpOption(socket_id,TCP_CORK,cork);
+}
+
+
+void
+  SystemSockets::setKeepAlive(
+    SocketId socket_id,
+    std::chrono::seconds idle_time
+  )
+{
+  int keep_alive = 1;
+
+  int setsockopt_result =
+    setsockopt(
+      socket_id, SOL_SOCKET, SO_KEEPALIVE, &keep_alive, sizeof keep_alive
+    );
+
+  if (setsockopt_result == -1) {
+    throw std::runtime_error("Unable to enable keep-alive.");
+  }
+
+  setTcpOption(socket_id,TCP_KEEPIDLE,idle_time.count());
+}
+
+
 int SystemSockets::send(SocketId sockfd, const void *buf, size_t len)
 {
-  int send_result = ::send(sockfd,buf,len,/*flags*/0);
+  // A peer which has gone away is reported as EPIPE instead of raising
+  // SIGPIPE.
+  return ::send(sockfd,buf,len,MSG_NOSIGNAL);
+}
 
-  if (send_result < 0) {
-    cerr << strerror(errno) << "\n";
-    assert(false);
+
+int
+  SystemSockets::sendFile(
+    SocketId sockfd,
+    int file_descriptor,
+    off_t offset,
+    size_t len
+  )
+{
+  // There is no MSG_NOSIGNAL for sendfile(), so processes which send
+  // files to peers which may go away need to ignore SIGPIPE.
+  return ::sendfile(sockfd,file_descriptor,&offset,len);
+}
+
+
+bool SystemSockets::enableZeroCopy(SocketId sockfd)
+{
+  int one = 1;
+
+  int setsockopt_result =
+    setsockopt(sockfd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof one);
+
+  return setsockopt_result == 0;
+}
+
+
+int
+  SystemSockets::sendZeroCopy(
+    SocketId sockfd,
+    const void *buf,
+    size_t len,
+    bool &is_zero_copy
+  )
+{
+  int send_result = ::send(sockfd,buf,len,MSG_ZEROCOPY | MSG_NOSIGNAL);
+
+  if (send_result < 0 && errno == ENOBUFS) {
+    // We've hit the limit on pinned memory for this socket, so fall back
+    // to copying.
+    is_zero_copy = false;
+    return send(sockfd,buf,len);
   }
 
+  is_zero_copy = (send_result >= 0);
   return send_result;
 }
 
 
+auto SystemSockets::readZeroCopyCompletion(SocketId sockfd)
+  -> std::optional<ZeroCopyCompletion>
+{
+  const size_t control_size =
+    CMSG_SPACE(sizeof(sock_extended_err) + sizeof(sockaddr_in6));
+
+  for (;;) {
+    char control[control_size];
+    msghdr message = {};
+    message.msg_control = control;
+    message.msg_controllen = sizeof control;
+
+    if (recvmsg(sockfd, &message, MSG_ERRQUEUE | MSG_DONTWAIT) == -1) {
+      // The error queue is empty.
+      return std::nullopt;
+    }
+
+    cmsghdr *cmsg = CMSG_FIRSTHDR(&message);
+
+    if (!cmsg) {
+      continue;
+    }
+
+    bool is_extended_error =
+      (cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) ||
+      (cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR);
+
+    if (!is_extended_error) {
+      continue;
+    }
+
+    const sock_extended_err *error_ptr =
+      reinterpret_cast<const sock_extended_err *>(CMSG_DATA(cmsg));
+
+    if (error_ptr->ee_errno != 0) {
+      continue;
+    }
+
+    if (error_ptr->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+      continue;
+    }
+
+    return ZeroCopyCompletion{error_ptr->ee_info, error_ptr->ee_data};
+  }
+}
+
+
 int SystemSockets::recv(SocketId sockfd, void *buf, size_t len)
 {
   return ::recv(sockfd,buf,len,/*flags*/0);
@@ -53,9 +191,104 @@ void SystemSockets::close(SocketId sockfd)
 }
 
 
-SocketId SystemSockets::create()
+SocketId SystemSockets::createDatagram()
+{
+  int socket_result = socket(AF_INET,SOCK_DGRAM,/*protocol*/0);
+
+  if (socket_result == -1) {
+    throw std::runtime_error("Failed to create socket.");
+  }
+
+  return socket_result;
+}
+
+
+void SystemSockets::resizeDatagramHeaders(int n)
+{
+  datagram_headers.assign(n,mmsghdr{});
+  datagram_iovecs.resize(n);
+}
+
+
+int
+  SystemSockets::recvDatagrams(
+    SocketId sockfd,
+    ReceivedDatagram *datagrams,
+    int n
+  )
+{
+  resizeDatagramHeaders(n);
+
+  for (int i=0; i!=n; ++i) {
+    ReceivedDatagram &datagram = datagrams[i];
+    msghdr &header = datagram_headers[i].msg_hdr;
+    datagram_iovecs[i] = iovec{datagram.buffer,datagram.buffer_size};
+    header.msg_iov = &datagram_iovecs[i];
+    header.msg_iovlen = 1;
+    header.msg_name = datagram.address.sockaddrPtr();
+    header.msg_namelen = sizeof(sockaddr_storage);
+  }
+
+  int recvmmsg_result =
+    recvmmsg(sockfd,datagram_headers.data(),n,MSG_DONTWAIT,/*timeout*/0);
+
+  if (recvmmsg_result < 0) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      return 0;
+    }
+
+    return -1;
+  }
+
+  for (int i=0; i!=recvmmsg_result; ++i) {
+    const mmsghdr &header = datagram_headers[i];
+    datagrams[i].size =
+      std::min<size_t>(header.msg_len,datagrams[i].buffer_size);
+    datagrams[i].is_truncated = (header.msg_hdr.msg_flags & MSG_TRUNC) != 0;
+  }
+
+  return recvmmsg_result;
+}
+
+
+int
+  SystemSockets::sendDatagrams(
+    SocketId sockfd,
+    const DatagramToSend *datagrams,
+    int n
+  )
 {
-  int domain = AF_INET;
+  resizeDatagramHeaders(n);
+
+  for (int i=0; i!=n; ++i) {
+    const DatagramToSend &datagram = datagrams[i];
+    msghdr &header = datagram_headers[i].msg_hdr;
+    void *data = const_cast<void *>(datagram.data);
+    datagram_iovecs[i] = iovec{data,datagram.size};
+    header.msg_iov = &datagram_iovecs[i];
+    header.msg_iovlen = 1;
+    header.msg_name = const_cast<sockaddr *>(datagram.address.sockaddrPtr());
+    header.msg_namelen = datagram.address.sockaddrSize();
+  }
+
+  int sendmmsg_result =
+    sendmmsg(sockfd,datagram_headers.data(),n,MSG_DONTWAIT);
+
+  if (sendmmsg_result < 0) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      return 0;
+    }
+
+    return -1;
+  }
+
+  return sendmmsg_result;
+}
+
+
+SocketId SystemSockets::create(int address_family)
+{
+  int domain = address_family;
   int type = SOCK_STREAM;
   int protocol = 0;
   int socket_result = socket(domain,type,protocol);
@@ -121,7 +354,6 @@ void
       return;
     }
 
-    cerr << "errno: " << errno << "\n";
     throw std::runtime_error("Unable to connect to server.");
   }
 }
@@ -135,20 +367,12 @@ bool SystemSockets::connectionWasRefused(SocketId socket_id)
     getsockopt(socket_id, SOL_SOCKET, SO_ERROR, &error, &size);
 
   if (getsockopt_result == -1) {
-    assert(false);
-  }
-
-  if (error == 0) {
-    return false;
-  }
-
-  if (error == ECONNREFUSED) {
     return true;
   }
 
-  cerr << "SystemSockets::connectionWasRefused: error: " <<
-    strerror(error) << "\n";
-  assert(false);
+  // Other failures, like the host being unreachable or the attempt timing
+  // out, are treated the same as a refusal.
+  return error != 0;
 }
 
 
@@ -156,13 +380,8 @@ auto SystemSockets::accept(SocketId sockfd) -> SocketId
 {
   InternetAddress client_address;
   sockaddr *addr = client_address.sockaddrPtr();
-  socklen_t addrlen = client_address.sockaddrSize();
-  int accept_result = ::accept(sockfd,addr,&addrlen);
-
-  if (accept_result == -1) {
-    // Error accepting
-    assert(false);
-  }
-
-  return accept_result;
+  socklen_t addrlen = sizeof(sockaddr_storage);
+  // This is -1 with errno set if the connection was aborted before we
+  // got to it, or we are out of file descriptors.
+  return ::accept(sockfd,addr,&addrlen);
 }
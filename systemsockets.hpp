@@ -1,10 +1,17 @@
+#include <sys/uio.h>
+#include <vector>
 #include "socketsinterface.hpp"
 
 
 class SystemSockets : public SocketsInterface {
   public:
-    int create() override;
+    int create(int address_family = AF_INET) override;
     void setNonBlocking(SocketId socket_id,bool non_blocking) override;
+    void setNoDelay(SocketId socket_id,bool no_delay) override;
+    void setCork(SocketId socket_id,bool cork) override;
+
+    void
+      setKeepAlive(SocketId socket_id,std::chrono::seconds idle_time) override;
     void bind(SocketId sockfd,const InternetAddress &) override;
     void listen(SocketId sockfd, int backlog) override;
     void connect(SocketId sockfd, const InternetAddress &) override;
@@ -13,4 +20,30 @@ class SystemSockets : public SocketsInterface {
     int send(SocketId sockfd, const void *buf, size_t len) override;
     int recv(SocketId sockfd, void *buf, size_t len) override;
     void close(SocketId sockfd) override;
+
+    SocketId createDatagram() override;
+    int recvDatagrams(SocketId, ReceivedDatagram *, int n) override;
+    int sendDatagrams(SocketId, const DatagramToSend *, int n) override;
+
+    int
+      sendFile(
+        SocketId, int file_descriptor, off_t offset, size_t len
+      ) override;
+
+    bool enableZeroCopy(SocketId sockfd) override;
+
+    int
+      sendZeroCopy(
+        SocketId sockfd, const void *buf, size_t len, bool &is_zero_copy
+      ) override;
+
+    std::optional<ZeroCopyCompletion>
+      readZeroCopyCompletion(SocketId sockfd) override;
+
+  private:
+    // Reused between batch calls to avoid allocating.
+    std::vector<mmsghdr> datagram_headers;
+    std::vector<iovec> datagram_iovecs;
+
+    void resizeDatagramHeaders(int n);
 };
@@ -1,11 +1,75 @@
 #include "terminal.hpp"
 
+#include <algorithm>
 #include <cassert>
+#include <cerrno>
+#include <cstring>
 
 
 using std::string;
 
 
+struct Terminal::Impl {
+  static constexpr size_t read_size = 4096;
+
+  static void readInput(Terminal &self,EventInterface &event_handler)
+  {
+    string &buffer = self.input_buffer;
+    size_t old_size = buffer.size();
+    buffer.resize(old_size + read_size);
+
+    int read_result =
+      self.read(self.inputFileDescriptor(),&buffer[old_size],read_size);
+
+    buffer.resize(old_size + std::max(read_result,0));
+
+    if (read_result < 0) {
+      if (errno == EAGAIN || errno == EINTR) {
+        // Try again after the next select.
+        return;
+      }
+
+      // Got an error.
+      assert(false);
+    }
+
+    if (read_result == 0) {
+      // A last line without a newline still counts.
+      if (!buffer.empty()) {
+        event_handler.gotLine(buffer);
+        buffer.clear();
+      }
+
+      event_handler.endOfFile();
+      self.had_eof = true;
+      return;
+    }
+
+    // Only the new bytes need to be searched for newlines.
+    const char *begin = buffer.data();
+    const char *end = begin + buffer.size();
+    const char *line_begin = begin;
+    const char *search_begin = begin + old_size;
+
+    for (;;) {
+      const void *newline_ptr =
+        std::memchr(search_begin,'\n',end - search_begin);
+
+      if (!newline_ptr) {
+        break;
+      }
+
+      const char *line_end = static_cast<const char *>(newline_ptr);
+      event_handler.gotLine(Line(line_begin,line_end - line_begin));
+      line_begin = line_end + 1;
+      search_begin = line_begin;
+    }
+
+    buffer.erase(0,line_begin - begin);
+  }
+};
+
+
 void Terminal::setupSelect(PreSelectParamsInterface &select_params)
 {
   if (had_eof) {
@@ -14,7 +78,7 @@ void Terminal::setupSelect(PreSelectParamsInterface &select_params)
 
   select_params.setRead(inputFileDescriptor());
 
-  if (!text_to_show.empty()) {
+  if (isWriting()) {
     select_params.setWrite(errorFileDescriptor());
   }
 }
@@ -34,51 +98,49 @@ void
   int error_file_descriptor = errorFileDescriptor();
 
   if (select_params.readIsSet(input_file_descriptor)) {
-    char buffer[256];
-    int n_bytes_read = read(input_file_descriptor,buffer,sizeof buffer);
-
-    if (n_bytes_read == 0) {
-      event_handler.endOfFile();
-      had_eof = true;
-    }
-    else {
-      if (buffer[n_bytes_read - 1] == '\n') {
-        event_handler.gotLine(
-          line_received_so_far + Line(buffer,n_bytes_read - 1)
-        );
-        line_received_so_far = "";
-      }
-      else {
-        line_received_so_far += Line(buffer,n_bytes_read);
-      }
-    }
+    Impl::readInput(*this,event_handler);
   }
 
   if (select_params.writeIsSet(error_file_descriptor)) {
-    assert(!text_to_show.empty());
+    assert(isWriting());
 
     int write_result =
       write(
         error_file_descriptor,
-        text_to_show.c_str(),
-        text_to_show.length()
+        text_to_show.data() + n_bytes_shown,
+        nUnwrittenBytes()
       );
 
+    if (write_result < 0 && (errno == EAGAIN || errno == EINTR)) {
+      // Try again after the next select.
+      return;
+    }
+
     if (write_result <= 0) {
       // Got an error or EOF.
       assert(false);
     }
 
-    int n_bytes_written = write_result;
+    n_bytes_shown += write_result;
 
-    text_to_show.erase(
-      text_to_show.begin(), text_to_show.begin() + n_bytes_written
-    );
+    if (n_bytes_shown == text_to_show.size()) {
+      text_to_show.clear();
+      n_bytes_shown = 0;
+    }
+    else if (n_bytes_shown*2 >= text_to_show.size()) {
+      text_to_show.erase(0,n_bytes_shown);
+      n_bytes_shown = 0;
+    }
   }
 }
 
 
 void Terminal::show(const string &s)
 {
+  if (nUnwrittenBytes() + s.size() > max_unwritten_bytes) {
+    n_dropped_bytes += s.size();
+    return;
+  }
+
   text_to_show += s;
 }
@@ -2,21 +2,32 @@
 #define TERMINAL_HPP_
 
 #include <string>
+#include <string_view>
 #include "selectparams.hpp"
 
 
 class Terminal {
 public:
-  using Line = std::string;
+  // Lines don't include the newline, and only stay valid during the call
+  // to gotLine().
+  using Line = std::string_view;
 
   struct EventInterface {
-    virtual void gotLine(const Line &) = 0;
+    virtual void gotLine(Line) = 0;
     virtual void endOfFile() = 0;
   };
 
   bool isActive() const { return !had_eof; }
-  bool isWriting() const { return !text_to_show.empty(); }
+  bool isWriting() const { return n_bytes_shown != text_to_show.size(); }
+
+  // Text which would leave more than the maximum number of bytes waiting
+  // to be written is dropped and counted instead, so that a terminal
+  // which nobody is reading can't use up all the memory.
   void show(const std::string &);
+  void setMaxUnwrittenBytes(size_t n) { max_unwritten_bytes = n; }
+  size_t nUnwrittenBytes() const { return text_to_show.size() - n_bytes_shown; }
+  size_t nDroppedBytes() const { return n_dropped_bytes; }
+
   void setupSelect(PreSelectParamsInterface &select_params);
 
   void
@@ -26,10 +37,23 @@ public:
     );
 
 private:
+  struct Impl;
+
   bool had_eof = false;
-  Line line_received_so_far;
+
+  // Input is read into this, and complete lines are taken from it in
+  // place.  Only the partial line at the end is kept between reads.
+  std::string input_buffer;
   std::string text_to_show;
 
+  // The bytes at the start of text_to_show which have already been
+  // written.  They are only removed once they make up half of it, so
+  // each byte is moved at most once on average.
+  size_t n_bytes_shown = 0;
+
+  size_t max_unwritten_bytes = 1024*1024;
+  size_t n_dropped_bytes = 0;
+
   virtual int inputFileDescriptor() const = 0;
   virtual int errorFileDescriptor() const = 0;
   virtual int read(int file_descriptor,char *buffer,size_t size) = 0;
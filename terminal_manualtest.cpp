@@ -33,9 +33,9 @@ private:
     {
     }
 
-    void gotLine(const string &line) override
+    void gotLine(Terminal::Line line) override
     {
-      terminal_test.gotLineFromTerminal(line);
+      terminal_test.gotLineFromTerminal(string(line));
     }
 
     void endOfFile() override
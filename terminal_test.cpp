@@ -0,0 +1,134 @@
+#include "terminal.hpp"
+
+#include <string>
+#include <vector>
+#include "faketerminal.hpp"
+#include "fakeselector.hpp"
+
+using std::string;
+using std::vector;
+
+
+namespace {
+struct TerminalHandler : Terminal::EventInterface {
+  vector<string> lines;
+  bool got_eof = false;
+
+  void gotLine(Terminal::Line line) override
+  {
+    lines.push_back(string(line));
+  }
+
+  void endOfFile() override { got_eof = true; }
+};
+}
+
+
+namespace {
+struct Tester {
+  FakeFileDescriptorAllocator file_descriptor_allocator;
+  FakeTerminal terminal{file_descriptor_allocator};
+  FakeSelector selector{{&terminal}};
+  TerminalHandler handler;
+
+  void processEvents()
+  {
+    selector.beginSelect();
+    terminal.setupSelect(selector.preSelectParams());
+    selector.callSelect();
+    terminal.handleSelect(selector.postSelectParams(),handler);
+    selector.endSelect();
+  }
+
+  void waitForOutput()
+  {
+    while (terminal.isWriting()) {
+      processEvents();
+    }
+  }
+};
+}
+
+
+static void testPartialWrites()
+{
+  Tester tester;
+  tester.terminal.maybe_max_write_size = 3;
+  string expected_output;
+
+  for (int i=0; i!=100; ++i) {
+    string text = "line " + std::to_string(i) + "\n";
+    tester.terminal.show(text);
+    expected_output += text;
+
+    if (i % 10 == 0) {
+      tester.processEvents();
+    }
+  }
+
+  tester.waitForOutput();
+  assert(tester.terminal.output() == expected_output);
+  assert(tester.terminal.nUnwrittenBytes() == 0);
+  assert(tester.terminal.nDroppedBytes() == 0);
+}
+
+
+static void testDroppingWhileBlocked()
+{
+  Tester tester;
+  tester.terminal.setMaxUnwrittenBytes(10);
+  tester.terminal.output_is_blocked = true;
+  tester.terminal.show("12345");
+  tester.terminal.show("678901");
+  tester.terminal.show("abc");
+  tester.processEvents();
+  assert(tester.terminal.output() == "");
+  assert(tester.terminal.nUnwrittenBytes() == 8);
+  assert(tester.terminal.nDroppedBytes() == 6);
+
+  // There is room again once the text has been written.
+  tester.terminal.output_is_blocked = false;
+  tester.waitForOutput();
+  tester.terminal.show("678901");
+  tester.waitForOutput();
+  assert(tester.terminal.output() == "12345abc678901");
+  assert(tester.terminal.nDroppedBytes() == 6);
+}
+
+
+static void testMultipleLinesPerRead()
+{
+  Tester tester;
+  tester.terminal.addInput("one\ntwo\n\nthree\n");
+  tester.processEvents();
+  assert(tester.handler.lines == (vector<string>{"one","two","","three"}));
+}
+
+
+static void testLinesSplitAcrossReads()
+{
+  Tester tester;
+  tester.terminal.maybe_max_read_size = 3;
+  tester.terminal.addInput("first line\nsecond\nthird");
+  tester.terminal.closeInput();
+
+  while (!tester.handler.got_eof) {
+    tester.processEvents();
+  }
+
+  // A last line without a newline is still reported.
+  assert(
+    tester.handler.lines == (vector<string>{"first line","second","third"})
+  );
+
+  assert(!tester.terminal.isActive());
+}
+
+
+int main()
+{
+  testPartialWrites();
+  testDroppingWhileBlocked();
+  testMultipleLinesPerRead();
+  testLinesSplitAcrossReads();
+}